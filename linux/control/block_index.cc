@@ -0,0 +1,128 @@
+// block_index.cc
+// Copyright 2023 Richard L. Sites
+//
+// Per-block index of a raw trace file. See block_index.h
+//
+
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+#include "block_index.h"
+#include "kutrace_lib.h"
+
+using std::vector;
+
+static const int kBlockWords = 8192;	// Eight-byte words in a 64KB trace block
+
+// These must match rawtoevent exactly
+static const uint64 kLargeTsdelta = 2000000000;
+static const uint64 kLateStoreThresh = 0x0000000000020000LLU;
+
+inline bool Wrapped(uint64 prior, uint64 now) {
+  if (prior <= now) {return false;}
+  return (prior > (now + 4096));
+}
+
+inline bool LateStore(uint64 prior, uint64 now) {
+  if (prior <= now) {return false;}
+  return (prior <= (now + kLateStoreThresh));
+}
+
+inline bool IsNamedef(uint64 n) {return (0x010 <= n) && (n <= 0x1ff) && (n != KUTRACE_PC_TEMP);}
+
+inline bool IsPcSample(uint64 n) {
+  return (n == KUTRACE_PC_U) || (n == KUTRACE_PC_K) || (n == KUTRACE_PC_TEMP);
+}
+
+// Walk the entries the way rawtoevent DecodeBlock does, tracking only time
+void AddBlockIndex(const uint64* traceblock, uint64 offset, uint8 first_flags,
+                   BlockIndex* index) {
+  BlockIndexEntry entry;
+  memset(&entry, 0, sizeof(BlockIndexEntry));
+  entry.offset = offset;
+  entry.cpu = traceblock[0] >> 56;
+  entry.flags = traceblock[1] >> 56;
+
+  uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+  bool very_first_block = index->blocks.empty();
+  int first_real_entry = very_first_block ? 8 : 2;
+  uint64 prepend = base_cycle & ~0xfffff;
+  uint64 prior_t = traceblock[first_real_entry] >> 44;
+  if ((first_flags & 0x0F) >= 3) {first_real_entry += 4;}	// PID and pidname
+  if (Wrapped(prior_t, base_cycle)) {prepend -= 0x100000;}
+
+  bool any = false;
+  for (int i = first_real_entry; i < kBlockWords; ++i) {
+    uint64 w = traceblock[i];
+    if (w == 0) {continue;}					// NOP
+    if (w == 0xffffffffffffffffLLU) {break;}			// End of block
+    if ((w >> 32) == 0xffffffffLLU) {continue;}			// Filler
+    uint64 t = (w >> 44) & 0xfffff;
+    uint64 n = (w >> 32) & 0xfff;
+    uint64 argall = w & 0xffffffff;
+
+    if (n == KUTRACE_TSDELTA) {
+      uint64 oldfull = prepend | prior_t;
+      uint64 newfull = (argall < kLargeTsdelta) ?
+        oldfull + argall : oldfull + (0xFFFFFFFF00000000LLU | argall);
+      prepend = newfull & ~0xfffffLLU;
+      prior_t = newfull & 0xfffffLLU;
+      continue;
+    }
+    if (Wrapped(prior_t, t) && !LateStore(prior_t, t)) {prepend += 0x100000;}
+    uint64 tfull = prepend | t;
+    prior_t = t;
+
+    // Names take several words, and their times do not count
+    if (IsNamedef(n)) {
+      ++entry.name_count;
+      int len = (n >> 4) & 0x00f;
+      if ((1 <= len) && (len <= 8)) {i += (len - 1);}
+      continue;
+    }
+    if (IsPcSample(n)) {++i;}	// Second word is the PC
+
+    if (!any || (tfull < entry.first_cycles)) {entry.first_cycles = tfull;}
+    if (!any || (entry.last_cycles < tfull)) {entry.last_cycles = tfull;}
+    any = true;
+  }
+  if (!any) {
+    entry.first_cycles = base_cycle;
+    entry.last_cycles = base_cycle;
+  }
+  index->blocks.push_back(entry);
+}
+
+bool WriteBlockIndex(const char* fname, const BlockIndex& index) {
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {return false;}
+  uint64 count = index.blocks.size();
+  fwrite(kBlockIndexMagic, 1, kBlockIndexMagicLen, f);
+  fwrite(&index.trace_bytes, 1, sizeof(uint64), f);
+  fwrite(&count, 1, sizeof(uint64), f);
+  if (count != 0) {fwrite(&index.blocks[0], sizeof(BlockIndexEntry), count, f);}
+  return fclose(f) == 0;
+}
+
+bool ReadBlockIndex(const char* fname, BlockIndex* index) {
+  index->blocks.clear();
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {return false;}
+  char magic[kBlockIndexMagicLen];
+  uint64 count = 0;
+  bool ok = (fread(magic, 1, kBlockIndexMagicLen, f) == kBlockIndexMagicLen) &&
+            (memcmp(magic, kBlockIndexMagic, kBlockIndexMagicLen) == 0) &&
+            (fread(&index->trace_bytes, 1, sizeof(uint64), f) == sizeof(uint64)) &&
+            (fread(&count, 1, sizeof(uint64), f) == sizeof(uint64));
+  if (ok) {
+    index->blocks.resize(count);
+    ok = (count == 0) ||
+         (fread(&index->blocks[0], sizeof(BlockIndexEntry), count, f) == count);
+  }
+  fclose(f);
+  if (!ok) {index->blocks.clear();}
+  return ok;
+}
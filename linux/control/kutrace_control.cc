@@ -7,7 +7,7 @@
 //
 // This program reads commands from stdin
 //
-// Compile with gcc -O2 kutrace_control.cc kutrace_lib.cc -o kutrace_control
+// Compile with g++ -O2 kutrace_control.cc kutrace_lib.cc block_index.cc -o kutrace_control
 
 /*
  * Copyright (C) 2019 Richard L. Sites
@@ -15,6 +15,7 @@
 #endif
 
 #include "basetypes.h"
+#include "block_index.h"		// foo.trace.idx, written by DoDump
 #include "kutrace_control_names.h"	// PidNames, TrapNames, IrqNames, Syscall64Names
 #include "kutrace_lib.h"
 
@@ -836,6 +837,12 @@ void DoDump(const char* fname) {
     fprintf(stderr, "Live dump of 1.75MB\n");
   }
 
+  // Index the blocks as they go out, so rawtoevent -start/-stop can decode
+  // just the ones it needs without first reading the whole trace
+  BlockIndex index;
+  index.trace_bytes = 0;
+  uint8 first_flags = 0;
+
   // Loop on trace blocks
   for (int i = 0; i < blockcount; ++i) {
     u64 k = i * kTraceBufSize;  // Trace Word number to fetch next
@@ -915,7 +922,10 @@ void DoDump(const char* fname) {
     int64 block_cycles = traceblock[0] & CLU(0x00ffffffffffffff);
     int64 block_usec = CyclesToUsec(block_cycles, params);
     traceblock[1] |= (block_usec &  CLU(0x00ffffffffffffff));
+    if (very_first_block) {first_flags = traceblock[1] >> 56;}
+    AddBlockIndex(traceblock, index.trace_bytes, first_flags, &index);
     fwrite(traceblock, 1, sizeof(traceblock), f);
+    index.trace_bytes += sizeof(traceblock);
 
     ////fprintf(stderr, "[%d] ", i); DumpTimePair("block", block_cycles, block_usec);
 
@@ -935,11 +945,17 @@ void DoDump(const char* fname) {
       }
 
       fwrite(ipcblock, 1, sizeof(ipcblock), f);
+      index.trace_bytes += sizeof(ipcblock);
     }
   }
   fclose(f);
 
   fprintf(stdout, "  %s written (%3.1fMB)\n", fname, blockcount / 16.0);
+  char index_name[256];
+  snprintf(index_name, sizeof(index_name), "%s.idx", fname);
+  if (!WriteBlockIndex(index_name, index)) {
+    fprintf(stderr, "%s did not open\n", index_name);
+  }
 
   // Go ahead and set up for another trace
   DoControl(KUTRACE_CMD_RESET, 0);
@@ -0,0 +1,56 @@
+// block_index.h
+// Copyright 2023 Richard L. Sites
+//
+// Small sidecar index of a raw KUtrace file, foo.trace.idx next to foo.trace.
+// kutrace_control DoDump writes it along with the trace, and rawtoevent builds
+// it the first time it is asked for a time window if it is not there. With it,
+// rawtoevent -start/-stop decodes just the blocks that cover the window.
+//
+// Index layout:
+//   8-byte magic "KUBLKIX1"
+//   uint64 byte size of the trace file, to notice a stale index
+//   uint64 block count
+//   One 32-byte BlockIndexEntry per 64KB trace block, in file order
+//
+// Timestamps are the full cycle counts that rawtoevent reconstructs from each
+// entry's 20-bit truncated time, before any conversion to multiples of 10ns.
+// The same copy of this file is in linux/control for DoDump.
+//
+
+#ifndef __BLOCK_INDEX_H__
+#define __BLOCK_INDEX_H__
+
+#include <vector>
+
+#include "basetypes.h"
+
+static const char* const kBlockIndexMagic = "KUBLKIX1";
+static const int kBlockIndexMagicLen = 8;
+
+// One trace block, 32 bytes
+typedef struct {
+  uint64 offset;	// File offset of the 64KB block
+  uint64 first_cycles;	// Earliest reconstructed event time in the block
+  uint64 last_cycles;	// Latest reconstructed event time in the block
+  uint8 cpu;
+  uint8 flags;		// From traceblock[1]
+  uint16 name_count;	// Name definitions, not counting the block's header PID name
+  uint32 unused;
+} BlockIndexEntry;
+
+typedef struct {
+  uint64 trace_bytes;
+  std::vector<BlockIndexEntry> blocks;
+} BlockIndex;
+
+// Add the next block of the trace, at file offset. first_flags are the flags
+// of block 0, which carry the tracefile version. A block with no events gets
+// its base cycle count as both first and last
+void AddBlockIndex(const uint64* traceblock, uint64 offset, uint8 first_flags,
+                   BlockIndex* index);
+
+// Return false if the file does not open or, reading, is not a block index
+bool WriteBlockIndex(const char* fname, const BlockIndex& index);
+bool ReadBlockIndex(const char* fname, BlockIndex* index);
+
+#endif	// __BLOCK_INDEX_H__
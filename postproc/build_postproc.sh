@@ -1,18 +1,27 @@
 # Build file for KUtrace postprocessing programs
 # dsites 2022.08.17
 
-c++ -O2 checktrace.cc -o checktrace
-c++ -O2 eventtospan3.cc -o eventtospan3
-c++ -O2 kuod.cc -o kuod
-c++ -O2 makeself.cc -o makeself
-c++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
-c++ -O2 rawtoevent.cc from_base40.cc -o rawtoevent
+c++ -O2 -pthread checktrace.cc trace_reader.cc -o checktrace
+c++ -O2 eventtospan3.cc event_bin.cc span_bin.cc -o eventtospan3
+c++ -O2 kuod.cc trace_reader.cc -o kuod
+c++ -O2 -pthread -DKUTRACE_POST kutrace_post.cc rawtoevent.cc block_index.cc eventtospan3.cc spantotrim.cc makeself.cc event_bin.cc span_bin.cc from_base40.cc trace_reader.cc -lz -o kutrace_post
+c++ -O2 kutrace_gen.cc -o kutrace_gen
+c++ -O2 makeself.cc -lz -o makeself
+c++ -O2 -pthread rawtoevent.cc block_index.cc event_bin.cc from_base40.cc trace_reader.cc kutrace_lib.cc -o rawtoevent
+c++ -O2 -pthread rawtoevent.cc block_index.cc event_bin.cc from_base40.cc trace_reader.cc -o rawtoevent
+c++ -O2 postproc_bench.cc -o postproc_bench
 c++ -O2 samptoname_k.cc -o samptoname_k
-c++ -O2 samptoname_u.cc -o samptoname_u
-c++ -O2 spantoprof.cc -o spantoprof
-c++ -O2 spantospan.cc -o spantospan
-c++ -O2 spantotrim.cc from_base40.cc -o spantotrim
-c++ -O2 time_getpid.cc kutrace_lib.cc -o time_getpid
-c++ -O2 unmakeself.cc -o unmakeself
+c++ -O2 samptoname_u.cc elf_symbols.cc -o samptoname_u
+c++ -O2 spantodiff.cc latency_hist.cc span_bin.cc -o spantodiff
+c++ -O2 spantofold.cc span_bin.cc -o spantofold
+c++ -O2 spantolat.cc latency_hist.cc span_bin.cc -o spantolat
+c++ -O2 spantolock.cc latency_hist.cc span_bin.cc -o spantolock
+c++ -O2 spantoprof.cc span_bin.cc -o spantoprof
+c++ -O2 spantorpc.cc latency_hist.cc span_bin.cc -o spantorpc
+c++ -O2 spantospan.cc span_bin.cc -o spantospan
+c++ -O2 spantotrim.cc from_base40.cc span_bin.cc -o spantotrim
+c++ -O2 spantowake.cc latency_hist.cc span_bin.cc -o spantowake
+c++ -O2 time_getpid.cc kutrace_lib.cc block_index.cc -o time_getpid
+c++ -O2 unmakeself.cc -lz -o unmakeself
 
 
@@ -5,18 +5,23 @@
 // Input has filename like 
 //   kutrace_control_20170821_095154_dclab-1_2056.trace
 //
-// compile with g++ -O2 checktrace.cc -o checktrace
+// compile with g++ -O2 -pthread checktrace.cc trace_reader.cc -o checktrace
 //
 // To see raw trace in hex, use kuod or
 //   od -Ax -tx8z -w32 foo.trace
 //
 // dsites 2022.08.17 Initial version
+// dsites 2023.07.03 Check the trace in place via trace_reader.h instead of fread
+// dsites 2023.09.02 Add -threads n to scan block bodies in parallel, and -health
+//                   for a per-CPU report used to pick tracemb
 //
 
 
 #include <map>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
@@ -29,6 +34,7 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "trace_reader.h"
 
 #define IPC_Flag     0x80
 #define WRAP_Flag    0x40
@@ -38,6 +44,7 @@
 
 using std::map;
 using std::string;
+using std::vector;
 
 typedef map<uint64, string> U64Name;	// Name for each syscall/PID/etc.
 
@@ -57,6 +64,14 @@ static const uint64 kMinTimeOfDay = 1451606400000000L;
 // gettimeofday() 2050.01.01 * 1000000
 static const uint64 kMaxTimeOfDay = 2524608000000000L;
 
+// Same late-store test as rawtoevent: a 20-bit timestamp this far behind the
+// prior one is a late store, not a wraparound
+static const uint64 kLateStoreThresh = 0x0000000000020000LLU;
+
+// Blocks read and checked at a time. The bodies of a batch are scanned in
+// parallel, then the headers and results are checked serially in file order
+static const int kBatchBlocks = 256;
+
 enum Err {
   WARN,
   FAIL,
@@ -260,6 +275,53 @@ uint64 total_events_per_cpu[256];	// Events per CPU across the entire trace
 
 U64Name names;
 
+// Body scan of one block. Done in parallel, then reported in file order
+typedef struct {
+  int events;		// Including optimized returns, as event_count
+  int cross_entry;	// Entry that runs past the end of the block, else -1
+  int live_words;	// Words in real entries
+  int zero_words;	// All-zero NOPs
+  int nop_words;	// Other NOPs, plus all-ones filler to the end of the block
+  int tsdelta;		// TSDELTA entries
+  int late_stores;	// Timestamp slightly before the prior entry's
+} BlockHealth;
+
+// What one scanning thread accumulates over its run of blocks
+typedef struct {
+  uint64 event_count[4096];
+  uint64 hasret_count[4096];
+  U64Name names;
+} BodyTotals;
+
+// Per-CPU sums for -health
+typedef struct {
+  uint64 blocks;
+  uint64 events;
+  uint64 live_words;
+  uint64 zero_words;
+  uint64 nop_words;
+  uint64 tsdelta;
+  uint64 late_stores;
+  uint64 first_tod;	// Block start times, usec
+  uint64 last_tod;
+} CpuHealth;
+
+// Each block's start time, for events per second over time
+typedef struct {
+  uint64 tod;
+  int cpu;
+  int events;
+} BlockTime;
+
+bool health = false;		// If set, print the per-CPU report
+int nthreads = 1;
+CpuHealth cpu_health[256];
+vector<BlockTime> block_times;
+// A wrapped trace never overwrites block 0, so it can start long before the
+// retained blocks. It is kept out of the per-CPU sums and reported by itself
+BlockTime wrap_block0;
+bool has_wrap_block0 = false;
+
 static const int kMaxDateTimeBuffer = 32;
 static char gTempDateTimeBuffer[kMaxDateTimeBuffer];
 static char gTempDateTimeBuffer2[kMaxDateTimeBuffer];
@@ -269,11 +331,13 @@ static char gTempPrintBuffer2[kMaxPrintBuffer];
 
 
 void Usage() {
-  fprintf(stderr, "Usage: checktrace <filename> [-v] [-q] [-h] [-nopf]\n\n");
+  fprintf(stderr, "Usage: checktrace <filename> [-v] [-q] [-h] [-nopf] [-health] [-threads n]\n\n");
   fprintf(stderr, "       -v verbose, show hex at problem, more than two of each message\n");
   fprintf(stderr, "       -q quiet, just one line of PASS/FAIL output\n");
   fprintf(stderr, "       -h show hex for each event (debug)\n");
   fprintf(stderr, "       -nopf no page_fault checking, some files are OK without them\n");
+  fprintf(stderr, "       -health per-CPU event rates, buffer fill, padding, and wraparound coverage\n");
+  fprintf(stderr, "       -threads n scan block bodies on n threads\n");
   exit(0);
 }
 
@@ -339,7 +403,7 @@ const char* FormatUint64x2(uint64 n) {
   return gTempPrintBuffer2;
 }
 
-uint8 GetFlags(uint64* traceblock) {
+uint8 GetFlags(const uint64* traceblock) {
   return (uint8)((traceblock[1] >> 56) & 0xFF);
 }
 
@@ -455,7 +519,8 @@ void CleanupAscii(char* str, int len) {
 //  event_no_len = event &0xF0F (middle four bits are entry length)
 //  key of (event_no_len << 16) | arg0 
 // where event says what kind of name, and arg0 says which item is named
-void SaveName(uint64 event, uint64 arg0, int event_len, uint64* traceblock_i) {
+void SaveName(uint64 event, uint64 arg0, int event_len, const uint64* traceblock_i,
+              U64Name* names) {
   char nametemp[64];
   int namelen = (event_len - 1) * 8;	// Eight bytes per name word
   if (namelen <= 0) {return;}		// Avoid core dump on bogus length
@@ -466,7 +531,7 @@ void SaveName(uint64 event, uint64 arg0, int event_len, uint64* traceblock_i) {
   nametemp[namelen] = '\0';
   CleanupAscii(nametemp, namelen);
   uint64 key = MakeKey(event, arg0);
-  names[key] = string(nametemp);
+  (*names)[key] = string(nametemp);
 if (tracenames) fprintf(stdout, "%016llx insert names[%07llx] %s\n", *traceblock_i, key, nametemp);
 }
 
@@ -480,7 +545,7 @@ inline bool IsCallRet(uint64 event, uint64 delta_t) {
 
 
 // Print line of hex stating at a multipfle of 64 bytes 
-void PrintHex(size_t delta_byte, uint64* block) {
+void PrintHex(size_t delta_byte, const uint64* block) {
   if (block == NULL) {return;}
   // 32 bytes per line
   size_t line_start_byte = (offset + delta_byte) & ~0x01f;  // In file, bytes
@@ -499,7 +564,7 @@ void PrintHex(size_t delta_byte, uint64* block) {
 }
 
 // Always return subpar true for fail/warn
-bool Note(Err err, Msg msg, uint64* block, size_t delta_byte, const char* str) {
+bool Note(Err err, Msg msg, const uint64* block, size_t delta_byte, const char* str) {
   trace_fail |= (err == FAIL);
   trace_warn |= (err == WARN);
   bool subpar = (err < GOOD);
@@ -527,7 +592,7 @@ bool Note(Err err, Msg msg, uint64* block, size_t delta_byte, const char* str) {
   return subpar;
 }
 
-bool Note2(Err err, Msg msg, uint64* block, size_t delta_byte, const char* str, const char* str2) {
+bool Note2(Err err, Msg msg, const uint64* block, size_t delta_byte, const char* str, const char* str2) {
   bool subpar = Note(err, msg, block, delta_byte, str);
   if ((!verbose) && (2 < msg_count[msg])) {return subpar;}  // At most twice per message number
   if (quiet) {return subpar;}
@@ -537,7 +602,7 @@ bool Note2(Err err, Msg msg, uint64* block, size_t delta_byte, const char* str,
 
 
 // These tests fail immediately
-FILE* CheckStat(const char* fname) {
+void CheckStat(const char* fname, TraceReader* reader) {
   if (fname == NULL) {Usage();}
   struct stat buff;
   int status = stat(fname, &buff);
@@ -546,8 +611,7 @@ FILE* CheckStat(const char* fname) {
     exit(0);
   }
 
-  FILE* f = fopen(fname, "rb");
-  if (f == NULL) {
+  if (!OpenTraceReader(fname, reader)) {
     // Should never happen since CheckStat already tested
     fprintf(stdout, "FAILFAST %s %s\n\n", "NO FILE", fname);
     exit(0);
@@ -567,12 +631,11 @@ FILE* CheckStat(const char* fname) {
     exit(0);
   }
 
-  // If good, return the open file
-  return f;
+  // If good, the file is open in reader
 }
 
 // Return true if subpar -- fail or warn
-bool CheckTimePair(uint64 time_counter, uint64 time_of_day, uint64* traceblock, uint64 byte_offset) {
+bool CheckTimePair(uint64 time_counter, uint64 time_of_day, const uint64* traceblock, uint64 byte_offset) {
   bool subpar = false;
   if (!skip_tc_checks) {
     if (kMaxTimeCounter < time_counter) {
@@ -608,7 +671,7 @@ bool CheckTimePair(uint64 time_counter, uint64 time_of_day, uint64* traceblock,
 //   +===============================+===============================+
 
 // Return true if subpar -- fail or warn
-bool CheckFirstTraceBlock(uint64* traceblock) {
+bool CheckFirstTraceBlock(const uint64* traceblock) {
   bool subpar = false;
   start_time_counter = traceblock[2];
   start_time_of_day  = traceblock[3];
@@ -677,7 +740,7 @@ bool CheckFirstTraceBlock(uint64* traceblock) {
 }
 
 // Check for printable Ascii
-bool CheckAscii(uint64* traceblock, int entry, int len) {
+bool CheckAscii(const uint64* traceblock, int entry, int len) {
   uint8* base = (uint8*)&traceblock[entry];
   bool any_bad = false;
   if (64 < len) {len = 64;}
@@ -727,7 +790,7 @@ bool CheckAscii(uint64* traceblock, int entry, int len) {
 //   +-------------------------------+-------------------------------+
 
 // Return true if subpar -- fail or warn
-bool CheckBlockHeader(uint64* traceblock, int next_entry) {
+bool CheckBlockHeader(const uint64* traceblock, int next_entry) {
   bool subpar = false;
   uint64 cpu = traceblock[0] >> 56;
   uint64 time_counter = traceblock[0] & 0x00FFFFFFFFFFFFFFL;
@@ -823,29 +886,36 @@ bool TsBefore() {
       // +-------------------+-----------+---------------+-------+-------+
       //          20              12         8       8           16 
 
-// Return true if subpar -- fail or warn
-bool CheckBlockBody(uint64* traceblock, int next_entry, int* block_events) {
-  bool subpar = false;
-  uint64 block_event_count = 0;
+inline bool LateStore(uint64 prior, uint64 now) {
+  if (prior <= now) {return false;}		// Common case
+  return (prior <= (now + kLateStoreThresh));	// Late store
+}
+
+// Scan the entries of one block body. Touches no globals, so blocks can be
+// scanned in parallel, each thread into its own totals
+void ScanBlockBody(const uint64* traceblock, int next_entry, BodyTotals* totals,
+                   BlockHealth* bh) {
+  memset(bh, 0, sizeof(BlockHealth));
+  bh->cross_entry = -1;
+  bool filler = false;		// After an all-ones word, the rest is unused
+  bool any_ts = false;
+  uint64 prior_ts = 0;
 
   for (int i = next_entry; i < kTraceBufSize; ++i) {
-    if (hex) {fprintf(stdout, "[%4d] %016llx\n", i, traceblock[i]);}
     uint64 ts = (traceblock[i] >> 44) & 0xFFFFF;
     uint64 event = (traceblock[i] >> 32) & 0xFFF;
     uint64 delta_t = (traceblock[i] >> 24) & 0xFF;
-    uint64 retval = (traceblock[i] >> 16) & 0xFF;
     uint64 arg0 = (traceblock[i] >> 0) & 0xFFFF;
     int event_len = GetEventLen(event);
 
     // Count all events, and also any optimized returns
-    ++event_count[event];
-    ++block_event_count;
+    ++totals->event_count[event];
+    ++bh->events;
     if (IsCallRet(event, delta_t)) {
-      ++hasret_count[event];
-      ++block_event_count;
+      ++totals->hasret_count[event];
+      ++bh->events;
     }
 
-
     // Can't do this test reliably with 20-bit wraparound if we allow almost  
     //   all counts delta to be good
     // Check for monotonic time
@@ -853,28 +923,62 @@ bool CheckBlockBody(uint64* traceblock, int next_entry, int* block_events) {
     //  subpar |= Note(FAIL, BL_BACK, traceblock, i*8, "");
     //}
 
+    // Padding, by the word
+    if (traceblock[i] == 0xffffffffffffffffLLU) {filler = true;}
+    if (filler) {
+      ++bh->nop_words;
+    } else if (traceblock[i] == 0) {
+      ++bh->zero_words;
+    } else if (event == KUTRACE_NOP) {
+      ++bh->nop_words;
+    } else if (event == KUTRACE_TSDELTA) {
+      ++bh->tsdelta;
+      ++bh->live_words;
+    } else {
+      if (any_ts && LateStore(prior_ts, ts)) {++bh->late_stores;}
+      prior_ts = ts;
+      any_ts = true;
+      bh->live_words += event_len;
+    }
+
     // If variable-length entry (name), remember it 
     if (IsVarLen(event)) {
-      SaveName(event, arg0, event_len, &traceblock[i]);
+      SaveName(event, arg0, event_len, &traceblock[i], &totals->names);
     }
 
     // Extra advance over multi-word events
     if (1 < event_len) {
       i += (event_len - 1);
       // Check for block overflow
-      if (kTraceBufSize <= i) {
-        subpar |= Note(FAIL, BL_CROSS, traceblock, i*8, "");
+      if ((kTraceBufSize <= i) && (bh->cross_entry < 0)) {
+        bh->cross_entry = i;
+        bh->live_words -= (i + 1 - kTraceBufSize);
       }
     }
+  }
+}
 
-    // Keep track of the event counts per CPU and per second
-    *block_events = block_event_count;
+// Print each entry in hex, stepping over multi-word ones as the scan does
+void PrintBlockHex(const uint64* traceblock, int next_entry) {
+  for (int i = next_entry; i < kTraceBufSize; ++i) {
+    fprintf(stdout, "[%4d] %016llx\n", i, traceblock[i]);
+    uint64 event = (traceblock[i] >> 32) & 0xFFF;
+    int event_len = GetEventLen(event);
+    if (1 < event_len) {i += (event_len - 1);}
   }
+}
 
+// Return true if subpar -- fail or warn
+bool CheckBlockBody(const uint64* traceblock, int next_entry, const BlockHealth* bh) {
+  bool subpar = false;
+  if (hex) {PrintBlockHex(traceblock, next_entry);}
+  if (0 <= bh->cross_entry) {
+    subpar |= Note(FAIL, BL_CROSS, traceblock, bh->cross_entry*8, "");
+  }
   return subpar;
 }
 
-void TrackBlockEvents(uint64* traceblock, int block_events) {
+void TrackBlockEvents(const uint64* traceblock, int block_events) {
   uint64 cpu = traceblock[0] >> 56;
   uint64 time_of_day = traceblock[1] & 0x00FFFFFFFFFFFFFFL;
   uint64 current_100msec =  time_of_day / 100000;
@@ -938,10 +1042,44 @@ void FinishBlockEvents() {
   }
 }
 
+// Per-CPU sums and block start times for -health
+void TrackBlockHealth(const uint64* traceblock, const BlockHealth* bh) {
+  uint64 cpu = traceblock[0] >> 56;
+  uint64 time_of_day = traceblock[1] & 0x00FFFFFFFFFFFFFFL;
+  if ((block_num == 0) && HasWrap(flags)) {
+    wrap_block0.tod = time_of_day;
+    wrap_block0.cpu = cpu;
+    wrap_block0.events = bh->events;
+    has_wrap_block0 = true;
+    return;
+  }
+  CpuHealth* ch = &cpu_health[cpu];
+  if ((ch->blocks == 0) || (time_of_day < ch->first_tod)) {ch->first_tod = time_of_day;}
+  if (ch->last_tod < time_of_day) {ch->last_tod = time_of_day;}
+  ++ch->blocks;
+  ch->events += bh->events;
+  ch->live_words += bh->live_words;
+  ch->zero_words += bh->zero_words;
+  ch->nop_words += bh->nop_words;
+  ch->tsdelta += bh->tsdelta;
+  ch->late_stores += bh->late_stores;
+
+  BlockTime bt;
+  bt.tod = time_of_day;
+  bt.cpu = cpu;
+  bt.events = bh->events;
+  block_times.push_back(bt);
+}
+
+// Header words ahead of the first entry of block number b
+int FirstEntry(int b) {
+  return (b == 0) ? 8 + 4 : 2 + 4;	// First block has extra fields; then PID #,name
+}
+
 // Return true if subpar -- fail or warn
-bool CheckTraceBlock(size_t n, uint64* traceblock) {
+// The body has already been scanned into bh
+bool CheckTraceBlock(size_t n, const uint64* traceblock, const BlockHealth* bh) {
   bool subpar = false;
-  int block_events;
   // Must be 64KB
   if ((n & 0xFFFF) != 0) {
     subpar |= Note(FAIL, TR_TRUNC, traceblock, 0, "");
@@ -958,17 +1096,65 @@ bool CheckTraceBlock(size_t n, uint64* traceblock) {
 
   subpar |= CheckBlockHeader(traceblock, next_entry);
   next_entry += 4;					// Over the PID #,name
-  subpar |= CheckBlockBody(traceblock, next_entry, &block_events);
+  subpar |= CheckBlockBody(traceblock, next_entry, bh);
 
-  TrackBlockEvents(traceblock, block_events);
+  TrackBlockEvents(traceblock, bh->events);
+  TrackBlockHealth(traceblock, bh);
 
   // Give overall blessing for positive feedback
   if (!subpar) {Note(GOOD, BL_GOOD, NULL, 0, "");}
   return subpar;
 }
 
+// One thread's share of a batch: a contiguous run of blocks, so that merging
+// the threads in order keeps the last definition of each name, as serially
+void ScanBodies(const vector<const uint64*>* batch, int first_block_num, int lo, int hi,
+                BodyTotals* totals, vector<BlockHealth>* bh) {
+  for (int k = lo; k < hi; ++k) {
+    ScanBlockBody((*batch)[k], FirstEntry(first_block_num + k), totals, &(*bh)[k]);
+  }
+}
+
+// Add one thread's totals into the globals, then clear them for the next batch
+void MergeBodyTotals(BodyTotals* totals) {
+  for (int i = 0; i < 4096; ++i) {
+    event_count[i] += totals->event_count[i];
+    hasret_count[i] += totals->hasret_count[i];
+  }
+  for (U64Name::const_iterator it = totals->names.begin(); it != totals->names.end(); ++it) {
+    names[it->first] = it->second;
+  }
+  memset(totals->event_count, 0, 4096 * sizeof(uint64));
+  memset(totals->hasret_count, 0, 4096 * sizeof(uint64));
+  totals->names.clear();
+}
+
+// Scan the bodies of a batch of blocks on nthreads threads
+void ScanBatch(const vector<const uint64*>& batch, int first_block_num,
+               vector<BodyTotals*>* totals, vector<BlockHealth>* bh) {
+  bh->resize(batch.size());
+  int n = batch.size();
+  int nt = (nthreads < n) ? nthreads : n;
+  if (nt <= 1) {
+    ScanBodies(&batch, first_block_num, 0, n, (*totals)[0], bh);
+    MergeBodyTotals((*totals)[0]);
+    return;
+  }
+  vector<std::thread> threads;
+  for (int t = 0; t < nt; ++t) {
+    int lo = (n * t) / nt;
+    int hi = (n * (t + 1)) / nt;
+    threads.push_back(std::thread(ScanBodies, &batch, first_block_num, lo, hi,
+                                  (*totals)[t], bh));
+  }
+  for (int t = 0; t < nt; ++t) {
+    threads[t].join();
+    MergeBodyTotals((*totals)[t]);
+  }
+}
+
 // Return true if subpar -- fail or warn
-bool CheckIpcBlock(size_t n, uint64* ipcblock) {
+bool CheckIpcBlock(size_t n, const uint64* ipcblock) {
   bool subpar = false;
   // Must be 8KB
   if ((n & 0xFFF) != 0) {
@@ -1133,6 +1319,133 @@ bool CheckEventCounts() {
 }
 
 
+// Spread each block's events evenly from its start to the next block start
+// on the same CPU, or to the trace end, over buckets of interval usec
+void BucketEvents(uint64 lo_tod, uint64 end_tod, uint64 interval, int ncpu,
+                  vector<vector<double> >* buckets) {
+  vector<vector<BlockTime> > per_cpu(ncpu);
+  for (int i = 0; i < (int)block_times.size(); ++i) {
+    per_cpu[block_times[i].cpu].push_back(block_times[i]);
+  }
+  for (int cpu = 0; cpu < ncpu; ++cpu) {
+    const vector<BlockTime>& bt = per_cpu[cpu];
+    for (int k = 0; k < (int)bt.size(); ++k) {
+      uint64 t0 = bt[k].tod;
+      uint64 t1 = (k + 1 < (int)bt.size()) ? bt[k + 1].tod : end_tod;
+      if ((t0 < lo_tod) || (end_tod < t0)) {continue;}	// Implausible time, already noted
+      if (t1 <= t0) {t1 = t0 + 1;}
+      double per_usec = bt[k].events / (double)(t1 - t0);
+      for (uint64 t = t0; t < t1; ) {
+        uint64 b = (t - lo_tod) / interval;
+        if (buckets->size() <= b) {break;}
+        uint64 b_end = lo_tod + (b + 1) * interval;
+        uint64 piece_end = (t1 < b_end) ? t1 : b_end;
+        (*buckets)[b][cpu] += (piece_end - t) * per_usec;
+        t = piece_end;
+      }
+    }
+  }
+}
+
+// The -health report: how fast each CPU fills trace blocks, how much of each
+// block is padding, and what time interval the trace covers. Block times are
+// when each block was started; a CPU's last block runs to the trace stop.
+// On a wrapped trace all of this is over the retained blocks, without block 0
+void PrintHealth(uint64 file_bytes) {
+  int ncpu = max_cpu + 1;
+  uint64 lo_tod = 0;
+  uint64 hi_tod = 0;
+  uint64 complete_tod = 0;	// From here on every CPU that appears has blocks
+  for (int cpu = 0; cpu < ncpu; ++cpu) {
+    const CpuHealth* ch = &cpu_health[cpu];
+    if (ch->blocks == 0) {continue;}
+    if ((lo_tod == 0) || (ch->first_tod < lo_tod)) {lo_tod = ch->first_tod;}
+    if (hi_tod < ch->last_tod) {hi_tod = ch->last_tod;}
+    if (complete_tod < ch->first_tod) {complete_tod = ch->first_tod;}
+  }
+  if (lo_tod == 0) {return;}
+  // Use the recorded stop time if it is plausible
+  uint64 end_tod = hi_tod;
+  if ((hi_tod <= stop_time_of_day) && (stop_time_of_day < hi_tod + 3600000000LL)) {
+    end_tod = stop_time_of_day;
+  }
+  if (end_tod <= lo_tod) {end_tod = lo_tod + 1;}
+  uint64 span = end_tod - lo_tod;
+  uint64 block_bytes = kTraceBlockBytes + (HasIPC(flags) ? kIpcBlockBytes : 0);
+  uint64 retained_bytes = file_bytes - (has_wrap_block0 ? block_bytes : 0);
+
+  // At most about 40 rows of events over time
+  uint64 interval = 100000;	// usec
+  while ((40 * interval) < span) {interval *= 10;}
+  int nrows = (span + interval - 1) / interval;
+  vector<vector<double> > buckets(nrows, vector<double>(ncpu, 0.0));
+  BucketEvents(lo_tod, end_tod, interval, ncpu, &buckets);
+  double interval_sec = interval / 1000000.0;
+
+  fprintf(stdout, "\nPer-CPU trace health\n");
+  fprintf(stdout, " cpu  blocks   Kevents  Kev/sec peakKev/s   KB/sec  live%%  zero%%  nop%%  tsdelta    late  first_block\n");
+  for (int cpu = 0; cpu < ncpu; ++cpu) {
+    const CpuHealth* ch = &cpu_health[cpu];
+    if (ch->blocks == 0) {continue;}
+    double sec = (end_tod - ch->first_tod) / 1000000.0;
+    if (sec <= 0.0) {sec = 1.0 / 1000000.0;}
+    double peak = 0.0;
+    for (int r = 0; r < nrows; ++r) {
+      if (peak < buckets[r][cpu]) {peak = buckets[r][cpu];}
+    }
+    double words = ch->blocks * (double)kTraceBufSize;
+    fprintf(stdout, "%4d %7llu %9.1f %8.1f %9.1f %8.1f %6.1f %6.1f %5.1f %8llu %7llu  +%.6f\n",
+            cpu, ch->blocks, ch->events / 1000.0, ch->events / sec / 1000.0,
+            peak / interval_sec / 1000.0, (ch->blocks * block_bytes) / sec / 1024.0,
+            (ch->live_words * 100.0) / words, (ch->zero_words * 100.0) / words,
+            (ch->nop_words * 100.0) / words, ch->tsdelta, ch->late_stores,
+            (ch->first_tod - lo_tod) / 1000000.0);
+  }
+
+  fprintf(stdout, "\nEvents over time, K events/sec in each %llu msec\n", interval / 1000);
+  fprintf(stdout, "    time_sec  all_CPUs  busiest_CPU\n");
+  for (int r = 0; r < nrows; ++r) {
+    double total = 0.0;
+    int busiest = 0;
+    for (int cpu = 0; cpu < ncpu; ++cpu) {
+      total += buckets[r][cpu];
+      if (buckets[r][busiest] < buckets[r][cpu]) {busiest = cpu;}
+    }
+    fprintf(stdout, "  %10.6f %9.1f  %3d %8.1f\n", (r * interval) / 1000000.0,
+            total / interval_sec / 1000.0, busiest,
+            buckets[r][busiest] / interval_sec / 1000.0);
+  }
+
+  // Coverage, and what a larger buffer would have kept
+  double span_sec = span / 1000000.0;
+  double bytes_per_sec = retained_bytes / span_sec;
+  double mb_per_sec = bytes_per_sec / (1024.0 * 1024.0);
+  fprintf(stdout, "\nTrace covers %.6f sec, %s to %s\n", span_sec,
+          FormatUsecDateTime(lo_tod), FormatUsecDateTime2(end_tod));
+  fprintf(stdout, "  %.1f MB of trace at %.2f MB/sec, so ~%.1f MB of tracemb per second traced\n",
+          retained_bytes / (1024.0 * 1024.0), mb_per_sec, mb_per_sec);
+  if (HasWrap(flags)) {
+    if (has_wrap_block0) {
+      fprintf(stdout, "  Block 0 (CPU %d, %d events) is kept across wraparound, from %.6f sec "
+              "before the retained blocks\n", wrap_block0.cpu, wrap_block0.events,
+              (lo_tod < wrap_block0.tod) ? 0.0 : (lo_tod - wrap_block0.tod) / 1000000.0);
+    }
+    fprintf(stdout, "  Buffer wrapped. All CPUs have blocks from +%.6f sec; "
+            "earlier, some CPUs' blocks were overwritten\n",
+            (complete_tod - lo_tod) / 1000000.0);
+    // A k times larger buffer keeps k times the bytes, less the fixed block 0,
+    // filled at the rate just measured
+    double fixed = has_wrap_block0 ? block_bytes : 0;
+    fprintf(stdout, "  A larger buffer would cover about %.1f sec at 2x, %.1f sec at 4x, %.1f sec at 8x\n",
+            (2 * (double)file_bytes - fixed) / bytes_per_sec,
+            (4 * (double)file_bytes - fixed) / bytes_per_sec,
+            (8 * (double)file_bytes - fixed) / bytes_per_sec);
+  } else {
+    fprintf(stdout, "  Buffer did not wrap; the whole traced interval is here\n");
+  }
+}
+
+
 int main (int argc, const char** argv) {
   //const char* fname = NULL;
 
@@ -1148,6 +1461,11 @@ int main (int argc, const char** argv) {
       hex = true;
     } else if (strcmp(argv[i], "-nopf") == 0) {
       nopf = true;
+    } else if (strcmp(argv[i], "-health") == 0) {
+      health = true;
+    } else if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) {
+      nthreads = atoi(argv[++i]);
+      if (nthreads < 1) {nthreads = 1;}
     } else {
       Usage();
     }
@@ -1174,35 +1492,86 @@ int main (int argc, const char** argv) {
   prior_10second = 0;
 
   memset(total_events_per_cpu, 0, 256 * sizeof(uint64));
-
+  memset(cpu_health, 0, 256 * sizeof(CpuHealth));
 
   // Exits if any problem with file -- fail_fast
-  FILE* f = CheckStat(fname);
-
-  // Loop reading and testing trace blocks
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint64 ipcblock[kIpcBufSize];		// One byte per trace entry
+  TraceReader reader;
+  CheckStat(fname, &reader);
+
+  // Loop testing trace blocks, in place in the file. A batch of blocks is
+  // read, their bodies scanned in parallel, then everything else is checked
+  // serially in file order. Streamed input is copied, a batch at a time
+  const uint64* traceblock = NULL;	// 8 bytes per trace entry
+  const uint64* ipcblock;		// One byte per trace entry
+  bool mapped = IsMappedTrace(&reader);
+  vector<uint64> trace_copy(mapped ? 0 : kBatchBlocks * kTraceBufSize);
+  vector<uint64> ipc_copy(mapped ? 0 : kBatchBlocks * kIpcBufSize);
+  vector<BodyTotals*> totals(nthreads);
+  for (int t = 0; t < nthreads; ++t) {
+    totals[t] = new BodyTotals;
+    memset(totals[t]->event_count, 0, 4096 * sizeof(uint64));
+    memset(totals[t]->hasret_count, 0, 4096 * sizeof(uint64));
+  }
+  vector<const uint64*> batch;
+  vector<const uint64*> batch_ipc;
+  vector<size_t> batch_n;
+  vector<size_t> batch_ipc_n;
+  vector<BlockHealth> batch_health;
 
   offset = 0;
   block_num = 0;
   size_t n;
-  while ((n = fread(traceblock, 1, sizeof(traceblock), f)) != 0) {
-    bool subpar_block = false; 
-    subpar_block |= CheckTraceBlock(n, traceblock);	// Sets flags at first block
-    offset += n;
-
-    if (HasIPC(flags)) {
-      // Extract 8KB IPC block
-      n = fread(ipcblock, 1, sizeof(ipcblock), f);
-      subpar_block |= CheckIpcBlock(n, ipcblock);
-      offset += n;
+  bool more = true;
+  while (more) {
+    batch.clear();
+    batch_ipc.clear();
+    batch_n.clear();
+    batch_ipc_n.clear();
+    while ((int)batch.size() < kBatchBlocks) {
+      traceblock = NextTraceBlock(&reader, &n);
+      if (traceblock == NULL) {more = false; break;}
+      int k = batch.size();
+      if (!mapped) {
+        memcpy(&trace_copy[k * kTraceBufSize], traceblock, kTraceBlockBytes);
+        traceblock = &trace_copy[k * kTraceBufSize];
+      }
+      // Flags are only in the first block, but say whether IPC blocks follow
+      if (block_num + k == 0) {flags = GetFlags(traceblock);}
+      batch.push_back(traceblock);
+      batch_n.push_back(n);
+
+      if (HasIPC(flags)) {
+        // Extract 8KB IPC block
+        ipcblock = reinterpret_cast<const uint64*>(NextIpcBlock(&reader, &n));
+        if (!mapped && (ipcblock != NULL)) {
+          memcpy(&ipc_copy[k * kIpcBufSize], ipcblock, kIpcBlockBytes);
+          ipcblock = &ipc_copy[k * kIpcBufSize];
+        }
+        batch_ipc.push_back(ipcblock);
+        batch_ipc_n.push_back(n);
+      }
     }
-    ++total_block_count;
-    if (subpar_block) {++total_bad_block_count;}
+    if (batch.empty()) {break;}
+
+    ScanBatch(batch, block_num, &totals, &batch_health);
 
-    ++block_num;
+    for (int k = 0; k < (int)batch.size(); ++k) {
+      bool subpar_block = false; 
+      subpar_block |= CheckTraceBlock(batch_n[k], batch[k], &batch_health[k]);
+      offset += batch_n[k];
+
+      if (HasIPC(flags)) {
+        subpar_block |= CheckIpcBlock(batch_ipc_n[k], batch_ipc[k]);
+        offset += batch_ipc_n[k];
+      }
+      ++total_block_count;
+      if (subpar_block) {++total_bad_block_count;}
+
+      ++block_num;
+    }
   }
-  fclose(f);
+  for (int t = 0; t < nthreads; ++t) {delete totals[t];}
+  CloseTraceReader(&reader);
   FinishBlockEvents();
 
   // Reset verbose and counting state
@@ -1251,6 +1620,8 @@ int main (int argc, const char** argv) {
 #endif
   }
 
+  if (health && !quiet) {PrintHealth(offset);}
+
   fprintf(stdout, "%s %s\n\n", trace_fail ? "FAIL" : "PASS", fname);
 
   return 0;
@@ -0,0 +1,152 @@
+// elf_symbols.cc
+// Copyright 2023 Richard L. Sites
+//
+// In-process ELF function symbols. See elf_symbols.h
+//
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "basetypes.h"
+#include "elf_symbols.h"
+
+using std::string;
+using std::vector;
+
+// Sort by address; among aliases at one address, global names first
+typedef struct {
+  ElfSym sym;
+  int rank;
+} RankedSym;
+
+static bool SymOrder(const RankedSym& a, const RankedSym& b) {
+  if (a.sym.addr != b.sym.addr) {return a.sym.addr < b.sym.addr;}
+  return a.rank < b.rank;
+}
+
+static int BindRank(int bind) {
+  if (bind == STB_GLOBAL) {return 0;}
+  if (bind == STB_WEAK) {return 1;}
+  return 2;
+}
+
+// Append the function symbols of one symbol table section
+static void AddSymtab(const uint8* base, uint64 filesize, const Elf64_Shdr* shdrs,
+                      int shnum, int symtab, ElfSymbols* elf, vector<RankedSym>* ranked) {
+  const Elf64_Shdr* sh = &shdrs[symtab];
+  if (sh->sh_link >= (uint32)shnum) {return;}
+  const Elf64_Shdr* strsh = &shdrs[sh->sh_link];
+  if ((filesize < sh->sh_offset + sh->sh_size) ||
+      (filesize < strsh->sh_offset + strsh->sh_size)) {return;}
+  const Elf64_Sym* syms = (const Elf64_Sym*)(base + sh->sh_offset);
+  const char* strtab = (const char*)(base + strsh->sh_offset);
+  uint64 count = sh->sh_size / sizeof(Elf64_Sym);
+  for (uint64 i = 0; i < count; ++i) {
+    const Elf64_Sym* s = &syms[i];
+    int type = ELF64_ST_TYPE(s->st_info);
+    if ((type != STT_FUNC) && (type != STT_GNU_IFUNC)) {continue;}
+    if ((s->st_shndx == SHN_UNDEF) || (s->st_value == 0)) {continue;}
+    if (strsh->sh_size <= s->st_name) {continue;}
+    const char* name = strtab + s->st_name;
+    if (name[0] == '\0') {continue;}
+    RankedSym r;
+    r.sym.addr = s->st_value;
+    r.sym.size = s->st_size;
+    r.sym.name_offset = elf->names.size();
+    r.sym.unused = 0;
+    r.rank = BindRank(ELF64_ST_BIND(s->st_info));
+    elf->names.append(name, strnlen(name, strsh->sh_size - s->st_name));
+    elf->names.push_back('\0');
+    ranked->push_back(r);
+  }
+}
+
+bool LoadElfSymbols(const char* fname, ElfSymbols* elf) {
+  elf->syms.clear();
+  elf->loads.clear();
+  elf->names.clear();
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {return false;}
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(Elf64_Ehdr))) {
+    close(fd);
+    return false;
+  }
+  uint64 filesize = st.st_size;
+  void* map = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {return false;}
+  const uint8* base = (const uint8*)map;
+
+  const Elf64_Ehdr* eh = (const Elf64_Ehdr*)base;
+  bool ok = (memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0) &&
+            (eh->e_ident[EI_CLASS] == ELFCLASS64) &&
+            (eh->e_ident[EI_DATA] == ELFDATA2LSB) &&
+            (eh->e_phoff + (uint64)eh->e_phnum * sizeof(Elf64_Phdr) <= filesize) &&
+            (eh->e_shoff + (uint64)eh->e_shnum * sizeof(Elf64_Shdr) <= filesize);
+  if (ok) {
+    const Elf64_Phdr* phdrs = (const Elf64_Phdr*)(base + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; ++i) {
+      if (phdrs[i].p_type != PT_LOAD) {continue;}
+      ElfLoad load;
+      load.file_offset = phdrs[i].p_offset;
+      load.vaddr = phdrs[i].p_vaddr;
+      load.filesz = phdrs[i].p_filesz;
+      elf->loads.push_back(load);
+    }
+
+    // The full .symtab if there is one, else just the exported .dynsym
+    const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + eh->e_shoff);
+    int symtab = -1;
+    int dynsym = -1;
+    for (int i = 0; i < eh->e_shnum; ++i) {
+      if (shdrs[i].sh_type == SHT_SYMTAB) {symtab = i;}
+      if (shdrs[i].sh_type == SHT_DYNSYM) {dynsym = i;}
+    }
+    vector<RankedSym> ranked;
+    if (symtab >= 0) {AddSymtab(base, filesize, shdrs, eh->e_shnum, symtab, elf, &ranked);}
+    if (ranked.empty() && (dynsym >= 0)) {
+      AddSymtab(base, filesize, shdrs, eh->e_shnum, dynsym, elf, &ranked);
+    }
+
+    // One symbol per address
+    std::sort(ranked.begin(), ranked.end(), SymOrder);
+    for (int i = 0; i < (int)ranked.size(); ++i) {
+      if ((i > 0) && (ranked[i].sym.addr == ranked[i - 1].sym.addr)) {continue;}
+      elf->syms.push_back(ranked[i].sym);
+    }
+  }
+
+  munmap(map, filesize);
+  return ok;
+}
+
+uint64 ElfFileOffsetToVaddr(const ElfSymbols& elf, uint64 file_offset) {
+  for (int i = 0; i < (int)elf.loads.size(); ++i) {
+    const ElfLoad& load = elf.loads[i];
+    if ((load.file_offset <= file_offset) &&
+        (file_offset < load.file_offset + load.filesz)) {
+      return file_offset - load.file_offset + load.vaddr;
+    }
+  }
+  return file_offset;
+}
+
+static bool AddrLess(uint64 addr, const ElfSym& sym) {return addr < sym.addr;}
+
+const char* LookupElfSymbol(const ElfSymbols& elf, uint64 vaddr) {
+  vector<ElfSym>::const_iterator it =
+    std::upper_bound(elf.syms.begin(), elf.syms.end(), vaddr, AddrLess);
+  if (it == elf.syms.begin()) {return NULL;}
+  --it;		// At or just below vaddr
+  return elf.names.c_str() + it->name_offset;
+}
@@ -0,0 +1,55 @@
+// elf_symbols.h
+// Copyright 2023 Richard L. Sites
+//
+// In-process function symbols of an ELF executable or shared library, for
+// turning user-mode PC samples into routine names without running addr2line
+// once per sample. Each file is read once: the function symbols from .symtab,
+// or .dynsym if the file is stripped, go into one array sorted by address,
+// and a lookup is a binary search.
+//
+// Only 64-bit little-endian files are understood. Anything else fails to
+// load, and the caller can fall back to addr2line.
+//
+
+#ifndef __ELF_SYMBOLS_H__
+#define __ELF_SYMBOLS_H__
+
+#include <string>
+#include <vector>
+
+#include "basetypes.h"
+
+typedef struct {
+  uint64 addr;		// Link-time virtual address
+  uint64 size;		// 0 if the symbol table does not say
+  uint32 name_offset;	// Into ElfSymbols.names
+  uint32 unused;
+} ElfSym;
+
+// One PT_LOAD segment, to turn file offsets into link-time addresses
+typedef struct {
+  uint64 file_offset;
+  uint64 vaddr;
+  uint64 filesz;
+} ElfLoad;
+
+typedef struct {
+  std::vector<ElfSym> syms;	// Sorted by addr
+  std::vector<ElfLoad> loads;
+  std::string names;		// NUL-terminated, raw (still mangled)
+} ElfSymbols;
+
+// Return false if the file does not open or is not an ELF file we understand
+bool LoadElfSymbols(const char* fname, ElfSymbols* elf);
+
+// Link-time address of a byte at file_offset, or file_offset itself if no
+// loaded segment covers it
+uint64 ElfFileOffsetToVaddr(const ElfSymbols& elf, uint64 file_offset);
+
+// The function at or just below vaddr, or NULL if vaddr is below them all.
+// Like addr2line, this ignores symbol sizes: in a stripped library only the
+// exported functions are named, and the code of the internal ones between
+// them goes to the exported one just below
+const char* LookupElfSymbol(const ElfSymbols& elf, uint64 vaddr);
+
+#endif	// __ELF_SYMBOLS_H__
@@ -0,0 +1,266 @@
+// event_bin.cc
+// Copyright 2023 Richard L. Sites
+//
+// Packed binary event stream between rawtoevent and eventtospan3.
+// See event_bin.h for the layout
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "event_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kMaxLineSize = 256;
+
+
+void InitEventBinWriter(FILE* f, EventBinWriter* w) {
+  w->f = f;
+  w->put = NULL;
+  w->put_arg = NULL;
+  w->name_ids.clear();
+  w->names.clear();
+  fwrite(kEventBinMagic, 1, kEventBinMagicLen, f);
+}
+
+void InitEventBinSink(EventBinPut put, void* put_arg, EventBinWriter* w) {
+  w->f = NULL;
+  w->put = put;
+  w->put_arg = put_arg;
+  w->name_ids.clear();
+  w->names.clear();
+}
+
+// Return the id for name, sending a new dictionary entry the first time we see it
+uint32 EventBinNameId(EventBinWriter* w, const char* name) {
+  string s = string(name);
+  map<string, uint32>::const_iterator it = w->name_ids.find(s);
+  if (it != w->name_ids.end()) {return it->second;}
+
+  uint32 id = w->name_ids.size();
+  w->name_ids[s] = id;
+  w->names.push_back(s);
+  if (w->f == NULL) {return id;}	// The sink reads w->names
+
+  EventBin rec;
+  memset(&rec, 0, sizeof(EventBin));
+  rec.kind = kEvbString;
+  rec.name_id = id;
+  rec.arg = s.length();
+  fwrite(&rec, 1, sizeof(EventBin), w->f);
+  // Name bytes, NUL-padded to a multiple of eight
+  char pad[8];
+  memset(pad, 0, 8);
+  fwrite(s.data(), 1, s.length(), w->f);
+  fwrite(pad, 1, (8 - (s.length() & 7)) & 7, w->f);
+  return id;
+}
+
+void WriteEventBin(EventBinWriter* w, const EventBin& rec) {
+  if (w->f == NULL) {
+    w->put(w->put_arg, rec, w->names);
+    return;
+  }
+  fwrite(&rec, 1, sizeof(EventBin), w->f);
+}
+
+
+bool IsEventBin(FILE* f) {
+  int c = getc(f);
+  if (c == EOF) {return false;}
+  ungetc(c, f);
+  if (c != kEventBinMagic[0]) {return false;}
+
+  char magic[kEventBinMagicLen];
+  if ((fread(magic, 1, kEventBinMagicLen, f) != kEventBinMagicLen) ||
+      (memcmp(magic, kEventBinMagic, kEventBinMagicLen) != 0)) {
+    fprintf(stderr, "ReadEventBin: bad binary event magic\n");
+    exit(0);
+  }
+  return true;
+}
+
+void InitEventBinMeta(EventBinMeta* meta) {
+  meta->version = 0;
+  meta->flags = 0;
+  meta->datetime.clear();
+  meta->lo_ts = 0;
+  meta->hi_ts = 0;
+  meta->sorted = false;
+}
+
+bool AbsorbEventBinMeta(const EventBin& rec, const vector<string>& names,
+                        EventBinMeta* meta) {
+  switch (rec.kind) {
+  case kEvbVersion:
+    meta->version = rec.arg;
+    return true;
+  case kEvbFlags:
+    meta->flags = rec.arg;
+    return true;
+  case kEvbDateTime:
+    meta->datetime = names[rec.name_id];
+    return true;
+  case kEvbTimes:
+    meta->lo_ts = rec.start_ts;
+    meta->hi_ts = rec.duration;
+    return true;
+  case kEvbSorted:
+    meta->sorted = true;
+    return true;
+  }
+  return false;
+}
+
+void InitEventBinReader(FILE* f, EventBinReader* r) {
+  r->f = f;
+  r->names.clear();
+  InitEventBinMeta(&r->meta);
+}
+
+bool ReadEventBinRecord(EventBinReader* r, EventBin* rec) {
+  while (fread(rec, 1, sizeof(EventBin), r->f) == sizeof(EventBin)) {
+    if (AbsorbEventBinMeta(*rec, r->names, &r->meta)) {continue;}
+    switch (rec->kind) {
+    case kEvbEvent:
+    case kEvbName:
+      return true;
+    case kEvbString: {
+      uint32 padlen = (rec->arg + 7) & ~7;
+      char* temp = new char[padlen + 1];
+      if (fread(temp, 1, padlen, r->f) != padlen) {
+        fprintf(stderr, "ReadEventBin: truncated name %u\n", rec->name_id);
+        exit(0);
+      }
+      if (r->names.size() <= rec->name_id) {r->names.resize(rec->name_id + 1);}
+      r->names[rec->name_id] = string(temp, rec->arg);
+      delete[] temp;
+      break;
+    }
+    default:
+      fprintf(stderr, "ReadEventBin: bad record kind %d\n", rec->kind);
+      exit(0);
+    }
+  }
+  return false;
+}
+
+void ReadEventBin(EventBinReader* r, vector<EventBin>* recs) {
+  EventBin rec;
+  while (ReadEventBinRecord(r, &rec)) {recs->push_back(rec);}
+}
+
+// Must exactly match rawtoevent OutputName and OutputEvent
+int FormatEventBin(const EventBin& rec, const vector<string>& names,
+                   char* buffer, int maxsize) {
+  const char* name = names[rec.name_id].c_str();
+  if (rec.kind == kEvbName) {
+    return snprintf(buffer, maxsize, "%lld %lld %lld %d %s",
+                    rec.start_ts, rec.duration, (uint64)rec.eventnum,
+                    (int32)rec.arg, name);
+  }
+  return snprintf(buffer, maxsize, "%lld %lld %lld %lld  %lld %lld  %lld %lld %d %s (%llx)",
+                  rec.start_ts, rec.duration, (uint64)rec.eventnum, (uint64)rec.cpu,
+                  (uint64)rec.pid, (uint64)rec.rpcid,
+                  (uint64)rec.arg, (uint64)rec.retval, rec.ipc, name, (uint64)rec.eventnum);
+}
+
+// Powers of ten, for counting decimal digits
+static const uint64 kPow10[20] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+  100000000ull, 1000000000ull, 10000000000ull, 100000000000ull,
+  1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+  10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+  10000000000000000000ull
+};
+
+static int DecimalDigits(uint64 x) {
+  int n = 1;
+  while ((n < 20) && (kPow10[n] <= x)) {++n;}
+  return n;
+}
+
+// Compare two fields as their decimal text, each followed by a space. A field
+// that is a prefix of the other sorts first, since space is below any digit
+static int CompareDecimal(uint64 x, uint64 y) {
+  if (x == y) {return 0;}
+  int nx = DecimalDigits(x);
+  int ny = DecimalDigits(y);
+  if (nx == ny) {return (x < y) ? -1 : 1;}
+  if (nx < ny) {return (x <= (y / kPow10[ny - nx])) ? -1 : 1;}
+  return ((x / kPow10[nx - ny]) < y) ? -1 : 1;
+}
+
+// A leading minus sign sorts below any digit
+static int CompareSignedDecimal(int64 x, int64 y) {
+  if ((x < 0) != (y < 0)) {return (x < 0) ? -1 : 1;}
+  if (x < 0) {return CompareDecimal(0 - (uint64)x, 0 - (uint64)y);}
+  return CompareDecimal(x, y);
+}
+
+// Both lines are the same up to their names. An event name is followed by
+// " (event)", and names have no spaces, so a name that is a prefix of the
+// other sorts first there too. Name definitions end with the name.
+// Returns 0 if the bytes after the names are needed to decide
+static int CompareNames(const string& a, const string& b, bool at_end) {
+  int n = (a.size() < b.size()) ? a.size() : b.size();
+  int c = memcmp(a.data(), b.data(), n);
+  if (c != 0) {return c;}
+  if (a.size() == b.size()) {return 0;}
+  if (at_end) {return (a.size() < b.size()) ? -1 : 1;}
+  if (a.size() < b.size()) {return ' ' - (uint8)b[n];}
+  return (uint8)a[n] - ' ';
+}
+
+// sort -n compares the leading number, then falls back to comparing
+// entire lines bytewise. The fields go out in the same order with the same
+// separators, so equal timestamps compare field by field. Only a name
+// definition against an event at the same time needs the formatted text
+int CompareEventBin(const EventBin& a, const EventBin& b, const vector<string>& names) {
+  if (a.start_ts != b.start_ts) {return (a.start_ts < b.start_ts) ? -1 : 1;}
+  int c = 0;
+  if (a.kind == b.kind) {
+    if ((c = CompareSignedDecimal(a.duration, b.duration)) != 0) {return c;}
+    if ((c = CompareDecimal(a.eventnum, b.eventnum)) != 0) {return c;}
+    if (a.kind == kEvbName) {
+      if ((c = CompareSignedDecimal((int32)a.arg, (int32)b.arg)) != 0) {return c;}
+      return CompareNames(names[a.name_id], names[b.name_id], true);
+    }
+    if ((c = CompareDecimal(a.cpu, b.cpu)) != 0) {return c;}
+    if ((c = CompareDecimal(a.pid, b.pid)) != 0) {return c;}
+    if ((c = CompareDecimal(a.rpcid, b.rpcid)) != 0) {return c;}
+    if ((c = CompareDecimal(a.arg, b.arg)) != 0) {return c;}
+    if ((c = CompareDecimal(a.retval, b.retval)) != 0) {return c;}
+    if ((c = CompareDecimal(a.ipc, b.ipc)) != 0) {return c;}
+    if ((c = CompareNames(names[a.name_id], names[b.name_id], false)) != 0) {return c;}
+    if (names[a.name_id] == names[b.name_id]) {return 0;}
+  }
+  char abuf[kMaxLineSize];
+  char bbuf[kMaxLineSize];
+  FormatEventBin(a, names, abuf, kMaxLineSize);
+  FormatEventBin(b, names, bbuf, kMaxLineSize);
+  return strcmp(abuf, bbuf);
+}
+
+struct EventBinLess {
+  const vector<string>* names;
+  bool operator()(const EventBin& a, const EventBin& b) const {
+    return CompareEventBin(a, b, *names) < 0;
+  }
+};
+
+void SortEventBin(vector<EventBin>* recs, const vector<string>& names) {
+  EventBinLess less;
+  less.names = &names;
+  std::sort(recs->begin(), recs->end(), less);
+}
@@ -0,0 +1,126 @@
+// event_bin.h
+// Copyright 2023 Richard L. Sites
+//
+// Packed binary form of the rawtoevent event listing, an optional replacement
+// for the Ascii listing between rawtoevent and eventtospan3. It avoids all the
+// printf/sscanf work and the external sort -n. The Ascii form remains the
+// default, since it is much easier to read when debugging.
+//
+// Stream layout:
+//   8-byte magic "KUEVBIN1"
+//   Any number of 48-byte EventBin records
+//   Each kEvbString record is followed by its name bytes, NUL-padded to a
+//   multiple of eight bytes
+//
+// Each distinct name string is sent just once, as a kEvbString record that
+// precedes its first use. All other records carry only the 32-bit name_id.
+//
+
+#ifndef __EVENT_BIN_H__
+#define __EVENT_BIN_H__
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basetypes.h"
+
+static const char* const kEventBinMagic = "KUEVBIN1";
+static const int kEventBinMagicLen = 8;
+
+// Record kinds
+static const uint8 kEvbEvent    = 0;  // ts dur event cpu pid rpc arg retval ipc name
+static const uint8 kEvbName     = 1;  // ts dur event arg name, a name definition
+static const uint8 kEvbString   = 2;  // Name dictionary entry, arg = byte length
+static const uint8 kEvbVersion  = 3;  // arg = ## VERSION
+static const uint8 kEvbFlags    = 4;  // arg = ## FLAGS, OR of all block flags
+static const uint8 kEvbDateTime = 5;  // name_id = earliest # [1] block date_time
+static const uint8 kEvbTimes    = 6;  // start_ts, duration = ## TIMES lo, hi
+static const uint8 kEvbSorted   = 7;  // Records are already in sort -n order
+
+// One fixed-width record, 48 bytes
+typedef struct {
+  int64 start_ts;	// Multiples of 10ns, -1 for names copied to the front
+  int64 duration;	// Multiples of 10ns
+  uint32 eventnum;
+  uint32 cpu;
+  uint32 pid;
+  uint32 rpcid;
+  uint32 arg;		// Names carry argall here
+  uint32 retval;
+  uint32 name_id;	// Index into the name dictionary
+  uint8 ipc;
+  uint8 kind;
+  uint16 unused;
+} EventBin;
+
+// Where records go instead of a file, for kutrace_post: each event, name
+// definition, and metadata record, with the name dictionary so far
+typedef void (*EventBinPut)(void* arg, const EventBin& rec,
+                            const std::vector<std::string>& names);
+
+// Writer state: the names already sent
+typedef struct {
+  FILE* f;		// NULL if sending to put instead
+  EventBinPut put;
+  void* put_arg;
+  std::map<std::string, uint32> name_ids;
+  std::vector<std::string> names;	// Indexed by name_id
+} EventBinWriter;
+
+// Everything that arrives outside the event records proper
+typedef struct {
+  int version;
+  int flags;
+  std::string datetime;	// From the earliest # [1] block line, block 0's if sorted
+  int64 lo_ts;
+  int64 hi_ts;
+  bool sorted;
+} EventBinMeta;
+
+// Reader state: the names and metadata seen so far
+typedef struct {
+  FILE* f;
+  std::vector<std::string> names;	// Indexed by name_id
+  EventBinMeta meta;
+} EventBinReader;
+
+
+// Writing, used by rawtoevent
+void InitEventBinWriter(FILE* f, EventBinWriter* w);
+// Hand each record to put instead of writing a stream. No kEvbString records
+void InitEventBinSink(EventBinPut put, void* put_arg, EventBinWriter* w);
+uint32 EventBinNameId(EventBinWriter* w, const char* name);
+void WriteEventBin(EventBinWriter* w, const EventBin& rec);
+
+// Reading, used by eventtospan3
+void InitEventBinMeta(EventBinMeta* meta);
+// If rec is a version, flags, date, times, or sorted record, note it in meta
+// and return true
+bool AbsorbEventBinMeta(const EventBin& rec, const std::vector<std::string>& names,
+                        EventBinMeta* meta);
+// True if f starts with the binary magic, which is then consumed.
+// Anything else consumes nothing, so the Ascii listing can be read as before
+bool IsEventBin(FILE* f);
+void InitEventBinReader(FILE* f, EventBinReader* r);
+// Returns the next event or name definition, false at the end. The string
+// and metadata records in between just update r
+bool ReadEventBinRecord(EventBinReader* r, EventBin* rec);
+// Reads all remaining records, returning events and name definitions in recs
+void ReadEventBin(EventBinReader* r, std::vector<EventBin>* recs);
+
+// Reproduce the exact Ascii line rawtoevent would have written, without the newline
+int FormatEventBin(const EventBin& rec, const std::vector<std::string>& names,
+                   char* buffer, int maxsize);
+
+// Compare in exactly the order that "LC_ALL=C sort -n" gives the Ascii lines,
+// returning <0, 0, or >0. Works on the packed fields, without formatting
+int CompareEventBin(const EventBin& a, const EventBin& b, const std::vector<std::string>& names);
+
+// Sort into that order
+void SortEventBin(std::vector<EventBin>* recs, const std::vector<std::string>& names);
+
+#endif	// __EVENT_BIN_H__
+
@@ -65,8 +65,17 @@
 // 2022.06.05 dsites Allow mwait(0) for C1 state, add mwait exit event
 // 2022.06.05 dsites Get pid (later: rpc names to track over time if they change
 // 2023.07.24 dsites Make default syscall dff, not 9ff
+// 2023.08.02 dsites Accept packed binary input from rawtoevent -bin, see event_bin.h
+// 2023.08.09 dsites Per-CPU state sized to the CPUs seen, no 80-CPU limit
+// 2023.08.10 dsites Flat hash tables for per-PID state, 32-bit interned names in spans
+// 2023.08.15 dsites Format span JSON lines directly from 10ns ticks, no printf
+// 2023.08.17 dsites Optional seekable binary span file, -spanbin, see span_bin.h
+// 2023.08.23 dsites Cache the name ids built per event: input names, name.pid, /return
+// 2023.09.05 dsites Stream rawtoevent -bin -sorted input instead of reading it all first
+// 2023.09.08 dsites Split main into InitSpans, SpanEventBin/SpanEventLine, and FinishSpans,
+//   see eventtospan3.h, so kutrace_post can feed it records and take back SpanBin records
 
-// Compile with  g++ -O2 eventtospan3.cc -o eventtospan3
+// Compile with  g++ -O2 eventtospan3.cc event_bin.cc span_bin.cc -o eventtospan3
 
 
 /*TODO:
@@ -76,6 +85,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit, random
@@ -86,9 +96,15 @@
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "event_bin.h"
+#include "eventtospan3.h"
+#include "flat_hash.h"
+#include "span_bin.h"
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
 
+namespace eventtospan3 {
+
 // Event numbers or related masks
 #define call_mask        0xc00
 #define call_ret_mask    0xe00
@@ -119,7 +135,8 @@
 
 static const char* kIdleName = "-idle-";
 static const char* kIdlelpName = "-idlelp-";
-static const int kMAX_CPUS = 80;
+static const int kMAX_CPUS = 4096;	// Sanity check only; state grows to the CPUs seen
+static const int kCacheLineBytes = 64;
 static const int kNetworkMbitSec = 1000;	// Default: 1 Gb/s if not in trace
 
 static const uint64 kMIN_CEXIT_DURATION = 10LL;	//  0.100 usec in multiples of 10 nsec
@@ -187,6 +204,7 @@ static const double kPowerTwoTenths[10] = {
 using std::map;
 using std::multimap;
 using std::string;
+using std::vector;
 
 
 // Per-PID short stack of events to return to.
@@ -230,7 +248,7 @@ typedef struct {
   int dequeue_num_pending;	// For piecing together RPC waiting in a queue (-1 = inactive)
   int top;		        // Top of our small stack
   int eventnum[5];		// One or more event numbers that are stacked calls
-  string name[5];		// One or more event names that are stacked calls
+  uint32 name[5];		// One or more event name ids that are stacked calls
 } PidState;
 
 
@@ -261,7 +279,7 @@ typedef struct {
   int arg;
   int retval;
   int ipc;
-  string name;
+  uint32 name;		// Interned name id, see Intern
 } OneSpan;
 
 
@@ -292,7 +310,7 @@ typedef struct {
 } LockContend;
 
 
-// Per-CPU state: M sets of these for M CPUs
+// Per-CPU state: M sets of these for M CPUs, each on its own cache lines
 // +---------------+
 // | cpu_stack   o-|--> current thread's PidState w/return stack
 // +---------------+    saved and restored across context switches
@@ -318,8 +336,8 @@ typedef struct {
 // | valid_span    |
 // +---------------+
 //
-typedef struct {
-  PidState cpu_stack;		// Current call stack & span for each of kMAX_CPUS CPUs
+typedef struct alignas(kCacheLineBytes) {
+  PidState cpu_stack;		// Current call stack & span for this CPU
   OneSpan cur_span;
   uint64 prior_pstate_ts;	// Used to assign duration to each pstate (CPU clock freq)
   uint64 prior_pstate_freq;	// Used to assign frequency to each pstate2 span
@@ -336,18 +354,18 @@ typedef struct {
 //
 // Globals across all CPUs
 //
-typedef map<int, PidState> PerPidState;	// State of each suspended task, by PID
+typedef FlatMap<int, PidState> PerPidState;	// State of each suspended task, by PID
 typedef map<int, string> IntName;	// Name for each PID/lock/method
-typedef map<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
-typedef map<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
-typedef map<int, uint> PidLock;		// Previous per-PID lock hash number
-typedef map<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
-typedef map<int, bool> PidRunning;	// Set of currently-running PIDs
-typedef map<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
+typedef FlatMap<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
+typedef FlatMap<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
+typedef FlatMap<int, uint> PidLock;	// Previous per-PID lock hash number
+typedef FlatMap<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
+typedef FlatMap<int, bool> PidRunning;	// Set of currently-running PIDs
+typedef FlatMap<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
 						// Multiple threads can be wanting the same lock
-typedef map<uint32, PidCorr> PidToCorr;		// pid to <timestamp, rpcid, len>
-typedef map<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
-typedef map<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
+typedef FlatMap<uint32, PidCorr> PidToCorr;	// pid to <timestamp, rpcid, len>
+typedef FlatMap<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
+typedef FlatMap<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
 
 
 // RPC-to-packet correlation
@@ -487,6 +505,9 @@ bool trace = false;
 bool rel0 = false;
 bool is_rpi = false;		// True for Raspberry Pi
 bool is_low_res_ts = false;	// True for Riscv u74
+bool spanbin = false;		// True to also write the binary span file
+SpanBinWriter spanbin_writer;
+SpanSet* span_set = NULL;	// If not NULL, spans go here instead of the JSON
 
 string kernel_version;
 string cpu_model_name;
@@ -516,6 +537,34 @@ PidRunning pidRunning;		  // Set of currently-running PIDs
 				  //  during all of that second context switch. Any wakeup delivered while
 				  //  it is running creates no waiting before that wakeup.
 
+// Interned names. Spans and stacks carry a 32-bit name id, so pushing, popping,
+// and saving them copies no strings. Id 0 is the empty name.
+// NameText references are good only until the next Intern of a new name.
+vector<string> nametext(1);	  // Text of each name, by name id
+FlatMap<string, uint32> nameids;  // Id of each name, by text
+
+uint32 Intern(const string& name) {
+  if (name.empty()) {return 0;}
+  uint32& id = nameids[name];
+  if (id == 0) {
+    id = nametext.size();
+    nametext.push_back(name);
+  }
+  return id;
+}
+
+inline const string& NameText(uint32 id) {return nametext[id];}
+
+uint32 idle_name_id = Intern(kIdleName);
+uint32 idlelp_name_id = Intern(kIdlelpName);
+
+// Name ids that would otherwise be rebuilt as strings and interned again on
+// every event, each a malloc or two once a name is past the short-string
+// length. Id 0 means not cached yet
+vector<uint32> input_name_ids;	// By binary input name_id
+FlatMap<int, uint32> pidname_ids;	// "name.pid" for pidnames[pid], by pid
+vector<uint32> retname_ids;	// "/name", by call name id
+
 // Stats
 double total_usermode = 0.0;
 double total_idle = 0.0;
@@ -717,13 +766,13 @@ bool IsUserTxPktInt(int eventnum) {return (eventnum == KUTRACE_TX_USER);}
 // Incoming RPC request/response. Prior RX_USER has set up pidtocorr[pid]
 bool IsIncomingRpcReqResp(const OneSpan& event) {
   return IsRpcReqRespInt(event.eventnum) && (event.arg != 0) &&
-    (pidtocorr.find(event.pid) != pidtocorr.end());
+    (pidtocorr.count(event.pid) != 0);
 }
 
 // Outgoing RPC request/response. No pending pidcorr[pid]
 bool IsOutgoingRpcReqResp(const OneSpan& event) {
   return IsRpcReqRespInt(event.eventnum) && (event.arg != 0) &&
-    (pidtocorr.find(event.pid) == pidtocorr.end());
+    (pidtocorr.count(event.pid) == 0);
 }
 
 
@@ -773,10 +822,11 @@ bool IsOptimizedCall(const OneSpan& event) {  // Must be a call already
 bool IsNewRunnablePidSyscall(const OneSpan& event) {
   if (!IsACallOrReturn(event)) {return false;}
   if (!IsASyscallOrReturn(event)) {return false;}
-  if (event.name == "clone") {return true;}
-  if (event.name == "/clone") {return true;}
-  if (event.name == "fork") {return true;}
-  if (event.name == "/fork") {return true;}
+  const string& name = NameText(event.name);
+  if (name == "clone") {return true;}
+  if (name == "/clone") {return true;}
+  if (name == "fork") {return true;}
+  if (name == "/fork") {return true;}
   return false;
 }
 
@@ -875,11 +925,19 @@ int PidToEventnum(int pid) {return (pid & 0xFFFF) + 0x10000;}
 int EventnumToPid(int eventnum) {return eventnum & 0xFFFF;}
 
 // Format a user thread name
-string NameAppendPid(string name, int pid) {
+string NameAppendPid(const string& name, int pid) {
   if (pid == 0) {return kIdleName;}
   return name + "." + IntToString(pid);
 }
 
+// Interned "name.pid" for pid's current name. Like pidnames[pid], this gives
+// pid an empty name if it has none yet
+uint32 PidNameId(int pid) {
+  uint32& id = pidname_ids[pid];
+  if (id == 0) {id = Intern(NameAppendPid(pidnames[pid], pid));}
+  return id;
+}
+
 // Initially empty stack of -idle- running on this thread
 void InitPidState(PidState* t) {
   t->ambiguous = 0;
@@ -889,12 +947,11 @@ void InitPidState(PidState* t) {
   t->top = 0;
   for (int i = 0; i < 5; ++i) {
     t->eventnum[i] = event_idle;
-    t->name[i].clear();
-    t->name[i] = string(kIdleName);
+    t->name[i] = idle_name_id;
   }
 }
 
-void BrandNewPid(int newpid, const string& newname, PerPidState* perPidState) {
+void BrandNewPid(int newpid, uint32 newname, PerPidState* perPidState) {
   PidState temp;
   InitPidState(&temp);
   temp.top = 1;
@@ -902,10 +959,10 @@ void BrandNewPid(int newpid, const string& newname, PerPidState* perPidState) {
   temp.name[0] = newname;
   // Use current name, not the possibly-bad one from rawtoevent
   if (pidnames.find(newpid) != pidnames.end()) {
-    temp.name[0] = NameAppendPid(pidnames[newpid], newpid);
+    temp.name[0] = PidNameId(newpid);
   }
   temp.eventnum[1] = sched_syscall;
-  temp.name[1] = "-sched-";
+  temp.name[1] = Intern("-sched-");
   (*perPidState)[newpid] = temp;
 }
 
@@ -923,7 +980,7 @@ void InitSpan(OneSpan* s, int i) {
   // s->arg = 0;	// idle(0) regular; idle(1) low-power after mwait
   // s->retval = 0;
   // s->ipc = 0;
-  s->name = kIdleName;
+  s->name = idle_name_id;
 }
 
 // Example:
@@ -938,17 +995,17 @@ void InitSpan(OneSpan* s, int i) {
 void DumpSpan(FILE* f, const char* label, const OneSpan* span) {
   fprintf(f, "%s <%llu %llu %d  %d %d %d %d %d %d %s>\n",
   label, span->start_ts, span->duration, span->cpu,
-  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, span->name.c_str());
+  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, NameText(span->name).c_str());
 }
 
 void DumpSpanShort(FILE* f,  const OneSpan* span) {
-  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, span->name.c_str());
+  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, NameText(span->name).c_str());
 }
 
 void DumpStack(FILE* f, const char* label, const PidState* stack) {
   fprintf(f, "%s [%d] %d %d {\n", label, stack->top, stack->ambiguous, stack->rpcid);
   for (int i = 0; i < 5; ++i) {
-    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], stack->name[i].c_str());
+    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], NameText(stack->name[i]).c_str());
   }
   fprintf(f, "}\n");
 }
@@ -956,7 +1013,7 @@ void DumpStack(FILE* f, const char* label, const PidState* stack) {
 void DumpStackShort(FILE* f, const PidState* stack) {
   fprintf(f, "%d{", stack->top);
   for (int i = 0; i <= stack->top; ++i) {
-    fprintf(f, "%s ", stack->name[i].c_str());
+    fprintf(f, "%s ", NameText(stack->name[i]).c_str());
   }
   fprintf(f, "}%s %d ", stack->ambiguous ? "ambig" : "", stack->rpcid);
 }
@@ -964,7 +1021,7 @@ void DumpStackShort(FILE* f, const PidState* stack) {
 void DumpEvent(FILE* f, const char* label, const OneSpan& event) {
   fprintf(f, "%s [%llu %llu %d  %d %d %d %d %d %d %s]\n",
   label, event.start_ts, event.duration, event.cpu,
-  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc, event.name.c_str());
+  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc, NameText(event.name).c_str());
 }
 
 
@@ -1087,7 +1144,7 @@ void MakeArcSpan(const OneSpan& event1, const OneSpan& event2, OneSpan* span) {
   span->arg = event2.cpu;
   span->retval = event2.pid;	// Added 2020.08.20
   span->ipc = 0;
-  span->name = "-wakeup-";
+  span->name = Intern("-wakeup-");
 }
 
 // Waiting on reason c from event1 to event2. For PID or RPC, not on any CPU
@@ -1115,7 +1172,7 @@ void MakeWaitSpan(char letter, uint64 start_ts, uint64 end_ts, int pid, int rpci
   span->arg = 0;
   span->retval = 0;
   span->ipc = 0;
-  span->name = kWAIT_NAMES[letter - 'a'];
+  span->name = Intern(kWAIT_NAMES[letter - 'a']);
 }
 
 // For PID only; not CPU- or RPC-specific
@@ -1130,7 +1187,7 @@ void MakeLockSpan(bool dots, uint64 start_ts, uint64 end_ts, int pid,
   span->arg = lockhash;
   span->retval = 0;
   span->ipc = 0;
-  span->name = lockname;
+  span->name = Intern(lockname);
 }
 
 // To insert just after context switch back to a preempted in-progress RPC
@@ -1148,7 +1205,7 @@ void MakeRpcidMidSpan(uint64 start_ts, int cpu, int pid, int rpcid, OneSpan* spa
   span->arg = rpcid;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(rpc_name);
+  span->name = Intern(rpc_name);
 }
 
 // To insert just after dequeuing an RPC
@@ -1163,7 +1220,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
   span->arg = queue_num;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(queuenames[queue_num]);
+  span->name = Intern(queuenames[queue_num]);
 }
 
 
@@ -1172,7 +1229,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
 void CexitBackToIdle(OneSpan* span) {
   if (span->eventnum != event_c_exit) {return;}
   span->eventnum = event_idle;
-  span->name = string(kIdleName);
+  span->name = idle_name_id;
 //fprintf(stdout, "CexitBackToIdle at %llu\n", span->start_ts);
 }
 
@@ -1180,10 +1237,10 @@ void CexitBackToIdle(OneSpan* span) {
 void CheckSpan(const char* label, const CPUState* thiscpu) {
   bool fail = false;
   const OneSpan* span = &thiscpu->cur_span;
-  if ((span->name == string(kIdleName)) &&
+  if ((span->name == idle_name_id) &&
       (span->eventnum != event_idle)) {fail = true;}
   for (int i = 0; i < 5; ++i) {
-    if ((thiscpu->cpu_stack.name[i] == string(kIdleName)) &&
+    if ((thiscpu->cpu_stack.name[i] == idle_name_id) &&
         (thiscpu->cpu_stack.eventnum[i] != event_idle)) {fail = true;}
   }
   if (fail) {
@@ -1194,6 +1251,69 @@ void CheckSpan(const char* label, const CPUState* thiscpu) {
   }
 }
 
+// Span JSON text, built without printf; see PutTicks in span_bin.h. Each
+// line is formatted into a local buffer and written with a single fwrite into
+// stdout's enlarged buffer.
+static const int kMaxJsonLine = 512;
+
+// The binary form of one span
+SpanBin ToSpanBin(const OneSpan* span) {
+  SpanBin rec;
+  rec.start_ts = span->start_ts;
+  rec.duration = span->duration;
+  rec.cpu = span->cpu;
+  rec.pid = span->pid;
+  rec.rpcid = span->rpcid;
+  rec.eventnum = span->eventnum;
+  rec.arg = span->arg;
+  rec.retval = span->retval;
+  rec.ipc = span->ipc;
+  rec.name_id = span->name;
+  return rec;
+}
+
+// One span line, [ts, dur, cpu, pid, rpc, event, arg, ret, ipc, "name"],
+void PutSpanJson(FILE* f, const OneSpan* span) {
+  if (span_set != NULL) {
+    span_set->spans.push_back(ToSpanBin(span));
+    return;
+  }
+  char line[kMaxJsonLine];
+  char* p = line;
+  *p++ = '[';
+  p = PutTicks(p, span->start_ts, 12);
+  *p++ = ',';
+  *p++ = ' ';
+  p = PutTicks(p, span->duration, 10);
+  p = PutInt(p, span->cpu);
+  p = PutInt(p, span->pid);
+  p = PutInt(p, span->rpcid);
+  p = PutInt(p, span->eventnum);
+  p = PutInt(p, span->arg);
+  p = PutInt(p, span->retval);
+  p = PutInt(p, span->ipc);
+  const string& name = NameText(span->name);
+  // Names are short; an absurdly long one just takes a second write
+  int room = &line[kMaxJsonLine] - p - 8;
+  if (name.size() <= room) {
+    *p++ = ',';
+    *p++ = ' ';
+    *p++ = '"';
+    memcpy(p, name.data(), name.size());
+    p += name.size();
+    *p++ = '"';
+    *p++ = ']';
+    *p++ = ',';
+    *p++ = '\n';
+    fwrite(line, 1, p - line, f);
+  } else {
+    fwrite(line, 1, p - line, f);
+    fprintf(f, ", \"%s\"],\n", name.c_str());
+  }
+
+  if (spanbin) {WriteSpanBin(&spanbin_writer, ToSpanBin(span));}
+}
+
 // Write the current timespan and start a new one
 // Change time from multiples of 10ns to seconds
 // ts           dur       CPU tid  rpc event arg0 ret  name
@@ -1205,16 +1325,11 @@ void WriteSpanJson2(FILE* f, const OneSpan* span) {
   // Output
   // time dur cpu pid rpcid event arg retval ipc name
   // Change time from multiples of 10 nsec to seconds and fraction
-  double ts_sec = span->start_ts / 100000000.0;
   double dur_sec = span->duration / 100000000.0;
 //CHECK("f", *span);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],",
-          ts_sec, dur_sec, span->cpu,
-          span->pid, span->rpcid, span->eventnum,
-          span->arg, span->retval, span->ipc, span->name.c_str());
+  //       ts dur cpu  pid rpc event  arg ret ipc  name
+  PutSpanJson(f, span);
   ++span_count;
-  fprintf(f, "\n");
 
   // Stastics
   if (IsUserExecNonidlenum(span->eventnum)) {
@@ -1235,14 +1350,9 @@ void WriteSpanJson(FILE* f, const CPUState* thiscpu) {
 // Write a point event, so they aren't lost
 // Change time from multiples of 10 nsec to seconds and fraction
 void WriteEventJson(FILE* f, const OneSpan* event) {
-  double ts_sec = event->start_ts / 100000000.0;
-  double dur_sec = event->duration / 100000000.0;
 //CHECK("g", *event);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
-          ts_sec, dur_sec, event->cpu,
-          event->pid, event->rpcid, event->eventnum,
-          event->arg, event->retval, event->ipc, event->name.c_str());
+  //       ts dur cpu  pid rpc event  arg ret ipc  name
+  PutSpanJson(f, event);
   ++span_count;
 }
 
@@ -1252,33 +1362,47 @@ void InitialJson(FILE* f, const char* label, const char* basetime) {
   // saved state for different traces beyond their basetime
   unsigned int randomid = (time(NULL) ^ (getpid() * 12345678)) & 0x7FFFFFFF;
 
+  // Built in memory, so the binary span file can keep a copy
+  char* text = NULL;
+  size_t len = 0;
+  FILE* g = open_memstream(&text, &len);
+
   // Leading spaces are to keep this all in front and in order after text sort
-  fprintf(f, "  {\n");
-  fprintf(f, " \"Comment\" : \"V2 with IPC field\",\n");
-  fprintf(f, " \"axisLabelX\" : \"Time (sec)\",\n");
-  fprintf(f, " \"axisLabelY\" : \"CPU Number\",\n");
-  fprintf(f, " \"flags\" : %d,\n", incoming_flags);
-  fprintf(f, " \"randomid\" : %d,\n", randomid);
-  fprintf(f, " \"shortUnitsX\" : \"s\",\n");
-  fprintf(f, " \"shortMulX\" : 1,\n");
-  fprintf(f, " \"thousandsX\" : 1000,\n");
-  fprintf(f, " \"title\" : \"%s\",\n", label);
-  fprintf(f, " \"tracebase\" : \"%s\",\n", basetime);
-  fprintf(f, " \"version\" : %d,\n", incoming_version);
+  fprintf(g, "  {\n");
+  fprintf(g, " \"Comment\" : \"V2 with IPC field\",\n");
+  fprintf(g, " \"axisLabelX\" : \"Time (sec)\",\n");
+  fprintf(g, " \"axisLabelY\" : \"CPU Number\",\n");
+  fprintf(g, " \"flags\" : %d,\n", incoming_flags);
+  fprintf(g, " \"randomid\" : %d,\n", randomid);
+  fprintf(g, " \"shortUnitsX\" : \"s\",\n");
+  fprintf(g, " \"shortMulX\" : 1,\n");
+  fprintf(g, " \"thousandsX\" : 1000,\n");
+  fprintf(g, " \"title\" : \"%s\",\n", label);
+  fprintf(g, " \"tracebase\" : \"%s\",\n", basetime);
+  fprintf(g, " \"version\" : %d,\n", incoming_version);
   if (!kernel_version.empty()) {
     Clean(&kernel_version);
-    fprintf(f, " \"kernelVersion\" : \"%s\",\n", kernel_version.c_str());
+    fprintf(g, " \"kernelVersion\" : \"%s\",\n", kernel_version.c_str());
   }
   if (!cpu_model_name.empty()) {
     Clean(&cpu_model_name);
-    fprintf(f, " \"cpuModelName\" : \"%s\",\n", cpu_model_name.c_str());
+    fprintf(g, " \"cpuModelName\" : \"%s\",\n", cpu_model_name.c_str());
   }
   if (!host_name.empty()) {
     Clean(&host_name);
-    fprintf(f, " \"hostName\" : \"%s\",\n", host_name.c_str());
+    fprintf(g, " \"hostName\" : \"%s\",\n", host_name.c_str());
   }
 
-  fprintf(f, "\"events\" : [\n");
+  fprintf(g, "\"events\" : [\n");
+
+  fclose(g);
+  if (span_set != NULL) {
+    span_set->text.append(text, len);
+  } else {
+    fwrite(text, 1, len, f);
+  }
+  if (spanbin) {WriteSpanBinText(&spanbin_writer, text, len);}
+  free(text);
 }
 
 // Add dummy entry that sorts last, then close the events array and top-level json
@@ -1351,7 +1475,7 @@ fprintf(stdout,"AdjustStackForPush FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 0) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameText(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]).c_str());
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1361,10 +1485,10 @@ void AdjustStackForPop(const OneSpan& event, CPUState* thiscpu) {
   if (thiscpu->cpu_stack.top == 0) {
 fprintf(stdout,"AdjustStackForPop FAIL\n");
     // Trying to return above user mode. Push a dummy syscall
-if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, event.name.c_str());
+if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, NameText(event.name).c_str());
     ++thiscpu->cpu_stack.top;
     thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top] = dummy_syscall;
-    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = string("-dummy-");
+    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = Intern("-dummy-");
   }
   // If returning from something lower nesting than top of stack,
   // pop the stack for a match.
@@ -1375,7 +1499,7 @@ fprintf(stdout,"AdjustStackForPop FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 1) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameText(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]).c_str());
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1391,7 +1515,7 @@ string AppendPid(const string& name, uint64 pid) {
 }
 
 string EventNamePlusPid(const OneSpan& event) {
-  return AppendPid(event.name, event.pid);
+  return AppendPid(NameText(event.name), event.pid);
 }
 
 void DumpShort(FILE* f, const CPUState* thiscpu) {
@@ -1415,73 +1539,74 @@ void WaitBeforeWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* per
   // about to be context switched out. In that case, avoid any before-wakeup event.
 
   // There is no priorPidEvent at the beginning of a trace.
-  if (priorPidEvent.find(target_pid) == priorPidEvent.end()) {return;}
+  if (priorPidEvent.count(target_pid) == 0) {return;}
 
   // If the target PID is currently executing, do not generate a wait
-  if (pidRunning.find(target_pid) != pidRunning.end()) {return;}
+  if (pidRunning.count(target_pid) != 0) {return;}
 
   OneSpan& old_event = priorPidEvent[target_pid];
   const PidState* stack = &thiscpu->cpu_stack;
+  const string& topname = NameText(stack->name[stack->top]);
 
   // NOTE: This is mostly Linux centric. Other names might occur in FreeBSD, etc.
   // Create wait_* events
   // Also see soft_irq_name in rawtoevent.cc
   char letter = ' ';		// Default = unknown reason for waiting
-  if (stack->name[stack->top] == "local_timer_vector") {	// timer
+  if (topname == "local_timer_vector") {	// timer
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "arch_timer") {		// Rpi time
+  } else if (topname == "arch_timer") {		// Rpi time
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "riscv-timer") {	// Risc-v time
+  } else if (topname == "riscv-timer") {	// Risc-v time
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "page_fault") {	// memory
+  } else if (topname == "page_fault") {	// memory
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "mmap") {
+  } else if (topname == "mmap") {
 //DumpEvent(stdout, "letter m1", event);
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "munmap") {
+  } else if (topname == "munmap") {
 //DumpEvent(stdout, "letter m2", event);
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "mprotect") {
+  } else if (topname == "mprotect") {
 //DumpEvent(stdout, "letter m3", event);
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "madvise") {
+  } else if (topname == "madvise") {
 //DumpEvent(stdout, "letter m4", event);
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "futex") {	// lock
+  } else if (topname == "futex") {	// lock
     letter = 'l';		// lock
-  } else if (stack->name[stack->top] == "writev") {	// pipe
+  } else if (topname == "writev") {	// pipe
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "write") {
+  } else if (topname == "write") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "sendto") {
+  } else if (topname == "sendto") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "open") {
+  } else if (topname == "open") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "openat") {
+  } else if (topname == "openat") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top].substr(0,7) == "kworker") {
+  } else if (topname.substr(0,7) == "kworker") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "BH:hi") {	// tasklet
+  } else if (topname == "BH:hi") {	// tasklet
     letter = 'k';		// high prio tasklet or unknown BH fragment
-  } else if (stack->name[stack->top] == "BH:timer") {	// time
+  } else if (topname == "BH:timer") {	// time
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "BH:tx") {	// network
+  } else if (topname == "BH:tx") {	// network
     letter = 'n';		// network
-  } else if (stack->name[stack->top] == "BH:rx") {
+  } else if (topname == "BH:rx") {
     letter = 'n';		// network
-  } else if (stack->name[stack->top] == "BH:block") {	// disk
+  } else if (topname == "BH:block") {	// disk
     letter = 'd';		// disk/SSD
-  } else if (stack->name[stack->top] == "BH:irq_p") {
+  } else if (topname == "BH:irq_p") {
     letter = 'd';		// disk/SSD (iopoll)
-  } else if (stack->name[stack->top] == "syncfs") {
+  } else if (topname == "syncfs") {
     letter = 'd';		// disk/SSD
-  } else if (stack->name[stack->top] == "BH:taskl") {
+  } else if (topname == "BH:taskl") {
     letter = 'k';		// normal tasklet
-  } else if (stack->name[stack->top] == "BH:sched") {	// sched
+  } else if (topname == "BH:sched") {	// sched
     letter = 's';		// scheduler (load balancing)
-  } else if (stack->name[stack->top] == "BH:hrtim") {
+  } else if (topname == "BH:hrtim") {
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "BH:rcu") {
+  } else if (topname == "BH:rcu") {
     letter = 't';		// read-copy-update release code
   }
 
@@ -1514,7 +1639,7 @@ void DoWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate
   priorPidEnd[target_pid] = event.start_ts + event.duration;
 }
 
-void SwapStacks(int oldpid, int newpid, const string& name, CPUState* thiscpu, PerPidState* perpidstate) {
+void SwapStacks(int oldpid, int newpid, uint32 name, CPUState* thiscpu, PerPidState* perpidstate) {
   if (oldpid == newpid) {return;}
 
   // Swap out the old thread's stack, but don't change the idle stack
@@ -1525,7 +1650,7 @@ if (verbose) {
 fprintf(stdout, "SwapStacks old %d: ", oldpid);
 DumpStackShort(stdout, &thiscpu->cpu_stack);
 }
-  if (perpidstate->find(newpid) == perpidstate->end()) {
+  if (perpidstate->count(newpid) == 0) {
     // Switching to a thread we haven't seen before. Should only happen at trace start.
     // Create a two-item stack of just user-mode pid and sched_syscall
     BrandNewPid(newpid, name, perpidstate);
@@ -1551,7 +1676,7 @@ void FixupAmbiguousSpan(const OneSpan& event,
 
 if (verbose) {
 DumpStackShort(stdout, &thiscpu->cpu_stack);
-fprintf(stdout, " ===ambiguous at %s :\n", event.name.c_str());
+fprintf(stdout, " ===ambiguous at %s :\n", NameText(event.name).c_str());
 }
   if (OnlyInKernelMode(event)) {
     thiscpu->cpu_stack.ambiguous = 0;
@@ -1589,7 +1714,7 @@ void WriteFreqSpan(uint64 start_ts, uint64 end_ts, uint64 cpu, uint64 freq) {
   event.arg = freq;
   event.retval = 0;
   event.ipc = 0;
-  event.name = string("-freq-");
+  event.name = Intern("-freq-");
   WriteEventJson(stdout, &event);
 }
 
@@ -1610,7 +1735,7 @@ void ProcessEvent(const OneSpan& event,
   if (verbose) {
     fprintf(stdout, "zz[%d] %llu %llu %03x(%d)=%d %s ",
           event.cpu, event.start_ts, event.duration,
-          event.eventnum, event.arg, event.retval, event.name.c_str());
+          event.eventnum, event.arg, event.retval, NameText(event.name).c_str());
     DumpEvent(stdout, "", event);
     DumpShort(stdout, &cpustate[event.cpu]);
   }
@@ -1691,7 +1816,7 @@ if (verbose) DumpStackShort(stdout, &thiscpu->cpu_stack);
       // Scheduler entered from within a kernel routine
       // stack such as: 2{mystery25.3950 read -sched- }0
       // Record the subscript of the ambiguous stack entry just before -sched-
-if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", event.name.c_str());
+if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", NameText(event.name).c_str());
       thiscpu->cpu_stack.ambiguous = thiscpu->cpu_stack.top - 1;
     }
 
@@ -1708,7 +1833,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Turn context switch event into a user-mode-execution event at top of stack
     thiscpu->cpu_stack.eventnum[0] = PidToEventnum(event.pid);
     ////sthiscpu->cpu_stack.name[0] = EventNamePlusPid(event);
-    thiscpu->cpu_stack.name[0] = NameAppendPid(pidnames[event.pid], event.pid);
+    thiscpu->cpu_stack.name[0] = PidNameId(event.pid);
 
     // And also update the current span if we are at top
     if (thiscpu->cpu_stack.top == 0) {
@@ -1797,14 +1922,14 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (IsAnMwait(event)) {
       thiscpu->mwait_pending = event.arg;
       thiscpu->cur_span.arg = 1;	// Mark continuing idle as low-power
-      thiscpu->cur_span.name = kIdlelpName;
+      thiscpu->cur_span.name = idlelp_name_id;
     }
     // No mwait pending , back to regular idle
     if (IsAnMwaitExit(event)) {
       // We want to insert a c-exit span here
       thiscpu->mwait_pending = -1;
       thiscpu->cur_span.arg = 0;	// Mark continuing idle as regular
-      thiscpu->cur_span.name = kIdlelpName;
+      thiscpu->cur_span.name = idlelp_name_id;
     }
 
     return;
@@ -1846,14 +1971,14 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       int lockhash = event.arg;
       uint64 subscr = PackLock(lockhash, event.pid);
       // If prior try, draw dots for this PID trying to get this lock
-      if ((lockpending.find(subscr) != lockpending.end()) &&
+      if ((lockpending.count(subscr) != 0) &&
           (lockpending[subscr].eventnum == KUTRACE_LOCKNOACQUIRE)) {
         uint64 start_ts = lockpending[subscr].start_ts;
         uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
         // Ignore contention < 250ns
         if  (25 <= (end_ts - start_ts)) {
           bool dots = true;
-          string lockname = "~" + event.name.substr(4);	// Remove try_ acq_ rel_
+          string lockname = "~" + NameText(event.name).substr(4);	// Remove try_ acq_ rel_
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
@@ -1873,14 +1998,14 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       int lockhash = event.arg;
       uint64 subscr = PackLock(lockhash, event.pid);
       // If prior acq, draw line for this PID holding this lock
-      if ((lockpending.find(subscr) != lockpending.end()) &&
+      if ((lockpending.count(subscr) != 0) &&
           (lockpending[subscr].eventnum == KUTRACE_LOCKACQUIRE)) {
         uint64 start_ts = lockpending[subscr].start_ts;
         uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
         // Ignore contention < 250ns
         if (25 <= (end_ts - start_ts)) {
           bool dots = false;
-          string lockname = "=" + event.name.substr(4);	// Remove try_ acq_ rel_
+          string lockname = "=" + NameText(event.name).substr(4);	// Remove try_ acq_ rel_
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
@@ -1919,7 +2044,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   }
 
   // Connect wakeup event to new span if the PID matches
-  if (pendingWakeup.find(event.pid) != pendingWakeup.end()) {
+  if (pendingWakeup.count(event.pid) != 0) {
     // We are at an event w/pid for which there is a pending wakeup, make-runnable
     // Make a wakeup arc
     OneSpan temp_span = thiscpu->cur_span;	// Save
@@ -1931,7 +2056,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   }
 
   // Make a wait_cpu display span from the wakeup to here
-  if (priorPidEnd.find(event.pid) != priorPidEnd.end()) {
+  if (priorPidEnd.count(event.pid) != 0) {
     // We have been waiting for a CPU to become available and it did.
     OneSpan temp_span = thiscpu->cur_span;	// Save
     MakeWaitSpan('c', priorPidEnd[event.pid], event.start_ts, event.pid, 0, &thiscpu->cur_span);
@@ -2020,8 +2145,16 @@ void InsertEvent(const OneSpan& event,
 int CallToRet(int eventnum) {return eventnum | ret_mask;}
 int RetToCall(int eventnum) {return eventnum & ~ret_mask;}
 
-string CallnameToRetname(string name) {return "/" + name;}	// Add '/'
-string RetnameToCallname(string name) {return name.substr(1);}  // Remove '/'
+string CallnameToRetname(const string& name) {return "/" + name;}	// Add '/'
+string RetnameToCallname(const string& name) {return name.substr(1);}  // Remove '/'
+
+// Interned return name for a call name id
+uint32 RetNameId(uint32 call_id) {
+  if (retname_ids.size() <= call_id) {retname_ids.resize(nametext.size(), 0);}
+  uint32& id = retname_ids[call_id];
+  if (id == 0) {id = Intern(CallnameToRetname(NameText(call_id)));}
+  return id;
+}
 
 // Insert a dummy return at ts from TOS
 void InsertReturnAt(uint64 ts,
@@ -2041,7 +2174,7 @@ void InsertReturnAt(uint64 ts,
   newevent.arg = 0;
   newevent.retval = 0;
   //newevent.ipc = 0;
-  newevent.name = CallnameToRetname(thiscpu_stack->name[thiscpu_stack->top]);
+  newevent.name = RetNameId(thiscpu_stack->name[thiscpu_stack->top]);
   InsertEvent(newevent, cpustate, perpidstate);
 }
 
@@ -2060,7 +2193,7 @@ void InsertCallAt(uint64 ts,
   newevent.arg = 0;
   newevent.retval = 0;
   //newevent.ipc = 0;
-  newevent.name = RetnameToCallname(event.name);
+  newevent.name = Intern(RetnameToCallname(NameText(event.name)));
   InsertEvent(newevent, cpustate, perpidstate);
 }
 
@@ -2103,8 +2236,8 @@ bool FixupReturn(uint64 new_start_ts,
   if (thiscpu_stack->eventnum[thiscpu_stack->top] == matching_callnum) {return true;}
 
   // If TOS = reschedule_ipi and this = /BH:hi, let it match
-  if ((thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") &&
-      (event.name == "/BH:hi")) {return true;}
+  if ((NameText(thiscpu_stack->name[thiscpu_stack->top]) == "reschedule_ipi") &&
+      (NameText(event.name) == "/BH:hi")) {return true;}
 
   bool callfound = false;
   for (int i = 1; i <= thiscpu_stack->top; ++i) {
@@ -2160,7 +2293,7 @@ bool FixupResched(uint64 ts,
                  PerPidState* perpidstate) {
   CPUState* thiscpu = &cpustate[event.cpu];
   PidState* thiscpu_stack = &thiscpu->cpu_stack;
-  if (thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") {
+  if (NameText(thiscpu_stack->name[thiscpu_stack->top]) == "reschedule_ipi") {
     --thiscpu_stack->top;
   }
   return true;
@@ -2233,13 +2366,13 @@ bool FixupCexit(uint64 new_start_ts,
   newevent.arg = 0;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "-c-exit-";
+  newevent.name = Intern("-c-exit-");
   // Inserting the c-exit shortens the pending low-power idle
   InsertEvent(newevent, cpustate, perpidstate);
 
   // After the c-exit, we are no longer low power
   thiscpu->cur_span.arg = 0;	// Mark continuing idle as normal power
-  thiscpu->cur_span.name = kIdleName;
+  thiscpu->cur_span.name = idle_name_id;
 
   return true;
 }
@@ -2265,14 +2398,15 @@ bool FixupRunnable(uint64 new_start_ts,
   newevent.arg = event.retval;	// The target of clone/fork/etc.
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "runnable";
+  newevent.name = Intern("runnable");
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
 }
 
 // Insert an RPC msg event, describing msg span of packets on the network
 
-bool EmitRxTxMsg(const PidCorr& corr, CPUState* cpustate, PerPidState* perpidstate) {
+// corr is a copy, not a reference into pidtocorr, whose entries can move
+bool EmitRxTxMsg(PidCorr corr, CPUState* cpustate, PerPidState* perpidstate) {
 //fprintf(stderr, "EmitRxTxMsg ts/rpcid/lglen8/rx = %llu %u %u %u\n", corr.k_timestamp, corr.rpcid, corr.lglen8, corr.rx);
   uint64 k_timestamp;	// Time kernel code saw hash32. 0 means not known yet
   uint32 rpcid;		// 0 means not known yet
@@ -2301,7 +2435,7 @@ bool EmitRxTxMsg(const PidCorr& corr, CPUState* cpustate, PerPidState* perpidsta
   newevent.arg = msg_len;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = string(msg_name);
+  newevent.name = Intern(msg_name);
 //DumpEvent(stderr, "EmitRxTxMsg:", newevent);
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
@@ -2481,7 +2615,7 @@ void PreProcessEvent(const OneSpan& event,
   if (IsUserRxPktInt(event.eventnum)) {
 //DumpEvent(stderr, "IsUserRxPktInt:", event);
     pidtocorr[event.pid] = initpidcorr;
-    if (rx_hashtocorr.find(pkt_hash32) != rx_hashtocorr.end()) {
+    if (rx_hashtocorr.count(pkt_hash32) != 0) {
       pidtocorr[event.pid].k_timestamp = rx_hashtocorr[pkt_hash32].k_timestamp;
     }
     rx_hashtocorr.erase(pkt_hash32);
@@ -2527,11 +2661,11 @@ void PreProcessEvent(const OneSpan& event,
   if (IsRawTxPktInt(event.eventnum)) {
 //DumpEvent(stderr, "IsRawTxPktInt:", event);
     uint32 pid = 0;
-    if (tx_hashtocorr.find(pkt_hash32) != tx_hashtocorr.end()) {
+    if (tx_hashtocorr.count(pkt_hash32) != 0) {
       pid = tx_hashtocorr[pkt_hash32].pid;
     }
     tx_hashtocorr.erase(pkt_hash32);
-    if (pidtocorr.find(pid) != pidtocorr.end()) {
+    if (pidtocorr.count(pid) != 0) {
       pidtocorr[pid].k_timestamp = event.start_ts;
       keep &= EmitRxTxMsg(pidtocorr[pid], cpustate, perpidstate);
     }
@@ -2602,6 +2736,7 @@ void RecordPidName(int64 temp_ts, int temp_arg,
 
   // Record current name for this pid
   pidnames[temp_arg] = temp_name_str;			// Current name for this PID
+  pidname_ids.erase(temp_arg);
   //fprintf(stderr, "%lld pidname[%5d] = %s\n",  temp_ts, temp_arg, pidnames[temp_arg].c_str());
 
   if (temp_ts == -1) {return;}
@@ -2620,7 +2755,7 @@ void RecordPidName(int64 temp_ts, int temp_arg,
   // Update this name on any pending CPU stack
   for (int cpu = 0; cpu <= max_cpu_seen; ++cpu) {
     if(cpustatep[cpu].cpu_stack.eventnum[0] ==  PidToEventnum(temp_arg)) {
-      cpustatep[cpu].cpu_stack.name[0] = NameAppendPid(temp_name_str, temp_arg);
+      cpustatep[cpu].cpu_stack.name[0] = Intern(NameAppendPid(temp_name_str, temp_arg));
 //fprintf(stderr, "%lld cpu[%d] stack updated with %s\n", 
 //temp_ts, cpu, cpustatep[cpu].cpu_stack.name[0].c_str());
     }
@@ -2650,7 +2785,7 @@ void FixPidName(OneSpan* eventp) {
   int pid = EventnumToPid(eventp->eventnum);
   if (pidnames.find(pid) != pidnames.end()) {
 //fprintf(stdout, "    %s => %s\n", eventp->name.c_str(), NameAppendPid(pidnames[pid], pid).c_str());
-    eventp->name = NameAppendPid(pidnames[pid], pid);
+    eventp->name = PidNameId(pid);
     // Also update the stacked name for this pid
     // also update the span name for this pid
     //stack->name[0]
@@ -2661,7 +2796,7 @@ void FixPidName(OneSpan* eventp) {
 // For Raspberry PI, change mwait to wfi
 void FixMwaitName(OneSpan* eventp) {
   if (is_rpi && IsAnMwait(*eventp)) {
-    eventp->name = string("wfi");
+    eventp->name = Intern("wfi");
   }
 
 }
@@ -2691,6 +2826,237 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
+// Handle one incoming name definition
+void DoNamedef(int64 temp_ts, int temp_eventnum, int temp_arg, const char* temp_name,
+               CPUState* cpustate) {
+//fprintf(stdout, "====%%%s\n", buffer);
+  if (IsLockNameInt(temp_eventnum)) {		// Lock names
+    locknames[temp_arg] = string(temp_name);
+  } else if (IsKernelVerInt(temp_eventnum)) {
+    kernel_version = string(temp_name);
+    ////if (temp_ts == -1) {fprintf(stderr, "kernel_version = %s\n", temp_name);}
+  } else if (IsModelNameInt(temp_eventnum)) {
+    // If the model is Raspberry, set pstate_is_all_cpus
+    if (strstr(temp_name, "Raspberry") != NULL) {
+      is_rpi = true;
+    }
+    // If the model is Riscv u74 chip, set low resolution timestamps
+    if (strstr(temp_name, "u74-mc") != NULL) {
+      is_low_res_ts = true;
+    }
+    cpu_model_name = string(temp_name);
+    ////if (temp_ts == -1) {fprintf(stderr, "cpu_model_name = %s\n", temp_name);}
+  } else if (IsHostNameInt(temp_eventnum)) {
+    host_name = string(temp_name);
+    ////if (temp_ts == -1) {fprintf(stderr, "host_name = %s\n", temp_name);}
+  ////} else if (IsUserExecNonidlenum(temp_arg)) {	// Just pick off PID names, accumulating if multiple ones
+  } else if (IsPidNameInt(temp_eventnum)) {	// Just pick off PID names, accumulating if multiple ones
+    RecordPidName(temp_ts, temp_arg, temp_name, cpustate);
+    // Update any active stack if name just changed
+    // Update any current span if name just changed
+  } else if (IsMethodNameInt(temp_eventnum)) {
+	// Step (0) of RPC-to-packet correlation
+    int rpcid = temp_arg & 0xffff;
+    methodnames[rpcid] = string(temp_name);
+  } else if (IsQueueNameInt(temp_eventnum)) {
+    queuenames[temp_arg] = string(temp_name);	// Queue number is a small integer
+  }
+  // Ignore the rest of the names -- already handled by rawtoevent and sort
+}
+
+// Make room for CPU number cpu, initializing each new CPU's state.
+// buffer is the incoming text, just for error messages. False if cpu is bad
+bool GrowCPUState(int cpu, const char* buffer, int linenum, vector<CPUState>* cpustate) {
+  if ((cpu < 0) || (kMAX_CPUS <= cpu)){
+    fprintf(stderr, "FATAL: Too-big CPU number at line[%d] '%s'\n", linenum, buffer);
+    return false;
+  }
+  while (cpustate->size() <= cpu) {
+    int i = cpustate->size();
+    cpustate->push_back(CPUState());
+    CPUState* newcpu = &cpustate->back();
+    InitPidState(&newcpu->cpu_stack);
+    InitSpan(&newcpu->cur_span, i);
+    newcpu->prior_pstate_ts = 0;
+    newcpu->prior_pstate_freq = 0;
+    newcpu->prior_pc_samp_ts = 0;
+    newcpu->ctx_switch_ts = 0;
+    newcpu->mwait_pending = -1;		// None pending
+    newcpu->oldpid = 0;
+    newcpu->newpid = 0;
+    newcpu->valid_span = false;		// Ignore initial span
+  }
+  return true;
+}
+
+// Handle one incoming non-name event, with room already made for its CPU.
+// name_id is name_buffer interned. buffer is the incoming text, just for
+// tracing and error messages. False if the event is out of order
+bool DoEvent(OneSpan* eventp, uint32 name_id, const char* name_buffer, const char* buffer, int linenum,
+             uint64* prior_ts, uint64* lowest_ts,
+             CPUState* cpustate, PerPidState* perpidstate) {
+  eventp->name = name_id;
+
+  // Fix event rpcid. rawtoevent does not carry them across context switches
+  eventp->rpcid = cpustate[eventp->cpu].cpu_stack.rpcid;	// 2021.02.05
+
+  // Fixup name of idle thread once and for all
+  if (IsAnIdle(*eventp)) {eventp->name = idle_name_id;}
+
+  // Input must be sorted by timestamp
+  if (eventp->start_ts < *prior_ts) {
+    fprintf(stderr, "rawtoevent: Timestamp out of order at line[%d] %s\n", linenum, buffer);
+    return false;
+  }
+
+if (verbose) {
+fprintf(stdout, "\n%% [%d] %llu %llu %03x(%d)=%d %s ",
+      eventp->cpu, eventp->start_ts, eventp->duration,
+      eventp->eventnum, eventp->arg, eventp->retval, NameText(eventp->name).c_str());
+DumpShort(stdout, &cpustate[eventp->cpu]);
+}
+
+  if ((*lowest_ts == 0) && (0 < eventp->start_ts)) {
+    *lowest_ts = eventp->start_ts;
+  }
+
+  // Keep track of largest CPU number seen
+  if (max_cpu_seen < eventp->cpu) {
+    max_cpu_seen = eventp->cpu;
+  }
+
+  // Fixup names
+  FixNames(eventp);
+
+
+  // Fixup lock names
+  if (IsALockOneSpan(*eventp)) {
+    char maybe_better_name[64];
+    sprintf(maybe_better_name, "%s%s",
+            kSpecialName[eventp->eventnum & 0x001f],
+            locknames[eventp->arg].c_str());
+    if (true || strlen(maybe_better_name) > strlen(name_buffer)) {
+      // Do the replacement
+//fprintf(stderr, "LOCK %d %s => %s\n", eventp->arg, name_buffer, maybe_better_name);
+      eventp->name = Intern(maybe_better_name);
+    }
+  }
+
+  // Fixup queue names, adding queue number if missing
+  if (IsAnEnqueue(*eventp) || IsADequeue(*eventp)) {
+    if (strchr(name_buffer, '(') == NULL) {
+      char temp[64];
+      sprintf(temp, "%s(%d)", name_buffer, eventp->arg);
+      eventp->name = Intern(temp);
+    }
+  }
+
+  *prior_ts = eventp->start_ts;
+
+  // Now do the real work
+  PreProcessEvent(*eventp, &cpustate[0], perpidstate);
+
+  if (trace) {
+    fprintf(stderr, "\t");
+    CPUState* thiscpu = &cpustate[eventp->cpu];
+    DumpStackShort(stderr, &thiscpu->cpu_stack);
+  }
+  return true;
+}
+
+// Handle one record of the binary input, a name definition or an event.
+// False if it is bad
+bool DoEventBin(const EventBin& rec, const vector<string>& names, int linenum,
+                OneSpan* event, uint64* prior_ts, uint64* lowest_ts,
+                vector<CPUState>* cpustate, PerPidState* perpidstate) {
+  // Only tracing and error messages need the text form
+  char buffer[kMaxBufferSize];
+  buffer[0] = '\0';
+  if (trace || (kMAX_CPUS <= rec.cpu)) {
+    FormatEventBin(rec, names, buffer, kMaxBufferSize);
+  }
+  if (trace) {fprintf(stderr, "\n%s", buffer);}
+
+  const char* name = names[rec.name_id].c_str();
+  if (IsNamedef(rec.eventnum)) {
+    DoNamedef(rec.start_ts, rec.eventnum, rec.arg, name, &(*cpustate)[0]);
+    return true;
+  }
+
+  event->start_ts = rec.start_ts;
+  event->duration = rec.duration;
+  event->eventnum = rec.eventnum;
+  event->cpu = rec.cpu;
+  event->pid = rec.pid;
+  event->rpcid = rec.rpcid;
+  event->arg = rec.arg;
+  event->retval = rec.retval;
+  event->ipc = rec.ipc;
+  char name_buffer[256];
+  uint32 name_id;
+  if (name[0] == '\0') {
+    // Reading the Ascii form picks up the trailing (event) instead
+    sprintf(name_buffer, "(%x)", rec.eventnum);
+    name_id = Intern(name_buffer);
+  } else {
+    snprintf(name_buffer, 256, "%s", name);
+    if (input_name_ids.size() <= rec.name_id) {input_name_ids.resize(names.size(), 0);}
+    if (input_name_ids[rec.name_id] == 0) {input_name_ids[rec.name_id] = Intern(name_buffer);}
+    name_id = input_name_ids[rec.name_id];
+  }
+  if (!GrowCPUState(event->cpu, buffer, linenum, cpustate)) {return false;}
+  return DoEvent(event, name_id, name_buffer, buffer, linenum, prior_ts, lowest_ts,
+                 &(*cpustate)[0], perpidstate);
+}
+
+// Binary input records in sort -n order. rawtoevent -bin -sorted input
+// streams straight through, checked against the prior record as it goes.
+// Anything else reads all the records and sorts them first
+typedef struct {
+  EventBinReader reader;
+  vector<EventBin> recs;	// If not streaming
+  int next;
+  bool streaming;
+  bool more;		// If streaming, rec is valid
+  bool bad;		// Out of order
+  EventBin rec;
+  EventBin prior;
+} EventBinSource;
+
+void InitEventBinSource(FILE* f, EventBinSource* src) {
+  InitEventBinReader(f, &src->reader);
+  src->next = 0;
+  src->bad = false;
+  // The version and sorted flag come ahead of the first record
+  src->more = ReadEventBinRecord(&src->reader, &src->rec);
+  src->streaming = src->reader.meta.sorted;
+  if (src->more && !src->streaming) {
+    src->recs.push_back(src->rec);
+    ReadEventBin(&src->reader, &src->recs);
+    SortEventBin(&src->recs, src->reader.names);
+  }
+}
+
+// Return the next record, or NULL at the end or if out of order
+const EventBin* NextEventBin(EventBinSource* src) {
+  if (!src->streaming) {
+    return (src->next < src->recs.size()) ? &src->recs[src->next++] : NULL;
+  }
+  if (0 < src->next) {
+    src->prior = src->rec;
+    src->more = ReadEventBinRecord(&src->reader, &src->rec);
+    if (src->more && (0 < CompareEventBin(src->prior, src->rec, src->reader.names))) {
+      fprintf(stderr, "eventtospan3: -sorted input out of order at record %d; "
+                      "rerun rawtoevent without -sorted\n", src->next + 1);
+      src->bad = true;
+      return NULL;
+    }
+  }
+  if (!src->more) {return NULL;}
+  ++src->next;
+  return &src->rec;
+}
+
 // We assign every nanosecond of each CPUs time to some time span.
 // Initially, all CPUs are assumed to be executing the idle job, pid=0
 // Any syscall/irq/trap pushes into that kernel code
@@ -2706,16 +3072,29 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // If we encounter a not-allowed transition, we insert pops and pushes as needed
 // to make a correctly-nested set of time spans.
 
-//
-// Usage: eventtospan3 <event file name> [-v] [-t]
-//
-int main (int argc, const char** argv) {
-  CPUState cpustate[kMAX_CPUS];	// Running state for each CPU
+// The span reconstruction, carried from one incoming record to the next
+typedef struct {
+  vector<CPUState> cpustate;	// Running state for each CPU, grows as CPUs appear
   PerPidState perpidstate;	// Saved PID call stacks, for context switching
-
   OneSpan event;
+  uint64 lowest_ts;
+  uint64 prior_ts;
+  int linenum;
   string trace_label;
   string trace_timeofday;
+  bool header_done;		// Binary input: the JSON header is out
+} SpanState;
+
+SpanState state;
+
+void InitSpans(const char* label, SpanSet* out) {
+  span_set = out;
+  state.trace_label = string(label);
+  state.trace_timeofday.clear();
+  state.lowest_ts = 0;
+  state.prior_ts = 0;
+  state.linenum = 0;
+  state.header_done = false;
   kernel_version.clear();
   cpu_model_name.clear();
   host_name.clear();
@@ -2724,33 +3103,8 @@ int main (int argc, const char** argv) {
   rx_hashtocorr.clear();
   tx_hashtocorr.clear();
 
-
-  if (argc >= 2) {
-    // Pick off trace label from first argument, if any
-    trace_label = string(argv[1]);
-  }
-
-  // Pick off other flags
-  for (int i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
-    if (strcmp(argv[i], "-t") == 0) {trace = true;}
-    if (strcmp(argv[i], "-rel0") == 0) {rel0 = true;}
-  }
-
-  // Initialize CPU state
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    InitPidState(&cpustate[i].cpu_stack);
-    InitSpan(&cpustate[i].cur_span, i);
-    //InitSpan(&cpustate[i].prior_pc_sample, i);
-    cpustate[i].prior_pstate_ts = 0;
-    cpustate[i].prior_pstate_freq = 0;
-    cpustate[i].prior_pc_samp_ts = 0;
-    cpustate[i].ctx_switch_ts = 0;
-    cpustate[i].mwait_pending = -1;		// None pending
-    cpustate[i].oldpid = 0;
-    cpustate[i].newpid = 0;
-    cpustate[i].valid_span = false;		// Ignore initial span
-  }
+  // Initialize CPU state. CPU 0 is always there; the rest as they appear
+  GrowCPUState(0, "", 0, &state.cpustate);
 
   // Set idle name
   pidnames[pid_idle] = string(kIdleName);
@@ -2760,222 +3114,158 @@ int main (int argc, const char** argv) {
   // It can be in the midst of an interrupt when a context switch goes to another thread,
   // but the interrupt code is silently done.
   // Here we set the stacked idle task as inside sched, and we never change that elsewhere.
-  BrandNewPid(pid_idle, string(kIdleName), &perpidstate);
-
-
-  //
-  // Main loop
-  //
-  uint64 lowest_ts = 0;
-  uint64 prior_ts = 0;
-  int linenum = 0;
-  char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
-    ++linenum;
-    int len = strlen(buffer);
-    if (buffer[0] == '\0') {continue;}
-
-    // Comments start with #, some are stylized and contain data
-    if (buffer[0] == '#') {
-      // Pull timestamp out of early comments
-      // Look for first
-      // # [1] 2017-08-21_09:51:48.620665
-      // Must be there. This triggers initial json output
-      if ((len >= 32) &&
-          trace_timeofday.empty() &&
-          (memcmp(buffer, "# [1] 20", 8) == 0)) {
-          // From # [1] 2019-03-16_16:43:42.571604
-          // extract    2019-03-16_16:43:00
-          // since the timestamps are all relative to a minute boundary
-          trace_timeofday = string(buffer, 6, 17) + "00";
-          //fprintf(stderr, "eventtospan3: trace_timeofday '%s'\n", trace_timeofday.c_str());
-          InitialJson(stdout, trace_label.c_str(), trace_timeofday.c_str());
-      }
-      // Pull version and flags out if present
-      if (memcmp(buffer, "# ## VERSION: ", 14) == 0) {
-        incoming_version = atoi(buffer + 14);
-        //fprintf(stderr, "VERSION %d\n", incoming_version);
-      }
-      if (memcmp(buffer, "# ## FLAGS: ", 12) == 0) {
-        incoming_flags = atoi(buffer + 12);
-        //fprintf(stderr, "FLAGS %d\n", incoming_flags);
-      }
-      continue;
+  BrandNewPid(pid_idle, idle_name_id, &state.perpidstate);
+}
+
+// The stylized comments of the binary input sort just after the ts = -1 name copies
+void BinaryHeader(const EventBinMeta& meta) {
+  incoming_version = meta.version;
+  incoming_flags = meta.flags;
+  if (!meta.datetime.empty()) {
+    state.trace_timeofday = meta.datetime.substr(0, 17) + "00";
+    InitialJson(stdout, state.trace_label.c_str(), state.trace_timeofday.c_str());
+  }
+  state.header_done = true;
+}
+
+bool SpanEventBin(const EventBin& rec, const vector<string>& names, const EventBinMeta& meta) {
+  if (!state.header_done && (0 <= rec.start_ts)) {BinaryHeader(meta);}
+  ++state.linenum;
+  return DoEventBin(rec, names, state.linenum, &state.event, &state.prior_ts, &state.lowest_ts,
+                    &state.cpustate, &state.perpidstate);
+}
+
+bool SpanEventLine(char* buffer) {
+  ++state.linenum;
+  int len = strlen(buffer);
+  if (buffer[0] == '\0') {return true;}
+
+  // Comments start with #, some are stylized and contain data
+  if (buffer[0] == '#') {
+    // Pull timestamp out of early comments
+    // Look for first
+    // # [1] 2017-08-21_09:51:48.620665
+    // Must be there. This triggers initial json output
+    if ((len >= 32) &&
+        state.trace_timeofday.empty() &&
+        (memcmp(buffer, "# [1] 20", 8) == 0)) {
+        // From # [1] 2019-03-16_16:43:42.571604
+        // extract    2019-03-16_16:43:00
+        // since the timestamps are all relative to a minute boundary
+        state.trace_timeofday = string(buffer, 6, 17) + "00";
+        //fprintf(stderr, "eventtospan3: state.trace_timeofday '%s'\n", state.trace_timeofday.c_str());
+        InitialJson(stdout, state.trace_label.c_str(), state.trace_timeofday.c_str());
     }
-
-    // Input created by:
-    //  fprintf(stdout, "%lld %lld %lld %lld  %lld %lld %lld %lld %d %s (%llx)\n",
-    //          mhz, duration, event, current_cpu, current_pid[current_cpu], current_rpc[current_cpu],
-    //          arg, retval, ipc, name.c_str(), event);
-    // or if a name by
-    //    fprintf(stdout, "%lld %lld %lld %lld %s\n",
-    //            mhz, duration, event, nameinsert, tempstring);
-    //
-
-    // Trace flag prints each incoming line and the resulting stack and span,
-    // all on one line
-    if (trace) {fprintf(stderr, "\n%s", buffer);}
-
-    char name_buffer[256];
-    // Pick off the event to see if it is a name definition line
-    // (This could be done with less repeated effort)
-    int64 temp_ts;
-    uint64 temp_dur;
-    int temp_eventnum = 0;
-    int temp_arg = 0;
-    char temp_name[64];
-    sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
-    if (IsNamedef(temp_eventnum)) {
-//fprintf(stdout, "====%%%s\n", buffer);
-      if (IsLockNameInt(temp_eventnum)) {		// Lock names
-        locknames[temp_arg] = string(temp_name);
-      } else if (IsKernelVerInt(temp_eventnum)) {
-        kernel_version = string(temp_name);
-        ////if (temp_ts == -1) {fprintf(stderr, "kernel_version = %s\n", temp_name);}
-      } else if (IsModelNameInt(temp_eventnum)) {
-        // If the model is Raspberry, set pstate_is_all_cpus
-        if (strstr(temp_name, "Raspberry") != NULL) {
-          is_rpi = true;
-        }
-        // If the model is Riscv u74 chip, set low resolution timestamps
-        if (strstr(temp_name, "u74-mc") != NULL) {
-          is_low_res_ts = true;
-        }
-        cpu_model_name = string(temp_name);
-        ////if (temp_ts == -1) {fprintf(stderr, "cpu_model_name = %s\n", temp_name);}
-      } else if (IsHostNameInt(temp_eventnum)) {
-        host_name = string(temp_name);
-        ////if (temp_ts == -1) {fprintf(stderr, "host_name = %s\n", temp_name);}
-      ////} else if (IsUserExecNonidlenum(temp_arg)) {	// Just pick off PID names, accumulating if multiple ones
-      } else if (IsPidNameInt(temp_eventnum)) {	// Just pick off PID names, accumulating if multiple ones
-        RecordPidName(temp_ts, temp_arg, temp_name, cpustate);
-        // Update any active stack if name just changed
-        // Update any current span if name just changed
-      } else if (IsMethodNameInt(temp_eventnum)) {
-	// Step (0) of RPC-to-packet correlation
-        int rpcid = temp_arg & 0xffff;
-        methodnames[rpcid] = string(temp_name);
-      } else if (IsQueueNameInt(temp_eventnum)) {
-        queuenames[temp_arg] = string(temp_name);	// Queue number is a small integer
-      }
-      // Ignore the rest of the names -- already handled by rawtoevent and sort
-      continue;
+    // Pull version and flags out if present
+    if (memcmp(buffer, "# ## VERSION: ", 14) == 0) {
+      incoming_version = atoi(buffer + 14);
+      //fprintf(stderr, "VERSION %d\n", incoming_version);
     }
-
-    // Read the full non-name event
-    if (incoming_version < 2) {
-      int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %s",
-                     &event.start_ts, &event.duration, &event.eventnum, &event.cpu,
-                     &event.pid, &event.rpcid, &event.arg, &event.retval, name_buffer);
-      event.ipc = 0;
-      if (n != 9) {continue;}
-    } else {
-      int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %d %s",
-                     &event.start_ts, &event.duration, &event.eventnum, &event.cpu,
-                     &event.pid, &event.rpcid, &event.arg, &event.retval,
-                     &event.ipc, name_buffer);
-      if (n != 10) {continue;}
+    if (memcmp(buffer, "# ## FLAGS: ", 12) == 0) {
+      incoming_flags = atoi(buffer + 12);
+      //fprintf(stderr, "FLAGS %d\n", incoming_flags);
     }
-    event.name = string(name_buffer);
-
-    // Fix event.rpcid. rawtoevent does not carry them across context switches
-    event.rpcid = cpustate[event.cpu].cpu_stack.rpcid;	// 2021.02.05
+    return true;
+  }
 
-    // Fixup name of idle thread once and for all
-    if (IsAnIdle(event)) {event.name = string(kIdleName);}
+  // Input created by:
+  //  fprintf(stdout, "%lld %lld %lld %lld  %lld %lld %lld %lld %d %s (%llx)\n",
+  //          mhz, duration, event, current_cpu, current_pid[current_cpu], current_rpc[current_cpu],
+  //          arg, retval, ipc, name.c_str(), event);
+  // or if a name by
+  //    fprintf(stdout, "%lld %lld %lld %lld %s\n",
+  //            mhz, duration, event, nameinsert, tempstring);
+  //
 
-    // Input must be sorted by timestamp
-    if (event.start_ts < prior_ts) {
-      fprintf(stderr, "rawtoevent: Timestamp out of order at line[%d] %s\n", linenum, buffer);
-      exit(0);
-    }
+  // Trace flag prints each incoming line and the resulting stack and span,
+  // all on one line
+  if (trace) {fprintf(stderr, "\n%s", buffer);}
+
+  char name_buffer[256];
+  // Pick off the event to see if it is a name definition line
+  // (This could be done with less repeated effort)
+  int64 temp_ts;
+  uint64 temp_dur;
+  int temp_eventnum = 0;
+  int temp_arg = 0;
+  char temp_name[64];
+  sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
+  if (IsNamedef(temp_eventnum)) {
+    DoNamedef(temp_ts, temp_eventnum, temp_arg, temp_name, &state.cpustate[0]);
+    return true;
+  }
 
-if (verbose) {
-fprintf(stdout, "\n%% [%d] %llu %llu %03x(%d)=%d %s ",
-        event.cpu, event.start_ts, event.duration,
-        event.eventnum, event.arg, event.retval, event.name.c_str());
-DumpShort(stdout, &cpustate[event.cpu]);
+  // Read the full non-name event
+  if (incoming_version < 2) {
+    int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %s",
+                   &state.event.start_ts, &state.event.duration, &state.event.eventnum, &state.event.cpu,
+                   &state.event.pid, &state.event.rpcid, &state.event.arg, &state.event.retval, name_buffer);
+    state.event.ipc = 0;
+    if (n != 9) {return true;}
+  } else {
+    int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %d %s",
+                   &state.event.start_ts, &state.event.duration, &state.event.eventnum, &state.event.cpu,
+                   &state.event.pid, &state.event.rpcid, &state.event.arg, &state.event.retval,
+                   &state.event.ipc, name_buffer);
+    if (n != 10) {return true;}
+  }
+  if (!GrowCPUState(state.event.cpu, buffer, state.linenum, &state.cpustate)) {return false;}
+  return DoEvent(&state.event, Intern(name_buffer), name_buffer, buffer, state.linenum,
+                 &state.prior_ts, &state.lowest_ts,
+                 &state.cpustate[0], &state.perpidstate);
 }
 
-    if ((lowest_ts == 0) && (0 < event.start_ts)) {
-      lowest_ts = event.start_ts;
-    }
-
-    if (kMAX_CPUS <= event.cpu){
-      fprintf(stderr, "FATAL: Too-big CPU number at line[%d] '%s'\n", linenum, buffer);
-      exit(0);
-    }
-
-    // Keep track of largest CPU number seen
-    if (max_cpu_seen < event.cpu) {
-      max_cpu_seen = event.cpu;
-    }
-
-    // Fixup names
-    FixNames(&event);
-
-
-    // Fixup lock names
-    if (IsALockOneSpan(event)) {
-      char maybe_better_name[64];
-      sprintf(maybe_better_name, "%s%s",
-              kSpecialName[event.eventnum & 0x001f],
-              locknames[event.arg].c_str());
-      if (true || strlen(maybe_better_name) > strlen(name_buffer)) {
-        // Do the replacement
-//fprintf(stderr, "LOCK %d %s => %s\n", event.arg, name_buffer, maybe_better_name);
-        event.name = string(maybe_better_name);
-      }
-    }
-
-    // Fixup queue names, adding queue number if missing
-    if (IsAnEnqueue(event) || IsADequeue(event)) {
-      if (strchr(name_buffer, '(') == NULL) {
-        char temp[64];
-        sprintf(temp, "%s(%d)", name_buffer, event.arg);
-        event.name = string(temp);
-      }
-    }
-
-    prior_ts = event.start_ts;
-
-    // Now do the real work
-    PreProcessEvent(event, &cpustate[0], &perpidstate);
-
-    if (trace) {
-      fprintf(stderr, "\t");
-      CPUState* thiscpu = &cpustate[event.cpu];
-      DumpStackShort(stderr, &thiscpu->cpu_stack);
-    }
-  }
-  //
-  // End main loop
-  //
+void FinishSpans(const EventBinMeta* meta) {
+  if ((meta != NULL) && !state.header_done) {BinaryHeader(*meta);}
+  vector<CPUState>& cpustate = state.cpustate;
+  uint64 lowest_ts = state.lowest_ts;
 
   // Flush the last frequency spans here
   for (int i = 0; i <= max_cpu_seen; ++i) {
     if (cpustate[i].prior_pstate_ts != 0) {
       uint64 prior_ts = cpustate[i].prior_pstate_ts;
       uint64 prior_freq = cpustate[i].prior_pstate_freq;
-      WriteFreqSpan(prior_ts, event.start_ts, i, prior_freq);
+      WriteFreqSpan(prior_ts, state.event.start_ts, i, prior_freq);
     }
   }
 
   // Keep any hardware description. Leading space is required.
-  fprintf(stdout, " \"mbit_sec\" : %d,\n", mbit_sec);
+  char mbit_line[64];
+  int mbit_len = sprintf(mbit_line, " \"mbit_sec\" : %d,\n", mbit_sec);
+  if (span_set != NULL) {
+    span_set->text.append(mbit_line, mbit_len);
+  } else {
+    fwrite(mbit_line, 1, mbit_len, stdout);
+  }
+  if (spanbin) {WriteSpanBinText(&spanbin_writer, mbit_line, mbit_len);}
 
-  // Put out any multi-named PID row names
+  // Put out any multi-named PID row names, one 10ns span each
   for (IntName::const_iterator it = pidrownames.begin(); it != pidrownames.end(); ++it) {
     int pid = it->first;
     string rowname = it->second;
-    double lowest_sec = lowest_ts / 100000000.0;
     if (rowname.find("+") != string::npos) {
-      fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s.%d\"],\n",
-          lowest_sec, 0.00000001, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str(), pid);
+      OneSpan rowspan;
+      rowspan.start_ts = lowest_ts;
+      rowspan.duration = 1;
+      rowspan.cpu = 0;
+      rowspan.pid = pid;
+      rowspan.rpcid = 0;
+      rowspan.eventnum = KUTRACE_LEFTMARK;
+      rowspan.arg = 0;
+      rowspan.retval = 0;
+      rowspan.ipc = 0;
+      rowspan.name = Intern(rowname + "." + IntToString(pid));
+      PutSpanJson(stdout, &rowspan);
     }
   }
 
-  FinalJson(stdout);
+  // A SpanSet reader adds these itself
+  if (span_set == NULL) {FinalJson(stdout);}
+  if (spanbin) {
+    CloseSpanBinWriter(&spanbin_writer, nametext);
+    fclose(spanbin_writer.f);
+    spanbin = false;
+  }
 
   // Statistics for main timeline; no decorations, PCsamp, etc.
   double total_dur = total_usermode + total_idle + total_kernelmode;
@@ -2985,5 +3275,71 @@ DumpShort(stdout, &cpustate[event.cpu]);
           span_count,
           total_usermode / total_dur, total_kernelmode / total_dur, total_idle / total_dur);
 
+  if (span_set != NULL) {
+    span_set->names = nametext;
+    span_set = NULL;
+  }
+}
+
+bool EventsToSpans(FILE* f) {
+  // Packed binary input from rawtoevent -bin. It arrives unsorted unless -sorted
+  if (IsEventBin(f)) {
+    EventBinSource src;
+    InitEventBinSource(f, &src);
+    const EventBin* rec;
+    while ((rec = NextEventBin(&src)) != NULL) {
+      if (!SpanEventBin(*rec, src.reader.names, src.reader.meta)) {return false;}
+    }
+    if (src.bad) {return false;}
+    FinishSpans(&src.reader.meta);
+    return true;
+  }
+
+  char buffer[kMaxBufferSize];
+  while (ReadLine(f, buffer, kMaxBufferSize)) {
+    if (!SpanEventLine(buffer)) {return false;}
+  }
+  FinishSpans(NULL);
+  return true;
+}
+
+}	// namespace eventtospan3
+
+// kutrace_post links in the functions above and has its own main
+#ifndef KUTRACE_POST
+//
+// Usage: eventtospan3 <event file name> [-v] [-t]
+//   Input is either the sorted Ascii listing from rawtoevent | sort -n (or
+//   rawtoevent -sorted) or the packed binary from rawtoevent -bin, recognized
+//   by its magic number. Binary input from -bin -sorted is not held in memory
+// -spanbin <file> also writes the spans to <file> in the seekable binary form
+//   of span_bin.h
+//
+int main (int argc, const char** argv) {
+  // Pick off trace label from first argument, if any
+  const char* trace_label = (argc >= 2) ? argv[1] : "";
+
+  // Big output buffer; there are tens of millions of span lines
+  setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+  // Pick off other flags
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {eventtospan3::verbose = true;}
+    if (strcmp(argv[i], "-t") == 0) {eventtospan3::trace = true;}
+    if (strcmp(argv[i], "-rel0") == 0) {eventtospan3::rel0 = true;}
+    if ((strcmp(argv[i], "-spanbin") == 0) && (i < (argc - 1))) {
+      FILE* f = fopen(argv[++i], "wb");
+      if (f == NULL) {
+        fprintf(stderr, "eventtospan3: %s did not open\n", argv[i]);
+        exit(0);
+      }
+      InitSpanBinWriter(f, &eventtospan3::spanbin_writer);
+      eventtospan3::spanbin = true;
+    }
+  }
+
+  eventtospan3::InitSpans(trace_label, NULL);
+  if (!eventtospan3::EventsToSpans(stdin)) {exit(0);}
   return 0;
 }
+#endif
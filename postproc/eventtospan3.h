@@ -0,0 +1,43 @@
+// eventtospan3.h
+// Copyright 2023 Richard L. Sites
+//
+// The eventtospan3 span reconstruction as functions, so kutrace_post can hand
+// it the rawtoevent records directly and take the spans back as SpanBin
+// records. See the Usage comment in eventtospan3.cc for the flags.
+//
+
+#ifndef __EVENTTOSPAN3_H__
+#define __EVENTTOSPAN3_H__
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "event_bin.h"
+#include "span_bin.h"
+
+namespace eventtospan3 {
+
+// Start over. label is the trace title. If out is not NULL, the spans, names,
+// and non-span JSON lines go there instead of the JSON text on stdout
+void InitSpans(const char* label, SpanSet* out);
+
+// One record of rawtoevent -bin, with the names and meta so far.
+// False, after saying why on stderr, if the trace cannot be turned into spans
+bool SpanEventBin(const EventBin& rec, const std::vector<std::string>& names,
+                  const EventBinMeta& meta);
+
+// One line of the rawtoevent Ascii listing, without the newline. False as above
+bool SpanEventLine(char* buffer);
+
+// Put out the spans still open and the trailing lines. meta is the binary
+// input's, or NULL for Ascii input
+void FinishSpans(const EventBinMeta* meta);
+
+// All of the above over f, either form of rawtoevent output. False as above
+bool EventsToSpans(FILE* f);
+
+}	// namespace eventtospan3
+
+#endif	// __EVENTTOSPAN3_H__
@@ -0,0 +1,125 @@
+// flat_hash.h
+// Copyright 2023 Richard L. Sites
+//
+// Small open-addressing hash map for the postprocessing per-PID, per-lock,
+// and per-packet-hash tables. A trace with a few hundred thousand threads
+// makes std::map's one allocation per node and pointer chasing per lookup
+// show up; this keeps all entries in one array.
+//
+// Linear probing in a power-of-two table kept at most half full. Erase shifts
+// later entries of the probe run back, so there are no tombstones.
+//
+// Only the std::map subset the postprocessing uses: operator[] (inserting a
+// value-initialized entry if missing), count, erase, clear, size.
+// Entries move when the table grows or an entry is erased, so a reference
+// from operator[] is good only until the next insert or erase.
+//
+
+#ifndef __FLAT_HASH_H__
+#define __FLAT_HASH_H__
+
+#include <string>
+#include <vector>
+
+#include "basetypes.h"
+
+// Spread integer keys, so PIDs and lock addresses that differ only in high
+// or low bits still land in different slots
+inline uint64 FlatHash(uint64 x) {
+  x *= 0x9E3779B97F4A7C15LLU;
+  return x ^ (x >> 32);
+}
+
+// FNV-1a over the bytes of a string key
+inline uint64 FlatHash(const std::string& s) {
+  uint64 h = 0xCBF29CE484222325LLU;
+  for (int i = 0; i < s.size(); ++i) {
+    h ^= static_cast<uint8>(s[i]);
+    h *= 0x00000100000001B3LLU;
+  }
+  return h;
+}
+
+template <typename K, typename V>
+class FlatMap {
+ public:
+  FlatMap() : count_(0) {}
+
+  size_t size() const {return count_;}
+
+  void clear() {
+    slots_.clear();
+    count_ = 0;
+  }
+
+  // 1 if key is present, else 0
+  size_t count(const K& key) const {
+    if (count_ == 0) {return 0;}
+    return slots_[Probe(key)].used ? 1 : 0;
+  }
+
+  // Value for key, inserting V() if it is not there yet
+  V& operator[](const K& key) {
+    if (slots_.size() < (count_ + 1) * 2) {Grow();}
+    size_t i = Probe(key);
+    if (!slots_[i].used) {
+      slots_[i].used = true;
+      slots_[i].key = key;
+      slots_[i].value = V();
+      ++count_;
+    }
+    return slots_[i].value;
+  }
+
+  void erase(const K& key) {
+    if (count_ == 0) {return;}
+    size_t mask = slots_.size() - 1;
+    size_t i = Probe(key);
+    if (!slots_[i].used) {return;}
+    // Pull back any later entry whose home slot is at or before the hole
+    for (size_t j = (i + 1) & mask; slots_[j].used; j = (j + 1) & mask) {
+      size_t home = FlatHash(slots_[j].key) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i].used = false;
+    slots_[i].key = K();
+    slots_[i].value = V();
+    --count_;
+  }
+
+ private:
+  typedef struct {
+    K key;
+    V value;
+    bool used;
+  } Slot;
+
+  // Slot holding key, else the empty slot where it would go
+  size_t Probe(const K& key) const {
+    size_t mask = slots_.size() - 1;
+    size_t i = FlatHash(key) & mask;
+    while (slots_[i].used && !(slots_[i].key == key)) {i = (i + 1) & mask;}
+    return i;
+  }
+
+  void Grow() {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    size_t n = old.empty() ? 16 : old.size() * 2;
+    Slot empty = Slot();
+    slots_.resize(n, empty);
+    for (size_t j = 0; j < old.size(); ++j) {
+      if (!old[j].used) {continue;}
+      size_t i = Probe(old[j].key);
+      slots_[i] = old[j];
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t count_;
+};
+
+#endif	// __FLAT_HASH_H__
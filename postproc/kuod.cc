@@ -5,14 +5,16 @@
 //
 
 // dsites 2023.04.14 add showing local datetime for each raw block header
+// dsites 2023.07.03 read the trace in place via trace_reader.h
 
-// compile with g++ -O2 kuod.cc -o kuod
+// compile with g++ -O2 kuod.cc trace_reader.cc -o kuod
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "kutrace_lib.h"
+#include "trace_reader.h"
 
 typedef unsigned char uint8;
 typedef unsigned long long int uint64;
@@ -77,12 +79,11 @@ bool IsIpcWord(bool has_ipc, int block_8k, int wordnum) {
 }
 
 int main(int argc, const char** argv) {
-  FILE* f;
+  TraceReader reader;
   if (argc < 2) {
-    f = stdin;
+    OpenTraceReader(NULL, &reader);
   } else {
-    f = fopen(argv[1], "rb");
-    if (f == NULL) {
+    if (!OpenTraceReader(argv[1], &reader)) {
       fprintf(stderr, "%s did not open\n", argv[1]);
       exit(0);
     }
@@ -92,15 +93,15 @@ int main(int argc, const char** argv) {
   // If any extra parameter, treat as print all lines of zero
   if (3 <= argc) {printall = true;}
     
-  int n;
-  uint64 buffer[1024];	// read 8KB at a time
+  size_t n;
+  const uint64* buffer;	// 8KB at a time
   
   size_t offset = 0;
   bool skipping = false;
   int inside_name = 0;
   int block_8k = 0;
   bool has_ipc = false;
-  while ((n = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+  while ((buffer = reinterpret_cast<const uint64*>(NextTraceBytes(&reader, 1024 * 8, &n))) != NULL) {
     int lenu64 = n >> 3;
     if (block_8k == 0) {
       has_ipc = (((buffer[1] >> 56) & 0x80) != 0);  // High flag bit is IPC bit
@@ -168,6 +169,6 @@ int main(int argc, const char** argv) {
     ++block_8k;
   }
   
-  fclose(f);
+  CloseTraceReader(&reader);
   return 0;
 }
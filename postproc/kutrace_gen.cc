@@ -0,0 +1,486 @@
+// Little program to write synthetic raw KUtrace files, for measuring postprocessing
+// Copyright 2023 Richard L. Sites
+//
+// Writes a .trace file in the exact block layout that kutrace_mod.c builds and
+// kutrace_control DoDump writes out: 64KB blocks of 8-byte entries, allocated
+// to CPUs in time order, each starting with the CPU#/cycle and flags/gettimeofday
+// words and the current PID and its name, with 20-bit truncated timestamps,
+// optimized syscall returns, TSDELTA entries over long gaps, and zero-filled
+// unused tails. The very first block also carries the start/stop time pairs and
+// the names that kutrace_control inserts at startup.
+//
+// Each CPU runs a made-up workload of user threads doing syscalls, taking
+// timer interrupts with PC samples and page faults, and context switching
+// through -sched-, with wakeups, between them and the idle thread. A thread
+// runs on at most one CPU at a time; only the idle thread is on several. Each CPU's
+// entries are queued as it runs and then stored in time order across all
+// CPUs, so trace blocks are handed out in time order as the module does.
+//
+// Usage: kutrace_gen <output file> [-cpus n] [-sec s] [-mb n] [-mix sys,irq,ctx]
+//          [-ipc] [-wrap] [-late frac] [-seed n]
+//   -cpus n       CPU count, default 4 (at most 256)
+//   -sec s        seconds of traced time, default 1.0
+//   -mb n         trace buffer size in MB, default 64. Tracing stops when it is
+//                 full, or with -wrap keeps going around, keeping block 0
+//   -mix s,i,c    relative weights of syscalls, interrupts/faults, and context
+//                 switches, default 70,20,10
+//   -ipc          also write the 8KB IPC byte block after each trace block
+//   -wrap         wraparound trace
+//   -late frac    fraction of syscall entries stored late, after an interrupt
+//                 that arrived between taking the timestamp and storing the entry
+//   -seed n       random seed, default 1
+//
+// compile with g++ -O2 kutrace_gen.cc -o kutrace_gen
+//
+// dsites 2023.08.14 Initial version
+// dsites 2023.09.04 One CPU per thread at a time; usage for unknown options
+//
+
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit, random
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+
+using std::deque;
+using std::priority_queue;
+using std::string;
+using std::vector;
+
+#define IPC_Flag     0x80
+#define WRAP_Flag    0x40
+
+static const int kTraceBufSize = 8192;		// uint64 count
+static const int kIpcBufSize = 1024;		// uint64 count
+static const int kTracefileVersionNumber = 3;
+
+// Same as kutrace_mod.c: a time advance this big gets a TSDELTA entry first
+static const uint64 kLateStoreThresh = 0x00000000000e0000LLU;
+static const int kMaxDeltaValue = 255;		// Largest optimized-return delta_t
+
+// Time counter: x86 rdtsc >> 6 is about 50 counts per usec
+static const uint64 kCountsPerUsec = 50;
+static const uint64 kStartCounts = 0x0000012345600000LLU;
+static const uint64 kStartUsec = 1690000000000000LLU;	// 2023.07.22
+
+static const int kSchedSyscall = 511;		// -sched-, see rawtoevent.cc
+
+typedef struct {
+  int number;
+  const char* name;
+} NumName;
+
+// A few x86-64 Linux syscalls
+static const NumName kSyscalls[] = {
+  {0, "read"}, {1, "write"}, {2, "open"}, {3, "close"}, {9, "mmap"},
+  {44, "sendto"}, {45, "recvfrom"}, {202, "futex"}, {232, "epoll_wait"},
+};
+static const int kNumSyscalls = sizeof(kSyscalls) / sizeof(kSyscalls[0]);
+
+// Made-up user threads. PID 0 is the idle task
+static const NumName kPids[] = {
+  {0, "-idle-"}, {1234, "bash"}, {2345, "myserver"}, {2346, "myserver"},
+  {3456, "client"}, {4567, "kworker/0:1"}, {5678, "sshd"}, {6789, "postgres"},
+};
+static const int kNumPids = sizeof(kPids) / sizeof(kPids[0]);
+
+// Generator options
+int ncpus = 4;
+double trace_sec = 1.0;
+int buffer_mb = 64;
+int weight_sys = 70;
+int weight_irq = 20;
+int weight_ctx = 10;
+bool do_ipc = false;
+bool do_wrap = false;
+double late_frac = 0.0;
+
+// One 64KB trace block and its IPC bytes
+typedef struct {
+  uint64 word[kTraceBufSize];
+  uint8 ipc[kTraceBufSize];
+} Block;
+
+// One queued entry of 1..8 words, with timestamp ts, stored at time store
+typedef struct {
+  uint64 ts;
+  uint64 store;
+  int len;
+  uint64 words[8];
+} Pending;
+
+// What each CPU is doing
+typedef struct {
+  uint64 now;			// Current time counter value
+  uint64 prior_cycles;		// Time of the last entry stored, 0 if none yet
+  uint64 last_store;		// Store time of the last entry queued
+  int pid;			// Current PID, index into kPids
+  int block;			// Slot of its current block, -1 if none
+  int next;			// Next free word in that block
+  deque<Pending> pending;	// Entries made but not yet stored
+} CpuGen;
+
+// The trace buffer, in kutrace_control DoDump order
+vector<Block*> slots;
+int slots_used = 0;		// Allocations so far
+bool tracing = true;		// False once the buffer is full without -wrap
+bool wrapped = false;
+
+// Which CPU each kPids thread is on, -1 if none, and when it last left one.
+// A thread may start running again only after it has stopped elsewhere
+int running_on[kNumPids];
+uint64 free_at[kNumPids];
+
+double Random01() {return random() / 2147483648.0;}
+int RandomIn(int lo, int hi) {return lo + (random() % (hi - lo + 1));}
+
+uint64 CountsToUsec(uint64 counts) {
+  return kStartUsec + (counts - kStartCounts) / kCountsPerUsec;
+}
+
+uint64 Entry(uint64 now, uint64 event, uint64 delta, uint64 retval, uint64 arg) {
+  return ((now & 0xfffff) << 44) | ((event & 0xfff) << 32) |
+         ((delta & 0xff) << 24) | ((retval & 0xff) << 16) | (arg & 0xffff);
+}
+
+// Take a new block for cpu at time now, as kutrace_mod.c initialize_trace_block does
+void NewBlock(int cpu, CpuGen* g, uint64 now) {
+  int slot;
+  if (slots_used < slots.size()) {
+    slot = slots_used;
+  } else if (do_wrap && (slots.size() > 1)) {
+    // Wrap to slot 1, not 0
+    slot = 1 + ((slots_used - 1) % (slots.size() - 1));
+    wrapped = true;
+  } else {
+    tracing = false;
+    g->block = -1;
+    return;
+  }
+  ++slots_used;
+
+  Block* b = slots[slot];
+  memset(b, 0, sizeof(Block));
+  uint64 base = now + 2;	// The block is set up just after the entry's timestamp
+  b->word[0] = ((uint64)cpu << 56) | (base & 0x00ffffffffffffffLLU);
+  uint8 flags = (do_ipc ? IPC_Flag : 0) | (do_wrap ? WRAP_Flag : 0);
+  b->word[1] = ((uint64)flags << 56) | CountsToUsec(base);
+  int k = (slot == 0) ? 8 : 2;	// [2..7] of the very first block get the time pairs
+  b->word[k + 0] = kPids[g->pid].number;
+  b->word[k + 1] = 0;
+  char pidname[16];
+  memset(pidname, 0, 16);
+  strncpy(pidname, kPids[g->pid].name, 16);
+  memcpy(&b->word[k + 2], pidname, 16);
+  g->block = slot;
+  g->next = k + 4;
+}
+
+// Store one queued entry into cpu's block, with a TSDELTA entry first after a
+// long gap or for a late store, just as kutrace_mod.c get_claim_with_tsdelta does
+void Commit(int cpu, CpuGen* g, const Pending* p) {
+  if (!tracing) {return;}
+  uint64 now = p->ts;
+  uint64 delta_cycles = now - g->prior_cycles;
+  bool tsdelta = (delta_cycles > kLateStoreThresh) && (g->prior_cycles != 0);
+  int need = p->len + (tsdelta ? 1 : 0);
+  if ((g->block < 0) || (kTraceBufSize < g->next + need)) {
+    NewBlock(cpu, g, p->store);
+    if (g->block < 0) {return;}
+  }
+  Block* b = slots[g->block];
+  if (tsdelta) {
+    b->word[g->next++] = ((now & 0xfffff) << 44) | ((uint64)KUTRACE_TSDELTA << 32) |
+                         (delta_cycles & 0xffffffffLLU);
+  }
+  for (int i = 0; i < p->len; ++i) {
+    // IPC byte: low nibble before, high nibble within, in eighths
+    if (do_ipc) {b->ipc[g->next] = RandomIn(0, 255);}
+    b->word[g->next++] = p->words[i];
+  }
+  g->prior_cycles = now;
+}
+
+// Queue len words with timestamp now on cpu. They are stored no earlier than
+// anything queued before them
+void Store(int cpu, CpuGen* g, uint64 now, const uint64* words, int len) {
+  Pending p;
+  p.ts = now;
+  p.store = (now < g->last_store) ? g->last_store : now;
+  p.len = len;
+  memcpy(p.words, words, len * sizeof(uint64));
+  g->last_store = p.store;
+  g->pending.push_back(p);
+}
+
+void Store1(int cpu, CpuGen* g, uint64 now, uint64 word) {Store(cpu, g, now, &word, 1);}
+
+// A name entry: one word of event/arg, then the name in 1..7 more words
+void StoreName(int cpu, CpuGen* g, uint64 event, uint64 arg, const char* name) {
+  uint64 words[8];
+  memset(words, 0, sizeof(words));
+  int bytelen = strlen(name);
+  if (bytelen > 56) {bytelen = 56;}
+  int wordlen = 1 + ((bytelen + 7) / 8);
+  words[0] = ((g->now & 0xfffff) << 44) | (((event & 0xf0f) | (wordlen << 4)) << 32) |
+             (arg & 0xffffffffLLU);
+  memcpy(&words[1], name, bytelen);
+  Store(cpu, g, g->now, words, wordlen);
+  g->now += 1;
+}
+
+// The names kutrace_control inserts when tracing starts
+void StoreStartupNames(int cpu, CpuGen* g) {
+  for (int i = 0; i < kNumPids; ++i) {
+    StoreName(cpu, g, KUTRACE_PIDNAME, kPids[i].number, kPids[i].name);
+  }
+  for (int i = 0; i < kNumSyscalls; ++i) {
+    StoreName(cpu, g, KUTRACE_SYSCALL64NAME, kSyscalls[i].number, kSyscalls[i].name);
+  }
+  StoreName(cpu, g, KUTRACE_SYSCALL64NAME, kSchedSyscall, "-sched-");
+  StoreName(cpu, g, KUTRACE_INTERRUPTNAME, KUTRACE_LOCAL_TIMER_VECTOR, "local_timer_vector");
+  StoreName(cpu, g, KUTRACE_TRAPNAME, KUTRACE_PAGEFAULT, "page_fault");
+  StoreName(cpu, g, KUTRACE_KERNEL_VER, 0, "Linux 6.0.0 #1 SMP kutrace_gen");
+  StoreName(cpu, g, KUTRACE_MODEL_NAME, 0, "Synthetic CPU @ 3.20GHz");
+  StoreName(cpu, g, KUTRACE_HOST_NAME, 0, "kutrace_gen");
+  Store1(cpu, g, g->now, Entry(g->now, KUTRACE_MBIT_SEC, 0, 0, 1000));
+}
+
+// Timer interrupt with a PC sample, or a page fault
+void DoInterrupt(int cpu, CpuGen* g) {
+  if (Random01() < 0.7) {
+    int irq = KUTRACE_IRQ | KUTRACE_LOCAL_TIMER_VECTOR;
+    Store1(cpu, g, g->now, Entry(g->now, irq, 0, 0, 0));
+    g->now += RandomIn(20, 80);
+    // Two-word PC sample, user or kernel address
+    uint64 pc = (g->pid == 0) ? 0xffffffff81000000LLU : 0x0000000000400000LLU;
+    pc += RandomIn(0, 0xffff) << 4;
+    uint64 words[2] = {((g->now & 0xfffff) << 44) | ((uint64)KUTRACE_PC_TEMP << 32), pc};
+    Store(cpu, g, g->now, words, 2);
+    g->now += RandomIn(20, 80);
+    Store1(cpu, g, g->now, Entry(g->now, irq | 0x200, 0, 0, 0));
+  } else {
+    int trap = KUTRACE_TRAP | KUTRACE_PAGEFAULT;
+    Store1(cpu, g, g->now, Entry(g->now, trap, 0, 0, 0));
+    g->now += RandomIn(50, 400);
+    Store1(cpu, g, g->now, Entry(g->now, trap | 0x200, 0, 0, 0));
+  }
+}
+
+// Syscall, usually short enough for the return to be folded into the call entry
+void DoSyscall(int cpu, CpuGen* g) {
+  const NumName* sc = &kSyscalls[RandomIn(0, kNumSyscalls - 1)];
+  uint64 event = KUTRACE_SYSCALL64 | sc->number;
+  uint64 arg = RandomIn(0, 0xffff);
+  int retval = RandomIn(-4, 100);
+  uint64 dur = (Random01() < 0.9) ? RandomIn(1, kMaxDeltaValue) : RandomIn(300, 20000);
+
+  uint64 call_ts = g->now;
+  if (Random01() < late_frac) {
+    // Late store: an interrupt lands between taking the timestamp and storing
+    g->now += 2;
+    DoInterrupt(cpu, g);
+  }
+  if (dur <= kMaxDeltaValue) {
+    Store1(cpu, g, call_ts, Entry(call_ts, event, dur, retval, arg));
+    if (g->now < call_ts + dur) {g->now = call_ts + dur;}
+  } else {
+    Store1(cpu, g, call_ts, Entry(call_ts, event, 0, 0, arg));
+    if (g->now < call_ts + dur) {g->now = call_ts + dur;}
+    Store1(cpu, g, g->now, Entry(g->now, event | 0x200, 0, 0, retval));
+  }
+}
+
+// Context switch through -sched-, sometimes waking up another thread first
+void DoContextSwitch(int cpu, CpuGen* g) {
+  uint64 sched = KUTRACE_SYSCALL64 | kSchedSyscall;
+  Store1(cpu, g, g->now, Entry(g->now, sched, 0, 0, 0));
+  g->now += RandomIn(20, 200);
+  if (Random01() < 0.5) {
+    int target = RandomIn(1, kNumPids - 1);
+    Store1(cpu, g, g->now, Entry(g->now, KUTRACE_RUNNABLE, 0, 0, kPids[target].number));
+    g->now += RandomIn(5, 50);
+  }
+  // Sometimes go idle, more often run some other thread that is not running
+  // on another CPU. Idle if there is none
+  int newpid = 0;
+  if (0.3 <= Random01()) {
+    int first = RandomIn(1, kNumPids - 1);
+    for (int k = 0; k < kNumPids - 1; ++k) {
+      int p = 1 + ((first - 1 + k) % (kNumPids - 1));
+      if ((p == g->pid) || ((running_on[p] < 0) && (free_at[p] <= g->now))) {
+        newpid = p;
+        break;
+      }
+    }
+  }
+  int oldpid = g->pid;
+  if (newpid != 0) {running_on[newpid] = cpu;}
+  g->pid = newpid;
+  Store1(cpu, g, g->now, Entry(g->now, KUTRACE_USERPID, 0, 0, kPids[newpid].number));
+  g->now += RandomIn(5, 50);
+  Store1(cpu, g, g->now, Entry(g->now, sched | 0x200, 0, 0, 0));
+  // The old thread is off this CPU once -sched- returns
+  if ((oldpid != 0) && (oldpid != newpid)) {
+    running_on[oldpid] = -1;
+    free_at[oldpid] = g->now + 1;
+  }
+}
+
+// One step of activity on cpu, then some user-mode or idle time
+void Step(int cpu, CpuGen* g) {
+  if (g->pid == 0) {
+    // Idle: wait for an interrupt, now and then long enough to need TSDELTA
+    g->now += (Random01() < 0.002) ? RandomIn(1000000, 3000000) : RandomIn(200, 5000);
+    if (Random01() < 0.5) {
+      DoInterrupt(cpu, g);
+    } else {
+      DoContextSwitch(cpu, g);
+    }
+    return;
+  }
+
+  int total = weight_sys + weight_irq + weight_ctx;
+  int r = RandomIn(0, total - 1);
+  if (r < weight_sys) {
+    DoSyscall(cpu, g);
+  } else if (r < weight_sys + weight_irq) {
+    DoInterrupt(cpu, g);
+  } else {
+    DoContextSwitch(cpu, g);
+  }
+  g->now += RandomIn(3, 300);	// User-mode execution
+}
+
+// When cpu next does something: store its next queued entry, else make more
+uint64 NextTime(const CpuGen* g) {
+  return g->pending.empty() ? g->now : g->pending.front().store;
+}
+
+// CPU with the earliest next time on top
+struct LaterCpu {
+  const vector<CpuGen>* gen;
+  bool operator()(int a, int b) const {
+    return NextTime(&(*gen)[a]) > NextTime(&(*gen)[b]);
+  }
+};
+
+void Usage() {
+  fprintf(stderr, "Usage: kutrace_gen <output file> [-cpus n] [-sec s] [-mb n] "
+                  "[-mix sys,irq,ctx] [-ipc] [-wrap] [-late frac] [-seed n]\n");
+  exit(0);
+}
+
+int main (int argc, const char** argv) {
+  if ((argc < 2) || (argv[1][0] == '-')) {Usage();}
+  const char* fname = argv[1];
+  int seed = 1;
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-cpus") == 0) && (i < (argc - 1))) {
+      ncpus = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-sec") == 0) && (i < (argc - 1))) {
+      trace_sec = atof(argv[++i]);
+    } else if ((strcmp(argv[i], "-mb") == 0) && (i < (argc - 1))) {
+      buffer_mb = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-mix") == 0) && (i < (argc - 1))) {
+      int n = sscanf(argv[++i], "%d,%d,%d", &weight_sys, &weight_irq, &weight_ctx);
+      if (n != 3) {Usage();}
+    } else if (strcmp(argv[i], "-ipc") == 0) {
+      do_ipc = true;
+    } else if (strcmp(argv[i], "-wrap") == 0) {
+      do_wrap = true;
+    } else if ((strcmp(argv[i], "-late") == 0) && (i < (argc - 1))) {
+      late_frac = atof(argv[++i]);
+    } else if ((strcmp(argv[i], "-seed") == 0) && (i < (argc - 1))) {
+      seed = atoi(argv[++i]);
+    } else {
+      Usage();
+    }
+  }
+  if ((ncpus < 1) || (256 < ncpus)) {
+    fprintf(stderr, "kutrace_gen: -cpus must be 1..256\n");
+    exit(0);
+  }
+  if ((weight_sys < 0) || (weight_irq < 0) || (weight_ctx < 0) ||
+      (weight_sys + weight_irq + weight_ctx == 0)) {
+    fprintf(stderr, "kutrace_gen: -mix weights must be non-negative, not all zero\n");
+    exit(0);
+  }
+  srandom(seed);
+
+  int nslots = buffer_mb * 16;	// 64KB blocks
+  if (nslots < 2) {nslots = 2;}
+  for (int i = 0; i < nslots; ++i) {slots.push_back(new Block);}
+
+  // Each CPU starts running some thread at a slightly different time. CPUs
+  // beyond the thread count start out idle
+  for (int i = 0; i < kNumPids; ++i) {
+    running_on[i] = -1;
+    free_at[i] = 0;
+  }
+  vector<CpuGen> gen(ncpus);
+  for (int cpu = 0; cpu < ncpus; ++cpu) {
+    gen[cpu].now = kStartCounts + 1000 + RandomIn(0, 1000);
+    gen[cpu].prior_cycles = 0;
+    gen[cpu].last_store = 0;
+    gen[cpu].pid = (cpu < kNumPids) ? cpu : 0;
+    if (gen[cpu].pid != 0) {running_on[gen[cpu].pid] = cpu;}
+    gen[cpu].block = -1;
+    gen[cpu].next = 0;
+  }
+
+  // kutrace_control's startup names go into the very first block, on CPU 0
+  gen[0].now = kStartCounts + 100;
+  StoreStartupNames(0, &gen[0]);
+
+  uint64 stop_counts = kStartCounts + (uint64)(trace_sec * 1000000.0 * kCountsPerUsec);
+  LaterCpu later;
+  later.gen = &gen;
+  priority_queue<int, vector<int>, LaterCpu> next_cpu(later);
+  for (int cpu = 0; cpu < ncpus; ++cpu) {next_cpu.push(cpu);}
+  while (tracing && !next_cpu.empty()) {
+    int cpu = next_cpu.top();
+    next_cpu.pop();
+    CpuGen* g = &gen[cpu];
+    if (!g->pending.empty()) {
+      Commit(cpu, g, &g->pending.front());
+      g->pending.pop_front();
+    } else if (g->now < stop_counts) {
+      Step(cpu, g);
+    } else {
+      continue;		// This CPU is done
+    }
+    next_cpu.push(cpu);
+  }
+
+  // Finish up as DoDump does: time pairs and version number in the very first block
+  int nblocks = (slots_used < nslots) ? slots_used : nslots;
+  Block* first = slots[0];
+  first->word[1] |= ((uint64)kTracefileVersionNumber << 56);
+  if (!wrapped) {first->word[1] &= ~((uint64)WRAP_Flag << 56);}
+  first->word[2] = kStartCounts;
+  first->word[3] = kStartUsec;
+  first->word[4] = stop_counts;
+  first->word[5] = CountsToUsec(stop_counts);
+
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "kutrace_gen: %s did not open\n", fname);
+    exit(0);
+  }
+  for (int i = 0; i < nblocks; ++i) {
+    fwrite(slots[i]->word, 1, sizeof(slots[i]->word), f);
+    if (do_ipc) {fwrite(slots[i]->ipc, 1, sizeof(slots[i]->ipc), f);}
+  }
+  fclose(f);
+
+  fprintf(stderr, "  %s written (%3.1fMB, %d blocks%s)\n", fname,
+          nblocks * (do_ipc ? 72.0 : 64.0) / 1024.0, nblocks, wrapped ? ", wrapped" : "");
+  return 0;
+}
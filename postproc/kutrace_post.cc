@@ -0,0 +1,164 @@
+// Little program to do all the postprocessing of one raw trace in a single process
+// Copyright 2023 Richard L. Sites
+//
+// Same result as postproc3.sh, which runs
+//   rawtoevent |sort -n |eventtospan3 |sort >foo.json
+//   spantotrim |makeself >foo.html
+// as six processes that each re-parse the text the one before printed.
+//
+// Here the stages are called as functions and pass records, not text.
+// rawtoevent decodes the raw trace into time-ordered EventBin records
+// (-bin -sorted), handing each straight to eventtospan3, which collects its
+// spans as SpanBin records. Those are sorted in memory and written as
+// foo.json, then trimmed and made into the self-contained foo.html.
+//
+// Usage: kutrace_post <filename stem>[.trace] "title" [start_sec [stop_sec] | label]
+//
+// compile with g++ -O2 -pthread -DKUTRACE_POST kutrace_post.cc rawtoevent.cc eventtospan3.cc
+//   spantotrim.cc makeself.cc block_index.cc event_bin.cc span_bin.cc from_base40.cc trace_reader.cc -lz -o kutrace_post
+//
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit, free
+
+#include "basetypes.h"
+#include "event_bin.h"
+#include "eventtospan3.h"
+#include "makeself.h"
+#include "rawtoevent.h"
+#include "span_bin.h"
+#include "spantotrim.h"
+
+using std::string;
+using std::vector;
+
+static const int kMaxSpanLine = 512;	// Longest formatted span line, as in span_bin.cc
+
+// What passes from rawtoevent to eventtospan3 besides the records themselves
+typedef struct {
+  EventBinMeta meta;
+  bool ok;		// False once eventtospan3 has rejected a record
+} PostState;
+
+void Usage() {
+  fprintf(stderr, "Usage: kutrace_post <filename stem>[.trace] \"title\" "
+                  "[start_sec [stop_sec] | label]\n");
+  exit(0);
+}
+
+// rawtoevent hands each record here, in sort -n order
+void PutEvent(void* arg, const EventBin& rec, const vector<string>& names) {
+  PostState* post = reinterpret_cast<PostState*>(arg);
+  if (!post->ok) {return;}
+  if (AbsorbEventBinMeta(rec, names, &post->meta)) {return;}
+  post->ok = eventtospan3::SpanEventBin(rec, names, post->meta);
+}
+
+// Write every line of r, the sorted span JSON
+bool WriteJson(const string& fname, SpanBinReader* r) {
+  FILE* f = fopen(fname.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "kutrace_post: %s did not open\n", fname.c_str());
+    return false;
+  }
+  // Room for the longest non-span line; span lines fit in kMaxSpanLine
+  size_t maxlen = kMaxSpanLine;
+  for (int i = 0; i < r->head.size(); ++i) {
+    if (maxlen <= r->head[i].size()) {maxlen = r->head[i].size() + 1;}
+  }
+  for (int i = 0; i < r->tail.size(); ++i) {
+    if (maxlen <= r->tail[i].size()) {maxlen = r->tail[i].size() + 1;}
+  }
+  vector<char> buffer(maxlen);
+  while (ReadSpanBinLine(r, &buffer[0], maxlen)) {
+    fputs(&buffer[0], f);
+    fputc('\n', f);
+  }
+  fclose(f);
+  return true;
+}
+
+// Trim the spans of r and make them into the self-contained HTML
+bool WriteHtml(const string& fname, SpanBinReader* r, spantotrim::TrimArgs* trim) {
+  char* json = NULL;
+  size_t json_len = 0;
+  FILE* g = open_memstream(&json, &json_len);
+  spantotrim::TrimSpanBin(r, trim, g);
+  fclose(g);
+
+  FILE* f = fopen(fname.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "kutrace_post: %s did not open\n", fname.c_str());
+    free(json);
+    return false;
+  }
+  bool ok = makeself::MakeSelf("show_cpu.html", json, json_len, false, f);
+  fclose(f);
+  free(json);
+  return ok;
+}
+
+int main (int argc, const char** argv) {
+  vector<const char*> positional;
+  for (int i = 1; i < argc; ++i) {positional.push_back(argv[i]);}
+  if (positional.size() < 2) {Usage();}
+
+  // spantotrim start_sec [stop_sec] | label, default 0
+  vector<const char*> trim_args;
+  if (positional.size() < 3) {trim_args.push_back("0");}
+  for (int i = 2; (i < positional.size()) && (i < 4); ++i) {trim_args.push_back(positional[i]);}
+  spantotrim::TrimArgs trim;
+  if (!spantotrim::InitTrim(trim_args.size(), &trim_args[0], &trim)) {Usage();}
+
+  // Strip trailing .trace if it is there
+  string stem = string(positional[0]);
+  if ((stem.size() > 6) && (stem.substr(stem.size() - 6) == ".trace")) {
+    stem = stem.substr(0, stem.size() - 6);
+  }
+  string tracename = stem + ".trace";
+  string jsonname = stem + ".json";
+  string htmlname = stem + ".html";
+
+  // rawtoevent -bin -sorted replaces rawtoevent |sort -n, and its records go
+  // straight into eventtospan3 "title"
+  rawtoevent::RawToEventArgs raw_args;
+  raw_args.fname = tracename.c_str();
+  raw_args.verbose = false;
+  raw_args.hexevent = false;
+  raw_args.binary_out = true;
+  raw_args.sorted_out = true;
+  raw_args.maxblock = 999999999;
+  raw_args.nthreads = 1;		// -sorted decodes on one thread
+  raw_args.start_sec = -1.0;
+  raw_args.stop_sec = -1.0;
+  raw_args.lead = 1;
+
+  PostState post;
+  InitEventBinMeta(&post.meta);
+  post.ok = true;
+  EventBinWriter writer;
+  InitEventBinSink(PutEvent, &post, &writer);
+
+  SpanSet spans;
+  eventtospan3::InitSpans(positional[1], &spans);
+  if (!rawtoevent::RawToEvent(raw_args, &writer) || !post.ok) {
+    fprintf(stderr, "kutrace_post: %s not processed\n", tracename.c_str());
+    return 1;
+  }
+  eventtospan3::FinishSpans(&post.meta);
+
+  // |sort
+  SpanBinReader reader;
+  OpenSpanSet(&spans, &reader);
+  if (!WriteJson(jsonname, &reader)) {return 1;}
+  fprintf(stdout, "  %s written\n", jsonname.c_str());
+
+  RewindSpanBin(&reader);
+  if (!WriteHtml(htmlname, &reader, &trim)) {return 1;}
+  fprintf(stdout, "  %s written\n", htmlname.c_str());
+
+  return 0;
+}
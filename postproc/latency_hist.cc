@@ -0,0 +1,129 @@
+// latency_hist.cc
+// Copyright 2023 Richard L. Sites
+//
+// Log-linear latency histogram. See latency_hist.h
+//
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "basetypes.h"
+#include "latency_hist.h"
+
+// Return floor of log base2 of x, i.e. the number of bits-1 needed to hold x
+static int FloorLg(uint64 x) {
+  int lg = 0;
+  while (x > 1) {x >>= 1; ++lg;}
+  return lg;
+}
+
+// Values below 2 * kLatHistSub are their own bucket. Above that, bucket
+// (shift + 1) * kLatHistSub + low bits of the top kLatHistSubBits + 1 bits
+static int LatHistBucket(uint64 ticks) {
+  if (ticks < 2 * kLatHistSub) {return ticks;}
+  int shift = FloorLg(ticks) - kLatHistSubBits;
+  int sub = ticks >> shift;	// kLatHistSub..2*kLatHistSub-1
+  return (shift + 1) * kLatHistSub + (sub - kLatHistSub);
+}
+
+// Largest value that lands in bucket i
+static uint64 LatHistBucketHigh(int i) {
+  if (i < 2 * kLatHistSub) {return i;}
+  int shift = (i / kLatHistSub) - 1;
+  uint64 sub = (i % kLatHistSub) + kLatHistSub;
+  return ((sub + 1) << shift) - 1;
+}
+
+void InitLatHist(LatHist* h) {
+  h->count = 0;
+  h->sum = 0;
+  h->min = 0;
+  h->max = 0;
+  h->buckets.clear();
+}
+
+void AddLatHist(LatHist* h, uint64 ticks) {
+  int i = LatHistBucket(ticks);
+  if (h->buckets.size() <= (size_t)i) {h->buckets.resize(i + 1, 0);}
+  ++h->buckets[i];
+  if ((h->count == 0) || (ticks < h->min)) {h->min = ticks;}
+  if (h->max < ticks) {h->max = ticks;}
+  ++h->count;
+  h->sum += ticks;
+}
+
+void MergeLatHist(LatHist* h, const LatHist& other) {
+  if (other.count == 0) {return;}
+  if (h->buckets.size() < other.buckets.size()) {h->buckets.resize(other.buckets.size(), 0);}
+  for (size_t i = 0; i < other.buckets.size(); ++i) {h->buckets[i] += other.buckets[i];}
+  if ((h->count == 0) || (other.min < h->min)) {h->min = other.min;}
+  if (h->max < other.max) {h->max = other.max;}
+  h->count += other.count;
+  h->sum += other.sum;
+}
+
+uint64 LatHistPercentile(const LatHist& h, double pct) {
+  if (h.count == 0) {return 0;}
+  if (pct <= 0.0) {return h.min;}
+  if (pct >= 100.0) {return h.max;}
+  // Rank of the value wanted, 1..count
+  uint64 rank = (uint64)((pct / 100.0) * h.count + 0.9999999);
+  if (rank < 1) {rank = 1;}
+  uint64 seen = 0;
+  for (size_t i = 0; i < h.buckets.size(); ++i) {
+    seen += h.buckets[i];
+    if (rank <= seen) {
+      uint64 high = LatHistBucketHigh(i);
+      return (high < h.max) ? high : h.max;
+    }
+  }
+  return h.max;
+}
+
+void PrintLatHistHeader(FILE* f) {
+  fprintf(f, "%10s %10s %10s %10s %10s %10s", "count", "p50", "p90", "p99", "p99.9", "max");
+}
+
+// Ticks are 10ns, so usec to two places is exact
+void PrintLatHistRow(FILE* f, const LatHist& h) {
+  fprintf(f, "%10llu %10.2f %10.2f %10.2f %10.2f %10.2f", h.count,
+          LatHistPercentile(h, 50.0) / 100.0,
+          LatHistPercentile(h, 90.0) / 100.0,
+          LatHistPercentile(h, 99.0) / 100.0,
+          LatHistPercentile(h, 99.9) / 100.0,
+          h.max / 100.0);
+}
+
+// Buckets are merged into [2**k, 2**(k+1)) usec, with everything under 1 usec
+// in the first line. Bucket boundaries in ticks fall on multiples of 100
+// only approximately, so a bucket goes where its lowest value goes
+void PrintLatHistBars(FILE* f, const LatHist& h, const char* indent) {
+  static const int kBarWidth = 50;
+  static const int kLines = 40;
+  uint64 lines[kLines];
+  for (int k = 0; k < kLines; ++k) {lines[k] = 0;}
+  for (size_t i = 0; i < h.buckets.size(); ++i) {
+    if (h.buckets[i] == 0) {continue;}
+    uint64 low = (i == 0) ? 0 : LatHistBucketHigh(i - 1) + 1;
+    uint64 usec = low / 100;
+    int k = (usec == 0) ? 0 : FloorLg(usec) + 1;
+    if (kLines <= k) {k = kLines - 1;}
+    lines[k] += h.buckets[i];
+  }
+  uint64 most = 1;
+  for (int k = 0; k < kLines; ++k) {if (most < lines[k]) {most = lines[k];}}
+  for (int k = 0; k < kLines; ++k) {
+    if (lines[k] == 0) {continue;}
+    char range[32];
+    if (k == 0) {
+      snprintf(range, sizeof(range), "<1us");
+    } else {
+      snprintf(range, sizeof(range), ">=%lluus", 1LLU << (k - 1));
+    }
+    int len = (lines[k] * kBarWidth + most - 1) / most;
+    fprintf(f, "%s%-12s %10llu ", indent, range, lines[k]);
+    for (int j = 0; j < len; ++j) {fputc('#', f);}
+    fprintf(f, "\n");
+  }
+}
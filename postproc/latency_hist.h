@@ -0,0 +1,47 @@
+// latency_hist.h
+// Copyright 2023 Richard L. Sites
+//
+// Log-linear latency histogram, in the style of HdrHistogram. Values are
+// multiples of 10ns, the resolution of span times. Below 64 ticks every value
+// has its own bucket; above that each power of two is split into 32 buckets,
+// so a percentile is never more than about 3% above the value recorded.
+// A histogram is a few KB at most, even for minute-long spans.
+//
+
+#ifndef __LATENCY_HIST_H__
+#define __LATENCY_HIST_H__
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "basetypes.h"
+
+static const int kLatHistSubBits = 5;
+static const int kLatHistSub = 1 << kLatHistSubBits;	// Buckets per power of two
+
+typedef struct {
+  uint64 count;
+  uint64 sum;		// Ticks
+  uint64 min;
+  uint64 max;
+  std::vector<uint64> buckets;	// Grows as larger values arrive
+} LatHist;
+
+void InitLatHist(LatHist* h);
+void AddLatHist(LatHist* h, uint64 ticks);
+void MergeLatHist(LatHist* h, const LatHist& other);
+
+// Smallest recorded value v with at least pct percent of the values <= v,
+// to bucket resolution. Exact for 0 and 100
+uint64 LatHistPercentile(const LatHist& h, double pct);
+
+// Column headings and one row of count p50 p90 p99 p99.9 max, in usec
+void PrintLatHistHeader(FILE* f);
+void PrintLatHistRow(FILE* f, const LatHist& h);
+
+// The histogram itself, one line per power of two of usec that has values,
+// each with its count and a bar scaled to the largest count
+void PrintLatHistBars(FILE* f, const LatHist& h, const char* indent);
+
+#endif	// __LATENCY_HIST_H__
@@ -0,0 +1,28 @@
+// makeself.h
+// Copyright 2023 Richard L. Sites
+//
+// The makeself HTML builder as a function, so kutrace_post can hand it the
+// trimmed JSON it already holds.
+//
+
+#ifndef __MAKESELF_H__
+#define __MAKESELF_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace makeself {
+
+// Read the rest of f into a new[] buffer with a NUL after it.
+// Returns the length, or -1 on a read error
+int64_t ReadAll(FILE* f, char** buf);
+
+// Write to out the HTML file html_name with d3.v4.min.js, from the current
+// directory, and the JSON json[0..json_len) embedded. -raw embeds the JSON
+// text itself, turning its newlines into spaces in place. False, after saying
+// why on stderr, if the inputs are missing, malformed, or the JSON unsorted
+bool MakeSelf(const char* html_name, char* json, int64_t json_len, bool raw, FILE* out);
+
+}	// namespace makeself
+
+#endif	// __MAKESELF_H__
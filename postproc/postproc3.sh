@@ -7,7 +7,12 @@ export LC_ALL=C
 # Strip trailing .trace if it is there
 var1=${1%.trace}
 
-cat $var1.trace  |./rawtoevent |sort -n |./eventtospan3 "$2" |sort >$var1.json 
+./rawtoevent $var1.trace |sort -n |./eventtospan3 "$2" |sort >$var1.json 
+# Same result without the external sort -n, or also without the Ascii round trip
+#./rawtoevent $var1.trace -sorted |./eventtospan3 "$2" |sort >$var1.json 
+#./rawtoevent $var1.trace -bin -sorted |./eventtospan3 "$2" |sort >$var1.json 
+# Also write the seekable binary spans; spantotrim <$var1.spanbin then reads just the window
+#./rawtoevent $var1.trace -bin -sorted |./eventtospan3 "$2" -spanbin $var1.spanbin |sort >$var1.json 
 echo "  $var1.json written"
 
 trim_arg='0'
@@ -19,5 +24,7 @@ fi
 
 cat $var1.json |./spantotrim $trim_arg |./makeself show_cpu.html >$var1.html
 echo "  $var1.html written"
+# kutrace_post does all of the above in one process, without the Ascii round trips
+#./kutrace_post $var1 "$2" $3 $4
 
 google-chrome $var1.html &
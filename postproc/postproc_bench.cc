@@ -0,0 +1,297 @@
+// Little program to time the KUtrace postprocessing programs on one trace
+// Copyright 2023 Richard L. Sites
+//
+// Runs the standard postproc3.sh pipeline one stage at a time, each stage
+// reading the previous stage's output file, and reports for each its elapsed
+// time, items (events or spans) and MB per second, and peak resident memory.
+//
+//   rawtoevent   <trace>           > events
+//   sort -n      events            > sorted events
+//   eventtospan3 <sorted events>   > spans
+//   sort         spans             > sorted spans
+//   spantotrim 0 <sorted spans>    > trimmed spans
+//   spantospan 100 <trimmed spans> > coarse spans
+//   spantoprof   <trimmed spans>   > profile
+//
+// then the faster variants of the first stages, each timed on its own and
+// not part of the pipeline total
+//
+//   rawtoevent -sorted            <trace>          > sorted events
+//   rawtoevent -bin -sorted       <trace>          > binary events
+//   eventtospan3                  <binary events>  > spans
+//
+// Pair with kutrace_gen for repeatable input of any size, e.g.
+//   ./kutrace_gen /tmp/gen.trace -cpus 16 -sec 2 -ipc
+//   ./postproc_bench /tmp/gen.trace
+//
+// Usage: postproc_bench <trace file> [-dir <dir>] [-tmp <dir>] [-keep]
+//          [-save <file>] [-compare <file>] [-threshold pct]
+//   -dir       where the postprocessing programs are, default .
+//   -tmp       where the intermediate files go, default /tmp
+//   -keep      do not delete the intermediate files
+//   -save      write this run's stage times to file, as a baseline
+//   -compare   compare each stage with the baseline times in file. A stage
+//              more than pct percent slower (and at least 20 msec slower) is
+//              a regression, and postproc_bench exits with status 1
+//   -threshold regression threshold for -compare, default 10 percent
+//
+// compile with g++ -O2 postproc_bench.cc -o postproc_bench
+//
+// dsites 2023.08.14 Initial version
+// dsites 2023.09.04 Time rawtoevent -sorted and -bin -sorted, and eventtospan3 on
+//                   the binary events; -save and -compare against saved times
+//
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "basetypes.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+// What a stage's items/sec counts
+static const int kCountOutput = 0;	// Output lines
+static const int kCountInput = 1;	// Input lines
+static const int kCountEvents = 2;	// The events rawtoevent produced; binary files have no lines
+
+typedef struct {
+  const char* label;
+  bool is_ours;			// In -dir, else found on PATH
+  const char* args[5];		// Program and up to four arguments, NULL-terminated
+  int in;			// Input file index, 0 = the trace
+  int out;			// Output file index
+  int count;			// kCountOutput etc.
+} Stage;
+
+// Intermediate files: 0 is the trace itself
+static const int kNumFiles = 10;
+static const char* const kFileSuffix[kNumFiles] = {
+  "", ".events", ".sorted_events", ".spans", ".sorted_spans", ".trimmed", ".coarse",
+  ".sorted_events2", ".bin_events", ".bin_spans",
+};
+// The spantoprof output, ".prof", is index kNumFiles
+
+static const Stage kStages[] = {
+  {"rawtoevent",   true,  {"rawtoevent", NULL},   0, 1, kCountOutput},
+  {"sort -n",      false, {"sort", "-n", NULL},   1, 2, kCountInput},
+  {"eventtospan3", true,  {"eventtospan3", NULL}, 2, 3, kCountInput},
+  {"sort",         false, {"sort", NULL},         3, 4, kCountInput},
+  {"spantotrim",   true,  {"spantotrim", "0", NULL},   4, 5, kCountInput},
+  {"spantospan",   true,  {"spantospan", "100", NULL}, 5, 6, kCountInput},
+  {"spantoprof",   true,  {"spantoprof", NULL},   5, kNumFiles, kCountInput},
+  // Variants
+  {"raw -sorted",  true,  {"rawtoevent", "-sorted", NULL}, 0, 7, kCountOutput},
+  {"raw -bin -sorted", true, {"rawtoevent", "-bin", "-sorted", NULL}, 0, 8, kCountEvents},
+  {"e2s3 <bin",    true,  {"eventtospan3", NULL}, 8, 9, kCountEvents},
+};
+static const int kNumStages = sizeof(kStages) / sizeof(kStages[0]);
+static const int kNumPipelineStages = 7;	// The total is over these
+
+double GetSec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+int64 FileBytes(const string& fname) {
+  struct stat st;
+  if (stat(fname.c_str(), &st) != 0) {return 0;}
+  return st.st_size;
+}
+
+// Data lines, not counting the # comment lines or JSON punctuation
+int64 CountLines(const string& fname) {
+  FILE* f = fopen(fname.c_str(), "r");
+  if (f == NULL) {return 0;}
+  int64 count = 0;
+  char buffer[4096];
+  bool at_start = true;
+  while (fgets(buffer, sizeof(buffer), f) != NULL) {
+    if (at_start && (buffer[0] != '#') && (buffer[0] != '\n')) {++count;}
+    at_start = (strchr(buffer, '\n') != NULL);
+  }
+  fclose(f);
+  return count;
+}
+
+// Run one stage with stdin/stdout redirected. Returns elapsed seconds and sets
+// peak resident set in KB
+double RunStage(const char* path, const char* const* args,
+                const string& infile, const string& outfile, long* maxrss_kb) {
+  double start = GetSec();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "postproc_bench: fork failed\n");
+    exit(0);
+  }
+  if (pid == 0) {
+    int in = open(infile.c_str(), O_RDONLY);
+    int out = open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((in < 0) || (out < 0)) {
+      fprintf(stderr, "postproc_bench: %s or %s did not open\n",
+              infile.c_str(), outfile.c_str());
+      _exit(1);
+    }
+    dup2(in, 0);
+    dup2(out, 1);
+    close(in);
+    close(out);
+    setenv("LC_ALL", "C", 1);	// Plain byte order for sort, and faster
+    execvp(path, const_cast<char* const*>(args));
+    fprintf(stderr, "postproc_bench: could not run %s\n", path);
+    _exit(1);
+  }
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  wait4(pid, &status, 0, &usage);
+  double elapsed = GetSec() - start;
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "postproc_bench: %s failed\n", path);
+    exit(0);
+  }
+  *maxrss_kb = usage.ru_maxrss;
+  return elapsed;
+}
+
+// Baseline file: one line per stage, "sec rss_mb label"
+void ReadBaseline(const char* fname, map<string, double>* base_sec) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) {
+    fprintf(stderr, "postproc_bench: %s did not open\n", fname);
+    exit(0);
+  }
+  char buffer[256];
+  while (fgets(buffer, sizeof(buffer), f) != NULL) {
+    double sec, rss_mb;
+    char label[128];
+    if (sscanf(buffer, "%lf %lf %127[^\n]", &sec, &rss_mb, label) != 3) {continue;}
+    (*base_sec)[string(label)] = sec;
+  }
+  fclose(f);
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: postproc_bench <trace file> [-dir <dir>] [-tmp <dir>] [-keep]\n"
+                  "         [-save <file>] [-compare <file>] [-threshold pct]\n");
+  exit(0);
+}
+
+int main (int argc, const char** argv) {
+  if ((argc < 2) || (argv[1][0] == '-')) {Usage();}
+  string trace = argv[1];
+  string dir = ".";
+  string tmp = "/tmp";
+  bool keep = false;
+  const char* save_fname = NULL;
+  const char* compare_fname = NULL;
+  double threshold = 10.0;	// Percent
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-dir") == 0) && (i < (argc - 1))) {
+      dir = argv[++i];
+    } else if ((strcmp(argv[i], "-tmp") == 0) && (i < (argc - 1))) {
+      tmp = argv[++i];
+    } else if (strcmp(argv[i], "-keep") == 0) {
+      keep = true;
+    } else if ((strcmp(argv[i], "-save") == 0) && (i < (argc - 1))) {
+      save_fname = argv[++i];
+    } else if ((strcmp(argv[i], "-compare") == 0) && (i < (argc - 1))) {
+      compare_fname = argv[++i];
+    } else if ((strcmp(argv[i], "-threshold") == 0) && (i < (argc - 1))) {
+      threshold = atof(argv[++i]);
+    } else {
+      Usage();
+    }
+  }
+  if (FileBytes(trace) == 0) {
+    fprintf(stderr, "postproc_bench: %s missing or empty\n", trace.c_str());
+    exit(0);
+  }
+
+  // Intermediate file names
+  char pidbuf[32];
+  snprintf(pidbuf, sizeof(pidbuf), "%d", getpid());
+  string base = tmp + "/postproc_bench_" + pidbuf;
+  vector<string> files;
+  files.push_back(trace);
+  for (int i = 1; i < kNumFiles; ++i) {files.push_back(base + kFileSuffix[i]);}
+  files.push_back(base + ".prof");
+
+  map<string, double> base_sec;
+  if (compare_fname != NULL) {ReadBaseline(compare_fname, &base_sec);}
+  FILE* save = NULL;
+  if (save_fname != NULL) {
+    save = fopen(save_fname, "w");
+    if (save == NULL) {
+      fprintf(stderr, "postproc_bench: %s did not open\n", save_fname);
+      exit(0);
+    }
+  }
+
+  fprintf(stdout, "%s, %3.1fMB\n", trace.c_str(), FileBytes(trace) / 1048576.0);
+  fprintf(stdout, "%-18s %8s %11s %11s %8s %8s%s\n",
+          "stage", "sec", "items", "items/s", "MB/s", "RSS MB",
+          (compare_fname != NULL) ? "  base_sec  change" : "");
+  fflush(stdout);
+  double total_sec = 0.0;
+  int64 events = 0;
+  int regressions = 0;
+  for (int i = 0; i < kNumStages; ++i) {
+    const Stage* st = &kStages[i];
+    string path = st->is_ours ? (dir + "/" + st->args[0]) : string(st->args[0]);
+    const string& infile = files[st->in];
+    const string& outfile = files[st->out];
+    long maxrss_kb = 0;
+    double sec = RunStage(path.c_str(), st->args, infile, outfile, &maxrss_kb);
+    if (i < kNumPipelineStages) {total_sec += sec;}
+
+    // rawtoevent is measured by the events it produces, the rest by what they read
+    int64 items = events;
+    if (st->count == kCountOutput) {items = CountLines(outfile);}
+    if (st->count == kCountInput) {items = CountLines(infile);}
+    if (i == 0) {events = items;}
+    double mb = FileBytes(infile) / 1048576.0;
+    if (sec <= 0.0) {sec = 0.000001;}
+    fprintf(stdout, "%-18s %8.3f %11lld %11.0f %8.1f %8.1f",
+            st->label, sec, items, items / sec, mb / sec, maxrss_kb / 1024.0);
+    if (save != NULL) {fprintf(save, "%.3f %.1f %s\n", sec, maxrss_kb / 1024.0, st->label);}
+
+    // Small stages are noisy, so a regression must also be 20 msec or more
+    map<string, double>::const_iterator it = base_sec.find(string(st->label));
+    if (it != base_sec.end()) {
+      double change = (it->second > 0.0) ? ((sec / it->second) - 1.0) * 100.0 : 0.0;
+      bool regressed = (threshold < change) && (0.020 <= sec - it->second);
+      if (regressed) {++regressions;}
+      fprintf(stdout, "  %8.3f %+6.1f%%%s", it->second, change, regressed ? "  REGRESSION" : "");
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);	// Keep in step with the stages' stderr
+    if (i == kNumPipelineStages - 1) {
+      fprintf(stdout, "%-18s %8.3f %11lld %11.0f\n",
+              "total", total_sec, events, events / total_sec);
+    }
+  }
+  if (save != NULL) {fclose(save);}
+  if (compare_fname != NULL) {
+    fprintf(stdout, "%d stage%s more than %.1f%% slower than %s\n",
+            regressions, (regressions == 1) ? "" : "s", threshold, compare_fname);
+  }
+
+  if (!keep) {
+    for (int i = 1; i < files.size(); ++i) {unlink(files[i].c_str());}
+  }
+  return (0 < regressions) ? 1 : 0;
+}
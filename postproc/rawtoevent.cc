@@ -5,7 +5,7 @@
 // Input has filename like 
 //   kutrace_control_20170821_095154_dclab-1_2056.trace
 //
-// compile with g++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
+// compile with g++ -O2 -pthread rawtoevent.cc block_index.cc event_bin.cc from_base40.cc trace_reader.cc kutrace_lib.cc -o rawtoevent
 //
 // To see raw trace in hex, use
 //   od -Ax -tx8z -w32 foo.trace
@@ -15,12 +15,28 @@
 // dsites 2022.08.19 Add RPi tweaks
 // dsites 2023.04.30 Update TSDELTA processing to go backward
 // dsites 2023.05.03 Update timestamp processing to go backward in top 7/8 of wrap period
+// dsites 2023.06.12 Add -bin packed binary output, see event_bin.h
+// dsites 2023.06.19 Add -sorted per-CPU reorder windows and merge, replacing sort -n
+// dsites 2023.06.26 Add -threads, decoding each CPU's chain of blocks on its own thread
+// dsites 2023.07.03 Read the trace in place via trace_reader.h instead of fread
+// dsites 2023.07.08 Per-CPU state sized to the CPUs in the trace, no 80-CPU limit
+// dsites 2023.08.21 Add -start/-stop, decoding just the blocks a block index says cover them
+// dsites 2023.09.06 -sorted decodes a block at a time, flushing to a low-water mark, with
+//   wraparound chains in time order. Memory is a block or two per CPU
+// dsites 2023.09.08 The decoding is RawToEvent, see rawtoevent.h, so kutrace_post can
+//   take the binary records straight from it
 //
 
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
@@ -28,12 +44,19 @@
 #include <time.h>
 #include <unistd.h>     // getpid gethostname
 #include <sys/time.h>   // gettimeofday
+#include <sys/stat.h>   // stat
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "block_index.h"
+#include "event_bin.h"
 #include "from_base40.h"
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
+#include "rawtoevent.h"
+#include "trace_reader.h"
+
+namespace rawtoevent {
 
 // To come from names in trace
 static int gTIMER_IRQ_EVENT = 0x05ec;	// local_timer
@@ -53,6 +76,10 @@ static int gSCHED_EVENT = 0x0dff;	// -sched-
 bool verbose = false;
 bool hexevent = false;
 
+// Packed binary output instead of Ascii lines
+bool binary_out = false;
+EventBinWriter* bin_writer = NULL;	// Set up by the caller of RawToEvent
+
 //VERYTEMP
 bool keep_idle = false;
 
@@ -61,7 +88,7 @@ bool keep_idle = false;
 static const uint64 FINDME = 0;
 
 static const bool TRACEWRAP = false;
-static const int kMAX_CPUS = 80;
+static const int kCacheLineBytes = 64;
 static const int mhz_32bit_counts = 54;
 static const int kNetworkMbPerSec = 1000;	// Default: 1 Gb/s
 static const int kDefaultLowResNsec10 = 35;	// Low-res riscv: 0 dur => 350 nsec instead 
@@ -179,9 +206,12 @@ static const char* kIdleName = "-idle-";
 
 
 
+using std::deque;
 using std::map;
+using std::priority_queue;
 using std::set;
 using std::string;
+using std::vector;
 
 static double kDefaultSlope = 0.000285714;  // 1/3500, dclab-3 at 3.5 GHz
 
@@ -428,6 +458,221 @@ int HasWraparound(uint8 flags) {
 }
 
 
+
+//
+// -sorted output
+//
+// Within one CPU's chain of blocks, events come out almost in time order; only
+// late stores, the block-boundary timestamps, and PC samples moved back to
+// their timer interrupt go backward, and never past the earliest event of the
+// block before. Each CPU's blocks are therefore decoded one at a time, always
+// next on the CPU that is furthest behind, into a per-CPU reorder window.
+// Events that arrive in order append to the window's sorted run; the few that
+// go backward wait in a small heap beside it. After each block a heap over
+// the CPUs merges everything before the low-water mark, the earliest event of
+// the latest block decoded on each CPU that still has blocks to go. The
+// windows hold one or two blocks each.
+//
+// Wraparound traces rotate each CPU's chain, so there the chain is decoded in
+// order of its blocks' first timestamps instead. Each block still starts from
+// the state its predecessor in the file left, so the events are exactly those
+// of the file-order decode. See DecodeSorted.
+//
+
+// One event or name line waiting to go out
+typedef struct {
+  int64 ts;
+  EventBin rec;		// If binary_out
+  string line;		// Otherwise
+} PendingEvent;
+
+// Exactly the LC_ALL=C sort -n order: timestamp, then the entire line bytewise
+bool PendingLess(const PendingEvent& a, const PendingEvent& b) {
+  if (a.ts != b.ts) {return a.ts < b.ts;}
+  if (binary_out) {return CompareEventBin(a.rec, b.rec, bin_writer->names) < 0;}
+  return a.line < b.line;
+}
+
+// Heap order for the late events: the one that sorts first is at the front
+struct PendingGreater {
+  bool operator()(const PendingEvent& a, const PendingEvent& b) const {
+    return PendingLess(b, a);
+  }
+};
+
+typedef struct {
+  deque<PendingEvent> run;	// In order
+  vector<PendingEvent> late;	// A heap
+} ReorderWindow;
+
+bool sorted_out = false;
+vector<ReorderWindow> reorder;	// Indexed by CPU number, sized to the CPUs seen
+int reorder_cpu = 0;		// CPU of the block being decoded
+int64 reorder_earliest = 0x7FFFFFFFFFFFFFFFLL;	// Earliest added since last reset
+int64 reorder_flushed = -1;	// Everything below this has been sent
+bool reorder_complained = false;
+
+// The ts = -1 copies of names go out ahead of everything still waiting,
+// themselves in sort -n order
+ReorderWindow front_names;
+
+// The stylized comments that eventtospan needs after the front names but
+// before any event. The binary form sends block 0's date and flags instead
+string sorted_header;
+string sorted_datetime;
+int sorted_flags = 0;
+bool sorted_header_sent = false;
+
+void OutputBinMeta(uint8 kind, uint32 arg, int64 lo, int64 hi, const char* str);
+
+void SendPending(FILE* f, const PendingEvent& pe) {
+  if (binary_out) {
+    WriteEventBin(bin_writer, pe.rec);
+  } else {
+    fputs(pe.line.c_str(), f);
+  }
+}
+
+bool WindowEmpty(const ReorderWindow& window) {
+  return window.run.empty() && window.late.empty();
+}
+
+// The event in a window that sorts first
+const PendingEvent& WindowFront(const ReorderWindow& window) {
+  if (window.late.empty()) {return window.run.front();}
+  if (window.run.empty()) {return window.late.front();}
+  return PendingLess(window.late.front(), window.run.front()) ?
+         window.late.front() : window.run.front();
+}
+
+// Add to a window, taking over pe's line
+void InsertPending(ReorderWindow* window, PendingEvent* pe) {
+  bool in_order = window->run.empty() || !PendingLess(*pe, window->run.back());
+  PendingEvent* slot;
+  if (in_order) {
+    window->run.push_back(PendingEvent());
+    slot = &window->run.back();
+  } else {
+    window->late.push_back(PendingEvent());
+    slot = &window->late.back();
+  }
+  slot->ts = pe->ts;
+  slot->rec = pe->rec;
+  slot->line.swap(pe->line);
+  if (!in_order) {std::push_heap(window->late.begin(), window->late.end(), PendingGreater());}
+}
+
+// Send and remove the front of a window
+void SendFront(FILE* f, ReorderWindow* window) {
+  const PendingEvent& front = WindowFront(*window);
+  SendPending(f, front);
+  if (!window->run.empty() && (&front == &window->run.front())) {
+    window->run.pop_front();
+  } else {
+    std::pop_heap(window->late.begin(), window->late.end(), PendingGreater());
+    window->late.pop_back();
+  }
+}
+
+// Send an event or timestamped name, or hold it in its CPU's window
+void EmitPending(FILE* f, int cpu, PendingEvent* pe) {
+  if (!sorted_out) {
+    SendPending(f, *pe);
+    return;
+  }
+  if ((pe->ts < reorder_flushed) && !reorder_complained) {
+    fprintf(stderr, "rawtoevent: -sorted window too small at ts %lld < %lld; "
+                    "output is out of order\n", pe->ts, reorder_flushed);
+    reorder_complained = true;
+  }
+  if (pe->ts < reorder_earliest) {reorder_earliest = pe->ts;}
+  InsertPending(&reorder[cpu], pe);
+}
+
+void SendSortedHeader(FILE* f) {
+  if (sorted_header_sent) {return;}
+  if (binary_out) {
+    if (!sorted_datetime.empty()) {
+      OutputBinMeta(kEvbDateTime, 0, 0, 0, sorted_datetime.c_str());
+    }
+    OutputBinMeta(kEvbFlags, sorted_flags, 0, 0, NULL);
+  } else {
+    fputs(sorted_header.c_str(), f);
+  }
+  sorted_header_sent = true;
+}
+
+// Heap order for the merge: the CPU whose front event sorts first is on top
+struct FrontGreater {
+  bool operator()(int a, int b) const {
+    return PendingLess(WindowFront(reorder[b]), WindowFront(reorder[a]));
+  }
+};
+
+// Send everything earlier than bound, in order, merging across CPUs
+void FlushReorder(FILE* f, int64 bound) {
+  while (!WindowEmpty(front_names)) {SendFront(f, &front_names);}
+
+  priority_queue<int, vector<int>, FrontGreater> heads;
+  for (int cpu = 0; cpu < reorder.size(); ++cpu) {
+    if (!WindowEmpty(reorder[cpu]) && (WindowFront(reorder[cpu]).ts < bound)) {heads.push(cpu);}
+  }
+  if (reorder_flushed < bound) {reorder_flushed = bound;}
+  if (heads.empty()) {return;}
+
+  SendSortedHeader(f);
+  while (!heads.empty()) {
+    int cpu = heads.top();
+    heads.pop();
+    SendFront(f, &reorder[cpu]);
+    if (!WindowEmpty(reorder[cpu]) && (WindowFront(reorder[cpu]).ts < bound)) {heads.push(cpu);}
+  }
+}
+
+
+// The ts = -1 copy of a name, for the very front of the sorted event list.
+// With -sorted these are all queued by the pre-pass, ahead of any event
+bool front_names_queued = false;
+
+// Change any spaces and non-Ascii to underscore
+// -1 dur event pid name(event)
+void OutputFrontName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
+  // Avoid crazy big times
+  if (nsec10 >= 99900000000LL) {return;}
+
+  uint64 dur = 1;
+  // One initial word plus 8 chars per word
+  uint64 len = ((strlen(name) + 7) >> 3) + 1;
+  event = (event & 0xF0F) | (len << 4);		// Set name length
+
+  PendingEvent pe;
+  pe.ts = -1;
+  if (binary_out) {
+    memset(&pe.rec, 0, sizeof(EventBin));
+    pe.rec.kind = kEvbName;
+    pe.rec.start_ts = -1;
+    pe.rec.duration = dur;
+    pe.rec.eventnum = event;
+    pe.rec.arg = argall;
+    pe.rec.name_id = EventBinNameId(bin_writer, name);
+    if (sorted_out) {
+      InsertPending(&front_names, &pe);
+    } else {
+      WriteEventBin(bin_writer, pe.rec);
+    }
+    return;
+  }
+
+  if (sorted_out) {
+    char buffer[kMaxPrintBuffer];
+    snprintf(buffer, kMaxPrintBuffer, "%lld %lld %lld %d %s\n", -1ll, dur, event, argall, name);
+    pe.line = string(buffer);
+    InsertPending(&front_names, &pe);
+  } else {
+    fprintf(f, "%lld %lld %lld %d %s\n", -1ll, dur, event, argall, name);
+  }
+}
+
 // Change any spaces and non-Ascii to underscore
 // time dur event pid name(event)
 void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
@@ -440,11 +685,28 @@ void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char*
   uint64 dur = 1;
   // One initial word plus 8 chars per word
   uint64 len = ((strlen(name) + 7) >> 3) + 1;
+  uint64 raw_event = event;
   event = (event & 0xF0F) | (len << 4);		// Set name length
 
-  fprintf(f, "%lld %lld %lld %d %s\n", nsec10, dur, event, argall, name);
+  PendingEvent pe;
+  pe.ts = nsec10;
+  if (binary_out) {
+    memset(&pe.rec, 0, sizeof(EventBin));
+    pe.rec.kind = kEvbName;
+    pe.rec.start_ts = nsec10;
+    pe.rec.duration = dur;
+    pe.rec.eventnum = event;
+    pe.rec.arg = argall;
+    pe.rec.name_id = EventBinNameId(bin_writer, name);
+    EmitPending(f, reorder_cpu, &pe);
+  } else {
+    char buffer[kMaxPrintBuffer];
+    snprintf(buffer, kMaxPrintBuffer, "%lld %lld %lld %d %s\n", nsec10, dur, event, argall, name);
+    pe.line = string(buffer);
+    EmitPending(f, reorder_cpu, &pe);
+  }
   // Also put the name at the very front of the sorted event list
-  fprintf(f, "%lld %lld %lld %d %s\n", -1ll, dur, event, argall, name);
+  if (!front_names_queued) {OutputFrontName(f, nsec10, raw_event, argall, name);}
 }
 
 // time dur event cpu  pid rpc  arg retval IPC name(event)
@@ -462,10 +724,51 @@ void OutputEvent(FILE* f,
     return;
   }
 
-  fprintf(f, "%lld %lld %lld %lld  %lld %lld  %lld %lld %d %s (%llx)\n", 
-          nsec10, duration, event, current_cpu, 
-          pid, rpc, 
-          arg, retval, ipc, name, event);
+  PendingEvent pe;
+  pe.ts = nsec10;
+  if (binary_out) {
+    pe.rec.kind = kEvbEvent;
+    pe.rec.unused = 0;
+    pe.rec.start_ts = nsec10;
+    pe.rec.duration = duration;
+    pe.rec.eventnum = event;
+    pe.rec.cpu = current_cpu;
+    pe.rec.pid = pid;
+    pe.rec.rpcid = rpc;
+    pe.rec.arg = arg;
+    pe.rec.retval = retval;
+    pe.rec.ipc = ipc;
+    pe.rec.name_id = EventBinNameId(bin_writer, name);
+    EmitPending(f, reorder_cpu, &pe);
+    return;
+  }
+
+  if (!sorted_out) {
+    fprintf(f, "%lld %lld %lld %lld  %lld %lld  %lld %lld %d %s (%llx)\n", 
+            nsec10, duration, event, current_cpu, 
+            pid, rpc, 
+            arg, retval, ipc, name, event);
+    return;
+  }
+  char buffer[kMaxPrintBuffer];
+  snprintf(buffer, kMaxPrintBuffer, "%lld %lld %lld %lld  %lld %lld  %lld %lld %d %s (%llx)\n", 
+           nsec10, duration, event, current_cpu, 
+           pid, rpc, 
+           arg, retval, ipc, name, event);
+  pe.line = string(buffer);
+  EmitPending(f, reorder_cpu, &pe);
+}
+
+// Send one of the stylized-comment values in binary form
+void OutputBinMeta(uint8 kind, uint32 arg, int64 lo, int64 hi, const char* str) {
+  EventBin rec;
+  memset(&rec, 0, sizeof(EventBin));
+  rec.kind = kind;
+  rec.arg = arg;
+  rec.start_ts = lo;
+  rec.duration = hi;
+  if (str != NULL) {rec.name_id = EventBinNameId(bin_writer, str);}
+  WriteEventBin(bin_writer, rec);
 }
 
 // Add the pid#/rpc#/etc. to the end of name, if not already there
@@ -569,7 +872,8 @@ uint64 RemapIdlePid(uint64 fbpid, const U64set* idle_pids) {
 
 // If very first block, pick out time conversion parameters
 // First block has extra time fields. We do sanity checking here.
-bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, CyclesToUsecParams* params) {
+// Returns true if they fail, which is fatal
+bool handle_very_first_block (const uint64* traceblock, uint64* base_usec_timestamp, CyclesToUsecParams* params) {
       int64 start_counts = traceblock[2];
       int64 start_usec = traceblock[3];
       int64 stop_counts = traceblock[4];
@@ -691,7 +995,7 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
       if (fail) {
         fprintf(stderr, "rawtoevent **** FAIL in block[0] is fatal ****\n");
         fprintf(stderr, "     %016llx %016llx\n",traceblock[0], traceblock[1]);
-        exit(0);
+        return true;
       }
 
       // Map start_counts <==> start_usec
@@ -708,94 +1012,265 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
   return fail;
 }
 
+//--------------------------------------------------------------------------//
+// Block decoding                                                           //
+//--------------------------------------------------------------------------//
 //
-// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n]
+// -threads n decodes blocks in parallel. The blocks are grouped by CPU number
+// from traceblock[0] >> 56, and each CPU's chain is decoded in file order by
+// a single worker thread, because the only decoding state carried from one
+// block to the next is per CPU. (The timestamp prepend value is recomputed
+// from each block's base cycle count.)
 //
-int main (int argc, const char** argv) {
-  // Some statistics
-  uint64 base_usec_timestamp;
-  uint64 event_count = 0;
-  uint64 lo_timestamp = 0x7FFFFFFFFFFFFFFFl;
-  uint64 hi_timestamp = 0;
-  U64set unique_cpus;
+// Names are the exception: a pidname or lock name defined in one CPU's block
+// is used by the others. A quick serial pre-pass over all the blocks records
+// every name definition together with its position in the file, and each
+// lookup then finds the definition that the serial decode would have seen at
+// that same position.
+//
+// Each block's output is held until all the workers finish, then sent in the
+// original block order, so the output is byte-for-byte the serial output.
+//
+
+// Decoding state carried from one block to the next of the same CPU.
+// Workers update different CPUs at once, so each is on its own cache line
+typedef struct alignas(kCacheLineBytes) {
+  uint64 current_pid;			// Current PID on this CPU
+  uint64 current_rpc;			// Current rpcid on this CPU
+  uint64 prior_timer_irq_nsec10;	// For moving PC sample start_ts back
+  bool at_first_cpu_block;		// To special-case the initial PID of each CPU in trace
+} CpuState;
+
+// Some statistics, per decoding thread and then summed
+typedef struct {
+  uint64 event_count;
+  uint64 lo_timestamp;
+  uint64 hi_timestamp;
   U64set unique_pids;
-  U64set idle_pids;
-  uint64 ctx_switches = 0;
-  uint64 total_marks = 0;
+  uint64 ctx_switches;
+  uint64 total_marks;
   uint64 events_by_type[16];		// From high nibble of eventnum
-  memset(events_by_type, 0, 16 * sizeof(uint64));
+} DecodeStats;
 
-  int maxblock = 999999999;
-  uint64 current_cpu = 0;
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint8 ipcblock[kTraceBufSize];	// One byte per trace entry
+// One definition of a name, at file position blocknumber << 16 | entry
+typedef struct {
+  uint64 pos;
+  string name;
+} NameDef;
 
-  uint64 current_pid[kMAX_CPUS];	// Keep track of current PID on each of 16+ cores
-  uint64 current_rpc[kMAX_CPUS]; 	// Keep track of current rpcid on each of 1+6 cores
-  uint64 prior_timer_irq_nsec10[kMAX_CPUS];	// For moving PC sample start_ts back
-  bool at_first_cpu_block[kMAX_CPUS];	// To special-case the initial PID of each CPU in trace
-  U64toString names;			// Name keyed by PID#, RPC# etc. with high type nibble
+// Names keyed by PID#, RPC# etc. with high type nibble; definitions in file order
+typedef map<uint64, vector<NameDef> > NameHistory;
 
-  // Start timepair is set by DoInit
-  // Stop timepair is set by DoOff
-  // If start_counts is zero, we got here directly without calling DoInit, 
-  // which was done in some earlier run of this program. In that case, go 
-  // find the start pair as the first real trace entry in the first trace block.
+// Everything one decoding thread needs
+typedef struct {
   CyclesToUsecParams params;
+  uint8 first_flags;
+  NameHistory* names;
+  bool define_names;		// False once the pre-pass has recorded all of them
+  bool names_only;		// The pre-pass: just record name definitions
+  bool front_names;		// The pre-pass also queues the ts = -1 name copies
+  U64set* idle_pids;
+  vector<CpuState>* cpu_state;	// Indexed by CPU number
+  const vector<bool>* has_names;	// From the block index; NULL if not known
+  DecodeStats stats;
+} Decoder;
+
+// One event or name held back until its block's turn
+typedef struct {
+  bool is_name;
+  uint64 nsec10;
+  uint64 duration;
+  uint64 event;
+  uint64 cpu;
+  uint64 pid;
+  uint64 rpc;
+  uint64 arg;			// argall for names
+  uint64 retval;
+  int ipc;
+  string name;
+} DecodedItem;
+
+// The held-back output of one block. Plain Ascii output is formatted right
+// away by the worker into a memory stream. -bin shares the name dictionary,
+// so those events are replayed in block order
+typedef struct {
+  FILE* f;
+  char* text;
+  size_t textlen;
+  vector<DecodedItem> items;
+} DecodedBlock;
+
+// One raw trace block and its IPC bytes, in place in the mapped trace file
+// or else copied
+typedef struct {
+  const uint64* traceblock;	// 8 bytes per trace entry
+  const uint8* ipcblock;	// One byte per trace entry
+  uint8* copy;			// If not mapped, holds both
+} RawBlock;
+
+// IPC bytes for blocks without any
+static const uint8 kNoIpc[kTraceBufSize] = {0};
+
+
+void InitDecodeStats(DecodeStats* stats) {
+  stats->event_count = 0;
+  stats->lo_timestamp = 0x7FFFFFFFFFFFFFFFl;
+  stats->hi_timestamp = 0;
+  stats->unique_pids.clear();
+  stats->ctx_switches = 0;
+  stats->total_marks = 0;
+  memset(stats->events_by_type, 0, 16 * sizeof(uint64));
+}
 
-  // Events are 0..64K-1 for everything except context switch.
-  // Context switch events are 0x10000 + pid
-  // Initialize idle process name, pid 0
-  names[0x10000] = string(kIdleName);
+void AddDecodeStats(const DecodeStats& from, DecodeStats* to) {
+  to->event_count += from.event_count;
+  if (to->lo_timestamp > from.lo_timestamp) {to->lo_timestamp = from.lo_timestamp;}
+  if (to->hi_timestamp < from.hi_timestamp) {to->hi_timestamp = from.hi_timestamp;}
+  to->unique_pids.insert(from.unique_pids.begin(), from.unique_pids.end());
+  to->ctx_switches += from.ctx_switches;
+  to->total_marks += from.total_marks;
+  for (int i = 0; i < 16; ++i) {to->events_by_type[i] += from.events_by_type[i];}
+}
 
-  // Pick up flags
-  for (int i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
-    if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
-    if ((strcmp(argv[i], "-maxblock") == 0) && (i < (argc - 1))) {
-      ++i;
-      maxblock = atoi(argv[i]);
-    }
-  }
-  
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    current_pid[i] = 0; 
-    current_rpc[i] = 0;
-    prior_timer_irq_nsec10[i] = 0;
-    at_first_cpu_block[i] = true;
+// Make room for at least ncpus CPUs, initializing any new ones
+void SizeCpuState(int ncpus, vector<CpuState>* cpu_state) {
+  while (cpu_state->size() < ncpus) {
+    CpuState cs;
+    cs.current_pid = 0; 
+    cs.current_rpc = 0;
+    cs.prior_timer_irq_nsec10 = 0;
+    cs.at_first_cpu_block = true;
+    cpu_state->push_back(cs);
   }
+}
 
-  // For converting cycle counts to multiples of 100ns
-  double m = kDefaultSlope;
+// Remember a name defined at file position pos
+void DefineName(Decoder* d, uint64 key, uint64 pos, const string& name) {
+  if (!d->define_names) {return;}
+  NameDef def;
+  def.pos = pos;
+  def.name = name;
+  (*d->names)[key].push_back(def);
+}
 
-  FILE* f = stdin;
-  if (argc >= 2) {
-    f = fopen(argv[1], "rb");
-    if (f == NULL) {
-      fprintf(stderr, "rawtoevent: %s did not open\n", argv[1]);
-      exit(0);
-    }
+// Return the latest name for key defined before file position pos, or NULL
+const string* LookupName(const Decoder* d, uint64 key, uint64 pos) {
+  NameHistory::const_iterator it = d->names->find(key);
+  if (it == d->names->end()) {return NULL;}
+  const vector<NameDef>& defs = it->second;
+  // Decoding serially, the latest definition is always the one
+  if (defs.back().pos < pos) {return &defs.back().name;}
+  int lo = 0;
+  int hi = defs.size();
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (defs[mid].pos < pos) {lo = mid + 1;} else {hi = mid;}
   }
+  return (lo == 0) ? NULL : &defs[lo - 1].name;
+}
 
-  int blocknumber = 0;
-  uint64 base_minute_usec, base_minute_cycle, base_minute_shift;
+// As above, but empty if not defined
+string NameOrEmpty(const Decoder* d, uint64 key, uint64 pos) {
+  const string* name = LookupName(d, key, pos);
+  return (name == NULL) ? string("") : *name;
+}
 
-  // Need this to sort in front of allthe timestamps
-  fprintf(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
-  uint8 all_flags = 0;	// They should all be the same
-  uint8 first_flags;	// Just first block has tracefile version number
+// Send a name right away if out is NULL, else hold it in out
+void PutName(DecodedBlock* out, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
+  if (out == NULL) {OutputName(stdout, nsec10, event, argall, name); return;}
+  if (out->f != NULL) {OutputName(out->f, nsec10, event, argall, name); return;}
+  DecodedItem item;
+  item.is_name = true;
+  item.nsec10 = nsec10;
+  item.event = event;
+  item.arg = argall;
+  item.name = string(name);
+  out->items.push_back(item);
+}
 
+// Send an event right away if out is NULL, else hold it in out
+void PutEvent(DecodedBlock* out, 
+              uint64 nsec10, uint64 duration, uint64 event, uint64 current_cpu,
+              uint64 pid, uint64 rpc, 
+              uint64 arg, uint64 retval, int ipc, const char* name) {
+  if (out == NULL) {
+    OutputEvent(stdout, nsec10, duration, event, current_cpu, pid, rpc, arg, retval, ipc, name);
+    return;
+  }
+  if (out->f != NULL) {
+    OutputEvent(out->f, nsec10, duration, event, current_cpu, pid, rpc, arg, retval, ipc, name);
+    return;
+  }
+  DecodedItem item;
+  item.is_name = false;
+  item.nsec10 = nsec10;
+  item.duration = duration;
+  item.event = event;
+  item.cpu = current_cpu;
+  item.pid = pid;
+  item.rpc = rpc;
+  item.arg = arg;
+  item.retval = retval;
+  item.ipc = ipc;
+  item.name = name;
+  out->items.push_back(item);
+}
 
-  //--------------------------------------------------------------------------//
-  // Outer loop over blocks                                                   //
-  //--------------------------------------------------------------------------//
-  while (fread(traceblock, 1, sizeof(traceblock), f) != 0) {
-    if (blocknumber >= maxblock) {break;}
+// Send one block's held-back output
+void SendDecoded(DecodedBlock* out) {
+  if (out->text != NULL) {
+    fwrite(out->text, 1, out->textlen, stdout);
+    free(out->text);
+    out->text = NULL;
+  }
+  for (int k = 0; k < out->items.size(); ++k) {
+    const DecodedItem& item = out->items[k];
+    if (item.is_name) {
+      OutputName(stdout, item.nsec10, item.event, item.arg, item.name.c_str());
+    } else {
+      OutputEvent(stdout, item.nsec10, item.duration, item.event, item.cpu, 
+                  item.pid, item.rpc, item.arg, item.retval, item.ipc, item.name.c_str());
+    }
+  }
+  out->items.clear();
+}
 
-    // Need first [1] line to get basetime in later steps
-    // TODO: Move this to a stylized BASETIME comment
-    ////fprintf(stdout, "# blocknumber %d\n", blocknumber);
-    // These are stylized comments that eventtospan depends on for initial time
+// These are stylized comments that eventtospan depends on for initial time
+void OutputBlockComments(const uint64* traceblock, int blocknumber, string* first_datetime) {
+  // Need first [1] line to get basetime in later steps
+  // TODO: Move this to a stylized BASETIME comment
+  ////fprintf(stdout, "# blocknumber %d\n", blocknumber);
+  if (binary_out) {
+    // eventtospan only looks at 20xx dates
+    string datetime = string(FormatUsecDateTime(traceblock[1] & 0x00fffffffffffffful));
+    if ((memcmp(datetime.c_str(), "20", 2) == 0) &&
+        (first_datetime->empty() || (datetime < *first_datetime))) {
+      *first_datetime = datetime;
+    }
+    // -sorted streams, so eventtospan gets just the first, as with Ascii
+    if (sorted_out && (blocknumber == 0)) {
+      if (memcmp(datetime.c_str(), "20", 2) == 0) {sorted_datetime = datetime;}
+      sorted_flags = traceblock[1] >> 56;
+    }
+  } else if (sorted_out) {
+    // eventtospan needs just the first, and only after the front names
+    if (blocknumber == 0) {
+      char temp[kMaxPrintBuffer];
+      snprintf(temp, kMaxPrintBuffer, "# ## FLAGS: %d\n", (int)(traceblock[1] >> 56));
+      sorted_header += temp;
+      snprintf(temp, kMaxPrintBuffer, "# [0] %016llx cpu %02llx block %d\n", 
+               traceblock[0],
+               traceblock[0] >> 56,
+               blocknumber);
+      sorted_header += temp;
+      snprintf(temp, kMaxPrintBuffer, "# [1] %s cpu %02llx flags %02llx block %d\n",
+               FormatUsecDateTime(traceblock[1] & 0x00fffffffffffffful),
+               traceblock[0] >> 56, 
+               traceblock[1] >> 56,
+               blocknumber);
+      sorted_header += temp;
+    }
+  } else {
     fprintf(stdout, "# [0] %016llx cpu %02llx block %d\n", 
             traceblock[0],
             traceblock[0] >> 56,
@@ -807,92 +1282,35 @@ int main (int argc, const char** argv) {
             blocknumber);
     fprintf(stdout, 
             "# TS      DUR EVENT CPU PID RPC ARG0 RETVAL IPC NAME (t and dur multiples of 10ns)\n");
+  }
+}
 
-    if (verbose || hexevent) {
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
-    }
-//   +-------+-----------------------+-------------------------------+
-//   | cpu#  |                  cycle counter                        | 0 module
-//   +-------+-----------------------+-------------------------------+
-//   | flags |                  gettimeofday                         | 1 DoDump
-//   +-------+-----------------------+-------------------------------+
-
-    // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
-    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
-
-    // traceblock[1] has flags in top byte. 
-    uint8 flags = traceblock[1] >> 56;
-    uint64 gtod = traceblock[1] & 0x00fffffffffffffful;
-
-    bool fail = false;
-    if (kMAX_CPUS <= current_cpu) {
-      fprintf(stderr, "rawtoevent FAIL: block[%d] CPU number %lld > max %d\n", blocknumber, current_cpu, kMAX_CPUS);
-      fail = true;
-    }
-    // No constraints on base_cycle
-    // No constraints on flags
-    if (usec_per_100_years <= gtod) {
-      fprintf(stderr, "rawtoevent FAIL: block[%d] gettimeofday crazy large %016llx\n", blocknumber, gtod);
-      fail = true;
-    }
-  
-
-    all_flags |= flags;
-    bool this_block_has_ipc = (HasIPC(flags));
-
-    // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
-    if (this_block_has_ipc) {
-      // Extract 8KB IPC block
-      int n = fread(ipcblock, 1, sizeof(ipcblock), f);
-    } else {
-      memset(ipcblock, 0, sizeof(ipcblock));	// Default if no IPC data
-    }
-
-// WRAPAROUND PROBLEM:
-// We pick base_minute_usec here in block 0, but it can be
-// long before the real wrapped trace entries in blocks 1..N
-// Our downstream display does badly with seconds much over 120...
-//
-// We would like the base_minute_usec to be set by the first real entry in block 1 instead...
-// Can still use paramaters here for basic time conversion. 
-// Not much issue with overflow, I think.
-//
-
-    // If very first block, pick out time conversion parameters
-    int first_real_entry = 2;
-    bool very_first_block = (blocknumber == 0);
-    if (very_first_block) {
-      first_real_entry = 8;
-      first_flags = flags;
-      fail |= handle_very_first_block(traceblock, &base_usec_timestamp, &params);
-    }
-
-    if (fail) {
-      fprintf(stderr, "rawtoevent **** FAIL -- skipping block[%d] ****\n", blocknumber);
-      fprintf(stderr, "     %016llx %016llx\n",traceblock[0], traceblock[1]);
-      for (int i = 0; i < 16; ++i) {fprintf(stderr, "  [%d] %016llx\n", i, traceblock[i]);}
-      ++blocknumber;
-      continue;
-    }
-
-    // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
-    unique_cpus.insert(current_cpu);	// stats
-
-    // Pick out times for converting to 100Mhz
-    uint64 prepend = base_cycle & ~0xfffff;
-
-    // The base cycle count for this block may well be a bit later than the truncated time
-    // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits 
-    // we want to prepend should be one smaller.
-    uint64 first_timestamp = traceblock[first_real_entry] >> 44;
-    uint64 prior_t = first_timestamp;
-
-    // If wraparound trace and in very_first_block, suppress everything except name entries
-    // and hardware description
-    bool keep_just_names = HasWraparound(first_flags) && very_first_block;
+// Decode the entries of one block that passed the sanity checks.
+// out NULL sends the output straight to stdout
+void DecodeBlock(const uint64* traceblock, const uint8* ipcblock, int blocknumber,
+                 Decoder* d, DecodedBlock* out) {
+  // Pick out CPU number for this traceblock
+  uint64 current_cpu = traceblock[0] >> 56;
+  uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+  CpuState* cs = &(*d->cpu_state)[current_cpu];
+  uint64 block_pos = (uint64)blocknumber << 16;	// File position, for name lookups
+
+  // Very first block has the extra time fields
+  bool very_first_block = (blocknumber == 0);
+  int first_real_entry = very_first_block ? 8 : 2;
+
+  // Pick out times for converting to 100Mhz
+  uint64 prepend = base_cycle & ~0xfffff;
+
+  // The base cycle count for this block may well be a bit later than the truncated time
+  // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits 
+  // we want to prepend should be one smaller.
+  uint64 first_timestamp = traceblock[first_real_entry] >> 44;
+  uint64 prior_t = first_timestamp;
+
+  // If wraparound trace and in very_first_block, suppress everything except name entries
+  // and hardware description
+  bool keep_just_names = HasWraparound(d->first_flags) && very_first_block;
 
 // Every block has PID and pidname at the front                          created by
 //   +-------+-----------------------+-------------------------------+
@@ -910,46 +1328,51 @@ int main (int argc, const char** argv) {
 //   |                                                               | 5 or 11 module
 //   +-------------------------------+-------------------------------+
 
-    if (TracefileVersion(first_flags) >= 3) {
-      /* Every block has PID and pidname at the front */
-      /* CPU frequency may be in the first block per CPU, in the high half of pid */
-      uint64 pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
-      uint64 freq_mhz = traceblock[first_real_entry + 0] >> 32;
-      uint64 unused = traceblock[first_real_entry + 1];
-      char pidname[24];
-      pid = RemapHighPid(pid);
-      memcpy(pidname, reinterpret_cast<char*>(&traceblock[first_real_entry + 2]), 16);
-      pidname[16] = '\0';
-      
-      // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
-      // Map all of these to pid 0 name -idle-, remembering them
-      FixupIdlePid(&pid, pidname, &idle_pids);
+  if (TracefileVersion(d->first_flags) >= 3) {
+    /* Every block has PID and pidname at the front */
+    /* CPU frequency may be in the first block per CPU, in the high half of pid */
+    uint64 pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
+    uint64 freq_mhz = traceblock[first_real_entry + 0] >> 32;
+    uint64 unused = traceblock[first_real_entry + 1];
+    char pidname[24];
+    pid = RemapHighPid(pid);
+    memcpy(pidname, reinterpret_cast<const char*>(&traceblock[first_real_entry + 2]), 16);
+    pidname[16] = '\0';
+    
+    // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
+    // Map all of these to pid 0 name -idle-, remembering them
+    FixupIdlePid(&pid, pidname, d->idle_pids);
 
-      if (verbose || hexevent) {
-        if (at_first_cpu_block[current_cpu]) {
-          fprintf(stderr, "rawtoevent block[%d] cpu %lld pid %lld freq %lld %s\n", 
-                  blocknumber, current_cpu, pid, freq_mhz, pidname);
-        }
-        fprintf(stdout, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
-        fprintf(stdout, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
-        fprintf(stdout, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
-        fprintf(stdout, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
-        fprintf(stdout, "\n");
+    if (verbose || hexevent) {
+      if (cs->at_first_cpu_block) {
+        fprintf(stderr, "rawtoevent block[%d] cpu %lld pid %lld freq %lld %s\n", 
+                blocknumber, current_cpu, pid, freq_mhz, pidname);
       }
+      fprintf(stdout, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
+      fprintf(stdout, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
+      fprintf(stdout, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
+      fprintf(stdout, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
+      fprintf(stdout, "\n");
+    }
 
-      // Remember the name for this pid
-      uint64 nameinsert = PidToEvent(pid);
-      string name = MakeSafeAscii(ReduceSpaces(string(pidname)));
-      names[nameinsert] = name;
-      
+    // Remember the name for this pid
+    uint64 nameinsert = PidToEvent(pid);
+    string name = MakeSafeAscii(ReduceSpaces(string(pidname)));
+    DefineName(d, nameinsert, block_pos | first_real_entry, name);
+    if (d->front_names) {
+      uint64 nsec10 = CyclesToNsec10(base_cycle, d->params);
+      OutputFrontName(stdout, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
+    }
+
+    if (!d->names_only) {
       // To allow updates of the reconstruction stack in eventtospan
-      uint64 nsec10 = CyclesToNsec10(base_cycle, params);
-      OutputName(stdout, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
+      uint64 nsec10 = CyclesToNsec10(base_cycle, d->params);
+      PutName(out, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
 
       // New user-mode process id, pid
-      unique_pids.insert(pid);	// stats
-      if (current_pid[current_cpu] != pid) {++ctx_switches;}	// stats
-      current_pid[current_cpu] = pid;
+      d->stats.unique_pids.insert(pid);	// stats
+      if (cs->current_pid != pid) {++d->stats.ctx_switches;}	// stats
+      cs->current_pid = pid;
 
       uint64 event = KUTRACE_USERPID;	// Context switch
       uint64 duration = 1;
@@ -975,99 +1398,104 @@ int main (int argc, const char** argv) {
         // dsites 2021.07.26
         // Output the very first block's context switch to the running process at trace startup
         // dsites 2021.10.20 Output initial CPU frequency if nonzero
-        if (at_first_cpu_block[current_cpu]) {
-          at_first_cpu_block[current_cpu] = false;
-          OutputEvent(stdout, nsec10, duration, KUTRACE_USERPID, current_cpu, 
-                      pid, 0,  0, 0, 0, name.c_str());
+        if (cs->at_first_cpu_block) {
+          cs->at_first_cpu_block = false;
+          PutEvent(out, nsec10, duration, KUTRACE_USERPID, current_cpu, 
+                   pid, 0,  0, 0, 0, name.c_str());
           if (0 < freq_mhz) {
-            OutputEvent(stdout, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
-                        pid, 0,  freq_mhz, 0, 0, "-freq-");
+            PutEvent(out, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
+                     pid, 0,  freq_mhz, 0, 0, "-freq-");
            }
         }
       }
+    }
 
-      first_real_entry += 4;
-    }	// End of each block preprocessing
+    first_real_entry += 4;
+  }	// End of each block preprocessing
 
+  // Past the header PID name, the pre-pass has nothing to do in a block without names
+  if (d->names_only && (d->has_names != NULL) && !(*d->has_names)[blocknumber]) {return;}
 
-    // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
-    if (Wrapped(first_timestamp, base_cycle)) {
-      prepend -= 0x100000; 
-      if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
-    }
 
-    //------------------------------------------------------------------------//
-    // Inner loop over eight-byte entries                                     //
-    //------------------------------------------------------------------------//
-    for (int i = first_real_entry; i < kTraceBufSize; ++i) {
-      int entry_i = i;		// Always the first word, even if i subsequently incremented
-      bool has_arg = false;	// Set true if low 32 bits are used
-      bool extra_word = false;	// Set true if entry is at least two words
-      bool deferred_rpcid0 = false;
-      uint8 ipc = ipcblock[i];
-
-      // Completely skip any all-zero NOP entries
-      if (traceblock[i] == 0LLU) {continue;}
-
-      // Skip the entire rest of the block if all-ones entry found
-      if (traceblock[i] == 0xffffffffffffffffLLU) {break;}
-
-      // +-------------------+-----------+---------------+-------+-------+
-      // | timestamp         | event     | delta | retval|      arg0     |
-      // +-------------------+-----------+---------------+-------+-------+
-      //          20              12         8       8           16 
-      
-      uint64 t = traceblock[i] >> 44;			// Timestamp
-      uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
-      uint64 arg    = traceblock[i] & 0x0000ffff;	// syscall/ret arg/retval
-      uint64 argall = traceblock[i] & 0xffffffff;	// mark_a/b/c/d, etc.
-      uint64 arg_hi = (traceblock[i] >> 16) & 0xffff;	// rx_pkt tx_pkt lglen8
-      uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
-      uint64 retval = (traceblock[i] >> 16) & 0xff;	// Opt syscall retval
-
-      // Completely skip any mostly-FFFF entries, but keep FFF return of 32-bit -sched-
-      if ((t == 0xFFFFF) && (n == 0xFFF)) {continue;}
-
-      // Sign extend optimized retval [-128..127] from 8 bits to 16
-      retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
-      if (verbose) {
-        fprintf(stdout, 
-                "%% [%d,%d] %05llx %03llx %04llx %04llx = %lld %lld %lld, %lld %lld %02x\n", 
-                blocknumber, i,
-                (traceblock[i] >> 44) & 0xFFFFF, 
-                (traceblock[i] >> 32) & 0xFFF, 
-                (traceblock[i] >> 16) & 0xFFFF, 
-                (traceblock[i] >> 0) & 0xFFFF, 
-		t, n, delta_t, retval, arg, ipc);
-      }
+  // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
+  if (Wrapped(first_timestamp, base_cycle)) {
+    prepend -= 0x100000; 
+    if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
+  }
 
-      if (is_mark(n)) {
-        ++total_marks;	// stats
-      } else {
-        ++events_by_type[n >> 8];	// stats
-      }
+  //------------------------------------------------------------------------//
+  // Inner loop over eight-byte entries                                     //
+  //------------------------------------------------------------------------//
+  for (int i = first_real_entry; i < kTraceBufSize; ++i) {
+    int entry_i = i;		// Always the first word, even if i subsequently incremented
+    uint64 entry_pos = block_pos | entry_i;	// For name lookups
+    bool has_arg = false;	// Set true if low 32 bits are used
+    bool extra_word = false;	// Set true if entry is at least two words
+    bool deferred_rpcid0 = false;
+    uint8 ipc = ipcblock[i];
+
+    // Completely skip any all-zero NOP entries
+    if (traceblock[i] == 0LLU) {continue;}
+
+    // Skip the entire rest of the block if all-ones entry found
+    if (traceblock[i] == 0xffffffffffffffffLLU) {break;}
+
+    // +-------------------+-----------+---------------+-------+-------+
+    // | timestamp         | event     | delta | retval|      arg0     |
+    // +-------------------+-----------+---------------+-------+-------+
+    //          20              12         8       8           16 
+    
+    uint64 t = traceblock[i] >> 44;			// Timestamp
+    uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
+    uint64 arg    = traceblock[i] & 0x0000ffff;	// syscall/ret arg/retval
+    uint64 argall = traceblock[i] & 0xffffffff;	// mark_a/b/c/d, etc.
+    uint64 arg_hi = (traceblock[i] >> 16) & 0xffff;	// rx_pkt tx_pkt lglen8
+    uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
+    uint64 retval = (traceblock[i] >> 16) & 0xff;	// Opt syscall retval
+
+    // Completely skip any mostly-FFFF entries, but keep FFF return of 32-bit -sched-
+    if ((t == 0xFFFFF) && (n == 0xFFF)) {continue;}
+
+    // Sign extend optimized retval [-128..127] from 8 bits to 16
+    retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
+    if (verbose) {
+      fprintf(stdout, 
+              "%% [%d,%d] %05llx %03llx %04llx %04llx = %lld %lld %lld, %lld %lld %02x\n", 
+              blocknumber, i,
+              (traceblock[i] >> 44) & 0xFFFFF, 
+              (traceblock[i] >> 32) & 0xFFF, 
+              (traceblock[i] >> 16) & 0xFFFF, 
+              (traceblock[i] >> 0) & 0xFFFF, 
+		t, n, delta_t, retval, arg, ipc);
+    }
 
-      uint64 event;
-      if (is_contextswitch(n)) {	// Context switch
-        has_arg = true;
-        // Change event to new process id + 64k
-        event = PidToEvent(arg);
-      } else {
-        // Anything else 0..64K-1
-        event = n;
-      }
+    if (is_mark(n)) {
+      ++d->stats.total_marks;	// stats
+    } else {
+      ++d->stats.events_by_type[n >> 8];	// stats
+    }
 
-      // 2019.03.18 Go back to preserving KUTRACE_USERPID for eventtospan
+    uint64 event;
+    if (is_contextswitch(n)) {	// Context switch
+      has_arg = true;
+      // Change event to new process id + 64k
+      event = PidToEvent(arg);
+    } else {
+      // Anything else 0..64K-1
       event = n;
+    }
+
+    // 2019.03.18 Go back to preserving KUTRACE_USERPID for eventtospan
+    event = n;
 
  
-      // Module does
-      // delta_cycles = now - tb->prior_cycles;
-      // but records just the low 20 bits of now	
-      // We have to figure out here how to account for the low 20 bits wrapping:
-      // prior = ppp.f8938 now = nnn.d6f66 delta = 001.de62e
-      // prior + delta_lo = ppq.d6ff6 but (ppq.d6ff6 - ppp.f8938 fits in 20 bits, so would not have generated a tsdelta
-      // prior + delta = ppr.d6ff6
+    // Module does
+    // delta_cycles = now - tb->prior_cycles;
+    // but records just the low 20 bits of now	
+    // We have to figure out here how to account for the low 20 bits wrapping:
+    // prior = ppp.f8938 now = nnn.d6f66 delta = 001.de62e
+    // prior + delta_lo = ppq.d6ff6 but (ppq.d6ff6 - ppp.f8938 fits in 20 bits, so would not have generated a tsdelta
+    // prior + delta = ppr.d6ff6
  
 
 /*
@@ -1090,382 +1518,930 @@ int main (int argc, const char** argv) {
  * 
  */
 
-      // If TSDELTA entry, increment the prepend value.
-      // argall has the time difference between this entry and previous one,
-      // in units of timestamp ticks (10-20nsec).
-      // If time goes backward a little, difference will be large,  otherwise it will 
-      // be a small number of millions.
-      // A threshold of 2,000,000,000 is good for separating large, which we ignore
-      if (n == KUTRACE_TSDELTA) {
-        if (argall < kLargeTsdelta) {
-          // Increment time by delta
-          uint64 oldfull = (prepend | prior_t);	// Old prepend old t
-          uint64 newfull = oldfull + argall;
-
-          prepend = newfull & ~0xfffffLLU;
-          t =       newfull &  0xfffffLLU;
-          prior_t = t;
-        } else {
-          // Negative TSDELTA. Do unsigned subtraction.
-          uint64 oldfull = (prepend | prior_t);	// Old prepend old t
-          uint64 newfull = oldfull + (0xFFFFFFFF00000000LLU | argall); // sign extend arg
-
-          // Use newfull, but do not update prepend. Doing so would ... 
-          prepend = newfull & ~0xfffffLLU;
-          t =       newfull &  0xfffffLLU;
-          prior_t = t;
-        }
-        continue;	// Skip everything else about the TSDELTA event
-
+    // If TSDELTA entry, increment the prepend value.
+    // argall has the time difference between this entry and previous one,
+    // in units of timestamp ticks (10-20nsec).
+    // If time goes backward a little, difference will be large,  otherwise it will 
+    // be a small number of millions.
+    // A threshold of 2,000,000,000 is good for separating large, which we ignore
+    if (n == KUTRACE_TSDELTA) {
+      if (argall < kLargeTsdelta) {
+        // Increment time by delta
+        uint64 oldfull = (prepend | prior_t);	// Old prepend old t
+        uint64 newfull = oldfull + argall;
+
+        prepend = newfull & ~0xfffffLLU;
+        t =       newfull &  0xfffffLLU;
+        prior_t = t;
       } else {
-        // Increment the prepend if truncated time rolls over and not caused by a late store
-        if (Wrapped(prior_t, t) && !LateStore(prior_t, t)) {
-          prepend += 0x100000;
-        }
+        // Negative TSDELTA. Do unsigned subtraction.
+        uint64 oldfull = (prepend | prior_t);	// Old prepend old t
+        uint64 newfull = oldfull + (0xFFFFFFFF00000000LLU | argall); // sign extend arg
+
+        // Use newfull, but do not update prepend. Doing so would ... 
+        prepend = newfull & ~0xfffffLLU;
+        t =       newfull &  0xfffffLLU;
+        prior_t = t;
       }
+      continue;	// Skip everything else about the TSDELTA event
 
-      
-      // tfull is increments of cycles from the base minute for this trace
-      uint64 tfull = prepend | t;
-      prior_t = t;
+    } else {
+      // Increment the prepend if truncated time rolls over and not caused by a late store
+      if (Wrapped(prior_t, t) && !LateStore(prior_t, t)) {
+        prepend += 0x100000;
+      }
+    }
 
-      // nsec10 is increments of 10ns from the base minute.
-      // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
-      // this reaches 14,900,000,000 which means the 
-      // base minute + 149.000 000 00 seconds. More than 32 bits.
-      uint64 nsec10 = CyclesToNsec10(tfull, params);
-      uint64 duration = 0;
+    
+    // tfull is increments of cycles from the base minute for this trace
+    uint64 tfull = prepend | t;
+    prior_t = t;
+
+    // nsec10 is increments of 10ns from the base minute.
+    // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
+    // this reaches 14,900,000,000 which means the 
+    // base minute + 149.000 000 00 seconds. More than 32 bits.
+    uint64 nsec10 = CyclesToNsec10(tfull, d->params);
+    uint64 duration = 0;
+
+    if (has_rpcid(n)) {
+      // Working on this RPC until one with arg=0
+      has_arg = true;
+      // Defer switching to zero until after the OutputEvent
+      if (arg != 0) {cs->current_rpc = arg;}
+      else {deferred_rpcid0 = true;}
+    }
 
-      if (has_rpcid(n)) {
-        // Working on this RPC until one with arg=0
-        has_arg = true;
-        // Defer switching to zero until after the OutputEvent
-        if (arg != 0) {current_rpc[current_cpu] = arg;}
-        else {deferred_rpcid0 = true;}
+    // Pick out any name definitions 
+    if (is_namedef(n)) {
+      has_arg = true;
+      // We have a name or other variable-length entry
+      // Remap the raw numbering to unique ranges in names[]
+      uint64 nameinsert;
+      uint64 rpcid;
+      uint8 lglen8;
+      if (is_pidnamedef(n)) {
+        nameinsert = PidToEvent(arg); 	  // Processes 0..64K, idle fixup below
+      } else if (is_locknamedef(n)) {
+        nameinsert = arg | 0x20000;		  // Lock names
+      } else if (is_methodnamedef(n)) {
+        rpcid = arg & 0xffff;			  // RPC method names
+        lglen8 = arg_hi;	  		  //  may include TenLg msg len
+        nameinsert = rpcid | 0x30000;
+      } else if (is_kernelnamedef(n)) {
+        nameinsert = arg | 0x40000;		  // Kernel version
+      } else if (is_modelnamedef(n)) {
+        nameinsert = arg | 0x50000;		  // CPU model
+      } else if (is_hostnamedef(n)) {
+        nameinsert = arg | 0x60000;		  // CPU host name
+      } else if (is_queuenamedef(n)) {
+        nameinsert = arg | 0x70000;		  // Queue name
+      } else if (is_resnamedef(n)) {
+        nameinsert = arg | 0x80000;		  // Resource name
+      } else {
+        nameinsert = ((n & 0x00f) << 8) | arg;  // Syscall, etc. Include type of name
       }
 
-      // Pick out any name definitions 
-      if (is_namedef(n)) {
-        has_arg = true;
-        // We have a name or other variable-length entry
-        // Remap the raw numbering to unique ranges in names[]
-        uint64 nameinsert;
-        uint64 rpcid;
-        uint8 lglen8;
+      char tempstring[64];
+      int len = (n >> 4) & 0x00f;
+      if ((len < 1) || (8 < len)) {continue;}
+      // Ignore any timepair but keep the names
+      if (!is_timepair(n)) {
+        memset(tempstring, 0, 64);
+        memcpy(tempstring, &traceblock[i + 1], (len - 1) * 8);
+        
         if (is_pidnamedef(n)) {
-          nameinsert = PidToEvent(arg); 	  // Processes 0..64K, idle fixup below
-        } else if (is_locknamedef(n)) {
-          nameinsert = arg | 0x20000;		  // Lock names
-        } else if (is_methodnamedef(n)) {
-          rpcid = arg & 0xffff;			  // RPC method names
-          lglen8 = arg_hi;	  		  //  may include TenLg msg len
-          nameinsert = rpcid | 0x30000;
-        } else if (is_kernelnamedef(n)) {
-          nameinsert = arg | 0x40000;		  // Kernel version
-        } else if (is_modelnamedef(n)) {
-          nameinsert = arg | 0x50000;		  // CPU model
-        } else if (is_hostnamedef(n)) {
-          nameinsert = arg | 0x60000;		  // CPU host name
-        } else if (is_queuenamedef(n)) {
-          nameinsert = arg | 0x70000;		  // Queue name
-        } else if (is_resnamedef(n)) {
-          nameinsert = arg | 0x80000;		  // Resource name
-        } else {
-          nameinsert = ((n & 0x00f) << 8) | arg;  // Syscall, etc. Include type of name
+          // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
+          // Map all of these to pid 0 name -idle-, remembering them
+          FixupIdlePid(&arg, tempstring, d->idle_pids);
+          nameinsert = PidToEvent(arg); 	  // Processes 0..64K
         }
-
-        char tempstring[64];
-        int len = (n >> 4) & 0x00f;
-        if ((len < 1) || (8 < len)) {continue;}
-        // Ignore any timepair but keep the names
-        if (!is_timepair(n)) {
-          memset(tempstring, 0, 64);
-          memcpy(tempstring, &traceblock[i + 1], (len - 1) * 8);
-          
-          if (is_pidnamedef(n)) {
-            // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
-            // Map all of these to pid 0 name -idle-, remembering them
-            FixupIdlePid(&arg, tempstring, &idle_pids);
-            nameinsert = PidToEvent(arg); 	  // Processes 0..64K
-          }
-          
-          // Remember the name, except throw away the empty name
-          string name = string(tempstring);
-          if (is_modelnamedef(n)) {
-            is_low_res_ts = (name.find("u74-mc") != 0);
-          }
-          name = ReduceSpaces(name);
-          name = MakeSafeAscii(name);
-          if (!name.empty()) {
-            names[nameinsert] = name;
-            ////OutputName(stdout, nsec10, nameinsert, argall, name.c_str());
-            OutputName(stdout, nsec10, n, argall, name.c_str());
-          }
-          // Remember which event number is local_timer (or local_timer_vector) and which is -sched-
-          // (these vary in different historical traces)
-          if (memcmp(tempstring, "local_timer", 11) == 0) {
-            gTIMER_IRQ_EVENT = KUTRACE_IRQ | (arg & 0xffff);
+        
+        // Remember the name, except throw away the empty name
+        string name = string(tempstring);
+        if (is_modelnamedef(n) && d->define_names) {
+          is_low_res_ts = (name.find("u74-mc") != 0);
+        }
+        name = ReduceSpaces(name);
+        name = MakeSafeAscii(name);
+        if (!name.empty()) {
+          DefineName(d, nameinsert, entry_pos, name);
+          ////OutputName(stdout, nsec10, nameinsert, argall, name.c_str());
+          if (d->front_names) {OutputFrontName(stdout, nsec10, n, argall, name.c_str());}
+          if (!d->names_only) {PutName(out, nsec10, n, argall, name.c_str());}
+        }
+        // Remember which event number is local_timer (or local_timer_vector) and which is -sched-
+        // (these vary in different historical traces)
+        if ((memcmp(tempstring, "local_timer", 11) == 0) && d->define_names) {
+          gTIMER_IRQ_EVENT = KUTRACE_IRQ | (arg & 0xffff);
 //fprintf(stderr, "local_timer irq = %03x %d\n", gTIMER_IRQ_EVENT, gTIMER_IRQ_EVENT);
-          }
-          if (memcmp(tempstring, "-sched-", 7) == 0) {
-            gSCHED_EVENT = KUTRACE_SYSCALL64 | (kutrace_map_nr(arg & 0xffff));
+        }
+        if ((memcmp(tempstring, "-sched-", 7) == 0) && d->define_names) {
+          gSCHED_EVENT = KUTRACE_SYSCALL64 | (kutrace_map_nr(arg & 0xffff));
 //fprintf(stderr, "-sched- syscall = %03x %d\n", gSCHED_EVENT, gSCHED_EVENT);
-          }
         }
-        i += (len - 1);	// Skip over the rest of the name event
-        extra_word = true;
-        continue;
-      }
-      
-      if (is_cpu_description(n)) {	// Just pass it on to eventtospan
-        OutputEvent(stdout, nsec10, 1, event, current_cpu, 
-                    0, 0, argall, 0, 0, "");
       }
+      i += (len - 1);	// Skip over the rest of the name event
+      extra_word = true;
+      continue;
+    }
+    
+    if (d->names_only) {
+      // Step over the second word of a PC sample, just as below
+      if (!keep_just_names && is_pc_sample(n)) {++i;}
+      continue;
+    }
 
-      if (keep_just_names) {continue;}
+    if (is_cpu_description(n)) {	// Just pass it on to eventtospan
+      PutEvent(out, nsec10, 1, event, current_cpu, 
+               0, 0, argall, 0, 0, "");
+    }
 
-      //========================================================================
-      // Name definitions above skip this code, so do not affect lo/hi 
-      if (lo_timestamp > nsec10) {lo_timestamp = nsec10;}	// stats
-      if (hi_timestamp < nsec10) {hi_timestamp = nsec10;}	// stats
+    if (keep_just_names) {continue;}
 
-      // Look for new user-mode process id, pid
-      if (is_contextswitch(n)) {
-        has_arg = true;
-        arg = RemapIdlePid(arg, &idle_pids);
-        unique_pids.insert(arg);	// stats
-        if (current_pid[current_cpu] != arg) {++ctx_switches;}	// stats
-        current_pid[current_cpu] = arg;
-      }
+    //========================================================================
+    // Name definitions above skip this code, so do not affect lo/hi 
+    if (d->stats.lo_timestamp > nsec10) {d->stats.lo_timestamp = nsec10;}	// stats
+    if (d->stats.hi_timestamp < nsec10) {d->stats.hi_timestamp = nsec10;}	// stats
 
-      // Nothing else, so dump in decimal
-      // Here n is the original 12-bit event; event is (pid | 64K) if n is user-mode code
-      string name = string("");
+    // Look for new user-mode process id, pid
+    if (is_contextswitch(n)) {
+      has_arg = true;
+      arg = RemapIdlePid(arg, d->idle_pids);
+      d->stats.unique_pids.insert(arg);	// stats
+      if (cs->current_pid != arg) {++d->stats.ctx_switches;}	// stats
+      cs->current_pid = arg;
+    }
 
-      // Put in name of event
-      if (is_return(n)) {
-        uint64 call_event = event & ~0x0200;
-        if (names.find(call_event) != names.end()) {name.append("/" + names[call_event]);}
-      } else {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
-      }
+    // Nothing else, so dump in decimal
+    // Here n is the original 12-bit event; event is (pid | 64K) if n is user-mode code
+    string name = string("");
 
-      if (is_contextswitch(n)) {
-        has_arg = true;
-        uint64 target = PidToEvent(arg);
-        if (names.find(target) != names.end()) {name.append(names[target]);}
-        name = AppendNum(name, arg);
-     }
+    // Put in name of event
+    if (is_return(n)) {
+      uint64 call_event = event & ~0x0200;
+      const string* call_name = LookupName(d, call_event, entry_pos);
+      if (call_name != NULL) {name.append("/" + *call_name);}
+    } else {
+      const string* event_name = LookupName(d, event, entry_pos);
+      if (event_name != NULL) {name.append(*event_name);}
+    }
 
-      if (is_usermode(event)) {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
-        name = AppendNum(name, EventToPid(event));
-      }
+    if (is_contextswitch(n)) {
+      has_arg = true;
+      uint64 target = PidToEvent(arg);
+      const string* target_name = LookupName(d, target, entry_pos);
+      if (target_name != NULL) {name.append(*target_name);}
+      name = AppendNum(name, arg);
+   }
+
+    if (is_usermode(event)) {
+      const string* event_name = LookupName(d, event, entry_pos);
+      if (event_name != NULL) {name.append(*event_name);}
+      name = AppendNum(name, EventToPid(event));
+    }
 
-      // If this is an optimized call, pick out the duration and leave return value
-      // The ipc value for this is two 4-bit values:
-      //   low bits IPC before call, high bits IPC within call
-      if (is_opt_call(n, delta_t)) {
-        has_arg = true;
-        // Optimized call with delta_t and retval
-        duration = CyclesToNsec10(tfull + delta_t, params) - nsec10;
-        if (is_low_res_ts && (delta_t == 1)) {
-          duration = kDefaultLowResNsec10;
-        }
-        if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
-      } else {
-        retval = 0;
+    // If this is an optimized call, pick out the duration and leave return value
+    // The ipc value for this is two 4-bit values:
+    //   low bits IPC before call, high bits IPC within call
+    if (is_opt_call(n, delta_t)) {
+      has_arg = true;
+      // Optimized call with delta_t and retval
+      duration = CyclesToNsec10(tfull + delta_t, d->params) - nsec10;
+      if (is_low_res_ts && (delta_t == 1)) {
+        duration = kDefaultLowResNsec10;
       }
+      if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
+    } else {
+      retval = 0;
+    }
 
-      // Remember timer interrupt start time, for PC sample fixup below
-      if (is_timer_irq(n)) {
-          prior_timer_irq_nsec10[current_cpu] = nsec10;
-      }
+    // Remember timer interrupt start time, for PC sample fixup below
+    if (is_timer_irq(n)) {
+        cs->prior_timer_irq_nsec10 = nsec10;
+    }
 
-      // Pick off non-standard PC values here
-      //
-      // Either of two forms:
-      // (1) Possible future v4 with ts/event swapped
-      // +-----------+---+-----------------------------------------------+
-      // | event     |///|               PC                              |
-      // +-----------+---+-----------------------------------------------+
-      //      12       4                 48 
-      // (2) Current scaffolding
-      // +-------------------+-----------+---------------+-------+-------+
-      // | timestamp         | event     |    zeros      |      arg0     |
-      // +-------------------+-----------+---------------+-------+-------+
-      // |                               PC                              |
-      // +---------------------------------------------------------------+
-      //                                 64 
-      // Just deal with form (2) right now
-      //
-      // 2021.04.05 We now include the CPU frequency sample as arg0 in this entry if nonzero.
-      //   Extract it as a separate KUTRACE_PSTATE event.
-      //   Strictly speaking, the event number for PC_TEMP should be 0x121 to signify 
-      //   two words, but it is in fact just 0x101.
-      // 
-      if (is_pc_sample(n)) {
-        has_arg = true;
-        extra_word = true;
-        uint64 freq_mhz = arg;
-        uint64 pc_sample = traceblock[++i];	// Consume second word, the PC sample
-        // Change PC_TEMP to either kernel or user sample address
-        event = n = (pc_sample & 0x8000000000000000LLU) ? KUTRACE_PC_K : KUTRACE_PC_U;
-
-        // The PC sample is generated after the local_timer interrupt, but we really 
-        // want its sample time to be just before that interrupt. We move it back here.
-        if (prior_timer_irq_nsec10[current_cpu] != 0) {
-          nsec10 = prior_timer_irq_nsec10[current_cpu] - 1;	// 10 nsec before timer IRQ
-        }
-        // Put a hash of the PC name into arg, so HTML display can choose colors quickly
-        arg = (pc_sample >> 6) & 0xFFFF;	// Initial hash just uses PC bits <21:6>
+    // Pick off non-standard PC values here
+    //
+    // Either of two forms:
+    // (1) Possible future v4 with ts/event swapped
+    // +-----------+---+-----------------------------------------------+
+    // | event     |///|               PC                              |
+    // +-----------+---+-----------------------------------------------+
+    //      12       4                 48 
+    // (2) Current scaffolding
+    // +-------------------+-----------+---------------+-------+-------+
+    // | timestamp         | event     |    zeros      |      arg0     |
+    // +-------------------+-----------+---------------+-------+-------+
+    // |                               PC                              |
+    // +---------------------------------------------------------------+
+    //                                 64 
+    // Just deal with form (2) right now
+    //
+    // 2021.04.05 We now include the CPU frequency sample as arg0 in this entry if nonzero.
+    //   Extract it as a separate KUTRACE_PSTATE event.
+    //   Strictly speaking, the event number for PC_TEMP should be 0x121 to signify 
+    //   two words, but it is in fact just 0x101.
+    // 
+    if (is_pc_sample(n)) {
+      has_arg = true;
+      extra_word = true;
+      uint64 freq_mhz = arg;
+      uint64 pc_sample = traceblock[++i];	// Consume second word, the PC sample
+      // Change PC_TEMP to either kernel or user sample address
+      event = n = (pc_sample & 0x8000000000000000LLU) ? KUTRACE_PC_K : KUTRACE_PC_U;
+
+      // The PC sample is generated after the local_timer interrupt, but we really 
+      // want its sample time to be just before that interrupt. We move it back here.
+      if (cs->prior_timer_irq_nsec10 != 0) {
+        nsec10 = cs->prior_timer_irq_nsec10 - 1;	// 10 nsec before timer IRQ
+      }
+      // Put a hash of the PC name into arg, so HTML display can choose colors quickly
+      arg = (pc_sample >> 6) & 0xFFFF;	// Initial hash just uses PC bits <21:6>
 						// This is used for drawing color
 						// If addrtoline is used later, reset arg
-        retval = 0;
-        ipc = 0; 
-        char temp_hex[24];
-        sprintf(temp_hex, "PC=%012llx", pc_sample);	// Normally 48-bit PC
-        name = string(temp_hex); 
-
-        // Output the frequency event first if nonzero
-        if (0 < freq_mhz) { 
-          OutputEvent(stdout, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
-                      current_pid[current_cpu], current_rpc[current_cpu], 
-                      freq_mhz, 0, 0, "-freq-");
-          ++event_count;	// stats
-        }
+      retval = 0;
+      ipc = 0; 
+      char temp_hex[24];
+      sprintf(temp_hex, "PC=%012llx", pc_sample);	// Normally 48-bit PC
+      name = string(temp_hex); 
+
+      // Output the frequency event first if nonzero
+      if (0 < freq_mhz) { 
+        PutEvent(out, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
+                 cs->current_pid, cs->current_rpc, 
+                 freq_mhz, 0, 0, "-freq-");
+        ++d->stats.event_count;	// stats
       }
+    }
 
-      // If this is a special event marker, keep the name and arg
-      if (is_special(n)) {
-        has_arg = true;
-        name.append(string(kSpecialName[n & 0x001f]));
-        if (has_rpcid(n)) {
-          name = AppendNum(names[arg | 0x30000], arg);	// method.rpcid
-        } else if (is_lock(n)) {
-          name = string(kSpecialName[n & 0x001f]) + names[arg | 0x20000];  // try_lockname etc.
-        } else if (is_raw_pkt_hash(n)  || is_user_msg_hash(n)) {
-          uint64 hash16 = ((argall >> 16) ^ argall) & 0xffffLLU;	// HTML shows this 16-bit hash
-          name = AppendHexNum(name, hash16);
-        } else if (n == KUTRACE_RUNNABLE) {
-          // Include which PID is being made runnable, from arg
-          name = AppendNum(name, arg);
-        }
-        if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
+    // If this is a special event marker, keep the name and arg
+    if (is_special(n)) {
+      has_arg = true;
+      name.append(string(kSpecialName[n & 0x001f]));
+      if (has_rpcid(n)) {
+        name = AppendNum(NameOrEmpty(d, arg | 0x30000, entry_pos), arg);	// method.rpcid
+      } else if (is_lock(n)) {
+        name = string(kSpecialName[n & 0x001f]) + NameOrEmpty(d, arg | 0x20000, entry_pos);  // try_lockname etc.
+      } else if (is_raw_pkt_hash(n)  || is_user_msg_hash(n)) {
+        uint64 hash16 = ((argall >> 16) ^ argall) & 0xffffLLU;	// HTML shows this 16-bit hash
+        name = AppendHexNum(name, hash16);
+      } else if (n == KUTRACE_RUNNABLE) {
+        // Include which PID is being made runnable, from arg
+        name = AppendNum(name, arg);
       }
+      if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
+    }
 
-      // If this is an unoptimized return, move the arg value to retval
-      if (is_return(n)) {
-        has_arg = true;
-        retval = arg;
-        arg = 0;
-      }
+    // If this is an unoptimized return, move the arg value to retval
+    if (is_return(n)) {
+      has_arg = true;
+      retval = arg;
+      arg = 0;
+    }
 
-      // If this is a call to an irq bottom half routine, name it BH:something
-      if (is_bottom_half(n)) {
-        has_arg = true;
-        name.append(":");
-        name.append(string(soft_irq_name[arg & 0x000f]));
-      }
+    // If this is a call to an irq bottom half routine, name it BH:something
+    if (is_bottom_half(n)) {
+      has_arg = true;
+      name.append(":");
+      name.append(string(soft_irq_name[arg & 0x000f]));
+    }
 
-      // If this is a packet rx or tx, remember the time
-      // Step (1) of RPC-to-packet correlation
-      // NOTE: the hash stored in KUTRACE_RX_PKT KUTRACE_TX_PKT is 32 bits
-      // Convention: hash16 is always shown in hex caps. Other numbers in decimal
-      if (is_raw_pkt_hash(n) || is_user_msg_hash(n)) {
-        arg = argall;	// Retain all 32 bits in output
-      }
+    // If this is a packet rx or tx, remember the time
+    // Step (1) of RPC-to-packet correlation
+    // NOTE: the hash stored in KUTRACE_RX_PKT KUTRACE_TX_PKT is 32 bits
+    // Convention: hash16 is always shown in hex caps. Other numbers in decimal
+    if (is_raw_pkt_hash(n) || is_user_msg_hash(n)) {
+      arg = argall;	// Retain all 32 bits in output
+    }
+
+    // If this packet is an RPC processing start, look to create the message span
+    // arg is the rpcid and arg_hi is the 16-bit packet-beginning hash
+    // Step (3) of RPC-to-packet correlation
+    if (is_rpc_msg(n) && (arg != 0)) {
+      arg = argall;	// Retain all 32 bits in output
+    }
 
-      // If this packet is an RPC processing start, look to create the message span
-      // arg is the rpcid and arg_hi is the 16-bit packet-beginning hash
-      // Step (3) of RPC-to-packet correlation
-      if (is_rpc_msg(n) && (arg != 0)) {
-        arg = argall;	// Retain all 32 bits in output
+    // MARK_A,B,C arg is six base-40 chars NUL, A_Z, 0-9, . - /
+    // MARK_D     arg is unsigned int
+    // +-------------------+-----------+-------------------------------+
+    // | timestamp         | event     |              arg              |
+    // +-------------------+-----------+-------------------------------+
+    //          20              12                    32 
+    if (is_mark_abc(n)) {
+      has_arg = true;
+      // Include the marker label string, from all 32 bits af argument
+      arg = argall;	// Retain all 32 bits in output
+      name += "=";
+      char temp[8];
+      name += Base40ToChar(arg, temp);
+    }
+
+    // Debug output. Raw 64-bit event in hex
+    if (hexevent) {
+      fprintf(stdout, "%05llx.%03llx ", 
+        (traceblock[entry_i] >> 44) & 0xFFFFF, 
+        (traceblock[entry_i] >> 32) & 0xFFF);
+      if (has_arg) {
+        fprintf(stdout, " %04llx%04llx ", 
+          (traceblock[entry_i] >> 16) & 0xFFFF, 
+          (traceblock[entry_i] >> 0) & 0xFFFF);
+      } else {
+        fprintf(stdout, "          "); 
       }
+    }
 
-      // MARK_A,B,C arg is six base-40 chars NUL, A_Z, 0-9, . - /
-      // MARK_D     arg is unsigned int
-      // +-------------------+-----------+-------------------------------+
-      // | timestamp         | event     |              arg              |
-      // +-------------------+-----------+-------------------------------+
-      //          20              12                    32 
-      if (is_mark_abc(n)) {
-        has_arg = true;
-        // Include the marker label string, from all 32 bits af argument
-        arg = argall;	// Retain all 32 bits in output
-        name += "=";
-        char temp[8];
-        name += Base40ToChar(arg, temp);
+    // If we have an empty name in the first 4K event numbers, create one
+    if (name.empty() && (event <= 0xFFF) && (0 <= event)) {
+      char temp[16];
+      int nummask = (0x800 <= event) ? 0x1FF : 0x0FF;
+      sprintf(temp, "%s%lld", missingeventname[event >> 8], event & nummask);
+      // If event is syscall/ret 511 and no name, then we have a trace file
+      // using 511 for -sched- mismatched with a more recent kutrace_control_names.h
+      // Fix them right here
+      if (event == 0x9ff) {strcpy(temp, "-sched-");} 
+      if (event == 0xdff) {strcpy(temp, "-sched-");} 
+      if (event == 0xbff) {strcpy(temp, "/-sched-");} 
+      if (event == 0xfff) {strcpy(temp, "/-sched-");} 
+      name = string(temp);
+    }
+
+    // Output the trace event
+    // Output format:
+    // time dur event cpu  pid rpc  arg retval IPC name(event)
+    PutEvent(out, nsec10, duration, event, current_cpu, 
+             cs->current_pid, cs->current_rpc, 
+             arg, retval, ipc, name.c_str());
+    // Update some statistics
+    ++d->stats.event_count;	// stats
+
+    if (hexevent && extra_word) {
+      fprintf(stdout, "   %16llx\n", traceblock[entry_i + 1]); 
+    }
+
+    // Do deferred switch to rpcid = 0
+    if (deferred_rpcid0) {cs->current_rpc = 0;}
+
+  }
+  //------------------------------------------------------------------------//
+  // End inner loop over eight-byte entries                                 //
+  //------------------------------------------------------------------------//
+}
+
+// Shared by the decoding threads. Each claims whole CPU chains until none are left
+typedef struct {
+  vector<RawBlock>* blocks;
+  vector<vector<int> > chains;		// Block numbers of each CPU, in file order
+  vector<DecodedBlock>* decoded;	// Indexed by block number
+  std::atomic<int> next_chain;
+} ChainWork;
+
+void DecodeChains(ChainWork* work, Decoder* d) {
+  for (;;) {
+    int k = work->next_chain++;
+    if (k >= work->chains.size()) {break;}
+    const vector<int>& chain = work->chains[k];
+    for (int j = 0; j < chain.size(); ++j) {
+      int b = chain[j];
+      DecodedBlock* out = &(*work->decoded)[b];
+      DecodeBlock((*work->blocks)[b].traceblock, (*work->blocks)[b].ipcblock, b, d, out);
+      if (out->f != NULL) {
+        fclose(out->f);		// Sets text and textlen
+        out->f = NULL;
       }
+    }
+  }
+}
 
-      // Debug output. Raw 64-bit event in hex
-      if (hexevent) {
-        fprintf(stdout, "%05llx.%03llx ", 
-          (traceblock[entry_i] >> 44) & 0xFFFFF, 
-          (traceblock[entry_i] >> 32) & 0xFFF);
-        if (has_arg) {
-          fprintf(stdout, " %04llx%04llx ", 
-            (traceblock[entry_i] >> 16) & 0xFFFF, 
-            (traceblock[entry_i] >> 0) & 0xFFFF);
-        } else {
-          fprintf(stdout, "          "); 
-        }
+// Serial pre-pass to record all the names, through block last_sel. Names from
+// blocks left out reach eventtospan3 only as the ts = -1 copies
+void PrepassNames(const vector<RawBlock>& blocks, const vector<bool>& block_ok,
+                  int last_sel, bool front_names, Decoder* serial) {
+  Decoder prepass = *serial;
+  vector<CpuState> scratch_state;
+  SizeCpuState(serial->cpu_state->size(), &scratch_state);
+  prepass.names_only = true;
+  prepass.front_names = front_names;
+  prepass.cpu_state = &scratch_state;
+  for (int b = 0; b <= last_sel; ++b) {
+    if (block_ok[b]) {DecodeBlock(blocks[b].traceblock, blocks[b].ipcblock, b, &prepass, NULL);}
+  }
+  // The names now all go out ahead of the first event
+  if (front_names) {front_names_queued = true;}
+}
+
+// Last block picked by block_sel, or the last block if none
+int LastSelected(const vector<RawBlock>& blocks, const vector<bool>* block_sel) {
+  int last_sel = blocks.size() - 1;
+  if (block_sel != NULL) {
+    while ((0 < last_sel) && !(*block_sel)[last_sel]) {--last_sel;}
+  }
+  return last_sel;
+}
+
+// Decode all the blocks read so far, with nthreads workers, then send the output
+// in block order. block_ok is false for blocks that failed the sanity checks.
+// block_sel, if not NULL, picks the blocks to decode and send; the rest are
+// looked at only for their names, and only up to the last block picked.
+void DecodeParallel(vector<RawBlock>* blocks, const vector<bool>& block_ok,
+                    const vector<bool>* block_sel, int nthreads,
+                    Decoder* serial, string* first_datetime) {
+  PrepassNames(*blocks, block_ok, LastSelected(*blocks, block_sel), block_sel != NULL, serial);
+
+  // Group the blocks by CPU
+  ChainWork work;
+  work.blocks = blocks;
+  work.next_chain = 0;
+  vector<int> chain_of_cpu(serial->cpu_state->size(), -1);
+  vector<DecodedBlock> decoded(blocks->size());
+  work.decoded = &decoded;
+  for (int b = 0; b < blocks->size(); ++b) {
+    decoded[b].f = NULL;
+    decoded[b].text = NULL;
+    decoded[b].textlen = 0;
+    if (!block_ok[b]) {continue;}
+    if ((block_sel != NULL) && !(*block_sel)[b]) {continue;}
+    int cpu = (*blocks)[b].traceblock[0] >> 56;
+    if (chain_of_cpu[cpu] < 0) {
+      chain_of_cpu[cpu] = work.chains.size();
+      work.chains.push_back(vector<int>());
+    }
+    work.chains[chain_of_cpu[cpu]].push_back(b);
+    // Plain Ascii output is formatted by the workers
+    if (!binary_out) {
+      decoded[b].f = open_memstream(&decoded[b].text, &decoded[b].textlen);
+    }
+  }
+
+  // Each worker has its own statistics and its own copy of the idle pids
+  if (nthreads > work.chains.size()) {nthreads = work.chains.size();}
+  if (nthreads < 1) {nthreads = 1;}
+  vector<Decoder> decoders(nthreads, *serial);
+  vector<U64set> idle_pids(nthreads, *serial->idle_pids);
+  vector<std::thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    decoders[t].define_names = false;
+    decoders[t].idle_pids = &idle_pids[t];
+    InitDecodeStats(&decoders[t].stats);
+    threads.push_back(std::thread(DecodeChains, &work, &decoders[t]));
+  }
+  for (int t = 0; t < nthreads; ++t) {
+    threads[t].join();
+    AddDecodeStats(decoders[t].stats, &serial->stats);
+  }
+
+  // Everything goes out in the original block order
+  for (int b = 0; b < blocks->size(); ++b) {
+    if ((block_sel != NULL) && !(*block_sel)[b]) {
+      delete[] (*blocks)[b].copy;
+      continue;
+    }
+    const uint64* traceblock = (*blocks)[b].traceblock;
+    OutputBlockComments(traceblock, b, first_datetime);
+    if (block_ok[b]) {SendDecoded(&decoded[b]);}
+    delete[] (*blocks)[b].copy;
+  }
+  blocks->clear();
+}
+
+// Wraparound chain order: by each block's starting cycle count
+struct BlockStartLess {
+  const vector<RawBlock>* blocks;
+  bool operator()(int a, int b) const {
+    return ((*blocks)[a].traceblock[0] & 0x00fffffffffffffful) <
+           ((*blocks)[b].traceblock[0] & 0x00fffffffffffffful);
+  }
+};
+
+// -sorted: decode one block at a time on the CPU furthest behind, sending
+// everything before the low-water mark after each. Each block starts from
+// the CPU state that its predecessor in the file left. When wraparound order
+// gets there first, the skipped predecessors are replayed with their output
+// dropped, and decoded again for real in their turn.
+void DecodeSorted(vector<RawBlock>* blocks, const vector<bool>& block_ok,
+                  const vector<bool>* block_sel,
+                  Decoder* serial, string* first_datetime) {
+  int nblocks = blocks->size();
+  PrepassNames(*blocks, block_ok, LastSelected(*blocks, block_sel), true, serial);
+  for (int b = 0; b < nblocks; ++b) {
+    if ((block_sel != NULL) && !(*block_sel)[b]) {continue;}
+    OutputBlockComments((*blocks)[b].traceblock, b, first_datetime);
+  }
+
+  // Each CPU's chain of blocks, and each block's predecessor in file order
+  int ncpus = serial->cpu_state->size();
+  vector<vector<int> > chains(ncpus);
+  vector<int> pred(nblocks, -1);
+  for (int b = 0; b < nblocks; ++b) {
+    if (!block_ok[b]) {continue;}
+    if ((block_sel != NULL) && !(*block_sel)[b]) {continue;}
+    int cpu = (*blocks)[b].traceblock[0] >> 56;
+    if (!chains[cpu].empty()) {pred[b] = chains[cpu].back();}
+    chains[cpu].push_back(b);
+  }
+  if (HasWraparound(serial->first_flags)) {
+    BlockStartLess less;
+    less.blocks = blocks;
+    for (int cpu = 0; cpu < ncpus; ++cpu) {
+      std::stable_sort(chains[cpu].begin(), chains[cpu].end(), less);
+    }
+  }
+
+  Decoder d = *serial;
+  d.define_names = false;
+  InitDecodeStats(&d.stats);
+  Decoder replay = d;		// Its statistics are dropped
+  vector<CpuState>& cpu_state = *serial->cpu_state;
+  vector<CpuState> initial_state = cpu_state;
+  vector<CpuState> end_state(nblocks);
+  vector<bool> have_end(nblocks, false);
+
+  if (reorder.size() < ncpus) {reorder.resize(ncpus);}
+  const int64 kNever = 0x7FFFFFFFFFFFFFFFLL;
+  vector<int> next(ncpus, 0);			// Next in each chain
+  vector<int64> behind(ncpus, -kNever);		// No later event of the CPU is earlier
+  for (;;) {
+    int cpu = -1;
+    for (int c = 0; c < ncpus; ++c) {
+      if (next[c] == chains[c].size()) {continue;}
+      if ((cpu < 0) || (behind[c] < behind[cpu])) {cpu = c;}
+    }
+    if (cpu < 0) {break;}
+    int b = chains[cpu][next[cpu]++];
+
+    // Start from where the predecessor left off, replaying it first if need be
+    vector<int> skipped;
+    int p = pred[b];
+    while ((0 <= p) && !have_end[p]) {skipped.push_back(p); p = pred[p];}
+    cpu_state[cpu] = (p < 0) ? initial_state[cpu] : end_state[p];
+    for (int k = skipped.size() - 1; 0 <= k; --k) {
+      int s = skipped[k];
+      DecodedBlock dropped;
+      dropped.f = NULL;
+      dropped.text = NULL;
+      dropped.textlen = 0;
+      DecodeBlock((*blocks)[s].traceblock, (*blocks)[s].ipcblock, s, &replay, &dropped);
+      end_state[s] = cpu_state[cpu];
+      have_end[s] = true;
+    }
+
+    reorder_cpu = cpu;
+    reorder_earliest = kNever;
+    DecodeBlock((*blocks)[b].traceblock, (*blocks)[b].ipcblock, b, &d, NULL);
+    end_state[b] = cpu_state[cpu];
+    have_end[b] = true;
+
+    // PC samples still to come can be moved back to the last timer interrupt
+    int64 bound = (reorder_earliest < kNever) ? reorder_earliest : behind[cpu];
+    uint64 irq = cpu_state[cpu].prior_timer_irq_nsec10;
+    if ((irq != 0) && ((int64)irq - 1 < bound)) {bound = (int64)irq - 1;}
+    behind[cpu] = (next[cpu] < chains[cpu].size()) ? bound : kNever;
+
+    int64 low_water = kNever;
+    for (int c = 0; c < ncpus; ++c) {
+      if (behind[c] < low_water) {low_water = behind[c];}
+    }
+    FlushReorder(stdout, low_water);
+  }
+  AddDecodeStats(d.stats, &serial->stats);
+
+  for (int b = 0; b < nblocks; ++b) {delete[] (*blocks)[b].copy;}
+  blocks->clear();
+}
+
+// -start/-stop: pick the blocks whose events overlap start10..stop10, in
+// multiples of 10ns, plus block 0 and the lead blocks just before the first
+// one picked on each CPU. Those rebuild each CPU's running PID, RPC, and
+// call stack before the window opens
+void SelectBlocks(const BlockIndex& index, CyclesToUsecParams& params,
+                  int64 start10, int64 stop10, int lead, vector<bool>* block_sel) {
+  int nblocks = index.blocks.size();
+  block_sel->assign(nblocks, false);
+  if (nblocks == 0) {return;}
+  (*block_sel)[0] = true;
+  map<int, vector<int> > chains;	// Block numbers of each CPU, in file order
+  for (int b = 1; b < nblocks; ++b) {
+    const BlockIndexEntry& entry = index.blocks[b];
+    int64 first10 = CyclesToNsec10(entry.first_cycles, params);
+    int64 last10 = CyclesToNsec10(entry.last_cycles, params);
+    if ((start10 <= last10) && (first10 <= stop10)) {(*block_sel)[b] = true;}
+    chains[entry.cpu].push_back(b);
+  }
+  for (map<int, vector<int> >::const_iterator it = chains.begin(); it != chains.end(); ++it) {
+    const vector<int>& chain = it->second;
+    for (int j = 0; j < chain.size(); ++j) {
+      if (!(*block_sel)[chain[j]]) {continue;}
+      for (int k = (j < lead) ? 0 : (j - lead); k < j; ++k) {(*block_sel)[chain[k]] = true;}
+      break;
+    }
+  }
+}
+
+//
+// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n] [-bin] [-sorted] [-threads n]
+//                   [-start sec] [-stop sec] [-lead n]
+//   -bin writes the packed binary form from event_bin.h instead of Ascii.
+//        It needs no sort -n before eventtospan3. -v and -h are ignored.
+//   -sorted writes events already in LC_ALL=C sort -n order, so no sort -n
+//        is needed. -v and -h are ignored.
+//   -threads n decodes each CPU's blocks on one of n threads. The whole trace
+//        is read into memory first. Output is identical. -v and -h force n = 1.
+//        -sorted decodes on one thread, a block at a time, to bound its memory.
+//   -start sec and -stop sec decode only the blocks with events in that time
+//        window, in seconds as in the span JSON, using <trace file>.idx from
+//        DoDump and building it if missing. -lead n more blocks of each CPU,
+//        default 1, come first to rebuild its state. Events near the window
+//        edges still come out; spantotrim trims them.
+//
+bool RawToEvent(const RawToEventArgs& args, EventBinWriter* w) {
+  // Some statistics
+  uint64 base_usec_timestamp;
+  U64set unique_cpus;
+  U64set idle_pids;
+
+  int maxblock = args.maxblock;
+  int nthreads = args.nthreads;
+  double start_sec = args.start_sec;
+  double stop_sec = args.stop_sec;
+  int lead = args.lead;
+  uint64 current_cpu = 0;
+
+  vector<CpuState> cpu_state;		// Grows to the largest CPU number seen
+  NameHistory names;			// Name keyed by PID#, RPC# etc. with high type nibble
+
+  // Start timepair is set by DoInit
+  // Stop timepair is set by DoOff
+  // If start_counts is zero, we got here directly without calling DoInit, 
+  // which was done in some earlier run of this program. In that case, go 
+  // find the start pair as the first real trace entry in the first trace block.
+  Decoder decoder;
+  CyclesToUsecParams& params = decoder.params;
+  decoder.names = &names;
+  decoder.define_names = true;
+  decoder.names_only = false;
+  decoder.front_names = false;
+  decoder.idle_pids = &idle_pids;
+  decoder.cpu_state = &cpu_state;
+  decoder.has_names = NULL;
+  InitDecodeStats(&decoder.stats);
+
+  // Events are 0..64K-1 for everything except context switch.
+  // Context switch events are 0x10000 + pid
+  // Initialize idle process name, pid 0
+  DefineName(&decoder, 0x10000, 0, string(kIdleName));
+
+  verbose = args.verbose;
+  hexevent = args.hexevent;
+  binary_out = args.binary_out;
+  sorted_out = args.sorted_out;
+  bin_writer = w;
+  bool windowed = (0.0 <= start_sec) || (0.0 <= stop_sec);
+  if (start_sec < 0.0) {start_sec = 0.0;}
+  if (stop_sec < 0.0) {stop_sec = 999.0;}
+
+  // For converting cycle counts to multiples of 100ns
+  double m = kDefaultSlope;
+
+  // Debug output would be mixed into the binary stream or reordered events
+  if (binary_out || sorted_out) {
+    verbose = false;
+    hexevent = false;
+  }
+  // Debug output comes out as each block is decoded
+  if (verbose || hexevent) {nthreads = 1;}
+  // -sorted always reads the whole trace first, so that the pre-pass can put
+  // every ts = -1 name ahead of the first event. So does -start/-stop, to
+  // pick the blocks before decoding any
+  bool parallel = (nthreads > 1) || sorted_out || windowed;
+  vector<RawBlock> blocks;		// If parallel
+  vector<bool> block_ok;
+
+  // The trace file is read in place if possible, else from stdin
+  const char* fname = args.fname;
+  TraceReader reader;
+  if (!OpenTraceReader(fname, &reader)) {
+    fprintf(stderr, "rawtoevent: %s did not open\n", (fname == NULL) ? "stdin" : fname);
+    return false;
+  }
+
+  int blocknumber = 0;
+  uint64 base_minute_usec, base_minute_cycle, base_minute_shift;
+
+  // -start/-stop use the block index, built here as we go if there is no
+  // up-to-date one next to the trace
+  BlockIndex index;
+  string index_name;
+  bool build_index = false;
+  uint64 block_offset = 0;
+  if (windowed) {
+    struct stat st;
+    index.trace_bytes = 0;
+    if ((fname != NULL) && (stat(fname, &st) == 0)) {
+      index_name = string(fname) + ".idx";
+      uint64 trace_bytes = st.st_size;
+      if (!ReadBlockIndex(index_name.c_str(), &index) || (index.trace_bytes != trace_bytes)) {
+        index.blocks.clear();
+        index.trace_bytes = trace_bytes;
+        build_index = true;
       }
+    } else {
+      build_index = true;
+    }
+  }
+
+  // Need this to sort in front of allthe timestamps
+  if (binary_out) {
+    OutputBinMeta(kEvbVersion, kRawVersionNumber, 0, 0, NULL);
+    if (sorted_out) {OutputBinMeta(kEvbSorted, 0, 0, 0, NULL);}
+  } else {
+    fprintf(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
+  }
+  // Binary output sends just the # [1] date_time that sorts first
+  string first_datetime;
+  uint8 all_flags = 0;	// They should all be the same
+  uint8& first_flags = decoder.first_flags;	// Just first block has tracefile version number
+
 
-      // If we have an empty name in the first 4K event numbers, create one
-      if (name.empty() && (event <= 0xFFF) && (0 <= event)) {
-        char temp[16];
-        int nummask = (0x800 <= event) ? 0x1FF : 0x0FF;
-        sprintf(temp, "%s%lld", missingeventname[event >> 8], event & nummask);
-        // If event is syscall/ret 511 and no name, then we have a trace file
-        // using 511 for -sched- mismatched with a more recent kutrace_control_names.h
-        // Fix them right here
-        if (event == 0x9ff) {strcpy(temp, "-sched-");} 
-        if (event == 0xdff) {strcpy(temp, "-sched-");} 
-        if (event == 0xbff) {strcpy(temp, "/-sched-");} 
-        if (event == 0xfff) {strcpy(temp, "/-sched-");} 
-        name = string(temp);
+  //--------------------------------------------------------------------------//
+  // Outer loop over blocks                                                   //
+  //--------------------------------------------------------------------------//
+  const uint64* traceblock;
+  size_t len;
+  while ((traceblock = NextTraceBlock(&reader, &len)) != NULL) {
+    if (blocknumber >= maxblock) {break;}
+    const uint8* ipcblock = kNoIpc;		// Default if no IPC data
+
+    if (!parallel) {OutputBlockComments(traceblock, blocknumber, &first_datetime);}
+
+    if (verbose || hexevent) {
+       fprintf(stdout, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
+       fprintf(stdout, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
+    }
+//   +-------+-----------------------+-------------------------------+
+//   | cpu#  |                  cycle counter                        | 0 module
+//   +-------+-----------------------+-------------------------------+
+//   | flags |                  gettimeofday                         | 1 DoDump
+//   +-------+-----------------------+-------------------------------+
+
+    // Pick out CPU number for this traceblock
+    current_cpu = traceblock[0] >> 56;
+    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+
+    // traceblock[1] has flags in top byte. 
+    uint8 flags = traceblock[1] >> 56;
+    uint64 gtod = traceblock[1] & 0x00fffffffffffffful;
+
+    bool fail = false;
+    // No constraints on CPU number; per-CPU state grows to fit
+    // No constraints on base_cycle
+    // No constraints on flags
+    if (usec_per_100_years <= gtod) {
+      fprintf(stderr, "rawtoevent FAIL: block[%d] gettimeofday crazy large %016llx\n", blocknumber, gtod);
+      fail = true;
+    }
+  
+
+    all_flags |= flags;
+    bool this_block_has_ipc = (HasIPC(flags));
+
+    // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
+    if (this_block_has_ipc) {
+      // Extract 8KB IPC block
+      ipcblock = NextIpcBlock(&reader, &len);
+      if (ipcblock == NULL) {ipcblock = kNoIpc;}
+    }
+
+// WRAPAROUND PROBLEM:
+// We pick base_minute_usec here in block 0, but it can be
+// long before the real wrapped trace entries in blocks 1..N
+// Our downstream display does badly with seconds much over 120...
+//
+// We would like the base_minute_usec to be set by the first real entry in block 1 instead...
+// Can still use paramaters here for basic time conversion. 
+// Not much issue with overflow, I think.
+//
+
+    // If very first block, pick out time conversion parameters
+    int first_real_entry = 2;
+    bool very_first_block = (blocknumber == 0);
+    if (very_first_block) {
+      first_real_entry = 8;
+      first_flags = flags;
+      if (handle_very_first_block(traceblock, &base_usec_timestamp, &params)) {
+        CloseTraceReader(&reader);
+        return false;
       }
+    }
 
-      // Output the trace event
-      // Output format:
-      // time dur event cpu  pid rpc  arg retval IPC name(event)
-      OutputEvent(stdout, nsec10, duration, event, current_cpu, 
-                  current_pid[current_cpu], current_rpc[current_cpu], 
-                  arg, retval, ipc, name.c_str());
-      // Update some statistics
-      ++event_count;	// stats
-
-      if (hexevent && extra_word) {
-        fprintf(stdout, "   %16llx\n", traceblock[entry_i + 1]); 
+    if (build_index) {AddBlockIndex(traceblock, block_offset, first_flags, &index);}
+    block_offset += kTraceBlockBytes + (this_block_has_ipc ? kIpcBlockBytes : 0);
+
+    // Parallel decoding keeps everything for later, even the failed blocks' comments
+    if (parallel) {
+      RawBlock rawblock;
+      rawblock.traceblock = traceblock;
+      rawblock.ipcblock = ipcblock;
+      rawblock.copy = NULL;
+      if (!IsMappedTrace(&reader)) {
+        // Streaming reuses its buffers
+        rawblock.copy = new uint8[kTraceBlockBytes + kIpcBlockBytes];
+        memcpy(rawblock.copy, traceblock, kTraceBlockBytes);
+        memcpy(rawblock.copy + kTraceBlockBytes, ipcblock, kIpcBlockBytes);
+        rawblock.traceblock = reinterpret_cast<const uint64*>(rawblock.copy);
+        rawblock.ipcblock = rawblock.copy + kTraceBlockBytes;
       }
+      blocks.push_back(rawblock);
+      block_ok.push_back(!fail);
+    }
 
-      // Do deferred switch to rpcid = 0
-      if (deferred_rpcid0) {current_rpc[current_cpu] = 0;}
+    if (fail) {
+      fprintf(stderr, "rawtoevent **** FAIL -- skipping block[%d] ****\n", blocknumber);
+      fprintf(stderr, "     %016llx %016llx\n",traceblock[0], traceblock[1]);
+      for (int i = 0; i < 16; ++i) {fprintf(stderr, "  [%d] %016llx\n", i, traceblock[i]);}
+      ++blocknumber;
+      continue;
+    }
 
+    // Pick out CPU number for this traceblock
+    current_cpu = traceblock[0] >> 56;
+    unique_cpus.insert(current_cpu);	// stats
+    SizeCpuState(current_cpu + 1, &cpu_state);
+    if (parallel) {
+      ++blocknumber;
+      continue;
     }
-    //------------------------------------------------------------------------//
-    // End inner loop over eight-byte entries                                 //
-    //------------------------------------------------------------------------//
 
+    DecodeBlock(traceblock, ipcblock, blocknumber, &decoder, NULL);
     ++blocknumber;
-
   }	// while (fread...
   //--------------------------------------------------------------------------//
   // End outer loop over blocks                                               //
   //--------------------------------------------------------------------------//
 
 
-  fclose(f);
+  if (windowed) {
+    if (build_index && !index_name.empty() && (blocknumber < maxblock)) {
+      if (WriteBlockIndex(index_name.c_str(), index)) {
+        fprintf(stderr, "rawtoevent: %s written\n", index_name.c_str());
+      }
+    }
+    // -maxblock stops short of the end of the trace
+    if (!build_index && (blocks.size() < index.blocks.size())) {index.blocks.resize(blocks.size());}
+    if (index.blocks.size() != blocks.size()) {
+      fprintf(stderr, "rawtoevent: block index does not match the trace; decoding it all\n");
+      windowed = false;
+    }
+  }
+  if (windowed) {
+    vector<bool> block_sel;
+    vector<bool> has_names(index.blocks.size());
+    int nsel = 0;
+    SelectBlocks(index, params, (int64)(start_sec * 100000000.0),
+                 (int64)(stop_sec * 100000000.0), lead, &block_sel);
+    for (int b = 0; b < index.blocks.size(); ++b) {
+      has_names[b] = (index.blocks[b].name_count != 0);
+      if (block_sel[b]) {++nsel;}
+    }
+    fprintf(stderr, "rawtoevent: decoding %d of %d blocks\n", nsel, (int)blocks.size());
+    decoder.has_names = &has_names;
+    if (sorted_out) {
+      DecodeSorted(&blocks, block_ok, &block_sel, &decoder, &first_datetime);
+    } else {
+      DecodeParallel(&blocks, block_ok, &block_sel, nthreads, &decoder, &first_datetime);
+    }
+    decoder.has_names = NULL;
+  } else if (sorted_out) {
+    DecodeSorted(&blocks, block_ok, NULL, &decoder, &first_datetime);
+  } else if (parallel) {
+    DecodeParallel(&blocks, block_ok, NULL, nthreads, &decoder, &first_datetime);
+  }
+  CloseTraceReader(&reader);
+
+  if (sorted_out) {
+    FlushReorder(stdout, 0x7FFFFFFFFFFFFFFFLL);
+    SendSortedHeader(stdout);
+  }
 
   // Pass along the OR of all incoming raw traceblock flags, in particular IPC_Flag 
-  fprintf(stdout, "# ## FLAGS: %d\n", all_flags);
+  // -bin -sorted already sent block 0's, ahead of the first event
+  if (binary_out) {
+    if (!sorted_out) {
+      if (!first_datetime.empty()) {
+        OutputBinMeta(kEvbDateTime, 0, 0, 0, first_datetime.c_str());
+      }
+      OutputBinMeta(kEvbFlags, all_flags, 0, 0, NULL);
+    }
+  } else {
+    fprintf(stdout, "# ## FLAGS: %d\n", all_flags);
+  }
 
 
   // Reduce timestamps to start at no more than 60 seconds after the base minute.
   // With wraparound tracing, we don't know the true value of lo_timestamp until
   // possibly the very last input block. So we offset here. The output file already 
   // has the larger times so eventtospan will reduce those. 
+  uint64 lo_timestamp = decoder.stats.lo_timestamp;
+  uint64 hi_timestamp = decoder.stats.hi_timestamp;
   uint64 extra_minutes = lo_timestamp / 6000000000l;
   uint64 offset_timestamp = extra_minutes * 6000000000l;
   lo_timestamp -= offset_timestamp;
@@ -1481,7 +2457,11 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
     total_seconds = 1.0;	// avoid zdiv
   }
   // Pass along the time bounds 
-  fprintf(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  if (binary_out) {
+    OutputBinMeta(kEvbTimes, 0, lo_timestamp, hi_timestamp, NULL);
+  } else {
+    fprintf(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  }
 
 
   uint64 total_cpus = unique_cpus.size();
@@ -1491,23 +2471,76 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
   //fprintf(stderr, 
   //        "  %s,  %lld events, %lld CPUs  (%1.0f/sec/cpu)\n",
   //        FormatSecondsDateTime(base_usec_timestamp / 1000000),
-  //        event_count, total_cpus, (event_count / total_seconds) /total_cpus); 
-  uint64 total_irqs  = events_by_type[5] + events_by_type[7];
-  uint64 total_traps = events_by_type[4] + events_by_type[6];
-  uint64 total_sys64 = events_by_type[8] + events_by_type[9] +
-                       events_by_type[10] + events_by_type[11];
-  uint64 total_sys32 = events_by_type[12] + events_by_type[13] +
-                       events_by_type[14] + events_by_type[15];
+  //        decoder.stats.event_count, total_cpus, (decoder.stats.event_count / total_seconds) /total_cpus); 
+  uint64 total_irqs  = decoder.stats.events_by_type[5] + decoder.stats.events_by_type[7];
+  uint64 total_traps = decoder.stats.events_by_type[4] + decoder.stats.events_by_type[6];
+  uint64 total_sys64 = decoder.stats.events_by_type[8] + decoder.stats.events_by_type[9] +
+                       decoder.stats.events_by_type[10] + decoder.stats.events_by_type[11];
+  uint64 total_sys32 = decoder.stats.events_by_type[12] + decoder.stats.events_by_type[13] +
+                       decoder.stats.events_by_type[14] + decoder.stats.events_by_type[15];
 
   //fprintf(stderr, "  %lld IRQ, %lld Trap, %lld Sys64, %lld Sys32, %lld Mark\n",
-  //        total_irqs, total_traps, total_sys64, total_sys32, total_marks); 
+  //        total_irqs, total_traps, total_sys64, total_sys32, decoder.stats.total_marks); 
   //fprintf(stderr, "  %lld PIDs, %lld context-switches (%1.0f/sec/cpu)\n", 
-  //        (u64)unique_pids.size(), ctx_switches, (ctx_switches / total_seconds) / total_cpus);
+  //        (u64)decoder.stats.unique_pids.size(), decoder.stats.ctx_switches, (decoder.stats.ctx_switches / total_seconds) / total_cpus);
 
-  fprintf(stderr, "rawtoevent: %llu events\n", event_count); 
+  fprintf(stderr, "rawtoevent: %llu events\n", decoder.stats.event_count); 
   fprintf(stderr, 
           "  %5.3f elapsed seconds: %5.3f to %5.3f\n", 
           total_seconds, lo_seconds, hi_seconds); 
 
+  return true;
 }
 
+}	// namespace rawtoevent
+
+// kutrace_post links in RawToEvent and has its own main
+#ifndef KUTRACE_POST
+int main (int argc, const char** argv) {
+  rawtoevent::RawToEventArgs args;
+  // The trace file is read in place if possible, else from stdin
+  args.fname = ((argc >= 2) && (argv[1][0] != '-')) ? argv[1] : NULL;
+  args.verbose = false;
+  args.hexevent = false;
+  args.binary_out = false;
+  args.sorted_out = false;
+  args.maxblock = 999999999;
+  args.nthreads = 1;
+  args.start_sec = -1.0;
+  args.stop_sec = -1.0;
+  args.lead = 1;
+
+  // Pick up flags
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {args.verbose = true;}
+    if (strcmp(argv[i], "-h") == 0) {args.hexevent = true;}
+    if (strcmp(argv[i], "-bin") == 0) {args.binary_out = true;}
+    if (strcmp(argv[i], "-sorted") == 0) {args.sorted_out = true;}
+    if ((strcmp(argv[i], "-maxblock") == 0) && (i < (argc - 1))) {
+      ++i;
+      args.maxblock = atoi(argv[i]);
+    }
+    if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) {
+      ++i;
+      args.nthreads = atoi(argv[i]);
+    }
+    if ((strcmp(argv[i], "-start") == 0) && (i < (argc - 1))) {
+      ++i;
+      args.start_sec = atof(argv[i]);
+    }
+    if ((strcmp(argv[i], "-stop") == 0) && (i < (argc - 1))) {
+      ++i;
+      args.stop_sec = atof(argv[i]);
+    }
+    if ((strcmp(argv[i], "-lead") == 0) && (i < (argc - 1))) {
+      ++i;
+      args.lead = atoi(argv[i]);
+    }
+  }
+
+  EventBinWriter writer;
+  if (args.binary_out) {InitEventBinWriter(stdout, &writer);}
+  if (!rawtoevent::RawToEvent(args, &writer)) {exit(0);}
+  return 0;
+}
+#endif
@@ -0,0 +1,36 @@
+// rawtoevent.h
+// Copyright 2023 Richard L. Sites
+//
+// The rawtoevent decoding as a function, so kutrace_post can run it in the
+// same process as the later stages. See the Usage comment in rawtoevent.cc
+// for what each option does.
+//
+
+#ifndef __RAWTOEVENT_H__
+#define __RAWTOEVENT_H__
+
+#include "event_bin.h"
+
+namespace rawtoevent {
+
+typedef struct {
+  const char* fname;	// Trace file, or NULL to read stdin
+  bool verbose;		// -v
+  bool hexevent;	// -h
+  bool binary_out;	// -bin
+  bool sorted_out;	// -sorted
+  int maxblock;		// -maxblock n
+  int nthreads;		// -threads n
+  double start_sec;	// -start sec, or -1.0
+  double stop_sec;	// -stop sec, or -1.0
+  int lead;		// -lead n
+} RawToEventArgs;
+
+// Decode the trace. -bin records go to w, which the caller has set up with
+// InitEventBinWriter or InitEventBinSink. The Ascii listing goes to stdout.
+// Returns false, after saying why on stderr, if the trace cannot be decoded
+bool RawToEvent(const RawToEventArgs& args, EventBinWriter* w);
+
+}	// namespace rawtoevent
+
+#endif	// __RAWTOEVENT_H__
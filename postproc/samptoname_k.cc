@@ -5,6 +5,11 @@
 //   $ cat foo.json |./samptoname_k >foo_with_k_pc.json
 //
 // dick sites 2020.03.06
+// dsites 2023.08.28
+//  Flat sorted arrays of text symbols with a branchless binary search instead
+//  of a std::map. Module symbols keep their [module] suffix. -kaslr/-anchor
+//  slide the kernel symbols to where KASLR put them. Lines without a PC
+//  sample are copied through without being parsed
 //
 // Compile with g++ -O2 samptoname_k.cc -o samptoname_k
 //
@@ -22,6 +27,14 @@
 //  ffffffffb43bd2e0 T clear_page_erms
 //  ffffffffb43bd2f0 T cmdline_find_option_bool
 //  ffffffffb43bd410 T cmdline_find_option
+//  ffffffffc0a01000 t e1000_open	[e1000]
+//
+// Only text symbols (t T w W) can contain a PC; the rest are skipped.
+// If the symbols come from a different boot than the trace, or from an
+// unrelocated System.map, the kernel (not module) symbols can be moved by
+//   -kaslr <hex offset>           added to each address, or
+//   -anchor <name>=<hex address>  where symbol name really was in the trace,
+//                                 e.g. -anchor _text=ffffffffb3e00000
 //
 // Output to stdout is the input json with names substituted and the
 // hash code in arg updated
@@ -29,8 +42,9 @@
 //
 
 
-#include <map>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
@@ -40,7 +54,7 @@
 #include "kutrace_lib.h"
 
 using std::string;
-using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -57,7 +71,21 @@ typedef struct {
   string name;
 } OneSpan;
 
-typedef map<uint64, string> SymMap;
+// All the text symbols, sorted by address. The addresses are alone in their
+// own array so the binary search touches as few cache lines as possible
+typedef struct {
+  vector<uint64> addrs;
+  vector<uint32> name_offsets;	// Into names
+  vector<bool> is_module;
+  string names;			// NUL-terminated, module ones as name[module]
+} KernelSyms;
+
+// One symbol while reading, before sorting
+typedef struct {
+  uint64 addr;
+  uint32 name_offset;
+  bool is_module;
+} RawSym;
 
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
@@ -79,7 +107,14 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 }
 
 
-void ReadAllsyms(FILE* f, SymMap* allsyms) {
+bool RawSymLess(const RawSym& a, const RawSym& b) {return a.addr < b.addr;}
+
+inline bool IsTextType(char c) {
+  return (c == 't') || (c == 'T') || (c == 'w') || (c == 'W');
+}
+
+void ReadAllsyms(FILE* f, KernelSyms* allsyms) {
+  vector<RawSym> raw;
   uint64 addr = 0LL;
   char buffer[kMaxBufferSize];
   while (ReadLine(f, buffer, kMaxBufferSize)) {
@@ -93,34 +128,102 @@ void ReadAllsyms(FILE* f, SymMap* allsyms) {
     buffer[space2] = '\0';
 
     size_t space3 = space2 + 1 + strcspn(buffer + space2 + 1, " \t");
-    // Space3 is optional
+    // Space3 is optional; after it comes any [module]
+    const char* module = "";
+    if (space3 < len) {
+      module = buffer + space3 + 1 + strspn(buffer + space3 + 1, " \t");
+    }
     buffer[space3] = '\0';
 
+    if (!IsTextType(buffer[space1 + 1])) {continue;}
     int n = sscanf(buffer, "%llx", &addr);
     if (n != 1) {continue;}
-    string name = string(buffer + space2 + 1);
-    (*allsyms)[addr] = name;
-//fprintf(stdout, "allsyms[%llx] = %s\n", addr, name.c_str());
+    RawSym sym;
+    sym.addr = addr;
+    sym.name_offset = allsyms->names.size();
+    sym.is_module = (module[0] == '[');
+    allsyms->names += (buffer + space2 + 1);
+    if (sym.is_module) {allsyms->names += module;}
+    allsyms->names.push_back('\0');
+    raw.push_back(sym);
   }
-  // We don't know how far the last item extends.
-  // Arbitrarily assume that it is 4KB and add a dummy entry at that end
-  if (addr < 0xffffffffffffffffL - 4096L) {
-    (*allsyms)[addr + 4096] = string("-dummy-");
+
+  // kallsyms is usually sorted already; a System.map may not be
+  std::stable_sort(raw.begin(), raw.end(), RawSymLess);
+  for (int i = 0; i < (int)raw.size(); ++i) {
+    allsyms->addrs.push_back(raw[i].addr);
+    allsyms->name_offsets.push_back(raw[i].name_offset);
+    allsyms->is_module.push_back(raw[i].is_module);
+  }
+}
+
+// We don't know how far the last item extends.
+// Arbitrarily assume that it is 4KB and add a dummy entry at that end
+void AddDummyEnd(KernelSyms* allsyms) {
+  if (allsyms->addrs.empty()) {return;}
+  uint64 last = allsyms->addrs.back();
+  if (last < 0xffffffffffffffffLLU - 4096) {
+    allsyms->addrs.push_back(last + 4096);
+    allsyms->name_offsets.push_back(allsyms->names.size());
+    allsyms->is_module.push_back(false);
+    allsyms->names += "-dummy-";
+    allsyms->names.push_back('\0');
   }
 }
 
-string Lookup(const string& s, const SymMap& allsyms) {
+// Offset that moves symbol name to anchor_addr, or 0 if name is not there
+int64 AnchorOffset(const KernelSyms& allsyms, const char* name, uint64 anchor_addr) {
+  for (int i = 0; i < (int)allsyms.addrs.size(); ++i) {
+    if (allsyms.is_module[i]) {continue;}
+    if (strcmp(allsyms.names.c_str() + allsyms.name_offsets[i], name) == 0) {
+      return anchor_addr - allsyms.addrs[i];
+    }
+  }
+  fprintf(stderr, "samptoname_k: anchor %s not found; no KASLR offset\n", name);
+  return 0;
+}
+
+// Slide the kernel symbols, keeping all of them sorted. Modules load at
+// addresses of their own, not moved by the kernel's KASLR offset
+void ApplyKaslr(int64 offset, KernelSyms* allsyms) {
+  if (offset == 0) {return;}
+  vector<RawSym> raw(allsyms->addrs.size());
+  for (int i = 0; i < (int)raw.size(); ++i) {
+    raw[i].addr = allsyms->addrs[i] + (allsyms->is_module[i] ? 0 : offset);
+    raw[i].name_offset = allsyms->name_offsets[i];
+    raw[i].is_module = allsyms->is_module[i];
+  }
+  std::stable_sort(raw.begin(), raw.end(), RawSymLess);
+  for (int i = 0; i < (int)raw.size(); ++i) {
+    allsyms->addrs[i] = raw[i].addr;
+    allsyms->name_offsets[i] = raw[i].name_offset;
+    allsyms->is_module[i] = raw[i].is_module;
+  }
+}
+
+// Name of the symbol at or just below addr, or NULL if addr is below them all.
+// The loop has no data-dependent branch; the compare becomes a conditional
+// move, so a lookup costs about lg(n) dependent loads and nothing else
+const char* Lookup(uint64 addr, const KernelSyms& allsyms) {
+  size_t n = allsyms.addrs.size();
+  if ((n == 0) || (addr < allsyms.addrs[0])) {return NULL;}
+  const uint64* base = &allsyms.addrs[0];
+  while (n > 1) {
+    size_t half = n / 2;
+    base = (base[half] <= addr) ? base + half : base;
+    n -= half;
+  }
+  return allsyms.names.c_str() + allsyms.name_offsets[base - &allsyms.addrs[0]];
+}
+
+// Returns 0 if not valid hex
+uint64 GetFromHex(const string& s) {
   if (s.find_first_not_of("0123456789abcdef") != string::npos) {
-    // Not valid hex. Leave unchanged.
-//fprintf(stdout, "Lookup(%s) unchanged\n", s.c_str());
-    return string("");
+    return 0L;
   }
   uint64 addr = 0;
   sscanf(s.c_str(), "%llx", &addr);
-  SymMap::const_iterator it = allsyms.upper_bound(addr);  // Just above addr
-  it = prev(it);	// At or just below addr
-//fprintf(stdout, "Lookup(%s %llx) = %s\n", s.c_str(), addr, it->second.c_str());
-  return it->second;
+  return addr;
 }
 
 // Cheap 16-bit hash so we can mostly distinguish different routine names
@@ -142,7 +245,7 @@ int NameHash(const string& s) {
 // start time and duration for each span are in seconds
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
-  fprintf(stderr, "Usage: spantopcnamek <allsyms fname>\n");
+  fprintf(stderr, "Usage: spantopcnamek <allsyms fname> [-kaslr hexoffset | -anchor name=hexaddr]\n");
   exit(0);
 }
 
@@ -151,9 +254,20 @@ void Usage() {
 //
 int main (int argc, const char** argv) {
   if (argc < 2) {Usage();}
+  int64 kaslr = 0;
+  const char* anchor = NULL;
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-kaslr") == 0) && (i < (argc - 1))) {
+      if (sscanf(argv[++i], "%llx", &kaslr) != 1) {Usage();}
+    }
+    else if ((strcmp(argv[i], "-anchor") == 0) && (i < (argc - 1))) {
+      anchor = argv[++i];
+    }
+    else Usage();
+  }
 
   // Input allsyms file
-  SymMap allsyms;
+  KernelSyms allsyms;
 
   const char* fname = argv[1];
   FILE* f = fopen(fname, "r");
@@ -163,6 +277,15 @@ int main (int argc, const char** argv) {
   }
   ReadAllsyms(f, &allsyms);
   fclose(f);
+  if (anchor != NULL) {
+    char name[kMaxBufferSize];
+    uint64 anchor_addr = 0;
+    if ((strlen(anchor) >= kMaxBufferSize) ||
+        (sscanf(anchor, "%[^=]=%llx", name, &anchor_addr) != 2)) {Usage();}
+    kaslr = AnchorOffset(allsyms, name, anchor_addr);
+  }
+  ApplyKaslr(kaslr, &allsyms);
+  AddDummyEnd(&allsyms);
   
   
   // expecting:
@@ -170,8 +293,18 @@ int main (int argc, const char** argv) {
   //  [  0.00000000, 0.00400049, -1, -1, 33588, 641, 61259, 0, 0, "PC=ffffffffb43bd2e7"],
 
   int output_events = 0;
+  int samples = 0;
   char buffer[kMaxBufferSize];
   while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+    // Only PC samples change. Spans from eventtospan3 are already in exactly
+    // the output format, so copy the rest without parsing them
+    if ((strstr(buffer, "\"PC=") == NULL) && (memcmp(buffer, "[999.0", 6) != 0)) {
+      fputs(buffer, stdout);
+      fputc('\n', stdout);
+      if (buffer[0] == '[') {++output_events;}
+      continue;
+    }
+
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -193,9 +326,11 @@ int main (int argc, const char** argv) {
       string oldname = onespan.name.substr(4);	// Skip over "PC=
       size_t quote2 = oldname.find("\"");
       if (quote2 != string::npos) {oldname = oldname.substr(0, quote2);}
-      string newname = Lookup(oldname, allsyms);
-      if (!newname.empty()) {
-        onespan.name = "\"PC=" + newname + "\"],";
+      ++samples;
+      uint64 addr = GetFromHex(oldname);
+      const char* newname = (addr == 0) ? NULL : Lookup(addr, allsyms);
+      if (newname != NULL) {
+        onespan.name = string("\"PC=") + newname + "\"],";
         onespan.arg = NameHash(newname);
       }
     }
@@ -212,7 +347,7 @@ int main (int argc, const char** argv) {
 
   // Add marker and closing at the end
   FinalJson(stdout);
-  fprintf(stderr, "spantopcnamek: %d events\n", output_events);
+  fprintf(stderr, "spantopcnamek: %d events, %d kernel PC samples\n", output_events, samples);
 
   return 0;
 }
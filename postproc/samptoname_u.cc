@@ -5,11 +5,11 @@
 //
 // dick sites 2020.03.06
 //  2020.04.12 dsites fixup __nss_passwd_lookup ==> memcpy
+//  2023.08.27 dsites read each binary's ELF symbols once, in-process, and cache
+//    names by (binary, offset). addr2line is now just the fallback for files
+//    that are not 64-bit ELF, or with -addr2line
 //
-// TODO: 
-//  cache lookup results to avoid excess command spawning
-//
-// Compile with g++ -O2 samptoname_u.cc -o samptoname_u
+// Compile with g++ -O2 samptoname_u.cc elf_symbols.cc -o samptoname_u
 //
 // Input from stdin is a KUtrace json file, some of whose events are
 // PC samples of kernel addresses. We want to rewrite these with the
@@ -41,12 +41,16 @@
 
 #include <map>
 #include <string>
+#include <utility>	// for pair
+#include <vector>
 
+#include <cxxabi.h>	// __cxa_demangle
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 
 #include "basetypes.h"
+#include "elf_symbols.h"
 #include "kutrace_lib.h"
 
 #define BUFFSIZE 256
@@ -57,6 +61,7 @@ static const int kMaxBufferSize = 256;
 
 using std::string;
 using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -80,12 +85,27 @@ typedef struct {
 typedef struct {
   uint64 addr_lo;
   uint64 addr_hi;
+  uint64 offset;	// File offset of addr_lo
   uint64 pid;
   string pathname;
 } RangeToFile;
 
 typedef map<uint64, RangeToFile> MapsMap;
 
+// Each binary named in the maps file is read at most once
+typedef struct {
+  bool elf_ok;		// False: use addr2line
+  ElfSymbols elf;
+} Binary;
+
+typedef map<string, int> BinaryIndex;		// pathname => subscript in binaries
+typedef map<std::pair<int, uint64>, string> NameCache;	// (binary, file offset) => name, or empty
+
+static bool force_addr2line = false;
+static BinaryIndex binary_index;
+static vector<Binary*> binaries;
+static NameCache name_cache;
+
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
   fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
@@ -104,13 +124,15 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 }
 
 void DumpRangeToFile(FILE* f, const RangeToFile rtf) {
-  fprintf(f, "%lld %llx %llx %s\n", rtf.pid, rtf.addr_lo, rtf.addr_hi, rtf.pathname.c_str()); 
+  fprintf(f, "%lld %llx %llx %llx %s\n", rtf.pid, rtf.addr_lo, rtf.addr_hi, rtf.offset,
+          rtf.pathname.c_str()); 
 }
 
 //  5636c2def000-5636c2eac000 r-xp 00000000 08:02 5510282                    /usr/sbin/sshd
 void ReadAllmaps(FILE* f, MapsMap* allmaps) {
   uint64 addr_lo = 0L;
   uint64 addr_hi = 0L;
+  uint64 offset = 0L;
   uint64 current_pid = 0L;
   char buffer[kMaxBufferSize];
   while (ReadLine(f, buffer, kMaxBufferSize)) {
@@ -136,12 +158,14 @@ void ReadAllmaps(FILE* f, MapsMap* allmaps) {
     if (n != 2) {continue;}
 
     if (strchr(buffer + space1 + 1, 'x') ==NULL) {continue;}
+    if (sscanf(buffer + space2 + 1, "%llx", &offset) != 1) {offset = 0;}
 
     string pathname = string(buffer + slash);
 
     RangeToFile temp;
     temp.addr_lo = addr_lo;
     temp.addr_hi = addr_hi;
+    temp.offset = offset;
     temp.pid = current_pid;
     temp.pathname = pathname;
     uint64 key = (current_pid << 48) | (addr_lo & 0x0000FFFFFFFFFFFFL);
@@ -263,6 +287,37 @@ const char* DoAddr2line(const string& pathname, uint64 offset, char* buffer) {
   return GetProcFileName(cmd, buffer);
 }
 
+// Subscript of the binary, reading its symbols the first time
+int FindBinary(const string& pathname) {
+  BinaryIndex::const_iterator it = binary_index.find(pathname);
+  if (it != binary_index.end()) {return it->second;}
+  Binary* b = new Binary;
+  b->elf_ok = !force_addr2line && LoadElfSymbols(pathname.c_str(), &b->elf);
+  int bin = binaries.size();
+  binaries.push_back(b);
+  binary_index[pathname] = bin;
+  return bin;
+}
+
+// Routine name at offset into the mapped range rtf, or NULL
+const char* Symbolize(const RangeToFile* rtf, uint64 offset, char* buffer) {
+  const Binary* b = binaries[FindBinary(rtf->pathname)];
+  if (!b->elf_ok) {return DoAddr2line(rtf->pathname, offset, buffer);}
+
+  // The maps line gives the file offset; the symbols use link-time addresses
+  uint64 vaddr = ElfFileOffsetToVaddr(b->elf, rtf->offset + offset);
+  const char* rawname = LookupElfSymbol(b->elf, vaddr);
+  if (rawname == NULL) {return NULL;}
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(rawname, NULL, NULL, &status);
+  if (demangled != NULL) {
+    snprintf(buffer, BUFFSIZE, "%s", demangled);
+    free(demangled);
+  } else {
+    snprintf(buffer, BUFFSIZE, "%s", rawname);
+  }
+  return NoArgs(buffer);
+}
 
 // Cheap 16-bit hash so we can mostly distinguish different routine names
 int NameHash(const string& s) {
@@ -291,10 +346,21 @@ void PossiblyReplaceName(OneSpan* onespan, const MapsMap& allmaps) {
   string pathname = rtf->pathname;	
   uint64 offset = addr - rtf->addr_lo;
 
-  // Now execute command: addr2line -fsC -e /lib/x86_64-linux-gnu/libc-2.27.so 0x18eb1f
-  // and parse the result into filename:line# or procname 
-  char buffer[256];
-  const char* newname = DoAddr2line(pathname, offset, buffer);
+  // Look up the routine name in the binary's symbols, or failing that
+  // execute command: addr2line -fsC -e /lib/x86_64-linux-gnu/libc-2.27.so 0x18eb1f
+  // and parse the result into filename:line# or procname.
+  // Many samples land on the same few addresses, so remember each answer.
+  // Key on the file offset, since two mappings of one file can put different
+  // code at the same distance from their starts
+  int bin = FindBinary(pathname);
+  std::pair<int, uint64> key(bin, rtf->offset + offset);
+  NameCache::const_iterator it = name_cache.find(key);
+  if (it == name_cache.end()) {
+    char buffer[BUFFSIZE + 1];
+    const char* found = Symbolize(rtf, offset, buffer);
+    it = name_cache.insert(std::make_pair(key, string(found == NULL ? "" : found))).first;
+  }
+  const char* newname = it->second.empty() ? NULL : it->second.c_str();
   if (newname != NULL) {
    // Fixup non-debug libc mapping memcpy into __nss_passwd_lookup
     if (strcmp(newname, "__nss_passwd_lookup") == 0) {newname = "memcpy";}
@@ -310,7 +376,7 @@ void PossiblyReplaceName(OneSpan* onespan, const MapsMap& allmaps) {
 // start time and duration for each span are in seconds
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
-  fprintf(stderr, "Usage: spantopcnameu <pidmaps fname>\n");
+  fprintf(stderr, "Usage: spantopcnameu <pidmaps fname> [-addr2line]\n");
   exit(0);
 }
 
@@ -319,6 +385,10 @@ void Usage() {
 //
 int main (int argc, const char** argv) {
   if (argc < 2) {Usage();}
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "-addr2line") == 0) {force_addr2line = true;}
+    else Usage();
+  }
 
   // Input allmaps file
   MapsMap allmaps;
@@ -373,7 +443,8 @@ int main (int argc, const char** argv) {
 
   // Add marker and closing at the end
   FinalJson(stdout);
-  fprintf(stderr, "spantopcnameu: %d events\n", output_events);
+  fprintf(stderr, "spantopcnameu: %d events, %d binaries, %d addresses\n", output_events,
+          (int)binaries.size(), (int)name_cache.size());
 
   return 0;
 }
@@ -0,0 +1,413 @@
+// span_bin.cc
+// Copyright 2023 Richard L. Sites
+//
+// Seekable binary span file from eventtospan3 -spanbin, read by the span tools.
+// See span_bin.h for the layout
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <sys/types.h>  // off_t
+
+#include "basetypes.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kMaxLineSize = 512;
+
+// The end marker eventtospan3 FinalJson writes, and the closing after it
+static const char* const kMarkerLine = "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]";
+static const char* const kCloseLine = "]}";
+// Spans starting before 999 seconds always sort ahead of the marker line
+static const int64 kMarkerTicks = 99900000000LL;
+// Spans starting before 1000 seconds have fixed-width times, so sort by time
+static const int64 kFixedWidthTicks = 100000000000LL;
+
+
+static void WriteBytes(SpanBinWriter* w, const void* p, size_t len) {
+  fwrite(p, 1, len, w->f);
+  w->offset += len;
+}
+
+void InitSpanBinWriter(FILE* f, SpanBinWriter* w) {
+  w->f = f;
+  w->offset = 0;
+  w->span_count = 0;
+  w->pending.clear();
+  w->chunks.clear();
+  w->text.clear();
+  WriteBytes(w, kSpanBinMagic, kSpanBinMagicLen);
+}
+
+// Write one CPU's chunk and add it to the index
+static void FlushChunk(SpanBinWriter* w, int cpu, vector<SpanBin>* spans) {
+  if (spans->empty()) {return;}
+  SpanBinChunk chunk;
+  chunk.lo_ts = (*spans)[0].start_ts;
+  chunk.hi_ts = (*spans)[0].start_ts;
+  for (int i = 1; i < spans->size(); ++i) {
+    if ((*spans)[i].start_ts < chunk.lo_ts) {chunk.lo_ts = (*spans)[i].start_ts;}
+    if (chunk.hi_ts < (*spans)[i].start_ts) {chunk.hi_ts = (*spans)[i].start_ts;}
+  }
+  chunk.offset = w->offset;
+  chunk.cpu = cpu;
+  chunk.count = spans->size();
+  WriteBytes(w, &(*spans)[0], spans->size() * sizeof(SpanBin));
+  w->chunks.push_back(chunk);
+  spans->clear();
+}
+
+void WriteSpanBin(SpanBinWriter* w, const SpanBin& rec) {
+  vector<SpanBin>* spans = &w->pending[rec.cpu];
+  spans->push_back(rec);
+  ++w->span_count;
+  if (spans->size() >= kSpanBinChunkSpans) {FlushChunk(w, rec.cpu, spans);}
+}
+
+void WriteSpanBinText(SpanBinWriter* w, const char* text, size_t len) {
+  w->text.append(text, len);
+}
+
+void CloseSpanBinWriter(SpanBinWriter* w, const vector<string>& names) {
+  for (map<int, vector<SpanBin> >::iterator it = w->pending.begin();
+       it != w->pending.end(); ++it) {
+    FlushChunk(w, it->first, &it->second);
+  }
+
+  SpanBinFooter footer;
+  memset(&footer, 0, sizeof(SpanBinFooter));
+
+  // Names: length, then bytes, NUL-padded to a multiple of eight
+  footer.names_offset = w->offset;
+  footer.name_count = names.size();
+  char pad[8];
+  memset(pad, 0, 8);
+  for (int i = 0; i < names.size(); ++i) {
+    uint32 len = names[i].length();
+    WriteBytes(w, &len, sizeof(uint32));
+    WriteBytes(w, names[i].data(), len);
+    WriteBytes(w, pad, (8 - ((sizeof(uint32) + len) & 7)) & 7);
+  }
+
+  footer.text_offset = w->offset;
+  footer.text_len = w->text.length();
+  WriteBytes(w, w->text.data(), w->text.length());
+
+  footer.index_offset = w->offset;
+  footer.chunk_count = w->chunks.size();
+  if (!w->chunks.empty()) {
+    WriteBytes(w, &w->chunks[0], w->chunks.size() * sizeof(SpanBinChunk));
+  }
+
+  footer.span_count = w->span_count;
+  memcpy(footer.magic, kSpanBinEndMagic, kSpanBinMagicLen);
+  WriteBytes(w, &footer, sizeof(SpanBinFooter));
+  fflush(w->f);
+}
+
+
+bool IsSpanBin(FILE* f) {
+  int c = getc(f);
+  if (c == EOF) {return false;}
+  ungetc(c, f);
+  if (c != kSpanBinMagic[0]) {return false;}
+
+  char magic[kSpanBinMagicLen];
+  if ((fread(magic, 1, kSpanBinMagicLen, f) != kSpanBinMagicLen) ||
+      (memcmp(magic, kSpanBinMagic, kSpanBinMagicLen) != 0)) {
+    fprintf(stderr, "IsSpanBin: bad binary span magic\n");
+    exit(0);
+  }
+  return true;
+}
+
+static void ReadAt(FILE* f, uint64 offset, void* p, size_t len, const char* what) {
+  if ((fseeko(f, (off_t)offset, SEEK_SET) != 0) || (fread(p, 1, len, f) != len)) {
+    fprintf(stderr, "OpenSpanBin: cannot read %s\n", what);
+    exit(0);
+  }
+}
+
+static void InitSpanBinReader(FILE* f, SpanBinReader* r) {
+  r->f = f;
+  r->names.clear();
+  r->head.clear();
+  r->tail.clear();
+  r->chunks.clear();
+  r->spans.clear();
+  RewindSpanBin(r);
+}
+
+// Split the non-span lines into those that sort ahead of the spans and
+// those that sort after, adding the closing line. The spans all start with [
+static void SplitSpanBinText(const char* p, size_t len, SpanBinReader* r) {
+  vector<string> lines;
+  const char* end = p + len;
+  while (p < end) {
+    const char* nl = reinterpret_cast<const char*>(memchr(p, '\n', end - p));
+    if (nl == NULL) {nl = end;}
+    lines.push_back(string(p, nl - p));
+    p = nl + 1;
+  }
+  lines.push_back(string(kCloseLine));
+  std::sort(lines.begin(), lines.end());
+  for (int i = 0; i < lines.size(); ++i) {
+    if (lines[i] < string("[")) {
+      r->head.push_back(lines[i]);
+    } else {
+      r->tail.push_back(lines[i]);
+    }
+  }
+}
+
+void OpenSpanBin(FILE* f, SpanBinReader* r) {
+  InitSpanBinReader(f, r);
+
+  // The index is at the end, so a pipe will not do
+  if (fseeko(f, -(off_t)sizeof(SpanBinFooter), SEEK_END) != 0) {
+    fprintf(stderr, "OpenSpanBin: binary span input must be a file, not a pipe\n");
+    exit(0);
+  }
+  if ((fread(&r->footer, 1, sizeof(SpanBinFooter), f) != sizeof(SpanBinFooter)) ||
+      (memcmp(r->footer.magic, kSpanBinEndMagic, kSpanBinMagicLen) != 0)) {
+    fprintf(stderr, "OpenSpanBin: missing footer, truncated file?\n");
+    exit(0);
+  }
+
+  // Names
+  uint64 names_len = r->footer.text_offset - r->footer.names_offset;
+  vector<char> temp(names_len + 1);
+  ReadAt(f, r->footer.names_offset, &temp[0], names_len, "names");
+  const char* p = &temp[0];
+  for (int i = 0; i < r->footer.name_count; ++i) {
+    uint32 len;
+    memcpy(&len, p, sizeof(uint32));
+    r->names.push_back(string(p + sizeof(uint32), len));
+    p += (sizeof(uint32) + len + 7) & ~7;
+  }
+
+  // Non-span lines, in sort order
+  temp.resize(r->footer.text_len + 1);
+  ReadAt(f, r->footer.text_offset, &temp[0], r->footer.text_len, "text");
+  SplitSpanBinText(&temp[0], r->footer.text_len, r);
+
+  r->chunks.resize(r->footer.chunk_count);
+  if (!r->chunks.empty()) {
+    ReadAt(f, r->footer.index_offset, &r->chunks[0],
+           r->chunks.size() * sizeof(SpanBinChunk), "index");
+  }
+}
+
+// Exactly the LC_ALL=C sort order of the formatted lines. Only equal or
+// wide start times need the text
+struct SpanBinLess {
+  const vector<string>* names;
+  bool operator()(const SpanBin& a, const SpanBin& b) const {
+    if ((a.start_ts != b.start_ts) &&
+        (a.start_ts < kFixedWidthTicks) && (b.start_ts < kFixedWidthTicks)) {
+      return a.start_ts < b.start_ts;
+    }
+    char abuf[kMaxLineSize];
+    char bbuf[kMaxLineSize];
+    FormatSpanBin(a, *names, abuf, kMaxLineSize);
+    FormatSpanBin(b, *names, bbuf, kMaxLineSize);
+    return strcmp(abuf, bbuf) < 0;
+  }
+};
+
+void SelectSpanBin(SpanBinReader* r, int64 lo_ts, int64 hi_ts, int lo_cpu, int hi_cpu) {
+  r->spans.clear();
+  r->next_span = 0;
+  for (int i = 0; i < r->chunks.size(); ++i) {
+    const SpanBinChunk& chunk = r->chunks[i];
+    if ((chunk.hi_ts < lo_ts) || (hi_ts < chunk.lo_ts)) {continue;}
+    if ((chunk.cpu >= 0) && ((chunk.cpu < lo_cpu) || (hi_cpu < chunk.cpu))) {continue;}
+    size_t k = r->spans.size();
+    r->spans.resize(k + chunk.count);
+    ReadAt(r->f, chunk.offset, &r->spans[k], chunk.count * sizeof(SpanBin), "spans");
+  }
+  SpanBinLess less;
+  less.names = &r->names;
+  std::sort(r->spans.begin(), r->spans.end(), less);
+}
+
+void OpenSpanSet(SpanSet* set, SpanBinReader* r) {
+  InitSpanBinReader(NULL, r);
+  memset(&r->footer, 0, sizeof(SpanBinFooter));
+  r->names.swap(set->names);
+  r->spans.swap(set->spans);
+  SplitSpanBinText(set->text.data(), set->text.length(), r);
+  SpanBinLess less;
+  less.names = &r->names;
+  std::sort(r->spans.begin(), r->spans.end(), less);
+}
+
+void RewindSpanBin(SpanBinReader* r) {
+  r->next_head = 0;
+  r->next_span = 0;
+  r->next_tail = 0;
+  r->marker_done = false;
+}
+
+static bool CopyLine(const string& s, char* buffer, int maxsize) {
+  snprintf(buffer, maxsize, "%s", s.c_str());
+  return true;
+}
+
+bool ReadSpanBinLine(SpanBinReader* r, char* buffer, int maxsize) {
+  const SpanBin* span;
+  if (!ReadSpanBinItem(r, &span, buffer, maxsize)) {return false;}
+  if (span != NULL) {FormatSpanBin(*span, r->names, buffer, maxsize);}
+  return true;
+}
+
+bool ReadSpanBinItem(SpanBinReader* r, const SpanBin** span, char* buffer, int maxsize) {
+  *span = NULL;
+  if (r->next_head < r->head.size()) {return CopyLine(r->head[r->next_head++], buffer, maxsize);}
+  if (r->next_span < r->spans.size()) {
+    const SpanBin& rec = r->spans[r->next_span];
+    // The end marker goes just ahead of the first span that sorts after it
+    if (!r->marker_done && (kMarkerTicks <= rec.start_ts)) {
+      char temp[kMaxLineSize];
+      FormatSpanBin(rec, r->names, temp, kMaxLineSize);
+      if (strcmp(kMarkerLine, temp) < 0) {
+        r->marker_done = true;
+        return CopyLine(string(kMarkerLine), buffer, maxsize);
+      }
+    }
+    ++r->next_span;
+    *span = &rec;
+    return true;
+  }
+  if (!r->marker_done) {
+    r->marker_done = true;
+    return CopyLine(string(kMarkerLine), buffer, maxsize);
+  }
+  if (r->next_tail < r->tail.size()) {return CopyLine(r->tail[r->next_tail++], buffer, maxsize);}
+  return false;
+}
+
+void OpenSpanLines(FILE* f, SpanLineReader* r) {
+  r->f = f;
+  r->spanbin = NULL;
+  r->buffer = NULL;
+  r->capacity = 0;
+  if (IsSpanBin(f)) {
+    r->spanbin = &r->spanbin_reader;
+    OpenSpanBin(f, r->spanbin);
+    SelectSpanBin(r->spanbin, -kSpanBinAllTs, kSpanBinAllTs, -1, 0x7FFFFFFF);
+    // Room for the longest non-span line; span lines fit in kMaxLineSize
+    size_t maxlen = kMaxLineSize;
+    for (int i = 0; i < r->spanbin->head.size(); ++i) {
+      if (maxlen <= r->spanbin->head[i].size()) {maxlen = r->spanbin->head[i].size() + 1;}
+    }
+    for (int i = 0; i < r->spanbin->tail.size(); ++i) {
+      if (maxlen <= r->spanbin->tail[i].size()) {maxlen = r->spanbin->tail[i].size() + 1;}
+    }
+    r->capacity = maxlen;
+    r->buffer = reinterpret_cast<char*>(malloc(r->capacity));
+  }
+}
+
+void CloseSpanLines(SpanLineReader* r) {
+  free(r->buffer);
+  r->buffer = NULL;
+  r->capacity = 0;
+}
+
+bool ReadSpanLine(SpanLineReader* r, SpanLine* line) {
+  if (r->spanbin != NULL) {
+    if (!ReadSpanBinLine(r->spanbin, r->buffer, r->capacity)) {return false;}
+  } else {
+    ssize_t len = getline(&r->buffer, &r->capacity, r->f);
+    if (len < 0) {return false;}
+    // Strip any crlf or cr or lf
+    if ((0 < len) && (r->buffer[len - 1] == '\n')) {r->buffer[--len] = '\0';}
+    if ((0 < len) && (r->buffer[len - 1] == '\r')) {r->buffer[--len] = '\0';}
+  }
+  ParseSpanLine(r->buffer, line);
+  return true;
+}
+
+bool ParseSpanLine(const char* text, SpanLine* line) {
+  line->text = text;
+  line->name = NULL;
+  line->is_span = false;
+  if (text[0] != '[') {return false;}
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.01911486, 0.00028634, 2, 6789, 0, 2050, 53763, 46, 0, "open"],
+  int name_pos = 0;
+  int n = sscanf(text, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                 &line->start_ts, &line->duration, &line->cpu, &line->pid, &line->rpcid,
+                 &line->eventnum, &line->arg, &line->retval, &line->ipc, &name_pos);
+  if ((n < 9) || (name_pos == 0) || (text[name_pos] == '\0')) {return false;}
+  line->name = text + name_pos;
+  line->is_span = true;
+  return true;
+}
+
+string Unquote(const char* s) {
+  if (*s == '"') {++s;}
+  const char* end = strchr(s, '"');
+  return (end == NULL) ? string(s) : string(s, end - s);
+}
+
+// Must exactly match eventtospan3 PutSpanJson
+int FormatSpanBin(const SpanBin& rec, const vector<string>& names,
+                  char* buffer, int maxsize) {
+  const string& name = names[rec.name_id];
+  if (maxsize < kMaxLineSize || (kMaxLineSize - 128) < name.size()) {
+    return snprintf(buffer, maxsize, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],",
+                    rec.start_ts / 100000000.0, rec.duration / 100000000.0,
+                    rec.cpu, rec.pid, rec.rpcid, rec.eventnum,
+                    rec.arg, rec.retval, rec.ipc, name.c_str());
+  }
+  char* p = buffer;
+  *p++ = '[';
+  p = PutTicks(p, rec.start_ts, 12);
+  *p++ = ',';
+  *p++ = ' ';
+  p = PutTicks(p, rec.duration, 10);
+  p = PutInt(p, rec.cpu);
+  p = PutInt(p, rec.pid);
+  p = PutInt(p, rec.rpcid);
+  p = PutInt(p, rec.eventnum);
+  p = PutInt(p, rec.arg);
+  p = PutInt(p, rec.retval);
+  p = PutInt(p, rec.ipc);
+  *p++ = ',';
+  *p++ = ' ';
+  *p++ = '"';
+  memcpy(p, name.data(), name.size());
+  p += name.size();
+  *p++ = '"';
+  *p++ = ']';
+  *p++ = ',';
+  *p = '\0';
+  return p - buffer;
+}
+
+// A span line's time in seconds, compared as a double, can round either way
+// from the tick count; a tick of slack either side keeps every candidate
+int64 SpanBinLoTicks(double sec) {
+  if (sec <= 0.0) {return -kSpanBinAllTs;}
+  if (9.0e10 <= sec) {return kSpanBinAllTs;}
+  return (int64)(sec * 100000000.0) - 1;
+}
+
+int64 SpanBinHiTicks(double sec) {
+  if (sec < 0.0) {return -kSpanBinAllTs;}
+  if (9.0e10 <= sec) {return kSpanBinAllTs;}
+  return (int64)(sec * 100000000.0) + 1;
+}
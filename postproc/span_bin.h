@@ -0,0 +1,227 @@
+// span_bin.h
+// Copyright 2023 Richard L. Sites
+//
+// Seekable binary form of the eventtospan3 span JSON, written alongside it
+// by eventtospan3 -spanbin. The span tools can then pull out a time window or
+// a few CPUs by reading just the chunks the index says overlap, instead of
+// sscanf-ing every line of a JSON file that can be GBs for a long trace.
+//
+// File layout:
+//   8-byte magic "KUSPBIN1"
+//   Chunks of 48-byte SpanBin records. Each chunk holds up to
+//     kSpanBinChunkSpans spans of a single CPU, in the order eventtospan3
+//     produced them, which is nearly time order
+//   The name dictionary: for each name, a uint32 byte length and the bytes,
+//     NUL-padded to a multiple of eight bytes after the length
+//   The JSON text lines that are not spans, as eventtospan3 wrote them
+//   The index: one 32-byte SpanBinChunk per chunk
+//   The 64-byte SpanBinFooter, ending in the magic "KUSPEND1"
+//
+// Reading gives back the same lines, in the same order, as the sorted JSON
+// file eventtospan3 |sort writes, restricted to the chunks selected.
+//
+
+#ifndef __SPAN_BIN_H__
+#define __SPAN_BIN_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basetypes.h"
+
+static const char* const kSpanBinMagic = "KUSPBIN1";
+static const char* const kSpanBinEndMagic = "KUSPEND1";
+static const int kSpanBinMagicLen = 8;
+static const int kSpanBinChunkSpans = 4096;	// Spans per chunk, at most
+
+// One span, 48 bytes
+typedef struct {
+  int64 start_ts;	// Multiples of 10ns
+  int64 duration;	// Multiples of 10ns
+  int32 cpu;		// -1 for spans not on any CPU, such as queued spans
+  int32 pid;
+  int32 rpcid;
+  int32 eventnum;
+  int32 arg;
+  int32 retval;
+  int32 ipc;
+  uint32 name_id;	// Index into the name dictionary
+} SpanBin;
+
+// One chunk of the index, 32 bytes
+typedef struct {
+  int64 lo_ts;		// Smallest span start_ts in the chunk
+  int64 hi_ts;		// Largest span start_ts in the chunk
+  uint64 offset;	// File offset of the first span
+  int32 cpu;
+  uint32 count;		// Number of spans
+} SpanBinChunk;
+
+// Last 64 bytes of the file
+typedef struct {
+  uint64 names_offset;
+  uint64 text_offset;
+  uint64 index_offset;
+  uint64 text_len;
+  uint32 name_count;
+  uint32 chunk_count;
+  uint64 span_count;
+  uint64 unused;
+  char magic[8];	// kSpanBinEndMagic
+} SpanBinFooter;
+
+// Writer state: each CPU's chunk being filled, plus the index so far
+typedef struct {
+  FILE* f;
+  uint64 offset;		// Bytes written so far
+  uint64 span_count;
+  std::map<int, std::vector<SpanBin> > pending;	// Chunk being filled, by CPU
+  std::vector<SpanBinChunk> chunks;
+  std::string text;		// Non-span JSON lines
+} SpanBinWriter;
+
+// All the spans of a trace in memory, as eventtospan3 hands them to
+// kutrace_post instead of writing JSON or a binary span file
+typedef struct {
+  std::vector<std::string> names;	// Indexed by name_id
+  std::vector<SpanBin> spans;		// In the order eventtospan3 produced them
+  std::string text;			// Non-span JSON lines
+} SpanSet;
+
+// Reader state. Only the chunks selected are in memory
+typedef struct {
+  FILE* f;				// NULL if opened on a SpanSet
+  SpanBinFooter footer;
+  std::vector<std::string> names;	// Indexed by name_id
+  std::vector<std::string> head;	// Non-span lines that sort ahead of the spans
+  std::vector<std::string> tail;	// Non-span lines that sort after them
+  std::vector<SpanBinChunk> chunks;
+  std::vector<SpanBin> spans;		// Spans selected, in sorted JSON order
+  int next_head;
+  int next_span;
+  int next_tail;
+  bool marker_done;			// The 999.0 end marker line
+} SpanBinReader;
+
+// The window that means all of the trace
+static const int64 kSpanBinAllTs = 0x7FFFFFFFFFFFFFFFLL;
+
+// Fixed-point JSON text straight from 10ns ticks, shared with eventtospan3.
+// This gives exactly what %<width>.8f prints for ticks / 100000000.0 whenever
+// the double holds ticks exactly, which is below 2**53 ticks (about 2.8 years).
+static const uint64 kMaxExactTicks = 1LLU << 53;
+
+// Append x right-justified in width, as %<width>.8f of x / 100000000.0
+inline char* PutTicks(char* p, uint64 ticks, int width) {
+  if (kMaxExactTicks <= ticks) {
+    // Never in a real trace; let printf round it the same way it always has
+    return p + sprintf(p, "%*.8f", width, ticks / 100000000.0);
+  }
+  char digits[32];
+  char* d = &digits[sizeof(digits)];
+  uint64 frac = ticks % 100000000;
+  uint64 whole = ticks / 100000000;
+  for (int i = 0; i < 8; ++i) {*--d = '0' + (frac % 10); frac /= 10;}
+  *--d = '.';
+  do {*--d = '0' + (whole % 10); whole /= 10;} while (whole != 0);
+  int len = &digits[sizeof(digits)] - d;
+  for (int i = len; i < width; ++i) {*p++ = ' ';}
+  memcpy(p, d, len);
+  return p + len;
+}
+
+// Append ", " and x, as ", %d"
+inline char* PutInt(char* p, int x) {
+  *p++ = ',';
+  *p++ = ' ';
+  uint32 ux = x;
+  if (x < 0) {*p++ = '-'; ux = -ux;}
+  char digits[16];
+  char* d = &digits[sizeof(digits)];
+  do {*--d = '0' + (ux % 10); ux /= 10;} while (ux != 0);
+  int len = &digits[sizeof(digits)] - d;
+  memcpy(p, d, len);
+  return p + len;
+}
+
+
+// Writing, used by eventtospan3
+void InitSpanBinWriter(FILE* f, SpanBinWriter* w);
+void WriteSpanBin(SpanBinWriter* w, const SpanBin& rec);
+// Non-span JSON text, one or more whole lines
+void WriteSpanBinText(SpanBinWriter* w, const char* text, size_t len);
+// Flush the last chunks and write the names, text, index, and footer
+void CloseSpanBinWriter(SpanBinWriter* w, const std::vector<std::string>& names);
+
+// Reading, used by spantotrim, spantospan, and spantoprof, and by
+// OpenSpanLines for the other span tools
+// True if f starts with the binary magic. Anything else consumes nothing,
+// so the JSON can be read as before
+bool IsSpanBin(FILE* f);
+// Read the footer, names, text, and index. f must be seekable
+void OpenSpanBin(FILE* f, SpanBinReader* r);
+// Load the spans of every chunk that overlaps start times lo_ts..hi_ts
+// inclusive on CPUs lo_cpu..hi_cpu inclusive. Chunks are whole, so callers
+// still filter individual spans. Spans with cpu -1 go along with any CPUs
+void SelectSpanBin(SpanBinReader* r, int64 lo_ts, int64 hi_ts, int lo_cpu, int hi_cpu);
+// Next line of the sorted JSON, without the newline. False at the end
+bool ReadSpanBinLine(SpanBinReader* r, char* buffer, int maxsize);
+// As ReadSpanBinLine, but a span line comes back as just its record in *span,
+// with buffer untouched. *span is NULL for the other lines
+bool ReadSpanBinItem(SpanBinReader* r, const SpanBin** span, char* buffer, int maxsize);
+// Start over at the first line
+void RewindSpanBin(SpanBinReader* r);
+// Read a SpanSet as if it were a binary span file with every chunk selected.
+// This takes over the set's names and spans
+void OpenSpanSet(SpanSet* set, SpanBinReader* r);
+
+// One line of span JSON as the span tools see it, from either form of input.
+// The fields after text are set only for span lines
+typedef struct {
+  const char* text;	// The whole line, without the newline
+  bool is_span;		// Ten fields: ts dur cpu pid rpc event arg ret ipc name
+  double start_ts;	// Seconds
+  double duration;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  const char* name;	// The rest of the line, starting with the quoted name
+} SpanLine;
+
+// Line-at-a-time reader shared by the span tools. Lines may be any length
+typedef struct {
+  FILE* f;
+  SpanBinReader* spanbin;	// NULL for JSON text
+  SpanBinReader spanbin_reader;
+  char* buffer;
+  size_t capacity;
+} SpanLineReader;
+
+// Read all of f: the JSON as is, or every chunk of a binary span file
+void OpenSpanLines(FILE* f, SpanLineReader* r);
+void CloseSpanLines(SpanLineReader* r);
+// Next line, parsed if it is a span. False at the end. line->text and
+// line->name are valid until the next call
+bool ReadSpanLine(SpanLineReader* r, SpanLine* line);
+// Parse text as a span line. False, with line->is_span false, if it is not one
+bool ParseSpanLine(const char* text, SpanLine* line);
+// A span line's name, line->name, without the quotes and trailing ],
+std::string Unquote(const char* name);
+
+// The exact span JSON line eventtospan3 writes, without the newline
+int FormatSpanBin(const SpanBin& rec, const std::vector<std::string>& names,
+                  char* buffer, int maxsize);
+
+// Seconds as on a span JSON line, rounded outward to 10ns ticks, for windows
+int64 SpanBinLoTicks(double sec);
+int64 SpanBinHiTicks(double sec);
+
+#endif	// __SPAN_BIN_H__
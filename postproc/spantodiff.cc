@@ -0,0 +1,389 @@
+// Little program to compare two traces, A and B, category by category
+//
+// Reads two span files and writes a text report to stdout of where the time
+// went differently: per kernel event or wait name, per process name (PID
+// basename, so bash.1234 and bash.5678 line up), and per RPC method. Each
+// category shows total time, count, and latency percentiles for A and B,
+// and the categories are ranked by how much of the total difference they
+// account for. With -json, also writes a row profile that show_cpu.html
+// loads like spantoprof output: one pair of A and B bars per category.
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.09.01
+//  Either input may be the binary span file from eventtospan3 -spanbin
+//
+// Times are raw totals, not normalized to trace length; the report header
+// gives both trace lengths. Event latencies are per span, so a syscall
+// split by an interrupt counts as two pieces -- spantolat merges those.
+// RPC latency is request to response.
+//
+// Compile with g++ -O2 spantodiff.cc latency_hist.cc span_bin.cc -o spantodiff
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "latency_hist.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define largest_non_pid    0xffff
+
+// One category of one trace
+typedef struct {
+  int64 ticks;		// Total time, 10ns
+  int eventnum;		// First seen, for coloring the JSON bars
+  LatHist hist;
+} CatTotal;
+
+typedef map<string, CatTotal> CatMap;
+
+// An RPC request not yet answered
+typedef struct {
+  int64 req_ts;
+  string method;
+} OpenRpc;
+
+// Everything about one trace
+typedef struct {
+  const char* fname;
+  CatMap events;	// Kernel events and waits, by name
+  CatMap pids;		// User-mode execution, by process basename
+  CatMap rpcs;		// Request to response, by method
+  map<int, OpenRpc> open_rpcs;
+  string header;	// JSON text ahead of "events"
+  int64 lo_ts;
+  int64 hi_ts;
+} TraceTotals;
+
+// One line of a report, A and B side by side
+typedef struct {
+  string name;
+  const CatTotal* a;	// NULL if only in B
+  const CatTotal* b;	// NULL if only in A
+  int64 delta;		// B - A ticks
+} DiffRow;
+
+static int top_n = 20;
+
+
+// method.rpcid => method, bash.1234 => bash
+string Basename(const string& s) {
+  size_t dot = s.rfind('.');
+  string retval = (dot == string::npos) ? s : s.substr(0, dot);
+  return retval.empty() ? string("-") : retval;
+}
+
+void AddCat(CatMap* m, const string& name, int eventnum, int64 ticks) {
+  CatMap::iterator it = m->find(name);
+  if (it == m->end()) {
+    CatTotal temp;
+    temp.ticks = 0;
+    temp.eventnum = eventnum;
+    InitLatHist(&temp.hist);
+    it = m->insert(std::make_pair(name, temp)).first;
+  }
+  it->second.ticks += ticks;
+  AddLatHist(&it->second.hist, ticks);
+}
+
+void DoSpan(int64 ts, int64 dur, int cpu, int eventnum, int arg, const char* name,
+            TraceTotals* t) {
+  if ((t->lo_ts < 0) || (ts < t->lo_ts)) {t->lo_ts = ts;}
+  if (t->hi_ts < ts + dur) {t->hi_ts = ts + dur;}
+
+  if (eventnum == KUTRACE_RPCIDREQ) {
+    int rpcid = arg & 0xffff;
+    if (rpcid == 0) {return;}
+    OpenRpc r;
+    r.req_ts = ts;
+    r.method = Basename(Unquote(name));
+    t->open_rpcs[rpcid] = r;
+    return;
+  }
+  if (eventnum == KUTRACE_RPCIDRESP) {
+    map<int, OpenRpc>::iterator it = t->open_rpcs.find(arg & 0xffff);
+    if (it == t->open_rpcs.end()) {return;}
+    // Bars for RPCs get a user-mode color per method
+    AddCat(&t->rpcs, it->second.method, 0x10000 | (arg & 0xffff), ts - it->second.req_ts);
+    t->open_rpcs.erase(it);
+    return;
+  }
+  if ((KUTRACE_WAITA <= eventnum) && (eventnum <= KUTRACE_WAITZ)) {
+    AddCat(&t->events, Unquote(name), eventnum, dur);
+    return;
+  }
+  if (cpu < 0) {return;}
+  if (largest_non_pid < eventnum) {
+    AddCat(&t->pids, Basename(Unquote(name)), eventnum, dur);
+  } else if ((KUTRACE_TRAP <= eventnum) && (eventnum < 0x1000)) {
+    AddCat(&t->events, Unquote(name), eventnum, dur);
+  }
+}
+
+void ReadTrace(const char* fname, TraceTotals* t) {
+  t->fname = fname;
+  t->lo_ts = -1;
+  t->hi_ts = 0;
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+
+  SpanLineReader reader;
+  OpenSpanLines(f, &reader);
+  bool in_header = true;
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {
+      if (!in_header) {continue;}
+      // The header ends at "events", which may share a line with the first span
+      const char* events = strstr(line.text, "\"events\"");
+      if (events == NULL) {
+        t->header.append(line.text);
+        t->header.append("\n");
+        continue;
+      }
+      t->header.append(line.text, events - line.text);
+      in_header = false;
+      const char* first = strchr(events, '[');
+      if (first == NULL) {continue;}
+      ++first;
+      while (*first == ' ') {++first;}
+      if (!ParseSpanLine(first, &line)) {continue;}
+    }
+    in_header = false;
+    if (line.start_ts >= 999.0) {break;}	// End marker
+    DoSpan((int64)(line.start_ts * 100000000.0 + 0.5), (int64)(line.duration * 100000000.0 + 0.5),
+           line.cpu, line.eventnum, line.arg, line.name, t);
+  }
+  CloseSpanLines(&reader);
+  fclose(f);
+}
+
+uint64 CountOf(const CatTotal* c) {return (c == NULL) ? 0 : c->hist.count;}
+
+bool BiggerDelta(const DiffRow& x, const DiffRow& y) {
+  int64 dx = (x.delta < 0) ? -x.delta : x.delta;
+  int64 dy = (y.delta < 0) ? -y.delta : y.delta;
+  if (dx != dy) {return dx > dy;}
+  return x.name < y.name;
+}
+
+// Every category in either trace, biggest absolute difference first
+void MakeDiffRows(const CatMap& a, const CatMap& b, vector<DiffRow>* rows) {
+  rows->clear();
+  for (CatMap::const_iterator it = a.begin(); it != a.end(); ++it) {
+    DiffRow row;
+    row.name = it->first;
+    row.a = &it->second;
+    CatMap::const_iterator it2 = b.find(it->first);
+    row.b = (it2 == b.end()) ? NULL : &it2->second;
+    row.delta = ((row.b == NULL) ? 0 : row.b->ticks) - row.a->ticks;
+    rows->push_back(row);
+  }
+  for (CatMap::const_iterator it = b.begin(); it != b.end(); ++it) {
+    if (a.find(it->first) != a.end()) {continue;}
+    DiffRow row;
+    row.name = it->first;
+    row.a = NULL;
+    row.b = &it->second;
+    row.delta = row.b->ticks;
+    rows->push_back(row);
+  }
+  std::sort(rows->begin(), rows->end(), BiggerDelta);
+}
+
+// Percentile in usec, or 0 for a category missing from one trace
+double Pct(const CatTotal* c, double pct) {
+  return (c == NULL) ? 0.0 : LatHistPercentile(c->hist, pct) / 100.0;
+}
+
+void PrintGroup(FILE* f, const char* label, const vector<DiffRow>& rows) {
+  int64 total_a = 0;
+  int64 total_b = 0;
+  int64 total_abs = 0;
+  for (int i = 0; i < (int)rows.size(); ++i) {
+    if (rows[i].a != NULL) {total_a += rows[i].a->ticks;}
+    if (rows[i].b != NULL) {total_b += rows[i].b->ticks;}
+    total_abs += (rows[i].delta < 0) ? -rows[i].delta : rows[i].delta;
+  }
+
+  fprintf(f, "\n%-24s %10s %10s %10s %6s %9s %9s %9s %9s %9s %9s %9s\n", label,
+          "A_msec", "B_msec", "delta", "share", "A_count", "B_count", "delta",
+          "A_p50", "B_p50", "A_p99", "B_p99");
+  fprintf(f, "%-24s %10.3f %10.3f %10.3f\n", "(all)",
+          total_a / 100000.0, total_b / 100000.0, (total_b - total_a) / 100000.0);
+  for (int i = 0; (i < (int)rows.size()) && (i < top_n); ++i) {
+    const DiffRow& row = rows[i];
+    int64 abs_delta = (row.delta < 0) ? -row.delta : row.delta;
+    double share = (total_abs == 0) ? 0.0 : (abs_delta * 100.0) / total_abs;
+    uint64 count_a = CountOf(row.a);
+    uint64 count_b = CountOf(row.b);
+    fprintf(f, "%-24s %10.3f %10.3f %10.3f %5.1f%% %9llu %9llu %9lld %9.2f %9.2f %9.2f %9.2f\n",
+            row.name.c_str(),
+            ((row.a == NULL) ? 0 : row.a->ticks) / 100000.0,
+            ((row.b == NULL) ? 0 : row.b->ticks) / 100000.0,
+            row.delta / 100000.0, share, count_a, count_b,
+            (int64)count_b - (int64)count_a,
+            Pct(row.a, 50.0), Pct(row.b, 50.0), Pct(row.a, 99.0), Pct(row.b, 99.0));
+  }
+}
+
+// s with JSON string escapes, without the surrounding quotes
+string JsonEscape(const string& s) {
+  string retval;
+  for (int i = 0; i < (int)s.size(); ++i) {
+    unsigned char c = s[i];
+    if ((c == '"') || (c == '\\')) {
+      retval.push_back('\\');
+      retval.push_back(c);
+    } else if (c < 0x20) {
+      char temp[8];
+      snprintf(temp, sizeof(temp), "\\u%04x", c);
+      retval.append(temp);
+    } else {
+      retval.push_back(c);
+    }
+  }
+  return retval;
+}
+
+// The "key" : value pairs of a JSON header, values as written. Values are
+// numbers or strings; nothing in the header nests
+void ParseHeaderKeys(const string& header, map<string, string>* keys) {
+  const char* p = header.c_str();
+  for (;;) {
+    const char* key = strchr(p, '"');
+    if (key == NULL) {return;}
+    const char* key_end = strchr(key + 1, '"');
+    if (key_end == NULL) {return;}
+    p = key_end + 1;
+    while ((*p == ' ') || (*p == '\t')) {++p;}
+    if (*p != ':') {continue;}
+    ++p;
+    while ((*p == ' ') || (*p == '\t')) {++p;}
+    const char* value = p;
+    if (*p == '"') {
+      for (++p; (*p != '\0') && (*p != '"'); ++p) {
+        if ((*p == '\\') && (p[1] != '\0')) {++p;}
+      }
+      if (*p == '"') {++p;}
+    } else {
+      while ((*p != '\0') && (*p != ',') && (*p != '}') && (*p != '\n') && (*p != ' ')) {++p;}
+    }
+    (*keys)[string(key + 1, key_end - key - 1)] = string(value, p - value);
+  }
+}
+
+// A row of the profile JSON: a label marker, then one bar of total time.
+// The CPU field is the row number, as spantoprof -row writes
+int WriteBarRow(FILE* f, int rownum, const string& label, const CatTotal* c,
+                const CatTotal* other) {
+  const CatTotal* color = (c != NULL) ? c : other;
+  fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
+          0.0, 0.0, rownum, -1, -1, KUTRACE_LEFTMARK, 0, 0, 0, JsonEscape(label).c_str());
+  if ((c != NULL) && (0 < c->ticks)) {
+    fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
+            0.0, c->ticks / 100000000.0, rownum, -1, -1, color->eventnum, 0, 0, 0,
+            JsonEscape(label.substr(2)).c_str());
+  }
+  return rownum + 1;
+}
+
+int WriteBarGroup(FILE* f, int rownum, const char* prefix, const vector<DiffRow>& rows) {
+  for (int i = 0; (i < (int)rows.size()) && (i < top_n); ++i) {
+    string name = string(prefix) + rows[i].name;
+    rownum = WriteBarRow(f, rownum, "A " + name, rows[i].a, rows[i].b);
+    rownum = WriteBarRow(f, rownum, "B " + name, rows[i].b, rows[i].a);
+  }
+  return rownum;
+}
+
+// A's header keys with a new title and the presorted flag, one per line in
+// sorted order as eventtospan3 |sort writes them, then the bars
+void WriteJson(FILE* f, const TraceTotals& a, const TraceTotals& b,
+               const vector<DiffRow>& events, const vector<DiffRow>& pids,
+               const vector<DiffRow>& rpcs) {
+  map<string, string> keys;
+  ParseHeaderKeys(a.header, &keys);
+  keys["presorted"] = "1";
+  keys["title"] = "\"" + JsonEscape(string("A ") + a.fname + " vs B " + b.fname) + "\"";
+  fprintf(f, "  {\n");
+  for (map<string, string>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+    fprintf(f, " \"%s\" : %s,\n", it->first.c_str(), it->second.c_str());
+  }
+  fprintf(f, "\"events\" : [\n");
+  int rownum = 0x10000;
+  rownum = WriteBarGroup(f, rownum, "", events);
+  rownum = WriteBarGroup(f, rownum, "", pids);
+  rownum = WriteBarGroup(f, rownum, "rpc ", rpcs);
+  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
+  fprintf(f, "]}\n");
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantodiff <A spans> <B spans> [-top n] [-json fname]\n");
+  exit(0);
+}
+
+int main (int argc, const char** argv) {
+  const char* fname[2] = {NULL, NULL};
+  const char* json_fname = NULL;
+  int nfiles = 0;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-top") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-json") == 0) && (i < (argc - 1))) {
+      json_fname = argv[++i];
+    }
+    else if ((argv[i][0] != '-') && (nfiles < 2)) {fname[nfiles++] = argv[i];}
+    else Usage();
+  }
+  if (nfiles < 2) {Usage();}
+
+  TraceTotals a;
+  TraceTotals b;
+  ReadTrace(fname[0], &a);
+  ReadTrace(fname[1], &b);
+
+  vector<DiffRow> events, pids, rpcs;
+  MakeDiffRows(a.events, b.events, &events);
+  MakeDiffRows(a.pids, b.pids, &pids);
+  MakeDiffRows(a.rpcs, b.rpcs, &rpcs);
+
+  fprintf(stdout, "# spantodiff: A %s, B %s\n", a.fname, b.fname);
+  fprintf(stdout, "# Trace length A %.6f sec, B %.6f sec\n",
+          (a.hi_ts - a.lo_ts) / 100000000.0, (b.hi_ts - b.lo_ts) / 100000000.0);
+  fprintf(stdout, "# delta is B - A; share is of the summed absolute deltas; p50/p99 usec\n");
+  PrintGroup(stdout, "event", events);
+  PrintGroup(stdout, "process", pids);
+  if (!rpcs.empty()) {PrintGroup(stdout, "rpc method", rpcs);}
+
+  if (json_fname != NULL) {
+    FILE* f = fopen(json_fname, "w");
+    if (f == NULL) {
+      fprintf(stderr, "%s did not open\n", json_fname);
+      exit(0);
+    }
+    WriteJson(f, a, b, events, pids, rpcs);
+    fclose(f);
+  }
+  fprintf(stderr, "spantodiff: %d events, %d processes, %d rpc methods\n",
+          (int)events.size(), (int)pids.size(), (int)rpcs.size());
+  return 0;
+}
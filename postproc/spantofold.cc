@@ -0,0 +1,345 @@
+// Little program to turn PC samples into a folded-stack CPU profile
+//
+// Filter from stdin to stdout, producing one line per distinct stack,
+//   frame;frame;frame count
+// the input format of flamegraph.pl and speedscope. With -html, also writes
+// a self-contained flame graph page that needs nothing else to view.
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.08.29
+//  First version, folding the PC sample spans of the JSON or of an
+//  eventtospan3 -spanbin file
+//
+// Run this after samptoname_k and samptoname_u so that the samples have
+// routine names instead of hex PCs. A sample has no call stack, so each stack
+// is just
+//   process.pid;routine            or, with -rpc or -mark,
+//   process.pid;group;routine
+// where kernel routines are suffixed _[k] as flamegraph.pl colors them.
+// The group is the RPC method the PID was working on when the sample was
+// taken, or the label of the PID's most recent mark_a.
+//
+// A sample span runs from the previous sample on its CPU up to the moment
+// this sample was taken, so a sample is held until the input reaches its end
+// time and is then charged to whatever its PID was doing at that moment.
+//
+// Compile with g++ -O2 spantofold.cc span_bin.cc -o spantofold
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>	// for pair
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "span_bin.h"
+
+using std::map;
+using std::multimap;
+using std::string;
+using std::vector;
+
+#define largest_non_pid    0xffff
+
+
+static const int GROUP_NONE = 0;
+static const int GROUP_RPC = 1;
+static const int GROUP_MARK = 2;
+
+// A sample waiting for the input to reach the moment it was taken
+typedef struct {
+  int pid;
+  bool kernel;
+  string name;
+} PcSample;
+
+// What each PID is doing, as of the input so far
+typedef struct {
+  int rpcid;
+  string mark;		// Label of its latest mark_a
+} PidState;
+
+typedef std::pair<int, string> FoldKey;	// PID, rest of the stack
+
+static int group_by = GROUP_NONE;
+static int only_pid = -1;
+
+static multimap<int64, PcSample> pending;	// By sample time
+static map<int, PidState> pidstate;
+static map<int, string> pidnames;		// From user-mode spans
+static map<int, string> methods;		// By RPC id
+static map<FoldKey, uint64> folded;
+static uint64 total_samples = 0;
+
+
+// method.rpcid => method
+string MethodName(const char* name) {
+  string s = Unquote(name);
+  size_t dot = s.rfind('.');
+  if (dot != string::npos) {s.resize(dot);}
+  if (s.empty()) {s = "-";}
+  return s;
+}
+
+// Semicolons separate frames and the last space separates the count
+string FrameName(const string& s) {
+  string retval = s.empty() ? string("-") : s;
+  for (int i = 0; i < (int)retval.size(); ++i) {
+    if ((retval[i] == ';') || (retval[i] == ' ')) {retval[i] = '_';}
+  }
+  return retval;
+}
+
+string PidName(int pid) {
+  map<int, string>::const_iterator it = pidnames.find(pid);
+  if (it != pidnames.end()) {return FrameName(it->second);}
+  char temp[16];
+  snprintf(temp, sizeof(temp), "pid.%d", pid);
+  return string(temp);
+}
+
+// Charge one sample to its PID's current RPC or mark
+void FoldSample(const PcSample& samp) {
+  string rest;
+  if (group_by != GROUP_NONE) {
+    map<int, PidState>::const_iterator it = pidstate.find(samp.pid);
+    string group;
+    if (it != pidstate.end()) {
+      if (group_by == GROUP_MARK) {
+        group = it->second.mark;
+      } else if (it->second.rpcid != 0) {
+        map<int, string>::const_iterator it2 = methods.find(it->second.rpcid);
+        group = (it2 != methods.end()) ? it2->second : string("rpc");
+      }
+    }
+    rest = FrameName(group) + ";";
+  }
+  rest += FrameName(samp.name);
+  if (samp.kernel) {rest += "_[k]";}
+  ++folded[FoldKey(samp.pid, rest)];
+  ++total_samples;
+}
+
+// Fold the samples taken before ts, now that we know what was running then
+void FlushPending(int64 ts) {
+  while (!pending.empty() && (pending.begin()->first <= ts)) {
+    FoldSample(pending.begin()->second);
+    pending.erase(pending.begin());
+  }
+}
+
+void PrintFolded(FILE* f, const vector<std::pair<string, uint64> >& lines) {
+  for (int i = 0; i < (int)lines.size(); ++i) {
+    fprintf(f, "%s %llu\n", lines[i].first.c_str(), lines[i].second);
+  }
+}
+
+// JavaScript string, safe inside a script element
+void PrintJsString(FILE* f, const string& s) {
+  fputc('"', f);
+  for (int i = 0; i < (int)s.size(); ++i) {
+    char c = s[i];
+    if ((c == '"') || (c == '\\')) {fputc('\\', f); fputc(c, f);}
+    else if (c == '<') {fprintf(f, "\\x3c");}
+    else if ((uint8)c < 0x20) {fprintf(f, "\\x%02x", (uint8)c);}
+    else {fputc(c, f);}
+  }
+  fputc('"', f);
+}
+
+// Frames are drawn top-down from the process, widths in proportion to
+// samples. Click a frame to zoom in on it; click the top bar to zoom out.
+static const char* kHtmlHead =
+  "<!DOCTYPE html>\n"
+  "<html><head><meta charset=\"utf-8\"><title>KUtrace PC sample profile</title>\n"
+  "<style>\n"
+  "body {font-family: sans-serif; font-size: 12px; margin: 8px;}\n"
+  "#graph {position: relative; width: 100%;}\n"
+  ".fr {position: absolute; height: 15px; line-height: 15px; overflow: hidden;\n"
+  "     white-space: nowrap; border-right: 1px solid white; box-sizing: border-box;\n"
+  "     padding-left: 2px; cursor: pointer;}\n"
+  ".fr:hover {filter: brightness(80%);}\n"
+  "#info {height: 18px;}\n"
+  "</style></head><body>\n"
+  "<div id=\"info\"></div>\n"
+  "<div id=\"graph\"></div>\n"
+  "<script>\n";
+
+static const char* kHtmlTail =
+  "var kRow = 16;\n"
+  "function Node(name) {return {name: name, value: 0, kids: {}};}\n"
+  "var root = Node(\"all\");\n"
+  "for (var i = 0; i < folded.length; ++i) {\n"
+  "  var frames = folded[i][0].split(\";\");\n"
+  "  var n = root;\n"
+  "  n.value += folded[i][1];\n"
+  "  for (var j = 0; j < frames.length; ++j) {\n"
+  "    if (!(frames[j] in n.kids)) {n.kids[frames[j]] = Node(frames[j]);}\n"
+  "    n = n.kids[frames[j]];\n"
+  "    n.value += folded[i][1];\n"
+  "  }\n"
+  "}\n"
+  "function Color(name) {\n"
+  "  var h = 0;\n"
+  "  for (var i = 0; i < name.length; ++i) {h = (h * 31 + name.charCodeAt(i)) & 0xffff;}\n"
+  "  if (name.endsWith(\"_[k]\")) {return \"hsl(\" + (25 + h % 15) + \",80%,\" + (60 + h % 10) + \"%)\";}\n"
+  "  return \"hsl(\" + (h % 55) + \",90%,\" + (55 + h % 15) + \"%)\";\n"
+  "}\n"
+  "function Depth(n) {\n"
+  "  var d = 0;\n"
+  "  for (var k in n.kids) {d = Math.max(d, Depth(n.kids[k]));}\n"
+  "  return d + 1;\n"
+  "}\n"
+  "function Draw(top, path) {\n"
+  "  var g = document.getElementById(\"graph\");\n"
+  "  g.innerHTML = \"\";\n"
+  "  g.style.height = ((Depth(top) + path.length) * kRow) + \"px\";\n"
+  "  var width = g.clientWidth;\n"
+  "  function Box(n, x, w, y, parents) {\n"
+  "    var d = document.createElement(\"div\");\n"
+  "    d.className = \"fr\";\n"
+  "    d.style.left = x + \"px\";\n"
+  "    d.style.width = w + \"px\";\n"
+  "    d.style.top = (y * kRow) + \"px\";\n"
+  "    d.style.background = (parents == null) ? \"#ddd\" : Color(n.name);\n"
+  "    var pct = (100 * n.value / root.value).toFixed(2);\n"
+  "    d.textContent = n.name;\n"
+  "    d.title = n.name + \"\\n\" + n.value + \" samples, \" + pct + \"%\";\n"
+  "    d.onmouseover = function() {\n"
+  "      document.getElementById(\"info\").textContent = n.name + \"  \" + n.value + \" samples, \" + pct + \"%\";\n"
+  "    };\n"
+  "    d.onclick = function() {\n"
+  "      if (parents == null) {Draw(root, []);} else {Draw(n, parents);}\n"
+  "    };\n"
+  "    g.appendChild(d);\n"
+  "  }\n"
+  "  // Zoomed-out ancestors as full-width bars\n"
+  "  for (var i = 0; i < path.length; ++i) {Box(path[i], 0, width, i, null);}\n"
+  "  function Lay(n, x, y, parents) {\n"
+  "    var w = width * n.value / top.value;\n"
+  "    if (w < 1) {return;}\n"
+  "    Box(n, x, w, y, parents);\n"
+  "    var kids = Object.keys(n.kids).sort();\n"
+  "    var here = parents.concat([n]);\n"
+  "    for (var i = 0; i < kids.length; ++i) {\n"
+  "      var k = n.kids[kids[i]];\n"
+  "      Lay(k, x, y + 1, here);\n"
+  "      x += width * k.value / top.value;\n"
+  "    }\n"
+  "  }\n"
+  "  Lay(top, 0, path.length, path);\n"
+  "}\n"
+  "Draw(root, []);\n"
+  "window.onresize = function() {Draw(root, []);};\n"
+  "</script></body></html>\n";
+
+void PrintHtml(FILE* f, const vector<std::pair<string, uint64> >& lines) {
+  fputs(kHtmlHead, f);
+  fprintf(f, "var folded = [\n");
+  for (int i = 0; i < (int)lines.size(); ++i) {
+    fprintf(f, "[");
+    PrintJsString(f, lines[i].first);
+    fprintf(f, ", %llu],\n", lines[i].second);
+  }
+  fprintf(f, "];\n");
+  fputs(kHtmlTail, f);
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantofold [-rpc | -mark] [-pid n] [-html fname]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  const char* html_fname = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-rpc") == 0) {group_by = GROUP_RPC;}
+    else if (strcmp(argv[i], "-mark") == 0) {group_by = GROUP_MARK;}
+    else if ((strcmp(argv[i], "-pid") == 0) && (i < (argc - 1))) {
+      only_pid = atoi(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-html") == 0) && (i < (argc - 1))) {
+      html_fname = argv[++i];
+    }
+    else Usage();
+  }
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.00002889, 0.00006894, 12, 0, 0, 641, 11900, 0, 0, "PC=clear_page_erms"],
+
+  SpanLineReader reader;
+  OpenSpanLines(stdin, &reader);
+
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {continue;}
+    if (line.start_ts >= 999.0) {break;}	// End marker
+    int64 ts = (int64)(line.start_ts * 100000000.0 + 0.5);
+    FlushPending(ts);
+
+    if ((line.eventnum == KUTRACE_PC_U) || (line.eventnum == KUTRACE_PC_K)) {
+      if ((line.pid < 0) || ((0 <= only_pid) && (line.pid != only_pid))) {continue;}
+      PcSample samp;
+      samp.pid = line.pid;
+      samp.kernel = (line.eventnum == KUTRACE_PC_K);
+      samp.name = Unquote(line.name);
+      if (samp.name.compare(0, 3, "PC=") == 0) {samp.name.erase(0, 3);}
+      int64 sample_ts = ts + (int64)(line.duration * 100000000.0 + 0.5);
+      pending.insert(std::make_pair(sample_ts, samp));
+      continue;
+    }
+    // The rpcid of an RPCIDREQ/RESP line is the one before it; arg has the new one
+    if ((line.eventnum == KUTRACE_RPCIDREQ) || (line.eventnum == KUTRACE_RPCIDRESP)) {
+      int new_rpcid = line.arg & 0xffff;
+      if ((new_rpcid != 0) && (methods.find(new_rpcid) == methods.end())) {
+        methods[new_rpcid] = MethodName(line.name);
+      }
+      continue;
+    }
+    if (line.pid < 0) {continue;}
+    if (line.eventnum == KUTRACE_MARKA) {
+      pidstate[line.pid].mark = Unquote(line.name);
+      continue;
+    }
+    if (largest_non_pid < line.eventnum) {
+      if (pidnames.find(line.pid) == pidnames.end()) {pidnames[line.pid] = Unquote(line.name);}
+    } else if ((line.eventnum < KUTRACE_TRAP) || (0x1000 <= line.eventnum)) {
+      continue;		// Marks, waits, and other non-execution
+    }
+    // Execution on a CPU carries the RPC it is for
+    if (line.cpu >= 0) {pidstate[line.pid].rpcid = line.rpcid;}
+  }
+  CloseSpanLines(&reader);
+  FlushPending(0x7FFFFFFFFFFFFFFFLL);
+
+  // Sorted by stack, as flamegraph.pl expects
+  vector<std::pair<string, uint64> > lines;
+  for (map<FoldKey, uint64>::const_iterator it = folded.begin(); it != folded.end(); ++it) {
+    lines.push_back(std::make_pair(PidName(it->first.first) + ";" + it->first.second, it->second));
+  }
+  std::sort(lines.begin(), lines.end());
+
+  PrintFolded(stdout, lines);
+  if (html_fname != NULL) {
+    FILE* f = fopen(html_fname, "w");
+    if (f == NULL) {
+      fprintf(stderr, "%s did not open\n", html_fname);
+      exit(0);
+    }
+    PrintHtml(f, lines);
+    fclose(f);
+  }
+  fprintf(stderr, "spantofold: %llu samples, %d stacks\n", total_samples, (int)lines.size());
+  return 0;
+}
@@ -0,0 +1,291 @@
+// Little program to report latency distributions of kernel calls from spans
+//
+// Filter from stdin to stdout, producing a text table per event number of
+// count, p50, p90, p99, p99.9, and max, in usec, for syscalls, traps,
+// interrupts, bottom halves, and the scheduler
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.08.23
+//  Split out of ad hoc scripts over the JSON. Reads span_bin.h binary
+//  spans as well
+//
+// A call that is interrupted shows up as several spans on its CPU, e.g.
+//   read, local_timer_vector, read
+// These pieces are put back together, so the latency of that read includes
+// the interrupt, as its caller saw it. A call that blocks ends at the context
+// switch away; the time blocked is in the wait_* spans, not here. With
+// -pieces, each span counts by itself instead.
+//
+// Compile with g++ -O2 spantolat.cc latency_hist.cc span_bin.cc -o spantolat
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "latency_hist.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define sched_syscall      0xdff
+#define sched_syscall_old  0x9ff
+#define bottom_half        (KUTRACE_IRQ + 255)
+#define largest_non_pid    0xffff
+
+// Kinds of kernel code, in the order reported
+static const int kSyscall = 0;
+static const int kTrap = 1;
+static const int kIrq = 2;
+static const int kBottomHalf = 3;
+static const int kSched = 4;
+static const int kNotCall = 5;
+static const char* kKindName[5] = {"syscalls", "traps", "interrupts", "bottom halves", "scheduler"};
+
+
+// Each JSON input record we care about
+typedef struct {
+  int64 start_ts;	// Multiples of 10ns
+  int64 duration;	// Multiples of 10ns
+  int cpu;
+  int pid;
+  int eventnum;
+} OneSpan;
+
+// A call in progress on one CPU. Deeper calls nest on top of it
+typedef struct {
+  int64 start_ts;
+  int64 end_ts;
+  int eventnum;
+  int pid;
+  int level;
+} OpenCall;
+
+// Everything about one event number, or one event number and PID
+typedef struct {
+  int eventnum;
+  int pid;
+  int kind;
+  string name;
+  LatHist hist;
+} EventLat;
+
+static bool per_pid = false;
+static bool pieces = false;
+
+static map<uint64, EventLat> eventlat;	// Key is eventnum << 32 | pid
+static map<int, string> pidnames;	// From user-mode spans
+static vector<vector<OpenCall> > cpustack;	// Indexed by CPU
+static vector<string> callnames;		// Indexed by eventnum
+
+
+int Kind(int eventnum) {
+  if ((eventnum == sched_syscall) || (eventnum == sched_syscall_old)) {return kSched;}
+  if (eventnum == bottom_half) {return kBottomHalf;}
+  int type = eventnum & 0xF00;
+  if (type == KUTRACE_TRAP) {return kTrap;}
+  if (type == KUTRACE_IRQ) {return kIrq;}
+  // Syscall returns never make spans, so 0x800..0x9ff and 0xc00..0xdff
+  if ((eventnum & 0xE00) == KUTRACE_SYSCALL64) {return kSyscall;}
+  if ((eventnum & 0xE00) == KUTRACE_SYSCALL32) {return kSyscall;}
+  return kNotCall;
+}
+
+// Nesting levels are user:0, syscall:1, trap:2, IRQ:3, sched_syscall:4,
+// as in eventtospan3
+int NestLevel(int kind) {
+  switch (kind) {
+  case kSyscall: return 1;
+  case kTrap: return 2;
+  case kIrq: return 3;
+  case kBottomHalf: return 3;
+  case kSched: return 4;
+  }
+  return 0;
+}
+
+void Record(int eventnum, int pid, int64 duration) {
+  int key_pid = per_pid ? pid : 0;
+  uint64 key = ((uint64)eventnum << 32) | (uint32)key_pid;
+  map<uint64, EventLat>::iterator it = eventlat.find(key);
+  if (it == eventlat.end()) {
+    EventLat temp;
+    temp.eventnum = eventnum;
+    temp.pid = key_pid;
+    temp.kind = Kind(eventnum);
+    temp.name = callnames[eventnum];
+    InitLatHist(&temp.hist);
+    it = eventlat.insert(std::make_pair(key, temp)).first;
+  }
+  AddLatHist(&it->second.hist, (duration < 0) ? 0 : duration);
+}
+
+void Finish(const OpenCall& call) {
+  Record(call.eventnum, call.pid, call.end_ts - call.start_ts);
+}
+
+// Follow the calls on one CPU. A span at the same level as the call on top
+// of the stack, with the same event number and PID, right after a deeper
+// span ended, is that call resuming
+void DoSpan(const OneSpan& span, int level) {
+  if ((int)cpustack.size() <= span.cpu) {cpustack.resize(span.cpu + 1);}
+  vector<OpenCall>& stack = cpustack[span.cpu];
+  int64 end_ts = span.start_ts + span.duration;
+
+  bool resumed = false;
+  while (!stack.empty() && (level < stack.back().level)) {
+    Finish(stack.back());
+    stack.pop_back();
+    resumed = true;
+  }
+  if (level == 0) {
+    // Back in user mode or idle; nothing is open
+    for (int i = 0; i < (int)stack.size(); ++i) {Finish(stack[i]);}
+    stack.clear();
+    return;
+  }
+  if (!stack.empty() && (level == stack.back().level)) {
+    OpenCall& top = stack.back();
+    if (resumed && (top.eventnum == span.eventnum) && (top.pid == span.pid)) {
+      top.end_ts = end_ts;
+      return;
+    }
+    Finish(top);
+    stack.pop_back();
+  }
+  OpenCall call;
+  call.start_ts = span.start_ts;
+  call.end_ts = end_ts;
+  call.eventnum = span.eventnum;
+  call.pid = span.pid;
+  call.level = level;
+  stack.push_back(call);
+}
+
+// Order by kind, then by descending count, then by event and PID
+bool LatOrder(const EventLat* a, const EventLat* b) {
+  if (a->kind != b->kind) {return a->kind < b->kind;}
+  if (a->hist.count != b->hist.count) {return a->hist.count > b->hist.count;}
+  if (a->eventnum != b->eventnum) {return a->eventnum < b->eventnum;}
+  return a->pid < b->pid;
+}
+
+void PrintReport(FILE* f) {
+  vector<const EventLat*> sorted;
+  for (map<uint64, EventLat>::const_iterator it = eventlat.begin(); it != eventlat.end(); ++it) {
+    sorted.push_back(&it->second);
+  }
+  std::sort(sorted.begin(), sorted.end(), LatOrder);
+
+  fprintf(f, "# spantolat: %s latency, usec\n", pieces ? "span" : "call");
+  int prior_kind = -1;
+  for (int i = 0; i < (int)sorted.size(); ++i) {
+    const EventLat* e = sorted[i];
+    if (e->kind != prior_kind) {
+      // Total for the kind, then its rows
+      LatHist total;
+      InitLatHist(&total);
+      for (int j = i; (j < (int)sorted.size()) && (sorted[j]->kind == e->kind); ++j) {
+        MergeLatHist(&total, sorted[j]->hist);
+      }
+      fprintf(f, "\n%-24s ", kKindName[e->kind]);
+      PrintLatHistHeader(f);
+      fprintf(f, "\n%-24s ", "(all)");
+      PrintLatHistRow(f, total);
+      fprintf(f, "\n");
+      prior_kind = e->kind;
+    }
+    char label[64];
+    if (per_pid) {
+      map<int, string>::const_iterator it = pidnames.find(e->pid);
+      if (it != pidnames.end()) {
+        snprintf(label, sizeof(label), "%s %s", e->name.c_str(), it->second.c_str());
+      } else {
+        snprintf(label, sizeof(label), "%s %d", e->name.c_str(), e->pid);
+      }
+    } else {
+      snprintf(label, sizeof(label), "%s", e->name.c_str());
+    }
+    fprintf(f, "%-24s ", label);
+    PrintLatHistRow(f, e->hist);
+    fprintf(f, "\n");
+  }
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantolat [-pid] [-pieces]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-pid") == 0) {per_pid = true;}
+    else if (strcmp(argv[i], "-pieces") == 0) {pieces = true;}
+    else Usage();
+  }
+  callnames.resize(largest_non_pid + 1);
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.01911486, 0.00028634, 2, 6789, 0, 2050, 53763, 46, 0, "open"],
+
+  SpanLineReader reader;
+  OpenSpanLines(stdin, &reader);
+
+  int span_count = 0;
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {continue;}
+    if (line.start_ts >= 999.0) {break;}	// End marker
+    if (line.cpu < 0) {continue;}		// Not executing on a CPU
+    ++span_count;
+
+    OneSpan span;
+    span.start_ts = (int64)(line.start_ts * 100000000.0 + 0.5);
+    span.duration = (int64)(line.duration * 100000000.0 + 0.5);
+    span.cpu = line.cpu;
+    span.pid = line.pid;
+    span.eventnum = line.eventnum;
+
+    if (largest_non_pid < line.eventnum) {
+      // User-mode execution or idle ends whatever was open on this CPU
+      if (per_pid && (pidnames.find(line.pid) == pidnames.end())) {
+        pidnames[line.pid] = Unquote(line.name);
+      }
+      if (!pieces) {DoSpan(span, 0);}
+      continue;
+    }
+    int kind = Kind(line.eventnum);
+    if (kind == kNotCall) {continue;}	// PC samples, waits, marks, ...
+    if (callnames[line.eventnum].empty()) {callnames[line.eventnum] = Unquote(line.name);}
+
+    if (pieces) {
+      Record(line.eventnum, line.pid, span.duration);
+    } else {
+      DoSpan(span, NestLevel(kind));
+    }
+  }
+  CloseSpanLines(&reader);
+
+  // Calls still open at the end of the trace end there
+  for (int cpu = 0; cpu < (int)cpustack.size(); ++cpu) {
+    for (int i = 0; i < (int)cpustack[cpu].size(); ++i) {Finish(cpustack[cpu][i]);}
+  }
+
+  PrintReport(stdout);
+  fprintf(stderr, "spantolat: %d spans\n", span_count);
+  return 0;
+}
@@ -0,0 +1,295 @@
+// Little program to profile lock contention from the KUtrace lock events
+//
+// Filter from stdin to stdout, producing a text report per lock: how often it
+// was acquired and how often that took waiting, histograms of wait and hold
+// times, the PIDs that waited and held it the longest, and the worst convoys
+// of several PIDs waiting at once.
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.08.25
+//  First version. The lock events can come from either span form, JSON
+//  text or -spanbin
+//
+// This uses the try_/acq_/rel_ point events (LOCKNOACQUIRE, LOCKACQUIRE,
+// LOCKWAKEUP) that eventtospan3 copies through, not the LOCK_TRY/LOCK_HELD
+// spans it draws from them, since those leave out anything under 250ns.
+// Pairing follows eventtospan3: per lock hash and PID, a try, then an acquire,
+// then a release. A PID that tries several times before it gets the lock
+// waits from its first try.
+//
+// The lock library traces contended locks, so acquisitions never contended
+// may be missing altogether. "contended" is a fraction of the acquisitions
+// in the trace.
+//
+// Compile with g++ -O2 spantolock.cc latency_hist.cc span_bin.cc -o spantolock
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "latency_hist.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define largest_non_pid    0xffff
+
+static const int kTopPids = 3;
+
+// What one PID is doing with one lock
+typedef struct {
+  int64 try_ts;		// First failed try, or -1 if not waiting
+  int64 acq_ts;		// Acquire, or -1 if not holding
+} LockPidState;
+
+// A stretch of time with at least one PID waiting for a lock
+typedef struct {
+  int lockhash;
+  int64 start_ts;
+  int64 end_ts;
+  int peak;		// Most PIDs waiting at once
+  int64 waiter_ticks;	// Sum over waiters of time waiting inside the stretch
+} Convoy;
+
+typedef struct {
+  int lockhash;
+  string name;
+  int acquires;
+  int contended;
+  LatHist wait;
+  LatHist hold;
+  map<int, int64> wait_by_pid;
+  map<int, int64> hold_by_pid;
+  // The convoy in progress, if waiters > 0
+  int waiters;
+  int64 last_change_ts;
+  Convoy convoy;
+} LockTotal;
+
+static bool do_hist = false;
+static int top_convoys = 10;
+
+static map<int, LockTotal> locks;		// By lock hash
+static map<uint64, LockPidState> lockpids;	// By lock hash << 32 | pid
+static map<int, string> pidnames;		// From user-mode spans
+static vector<Convoy> convoys;			// Finished, with two or more waiters
+
+
+LockTotal* FindLock(int lockhash, const char* name) {
+  map<int, LockTotal>::iterator it = locks.find(lockhash);
+  if (it == locks.end()) {
+    LockTotal temp;
+    temp.lockhash = lockhash;
+    temp.name = Unquote(name);
+    if (4 <= temp.name.size()) {temp.name = temp.name.substr(4);}	// Remove try_ acq_ rel_
+    temp.acquires = 0;
+    temp.contended = 0;
+    InitLatHist(&temp.wait);
+    InitLatHist(&temp.hold);
+    temp.waiters = 0;
+    temp.last_change_ts = 0;
+    it = locks.insert(std::make_pair(lockhash, temp)).first;
+  }
+  return &it->second;
+}
+
+// The number of PIDs waiting for the lock goes up or down by one at ts
+void ChangeWaiters(LockTotal* lock, int64 ts, int delta) {
+  if (lock->waiters == 0) {
+    lock->convoy.lockhash = lock->lockhash;
+    lock->convoy.start_ts = ts;
+    lock->convoy.peak = 0;
+    lock->convoy.waiter_ticks = 0;
+  } else {
+    lock->convoy.waiter_ticks += lock->waiters * (ts - lock->last_change_ts);
+  }
+  lock->last_change_ts = ts;
+  lock->waiters += delta;
+  if (lock->convoy.peak < lock->waiters) {lock->convoy.peak = lock->waiters;}
+  if (lock->waiters == 0) {
+    lock->convoy.end_ts = ts;
+    if (2 <= lock->convoy.peak) {convoys.push_back(lock->convoy);}
+  }
+}
+
+void DoLockEvent(int64 ts, int pid, int eventnum, int lockhash, const char* name) {
+  LockTotal* lock = FindLock(lockhash, name);
+  uint64 key = ((uint64)(uint32)lockhash << 32) | (uint32)pid;
+  map<uint64, LockPidState>::iterator it = lockpids.find(key);
+  if (it == lockpids.end()) {
+    LockPidState temp;
+    temp.try_ts = -1;
+    temp.acq_ts = -1;
+    it = lockpids.insert(std::make_pair(key, temp)).first;
+  }
+  LockPidState* state = &it->second;
+
+  if (eventnum == KUTRACE_LOCKNOACQUIRE) {
+    if (state->try_ts < 0) {
+      state->try_ts = ts;
+      ChangeWaiters(lock, ts, 1);
+    }
+  } else if (eventnum == KUTRACE_LOCKACQUIRE) {
+    ++lock->acquires;
+    if (0 <= state->try_ts) {
+      int64 wait = ts - state->try_ts;
+      ++lock->contended;
+      AddLatHist(&lock->wait, wait);
+      lock->wait_by_pid[pid] += wait;
+      state->try_ts = -1;
+      ChangeWaiters(lock, ts, -1);
+    }
+    state->acq_ts = ts;
+  } else if (eventnum == KUTRACE_LOCKWAKEUP) {
+    if (0 <= state->acq_ts) {
+      int64 hold = ts - state->acq_ts;
+      AddLatHist(&lock->hold, hold);
+      lock->hold_by_pid[pid] += hold;
+    }
+    // This PID is no longer interested in the lock
+    if (0 <= state->try_ts) {ChangeWaiters(lock, ts, -1);}
+    lockpids.erase(it);
+  }
+}
+
+// usec, two places
+double Usec(int64 ticks) {return ticks / 100.0;}
+
+string PidName(int pid) {
+  map<int, string>::const_iterator it = pidnames.find(pid);
+  if (it != pidnames.end()) {return it->second;}
+  char temp[16];
+  snprintf(temp, sizeof(temp), "%d", pid);
+  return string(temp);
+}
+
+bool LargerTotal(const std::pair<int, int64>& a, const std::pair<int, int64>& b) {
+  if (a.second != b.second) {return a.second > b.second;}
+  return a.first < b.first;
+}
+
+// The kTopPids PIDs with the most time, as name=usec
+void PrintTopPids(FILE* f, const char* label, const map<int, int64>& by_pid) {
+  if (by_pid.empty()) {return;}
+  vector<std::pair<int, int64> > sorted(by_pid.begin(), by_pid.end());
+  std::sort(sorted.begin(), sorted.end(), LargerTotal);
+  fprintf(f, "  %-8s", label);
+  for (int i = 0; (i < kTopPids) && (i < (int)sorted.size()); ++i) {
+    fprintf(f, " %s=%.2f", PidName(sorted[i].first).c_str(), Usec(sorted[i].second));
+  }
+  fprintf(f, "\n");
+}
+
+bool MoreWaiting(const LockTotal* a, const LockTotal* b) {
+  if (a->wait.sum != b->wait.sum) {return a->wait.sum > b->wait.sum;}
+  if (a->acquires != b->acquires) {return a->acquires > b->acquires;}
+  return a->lockhash < b->lockhash;
+}
+
+bool WorseConvoy(const Convoy& a, const Convoy& b) {
+  if (a.waiter_ticks != b.waiter_ticks) {return a.waiter_ticks > b.waiter_ticks;}
+  return a.start_ts < b.start_ts;
+}
+
+void PrintReport(FILE* f) {
+  vector<const LockTotal*> sorted;
+  for (map<int, LockTotal>::const_iterator it = locks.begin(); it != locks.end(); ++it) {
+    sorted.push_back(&it->second);
+  }
+  std::sort(sorted.begin(), sorted.end(), MoreWaiting);
+
+  fprintf(f, "# spantolock: lock contention, usec\n\n");
+  fprintf(f, "%-24s %10s %10s %10s %10s %10s %10s\n", "lock", "hash",
+          "acquires", "contended", "pct", "wait", "hold");
+  for (int i = 0; i < (int)sorted.size(); ++i) {
+    const LockTotal* lock = sorted[i];
+    double pct = (lock->acquires == 0) ? 0.0 : (lock->contended * 100.0) / lock->acquires;
+    fprintf(f, "%-24s %10x %10d %10d %9.1f%% %10.2f %10.2f\n",
+            lock->name.c_str(), lock->lockhash, lock->acquires, lock->contended, pct,
+            Usec(lock->wait.sum), Usec(lock->hold.sum));
+  }
+
+  for (int i = 0; i < (int)sorted.size(); ++i) {
+    const LockTotal* lock = sorted[i];
+    fprintf(f, "\n%s %x\n", lock->name.c_str(), lock->lockhash);
+    fprintf(f, "  %-8s", "");
+    PrintLatHistHeader(f);
+    fprintf(f, "\n  %-8s", "wait");
+    PrintLatHistRow(f, lock->wait);
+    fprintf(f, "\n");
+    if (do_hist) {PrintLatHistBars(f, lock->wait, "    ");}
+    fprintf(f, "  %-8s", "hold");
+    PrintLatHistRow(f, lock->hold);
+    fprintf(f, "\n");
+    if (do_hist) {PrintLatHistBars(f, lock->hold, "    ");}
+    PrintTopPids(f, "waiters", lock->wait_by_pid);
+    PrintTopPids(f, "holders", lock->hold_by_pid);
+  }
+
+  // Convoys, worst first by total time spent waiting in them
+  std::sort(convoys.begin(), convoys.end(), WorseConvoy);
+  fprintf(f, "\n%-24s %12s %10s %10s %10s\n", "worst convoys", "start_sec", "dur",
+          "peak", "waiting");
+  for (int i = 0; (i < top_convoys) && (i < (int)convoys.size()); ++i) {
+    const Convoy& c = convoys[i];
+    fprintf(f, "%-24s %12.8f %10.2f %10d %10.2f\n", locks[c.lockhash].name.c_str(),
+            c.start_ts / 100000000.0, Usec(c.end_ts - c.start_ts), c.peak,
+            Usec(c.waiter_ticks));
+  }
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantolock [-hist] [-convoys n]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-hist") == 0) {do_hist = true;}
+    else if ((strcmp(argv[i], "-convoys") == 0) && (i < (argc - 1))) {
+      top_convoys = atoi(argv[++i]);
+    }
+    else Usage();
+  }
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.01911486, 0.00000001, 2, 6789, 0, 528, 1234, 0, 0, "try_mylock"],
+
+  SpanLineReader reader;
+  OpenSpanLines(stdin, &reader);
+
+  int lock_event_count = 0;
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {continue;}
+    if (line.start_ts >= 999.0) {break;}	// End marker
+
+    if (largest_non_pid < line.eventnum) {
+      if (pidnames.find(line.pid) == pidnames.end()) {pidnames[line.pid] = Unquote(line.name);}
+      continue;
+    }
+    if ((line.eventnum < KUTRACE_LOCKNOACQUIRE) || (KUTRACE_LOCKWAKEUP < line.eventnum)) {continue;}
+    ++lock_event_count;
+    DoLockEvent((int64)(line.start_ts * 100000000.0 + 0.5), line.pid, line.eventnum, line.arg, line.name);
+  }
+  CloseSpanLines(&reader);
+
+  PrintReport(stdout);
+  fprintf(stderr, "spantolock: %d lock events, %d locks\n", lock_event_count, (int)locks.size());
+  return 0;
+}
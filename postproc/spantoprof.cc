@@ -4,7 +4,9 @@
 //
 // Copyright 2021 Richard L. Sites
 //
-// Compile with g++ -O2 spantoprof.cc -o spantoprof
+// Input may instead be the binary span file from eventtospan3 -spanbin
+//
+// Compile with g++ -O2 spantoprof.cc span_bin.cc -o spantoprof
 //
 
 #include <map>
@@ -18,6 +20,7 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "span_bin.h"
 
 
 using std::map;
@@ -1122,6 +1125,12 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
+// Next line of JSON, from stdin or from a binary span file
+bool NextLine(SpanBinReader* spanbin, char* buffer, int maxsize) {
+  if (spanbin != NULL) {return ReadSpanBinLine(spanbin, buffer, maxsize);}
+  return ReadLine(stdin, buffer, maxsize);
+}
+
 // Input is tail end of a line: "xyz..."],
 // Output is part between quotes. Naive about backslash.
 string StripQuotes(const char* s) {
@@ -1161,10 +1170,19 @@ int main (int argc, const char** argv) {
   //    ts           dur       cpu  pid  rpc event arg ret  ipc name--------------------> 
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, 1,  "gnome-terminal-.1910"],
 
+  // A profile covers the whole trace, so every chunk of a binary span file
+  SpanBinReader spanbin_reader;
+  SpanBinReader* spanbin = NULL;
+  if (IsSpanBin(stdin)) {
+    spanbin = &spanbin_reader;
+    OpenSpanBin(stdin, spanbin);
+    SelectSpanBin(spanbin, -kSpanBinAllTs, kSpanBinAllTs, -1, 0x7FFFFFFF);
+  }
+
   char buffer[kMaxBufferSize];
   bool needs_presorted = true;
   bool do_copy = true;
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (NextLine(spanbin, buffer, kMaxBufferSize)) {
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -0,0 +1,332 @@
+// Little program to break down the latency of each RPC from spans
+//
+// Filter from stdin to stdout, producing a text report. For each RPC, its
+// wall time and where that time went: user-mode and kernel execution on any
+// CPU and thread, each wait_* category, time queued between ENQUEUE and
+// DEQUEUE, and time the request and response messages spent on the network.
+// Then the same breakdown summed per method name.
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.08.24
+//  First version, grouping spans by rpcid, from the JSON or a -spanbin file
+//
+// Every span eventtospan3 writes while some thread works on an RPC carries
+// that rpcid, as do the wait_*, queued, and RXMSG/TXMSG message spans it
+// builds for the RPC. The pieces of one RPC are grouped by rpcid from the
+// first span to the last. The 16-bit rpcids get reused, so an RPCIDREQ for an
+// rpcid that has already seen its RPCIDRESP starts a new RPC; queued spans
+// that start after that response belong to the new one.
+//
+// The parts can overlap -- a client and server in the same trace both run
+// their halves of an RPC, and messages are on the wire while CPUs run -- so
+// they need not add up to the wall time.
+//
+// Compile with g++ -O2 spantorpc.cc latency_hist.cc span_bin.cc -o spantorpc
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "latency_hist.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define largest_non_pid    0xffff
+
+static const int kWaitCount = 26;	// wait_a .. wait_z
+
+// Where the time of an RPC went. All times are multiples of 10ns
+typedef struct {
+  int64 user;
+  int64 kernel;
+  int64 queue;
+  int64 rxmsg;
+  int64 txmsg;
+  int64 wait[kWaitCount];
+} RpcParts;
+
+typedef struct {
+  int rpcid;
+  string method;
+  int64 first_ts;
+  int64 last_ts;
+  int64 last_resp_ts;	// Start of the latest RPCIDRESP, or -1
+  int64 late_queue;	// Queued time that started after last_resp_ts, for the next RPC
+  int64 late_first_ts;	// When that queueing started
+  RpcParts parts;
+} OneRpc;
+
+typedef struct {
+  string method;
+  LatHist wall;
+  RpcParts sum;
+} MethodTotal;
+
+static bool print_all = false;
+static int top_n = 20;
+
+static vector<OneRpc> rpcs;		// Finished RPCs
+static map<int, OneRpc> active;		// The latest RPC for each rpcid
+static string wait_names[kWaitCount];
+
+void InitRpcParts(RpcParts* p) {
+  memset(p, 0, sizeof(RpcParts));
+}
+
+void AddRpcParts(RpcParts* p, const RpcParts& q) {
+  p->user += q.user;
+  p->kernel += q.kernel;
+  p->queue += q.queue;
+  p->rxmsg += q.rxmsg;
+  p->txmsg += q.txmsg;
+  for (int i = 0; i < kWaitCount; ++i) {p->wait[i] += q.wait[i];}
+}
+
+// method.rpcid => method
+string MethodName(const char* name) {
+  string s = Unquote(name);
+  size_t dot = s.rfind('.');
+  if (dot != string::npos) {s.resize(dot);}
+  if (s.empty()) {s = "-";}
+  return s;
+}
+
+void InitRpc(int rpcid, int64 ts, OneRpc* rpc) {
+  rpc->rpcid = rpcid;
+  rpc->method.clear();
+  rpc->first_ts = ts;
+  rpc->last_ts = ts;
+  rpc->last_resp_ts = -1;
+  rpc->late_queue = 0;
+  rpc->late_first_ts = 0;
+  InitRpcParts(&rpc->parts);
+}
+
+// The RPC rpcid currently means, starting one if need be
+OneRpc* FindRpc(int rpcid, int64 ts) {
+  map<int, OneRpc>::iterator it = active.find(rpcid);
+  if (it == active.end()) {
+    OneRpc temp;
+    InitRpc(rpcid, ts, &temp);
+    it = active.insert(std::make_pair(rpcid, temp)).first;
+  }
+  return &it->second;
+}
+
+// A request for an rpcid that has already responded is a new RPC
+void StartRpc(int rpcid, int64 ts) {
+  OneRpc* rpc = FindRpc(rpcid, ts);
+  if (rpc->last_resp_ts < 0) {return;}
+  int64 late_queue = rpc->late_queue;
+  int64 late_first_ts = rpc->late_first_ts;
+  rpcs.push_back(*rpc);
+  InitRpc(rpcid, ts, rpc);
+  if (late_queue != 0) {
+    rpc->first_ts = late_first_ts;
+    rpc->parts.queue = late_queue;
+  }
+}
+
+void DoSpan(int64 start_ts, int64 duration, int cpu, int pid, int rpcid,
+            int eventnum, int arg, const char* name) {
+  // The rpcid of an RPCIDREQ/RESP line is the one before it; arg has the new one
+  if ((eventnum == KUTRACE_RPCIDREQ) || (eventnum == KUTRACE_RPCIDRESP)) {
+    rpcid = arg & 0xffff;
+    if (rpcid == 0) {return;}
+    if (eventnum == KUTRACE_RPCIDREQ) {StartRpc(rpcid, start_ts);}
+  }
+  if (rpcid <= 0) {return;}
+
+  OneRpc* rpc = FindRpc(rpcid, start_ts);
+  if ((eventnum == KUTRACE_ENQUEUE) && (0 <= rpc->last_resp_ts) &&
+      (rpc->last_resp_ts <= start_ts)) {
+    // Queued after the response: the rpcid is being reused
+    if (rpc->late_queue == 0) {rpc->late_first_ts = start_ts;}
+    rpc->late_queue += duration;
+    return;
+  }
+  if (start_ts < rpc->first_ts) {rpc->first_ts = start_ts;}
+  if (rpc->last_ts < start_ts + duration) {rpc->last_ts = start_ts + duration;}
+
+  if ((eventnum == KUTRACE_RPCIDREQ) || (eventnum == KUTRACE_RPCIDRESP) ||
+      (eventnum == KUTRACE_RPCIDMID) || (eventnum == KUTRACE_RPCIDRXMSG) ||
+      (eventnum == KUTRACE_RPCIDTXMSG)) {
+    // These carry method.rpcid
+    if (rpc->method.empty()) {rpc->method = MethodName(name);}
+  }
+
+  if (largest_non_pid < eventnum) {
+    if ((cpu >= 0) && (pid != 0)) {rpc->parts.user += duration;}
+  } else if ((KUTRACE_TRAP <= eventnum) && (eventnum < 0x1000)) {
+    if (cpu >= 0) {rpc->parts.kernel += duration;}
+  } else if ((KUTRACE_WAITA <= eventnum) && (eventnum < KUTRACE_WAITA + kWaitCount)) {
+    int i = eventnum - KUTRACE_WAITA;
+    rpc->parts.wait[i] += duration;
+    if (wait_names[i].empty()) {wait_names[i] = Unquote(name);}
+  } else if (eventnum == KUTRACE_ENQUEUE) {
+    rpc->parts.queue += duration;
+  } else if (eventnum == KUTRACE_RPCIDRXMSG) {
+    rpc->parts.rxmsg += duration;
+  } else if (eventnum == KUTRACE_RPCIDTXMSG) {
+    rpc->parts.txmsg += duration;
+  } else if (eventnum == KUTRACE_RPCIDRESP) {
+    rpc->last_resp_ts = start_ts;
+  }
+}
+
+// usec, two places
+double Usec(int64 ticks) {return ticks / 100.0;}
+
+// Nonzero waits as name=usec
+void PrintWaits(FILE* f, const RpcParts& p, int64 divisor) {
+  for (int i = 0; i < kWaitCount; ++i) {
+    if (p.wait[i] == 0) {continue;}
+    fprintf(f, " %s=%.2f", wait_names[i].c_str(), Usec(p.wait[i]) / divisor);
+  }
+}
+
+void PrintPartsHeader(FILE* f) {
+  fprintf(f, "%10s %10s %10s %10s %10s", "user", "kernel", "queue", "rxmsg", "txmsg");
+}
+
+void PrintParts(FILE* f, const RpcParts& p, int64 divisor) {
+  fprintf(f, "%10.2f %10.2f %10.2f %10.2f %10.2f",
+          Usec(p.user) / divisor, Usec(p.kernel) / divisor, Usec(p.queue) / divisor,
+          Usec(p.rxmsg) / divisor, Usec(p.txmsg) / divisor);
+  PrintWaits(f, p, divisor);
+}
+
+void PrintRpc(FILE* f, const OneRpc& rpc) {
+  char label[64];
+  snprintf(label, sizeof(label), "%s.%d", rpc.method.c_str(), rpc.rpcid);
+  fprintf(f, "%-24s %12.8f %10.2f ", label, rpc.first_ts / 100000000.0,
+          Usec(rpc.last_ts - rpc.first_ts));
+  PrintParts(f, rpc.parts, 1);
+  fprintf(f, "\n");
+}
+
+bool SlowerRpc(const OneRpc* a, const OneRpc* b) {
+  int64 wall_a = a->last_ts - a->first_ts;
+  int64 wall_b = b->last_ts - b->first_ts;
+  if (wall_a != wall_b) {return wall_a > wall_b;}
+  return a->first_ts < b->first_ts;
+}
+
+bool MoreCalls(const MethodTotal* a, const MethodTotal* b) {
+  if (a->wall.count != b->wall.count) {return a->wall.count > b->wall.count;}
+  return a->method < b->method;
+}
+
+void PrintReport(FILE* f) {
+  map<string, MethodTotal> methods;
+  for (int i = 0; i < (int)rpcs.size(); ++i) {
+    OneRpc& rpc = rpcs[i];
+    if (rpc.method.empty()) {rpc.method = "-";}
+    map<string, MethodTotal>::iterator it = methods.find(rpc.method);
+    if (it == methods.end()) {
+      MethodTotal temp;
+      temp.method = rpc.method;
+      InitLatHist(&temp.wall);
+      InitRpcParts(&temp.sum);
+      it = methods.insert(std::make_pair(rpc.method, temp)).first;
+    }
+    AddLatHist(&it->second.wall, rpc.last_ts - rpc.first_ts);
+    AddRpcParts(&it->second.sum, rpc.parts);
+  }
+
+  // Per method: wall time percentiles, then the mean of each part
+  vector<const MethodTotal*> sorted_methods;
+  for (map<string, MethodTotal>::const_iterator it = methods.begin(); it != methods.end(); ++it) {
+    sorted_methods.push_back(&it->second);
+  }
+  std::sort(sorted_methods.begin(), sorted_methods.end(), MoreCalls);
+  fprintf(f, "# spantorpc: RPC latency breakdown, usec\n\n");
+  fprintf(f, "%-24s ", "method wall");
+  PrintLatHistHeader(f);
+  fprintf(f, "\n");
+  for (int i = 0; i < (int)sorted_methods.size(); ++i) {
+    fprintf(f, "%-24s ", sorted_methods[i]->method.c_str());
+    PrintLatHistRow(f, sorted_methods[i]->wall);
+    fprintf(f, "\n");
+  }
+  fprintf(f, "\n%-24s ", "method mean");
+  PrintPartsHeader(f);
+  fprintf(f, " waits\n");
+  for (int i = 0; i < (int)sorted_methods.size(); ++i) {
+    fprintf(f, "%-24s ", sorted_methods[i]->method.c_str());
+    PrintParts(f, sorted_methods[i]->sum, sorted_methods[i]->wall.count);
+    fprintf(f, "\n");
+  }
+
+  // The slowest RPCs, or all of them in time order
+  vector<const OneRpc*> sorted_rpcs;
+  for (int i = 0; i < (int)rpcs.size(); ++i) {sorted_rpcs.push_back(&rpcs[i]);}
+  int n = sorted_rpcs.size();
+  if (print_all) {
+    fprintf(f, "\n%-24s %12s %10s ", "rpc", "start_sec", "wall");
+  } else {
+    std::sort(sorted_rpcs.begin(), sorted_rpcs.end(), SlowerRpc);
+    if (top_n < n) {n = top_n;}
+    fprintf(f, "\n%-24s %12s %10s ", "slowest rpc", "start_sec", "wall");
+  }
+  PrintPartsHeader(f);
+  fprintf(f, " waits\n");
+  for (int i = 0; i < n; ++i) {PrintRpc(f, *sorted_rpcs[i]);}
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantorpc [-all | -top n]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-all") == 0) {print_all = true;}
+    else if ((strcmp(argv[i], "-top") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+    }
+    else Usage();
+  }
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.01911486, 0.00028634, 2, 6789, 1234, 67301, 0, 0, 0, "server.6789"],
+
+  SpanLineReader reader;
+  OpenSpanLines(stdin, &reader);
+
+  int span_count = 0;
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {continue;}
+    if (line.start_ts >= 999.0) {break;}	// End marker
+    ++span_count;
+    DoSpan((int64)(line.start_ts * 100000000.0 + 0.5), (int64)(line.duration * 100000000.0 + 0.5),
+           line.cpu, line.pid, line.rpcid, line.eventnum, line.arg, line.name);
+  }
+  CloseSpanLines(&reader);
+
+  // RPCs still going at the end of the trace end there
+  for (map<int, OneRpc>::const_iterator it = active.begin(); it != active.end(); ++it) {
+    rpcs.push_back(it->second);
+  }
+
+  PrintReport(stdout);
+  fprintf(stderr, "spantorpc: %d spans, %d RPCs\n", span_count, (int)rpcs.size());
+  return 0;
+}
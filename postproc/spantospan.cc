@@ -2,10 +2,12 @@
 // into fewer larger-granularity timespans
 // 
 // Filter from stdin to stdout
-// One command-line parameter -- 
+// One to three command-line parameters -- 
 //   granularity in microseconds. zero means 1:1 passthrough
+//     or -pyramid[=usec,usec,...] for several granularities at once
+//   optional start_sec [stop_sec] window
 //
-// compile with g++ -O2 spantospan.cc -o spantospan
+// compile with g++ -O2 spantospan.cc span_bin.cc -o spantospan
 //
 // dick sites 2016.11.07
 // dick sites 2017.08.16
@@ -13,6 +15,13 @@
 // dick sites 2017.11.18
 //  add instructions per cycle IPC support
 // dsites 2022.07.07 Total rewrite
+// dsites 2023.07.08 Per-CPU state sized to the CPUs seen, no 80-CPU limit
+// dsites 2023.08.17 Accept the binary span file from eventtospan3 -spanbin;
+//                   implement the start_sec stop_sec window
+// dsites 2023.08.30 -pyramid builds several granularities in one pass, for
+//                   show_cpu.html to switch between as you zoom
+// dsites 2023.09.05 -pyramid streams the finest level; only the coarse ones
+//                   are held, and they go out as header lines
 //
 
 /***
@@ -28,20 +37,38 @@
  Items that total less than granularity at the end are dropped. We compensate
  by initializing each deferred span's duration to half the granularity.
  Each combined span is represented by its first-arrived item.
+
+ Pyramid:
+ Each level is the same reduction at its own granularity, run side by side
+ over the one input, default 1us 10us 100us 1ms 10ms. The finest level is
+ the usual "events" array, written as it goes, so any viewer can show it.
+ Only the coarser levels, which are small, are held in memory. At the end
+ each is sorted and written as one header line
+    "lod_10" : [[...], ..., [999.0, ...]],
+ with
+    "lodUsec" : 1,
+ giving the granularity of "events". Pipe the output through sort, as for a
+ single granularity; the leading space puts these lines among the others
+ ahead of "events", so show_cpu.html can draw the coarse levels before it
+ parses the finest.
  ***/
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 #include "basetypes.h"
+#include "span_bin.h"
 
 #define UserPidNum       0x200
 
 using std::string;
 using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -61,20 +88,33 @@ typedef struct {
 // Short spans accumulate by summing duration
 typedef map<int, OneSpan> SpanMap;
 
-typedef struct {
+static const int kCacheLineBytes = 64;
+static const int kMaxCpus = 4096;	// Sanity check only; state grows to the CPUs seen
+
+// One per CPU, each on its own cache lines
+typedef struct alignas(kCacheLineBytes) {
+  int64 granularity_ns;
+  vector<string>* lines;	// Output for a coarse pyramid level; NULL for stdout
   int64 next_ts_ns;
   int64 total_deferred_ns;
   SpanMap spanmap;
+  bool output_buffer_full;
+  OneSpan buffered_span;
 } CPUstate;
 
-static const int kMaxCpus = 80;
 
+// One granularity of a pyramid
+typedef struct {
+  int64 granularity_ns;
+  vector<CPUstate> cpustate;
+  vector<string> lines;
+} Level;
+
+static const char* kDefaultPyramid = "1,10,100,1000,10000";
 
 // Globals
 int64 granularity_ns;
 int output_events = 0;
-bool output_buffer_full[kMaxCpus];
-OneSpan buffered_span[kMaxCpus];
 
 void PrintSpan(FILE* f, const OneSpan& onespan) {
     // Name has trailing punctuation, including ],
@@ -87,6 +127,19 @@ void PrintSpan(FILE* f, const OneSpan& onespan) {
             onespan.ipc, onespan.name);
 }
 
+// Same text as PrintSpan, kept for sorting
+string SpanText(const OneSpan& onespan) {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s",
+           onespan.start_ts_ns / 1000000000.0,
+           onespan.duration_ns / 1000000000.0,
+           onespan.cpu, onespan.pid,
+           onespan.rpcid, onespan.event,
+           onespan.arg, onespan.retval,
+           onespan.ipc, onespan.name);
+  return string(buffer);
+}
+
 // Accumulate a span in per-CPU state, incrementing the deferred not-yet-output times
 void AddSpan(const OneSpan& onespan, CPUstate* cpustate) {
   int event = onespan.event;
@@ -123,25 +176,44 @@ OneSpan* FindLargestDeferred(SpanMap& spanmap) {
 
 // Run a one-span buffer so we can combine identical-event spans
 // This can be called with newspan=NULL to flush the last buffered entry
-void OutputSpan(int cpu, int64 next_ts_ns, const OneSpan* newspan) {
+void OutputSpan(CPUstate* cpustate, int64 next_ts_ns, const OneSpan* newspan) {
   // Possibly combine with previously buffered span per CPU
   if ((newspan != NULL) && 
-      output_buffer_full[cpu] &&
-      (newspan->event == buffered_span[cpu].event)) {
-    buffered_span[cpu].duration_ns += newspan->duration_ns;
+      cpustate->output_buffer_full &&
+      (newspan->event == cpustate->buffered_span.event)) {
+    cpustate->buffered_span.duration_ns += newspan->duration_ns;
     return;
   }
   // Flush any buffered span
-  if (output_buffer_full[cpu]) {
-    PrintSpan(stdout, buffered_span[cpu]);
+  if (cpustate->output_buffer_full) {
+    if (cpustate->lines == NULL) {
+      PrintSpan(stdout, cpustate->buffered_span);
+    } else {
+      cpustate->lines->push_back(SpanText(cpustate->buffered_span));
+    }
     ++output_events;
-    output_buffer_full[cpu] = false;
+    cpustate->output_buffer_full = false;
   }
   // Save as new buffered span
   if (newspan != NULL) {
-    buffered_span[cpu] = *newspan;			// Copy all the fields
-    buffered_span[cpu].start_ts_ns = next_ts_ns;
-    output_buffer_full[cpu] = true;
+    cpustate->buffered_span = *newspan;			// Copy all the fields
+    cpustate->buffered_span.start_ts_ns = next_ts_ns;
+    cpustate->output_buffer_full = true;
+  }
+}
+
+// Make room for CPU number cpu, initializing each new CPU deferral
+void GrowCPUstate(int cpu, int64 granularity_ns, vector<string>* lines,
+                  vector<CPUstate>* cpustate) {
+  while (cpustate->size() <= cpu) {
+    cpustate->push_back(CPUstate());
+    CPUstate* newcpu = &cpustate->back();
+    newcpu->granularity_ns = granularity_ns;
+    newcpu->lines = lines;
+    newcpu->next_ts_ns = -1;
+    newcpu->total_deferred_ns = granularity_ns / 2;
+    newcpu->spanmap.clear();
+    newcpu->output_buffer_full = false;
   }
 }
 
@@ -169,8 +241,7 @@ void FlushCurrent(const OneSpan& onespan, CPUstate* cpustate) {
   if (curspan == NULL) {return;}
   int64 duration_ns = curspan->duration_ns;
   if (duration_ns == 0) {return;}
-  int cpu = curspan->cpu;
-  OutputSpan(cpu, cpustate->next_ts_ns, curspan);
+  OutputSpan(cpustate, cpustate->next_ts_ns, curspan);
 //fprintf(stderr, "  ->  "); PrintSpan(stderr, *curspan);
 //fprintf(stderr, "\n");
   curspan->duration_ns = 0;
@@ -181,11 +252,11 @@ void FlushCurrent(const OneSpan& onespan, CPUstate* cpustate) {
 // Output deferred spans by decreasing size
 void FlushDeferred(CPUstate* cpustate) {
     //DumpDeferred(stderr, &cpustate[cpu]);
-    while (cpustate->total_deferred_ns >= granularity_ns) {
+    while (cpustate->total_deferred_ns >= cpustate->granularity_ns) {
       OneSpan* deferspan = FindLargestDeferred(cpustate->spanmap);
       if (deferspan == NULL) {break;}
       int64 duration_ns = deferspan->duration_ns;
-      OutputSpan(deferspan->cpu, cpustate->next_ts_ns, deferspan);
+      OutputSpan(cpustate, cpustate->next_ts_ns, deferspan);
       //fprintf(stderr, "  =>  "); PrintSpan(stderr, *deferspan);
       deferspan->duration_ns = 0;
       cpustate->next_ts_ns += duration_ns;
@@ -217,7 +288,7 @@ void ProcessSpan(const OneSpan& onespan, CPUstate* cpustate) {
   if (curspan != NULL) {
     dur_ns += curspan->duration_ns;
   }
-  bool bigspan = (dur_ns >= granularity_ns);
+  bool bigspan = (dur_ns >= cpustate[cpu].granularity_ns);
 //fprintf(stderr, "bigspan %d\n", bigspan);  
   if (bigspan) {
     FlushDeferred(&cpustate[cpu]);
@@ -252,6 +323,53 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
+// Flush every CPU of one reduction
+void FlushAll(vector<CPUstate>* cpustate) {
+  for (int cpu = 0; cpu < cpustate->size(); ++cpu) {
+    // Possibly many deferred events
+    FlushDeferred(&(*cpustate)[cpu]);
+    // And push out last buffered item
+    OutputSpan(&(*cpustate)[cpu], (*cpustate)[cpu].next_ts_ns, NULL);
+  }
+}
+
+// usec,usec,... finest first. Return false if not a list of increasing numbers
+bool ParsePyramid(const char* s, vector<Level>* levels) {
+  while (*s != '\0') {
+    char* end;
+    long usec = strtol(s, &end, 10);
+    if ((end == s) || (usec <= 0)) {return false;}
+    if (!levels->empty() && (usec * 1000 <= levels->back().granularity_ns)) {return false;}
+    levels->push_back(Level());
+    levels->back().granularity_ns = usec * 1000;
+    s = end;
+    if (*s == ',') {++s;}
+    else if (*s != '\0') {return false;}
+  }
+  return !levels->empty();
+}
+
+// The coarser levels, each sorted, with its own end marker, on one header line.
+// The finest level has already gone to stdout
+void PrintPyramid(FILE* f, vector<Level>* levels) {
+  fprintf(f, " \"lodUsec\" : %lld,\n", (*levels)[0].granularity_ns / 1000);
+  for (int i = 1; i < levels->size(); ++i) {
+    Level* level = &(*levels)[i];
+    std::sort(level->lines.begin(), level->lines.end());
+    fprintf(f, " \"lod_%lld\" : [", level->granularity_ns / 1000);
+    for (int j = 0; j < level->lines.size(); ++j) {
+      fprintf(f, "%s ", level->lines[j].c_str());	// Each ends in ],
+    }
+    fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]],\n");
+  }
+}
+
+// Next line of JSON, from stdin or from the selected chunks of a binary span file
+bool NextLine(SpanBinReader* spanbin, char* buffer, int maxsize) {
+  if (spanbin != NULL) {return ReadSpanBinLine(spanbin, buffer, maxsize);}
+  return ReadLine(stdin, buffer, maxsize);
+}
+
 bool KeepIntact(const OneSpan& onespan) {
   // Keep mark_a for landmarks 
   if (onespan.event == 0x020A) {return true;}
@@ -269,8 +387,10 @@ bool DeleteMe(const OneSpan& onespan) {
 // Input is a json file of spans
 // start time and duration for each span are in seconds
 // Output is a smaller json file of fewer spans with lower-resolution times
+// Input may instead be the binary span file from eventtospan3 -spanbin
 void Usage() {
   fprintf(stderr, "Usage: spantospan resolution_usec [start_sec [stop_sec]]\n");
+  fprintf(stderr, "       spantospan -pyramid[=usec,usec,...] [start_sec [stop_sec]]\n");
   exit(0);
 }
 
@@ -278,20 +398,35 @@ void Usage() {
 // Filter from stdin to stdout
 //
 int main (int argc, const char** argv) {
-  CPUstate cpustate[kMaxCpus];
+  vector<CPUstate> cpustate;	// Grows to the largest CPU number seen
   // Internally, we keep everything as integer nanoseconds to avoid roundoff 
   // error and to give clean truncation
   int64 output_granularity_ns;
 
   if (argc < 2) {Usage();}
-  granularity_ns = 1000 * atoi(argv[1]);
-
-  // Initialize each CPU deferral
-  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
-    cpustate[cpu].next_ts_ns = -1;
-    cpustate[cpu].total_deferred_ns = granularity_ns / 2;
-    cpustate[cpu].spanmap.clear();
-    output_buffer_full[cpu] = false;
+  vector<Level> levels;		// Empty unless -pyramid
+  if (strncmp(argv[1], "-pyramid", 8) == 0) {
+    const char* list = kDefaultPyramid;
+    if (argv[1][8] == '=') {list = &argv[1][9];}
+    else if (argv[1][8] != '\0') {Usage();}
+    if (!ParsePyramid(list, &levels)) {Usage();}
+    granularity_ns = levels[0].granularity_ns;
+  } else {
+    granularity_ns = 1000 * atoi(argv[1]);
+  }
+  double start_sec = 0.0;
+  double stop_sec = 999.0;
+  if ((argc >= 3) && (sscanf(argv[2], "%lf", &start_sec) != 1)) {Usage();}
+  if ((argc >= 4) && (sscanf(argv[3], "%lf", &stop_sec) != 1)) {Usage();}
+
+  // A binary span file needs only the chunks in the window
+  SpanBinReader spanbin_reader;
+  SpanBinReader* spanbin = NULL;
+  if (IsSpanBin(stdin)) {
+    spanbin = &spanbin_reader;
+    OpenSpanBin(stdin, spanbin);
+    SelectSpanBin(spanbin, SpanBinLoTicks(start_sec), SpanBinHiTicks(stop_sec),
+                  -1, 0x7FFFFFFF);
   }
 
   // expecting:
@@ -299,18 +434,8 @@ int main (int argc, const char** argv) {
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, 3, "gnome-terminal-.1910"],
 
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (NextLine(spanbin, buffer, kMaxBufferSize)) {
 //fprintf(stderr, "%s\n", buffer);
-   // Zero granularity means 1:1 passthrough
-    if (granularity_ns == 0) {
-      fprintf(stdout, "%s\n", buffer);
-      // Leading "[" below picks off just span JSON entries
-      if (buffer[0] == '[') {
-        ++output_events;
-      }
-      continue;
-    }
-
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -320,6 +445,22 @@ int main (int argc, const char** argv) {
                    &onespan.cpu, &onespan.pid, &onespan.rpcid, 
                    &onespan.event, &onespan.arg, &onespan.retval, &onespan.ipc, onespan.name);
     // fprintf(stderr, "%d: %s\n", n, buffer);
+
+    // Spans outside the window, but not the 999.0 end marker, are dropped
+    if ((9 <= n) && (onespan.start_ts < 999.0) &&
+        ((onespan.start_ts < start_sec) || (stop_sec <= onespan.start_ts))) {
+      continue;
+    }
+
+   // Zero granularity means 1:1 passthrough
+    if (granularity_ns == 0) {
+      fprintf(stdout, "%s\n", buffer);
+      // Leading "[" below picks off just span JSON entries
+      if (buffer[0] == '[') {
+        ++output_events;
+      }
+      continue;
+    }
     
     if (n < 9) {
       // Copy unchanged anything not a span
@@ -335,6 +476,7 @@ int main (int argc, const char** argv) {
     // Keep a few things, such as mark_a marker
     if (KeepIntact(onespan)) {
       fprintf(stdout, "%s\n", buffer);
+      for (int i = 1; i < levels.size(); ++i) {levels[i].lines.push_back(string(buffer));}
       ++output_events;
       continue;
     }
@@ -344,7 +486,7 @@ int main (int argc, const char** argv) {
       continue;
     }
 
-    if (kMaxCpus <= onespan.cpu){
+    if ((onespan.cpu < 0) || (kMaxCpus <= onespan.cpu)){
       fprintf(stderr, "Bad CPU number at '%s'\n", buffer);
       fprintf(stdout, "Bad CPU number at '%s'\n", buffer);
       exit(0);
@@ -355,23 +497,28 @@ int main (int argc, const char** argv) {
     onespan.duration_ns = onespan.duration * 1000000000.0;
 
     // Defer and then possibly output this event
-    ProcessSpan(onespan, &cpustate[0]);    
+    if (levels.empty()) {
+      GrowCPUstate(onespan.cpu, granularity_ns, NULL, &cpustate);
+      ProcessSpan(onespan, &cpustate[0]);
+    } else {
+      for (int i = 0; i < levels.size(); ++i) {
+        Level* level = &levels[i];
+        vector<string>* lines = (i == 0) ? NULL : &level->lines;	// Finest to stdout
+        GrowCPUstate(onespan.cpu, level->granularity_ns, lines, &level->cpustate);
+        ProcessSpan(onespan, &level->cpustate[0]);
+      }
+    }
   }
 
   // Flush any remaining deferred spans per CPU
   //fprintf(stderr, "flush all\n");
-  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
-    // Possibly many deferred events
-    FlushDeferred(&cpustate[cpu]);
-    // And push out last buffered item
-    OutputSpan(cpu, cpustate[cpu].next_ts_ns, NULL);
-  }
+  FlushAll(&cpustate);
+  for (int i = 0; i < levels.size(); ++i) {FlushAll(&levels[i].cpustate);}
 
   // Add marker and closing at the end
   // Zero granularity means 1:1 passthrough
-  if (granularity_ns != 0) {
-    FinalJson(stdout);
-  }
+  if (!levels.empty()) {PrintPyramid(stdout, &levels);}
+  if (granularity_ns != 0) {FinalJson(stdout);}
 
   fprintf(stderr, "spantospan: %d events\n", output_events);
 
@@ -11,22 +11,37 @@
 //  Add trim by mark_abc label
 // dick sites 2017.11.18
 //  add optional instructions per cycle IPC support
+// dsites 2023.07.05
+//  Only check mark_abc against the label when given one
+// dsites 2023.08.17
+//  Accept the binary span file from eventtospan3 -spanbin, reading just the
+//  chunks inside the time window. Add -cpu lo[-hi]
+// dsites 2023.09.08
+//  Split into InitTrim, TrimText, and TrimSpanBin, see spantotrim.h, so
+//  kutrace_post can trim its spans in memory. Binary spans are no longer
+//  formatted and re-parsed
 //
 //
-// Compile with g++ -O2 spantotrim.cc from_base40.cc -o spantotrim
+// Compile with g++ -O2 spantotrim.cc from_base40.cc span_bin.cc -o spantotrim
 //
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 #include "basetypes.h"
 #include "from_base40.h"
+#include "span_bin.h"
+#include "spantotrim.h"
+
+namespace spantotrim {
 
 using std::string;
 using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -57,6 +72,11 @@ inline bool is_mark_abc(uint64 event) {return (event == 0x020A) || (event == 0x0
 
 static const int kMaxBufferSize = 256;
 
+// What TrimOneSpan says to do with a span
+static const int kKeep = 0;
+static const int kDrop = 1;
+static const int kStop = 2;
+
 // Read next line, stripping any crlf. Return false if no more.
 bool ReadLine(FILE* f, char* buffer, int maxsize) {
   char* s = fgets(buffer, maxsize, f);
@@ -68,61 +88,101 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
-// Input is a json file of spans
-// start time and duration for each span are in seconds
-// Output is a smaller json file of fewer spans with lower-resolution times
-void Usage() {
-  fprintf(stderr, "Usage: spantotrim label | start_sec [stop_sec]\n");
-  exit(0);
-}
-
-//
-// Filter from stdin to stdout
-//
-int main (int argc, const char** argv) {
-  double start_sec = 0.0;
-  double stop_sec = 999.0;
-  char label[8];
-  char notlabel[8];
+// Parse the positional arguments, label | start_sec [stop_sec], and -cpu lo[-hi].
+// False if they make no sense
+bool InitTrim(int argc_all, const char** argv_all, TrimArgs* t) {
+  t->start_sec = 0.0;
+  t->stop_sec = 999.0;
   // Default: label filter is a nop
-  bool inside_label_span = true;
-  bool next_inside_label_span = true;
+  t->label_filter = false;
+  t->inside_label_span = true;
+  t->next_inside_label_span = true;
+  t->lo_cpu = -1;
+  t->hi_cpu = 0x7FFFFFFF;
+
+  // Pick off -cpu, leaving the positional arguments
+  vector<const char*> args;
+  for (int i = 0; i < argc_all; ++i) {
+    if ((strcmp(argv_all[i], "-cpu") == 0) && (i < (argc_all - 1))) {
+      int n = sscanf(argv_all[++i], "%d-%d", &t->lo_cpu, &t->hi_cpu);
+      if (n < 1) {return false;}
+      if (n == 1) {t->hi_cpu = t->lo_cpu;}
+      continue;
+    }
+    args.push_back(argv_all[i]);
+  }
+  int argc = args.size();
+  if (argc < 1) {return false;}
+  const char** argv = &args[0];
 
-  if (argc < 2) {Usage();}
-  
-  if ('9' < argv[1][0]) {
+  if ('9' < argv[0][0]) {
     // Does not start with a digit. Assume it is a label and
     // that we should filter  
     //   Mark_abc label .. Mark_abc /label 
     // inclusive
-    int len = strlen(argv[1]);
+    int len = strlen(argv[0]);
     if (len > 6 ) {len = 6;}
-    memcpy(label, argv[1], len + 1);
-    memcpy(notlabel + 1, label, len);
-    notlabel[0] = '/';
-    notlabel[7] = '\0';
-    inside_label_span = false;
-    next_inside_label_span = false;
+    memcpy(t->label, argv[0], len + 1);
+    t->label[6] = '\0';
+    memcpy(t->notlabel + 1, t->label, len);
+    t->notlabel[0] = '/';
+    t->notlabel[len + 1] = '\0';
+    t->label_filter = true;
+    t->inside_label_span = false;
+    t->next_inside_label_span = false;
   }
 
-  if (inside_label_span && (argc >= 2)) {
-    int n = sscanf(argv[1], "%lf", &start_sec);
-    if (n != 1) {Usage();}
+  if (t->inside_label_span && (argc >= 1)) {
+    int n = sscanf(argv[0], "%lf", &t->start_sec);
+    if (n != 1) {return false;}
+  }
+  if (t->inside_label_span && (argc >= 2)) {
+    int n = sscanf(argv[1], "%lf", &t->stop_sec);
+    if (n != 1) {return false;}
+  }
+  return true;
+}
+
+// Decide about one span. Returns kKeep, kDrop, or kStop
+int TrimOneSpan(const OneSpan& onespan, TrimArgs* t) {
+  if (onespan.start_ts >= 999.0) {return kStop;}	// Always strip 999.0 end marker and stop
+  if (onespan.start_ts < t->start_sec) {return kDrop;}
+  if (onespan.start_ts >= t->stop_sec) {return kDrop;}
+
+  // Keep an eye out for mark_abc. label and notlabel are only set if filtering
+  if (t->label_filter && is_mark_abc(onespan.event)) {
+    char temp[8];
+    Base40ToChar(onespan.arg, temp);
+    // Turn on keeping events if we find a mathcing label
+    if (strcmp(t->label, temp) == 0) {t->inside_label_span = true;}
+    // Defer turning off keeping events so we keep this one
+    t->next_inside_label_span = t->inside_label_span;
+    if (strcmp(t->notlabel, temp) == 0) {t->next_inside_label_span = false;}
   }
-  if (inside_label_span && (argc >= 3)) {
-    int n = sscanf(argv[2], "%lf", &stop_sec);
-    if (n != 1) {Usage();}
+  if (!t->inside_label_span) {return kDrop;}	
+
+  // Spans not on any CPU, such as queued spans, are kept
+  if ((0 <= t->lo_cpu) && (0 <= onespan.cpu) &&
+      ((onespan.cpu < t->lo_cpu) || (t->hi_cpu < onespan.cpu))) {
+    t->inside_label_span = t->next_inside_label_span;
+    return kDrop;
   }
 
+  t->inside_label_span = t->next_inside_label_span;
+  return kKeep;
+}
+
+// Input is a json file of spans
+// start time and duration for each span are in seconds
+// Output is a smaller json file of fewer spans with lower-resolution times
+int TrimText(FILE* in, TrimArgs* t, FILE* out) {
   // expecting:
   //    ts           dur       cpu  pid  rpc event arg ret  name--------------------> 
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, "gnome-terminal-.1910"],
 
   int output_events = 0;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
-    char buffer2[256];
-    buffer2[0] = '\0';
+  while (ReadLine(in, buffer, kMaxBufferSize)) {
     OneSpan onespan;
     int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %s",
                    &onespan.start_ts, &onespan.duration, 
@@ -132,38 +192,100 @@ int main (int argc, const char** argv) {
     
     if (n < 9) {
       // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
+      fprintf(out, "%s\n", buffer);
       continue;
     }
-    if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
-    if (onespan.start_ts < start_sec) {continue;}
-    if (onespan.start_ts >= stop_sec) {continue;}
-
-    // Keep an eye out for mark_abc
-    if (is_mark_abc(onespan.event)) {
-      char temp[8];
-      Base40ToChar(onespan.arg, temp);
-      // Turn on keeping events if we find a mathcing label
-      if (strcmp(label, temp) == 0) {inside_label_span = true;}
-      // Defer turning off keeping events so we keep this one
-      next_inside_label_span = inside_label_span;
-      if (strcmp(notlabel, temp) == 0) {next_inside_label_span = false;}
-    }
-    if (!inside_label_span) {continue;}	
+    int action = TrimOneSpan(onespan, t);
+    if (action == kStop) {break;}
+    if (action == kDrop) {continue;}
 
     // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
+    fprintf(out, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
             onespan.start_ts, onespan.duration,
             onespan.cpu, onespan.pid, onespan.rpcid, onespan.event, 
             onespan.arg, onespan.retval, onespan.ipc, onespan.name);
     ++output_events;
+  }
+
+  // Add marker and closing at the end
+  FinalJson(out);
+  fprintf(stderr, "spantotrim: %d events\n", output_events);
+  return output_events;
+}
 
-    inside_label_span = next_inside_label_span;
+// The same, but over the spans r has selected, which need no parsing. The
+// spans are printed exactly as eventtospan3 does
+int TrimSpanBin(SpanBinReader* r, TrimArgs* t, FILE* out) {
+  int output_events = 0;
+  char buffer[kMaxBufferSize];
+  const SpanBin* rec;
+  while (ReadSpanBinItem(r, &rec, buffer, kMaxBufferSize)) {
+    OneSpan onespan;
+    if (rec == NULL) {
+      // Not a span, except for the 999.0 end marker
+      int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %s",
+                     &onespan.start_ts, &onespan.duration, 
+                     &onespan.cpu, &onespan.pid, &onespan.rpcid, 
+                     &onespan.event, &onespan.arg, &onespan.retval, &onespan.ipc, onespan.name);
+      if (n < 9) {
+        fprintf(out, "%s\n", buffer);
+        continue;
+      }
+      if (TrimOneSpan(onespan, t) == kStop) {break;}
+      continue;
+    }
+    onespan.start_ts = rec->start_ts / 100000000.0;
+    onespan.duration = rec->duration / 100000000.0;
+    onespan.cpu = rec->cpu;
+    onespan.event = rec->eventnum;
+    onespan.arg = rec->arg;
+    int action = TrimOneSpan(onespan, t);
+    if (action == kStop) {break;}
+    if (action == kDrop) {continue;}
+
+    FormatSpanBin(*rec, r->names, buffer, kMaxBufferSize);
+    fprintf(out, "%s\n", buffer);
+    ++output_events;
   }
 
   // Add marker and closing at the end
-  FinalJson(stdout);
+  FinalJson(out);
   fprintf(stderr, "spantotrim: %d events\n", output_events);
+  return output_events;
+}
+
+}	// namespace spantotrim
 
+// kutrace_post links in the functions above and has its own main
+#ifndef KUTRACE_POST
+// Input may instead be the binary span file from eventtospan3 -spanbin
+void Usage() {
+  fprintf(stderr, "Usage: spantotrim label | start_sec [stop_sec] [-cpu lo[-hi]]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  spantotrim::TrimArgs t;
+  if (!spantotrim::InitTrim(argc - 1, argv + 1, &t)) {Usage();}
+
+  // A binary span file needs only the chunks in the window. A label can be
+  // anywhere, on any CPU
+  if (IsSpanBin(stdin)) {
+    SpanBinReader spanbin;
+    OpenSpanBin(stdin, &spanbin);
+    if (t.label_filter) {
+      SelectSpanBin(&spanbin, -kSpanBinAllTs, kSpanBinAllTs, -1, 0x7FFFFFFF);
+    } else {
+      SelectSpanBin(&spanbin, SpanBinLoTicks(t.start_sec), SpanBinHiTicks(t.stop_sec),
+                    t.lo_cpu, t.hi_cpu);
+    }
+    spantotrim::TrimSpanBin(&spanbin, &t, stdout);
+  } else {
+    spantotrim::TrimText(stdin, &t, stdout);
+  }
   return 0;
 }
+#endif
@@ -0,0 +1,43 @@
+// spantotrim.h
+// Copyright 2023 Richard L. Sites
+//
+// The spantotrim filter as functions, so kutrace_post can trim the spans it
+// already holds. See the top of spantotrim.cc for what the arguments mean.
+//
+
+#ifndef __SPANTOTRIM_H__
+#define __SPANTOTRIM_H__
+
+#include <stdio.h>
+
+#include "span_bin.h"
+
+namespace spantotrim {
+
+// The filter, and its state as the spans go by
+typedef struct {
+  double start_sec;
+  double stop_sec;
+  char label[8];
+  char notlabel[8];
+  bool label_filter;
+  bool inside_label_span;
+  bool next_inside_label_span;
+  int lo_cpu;
+  int hi_cpu;
+} TrimArgs;
+
+// Parse label | start_sec [stop_sec] [-cpu lo[-hi]], without the program
+// name. False if they make no sense
+bool InitTrim(int argc, const char** argv, TrimArgs* t);
+
+// Filter the span JSON text in to out. Returns the number of spans kept
+int TrimText(FILE* in, TrimArgs* t, FILE* out);
+
+// Filter the spans r has selected to out, as JSON text. Returns the number
+// of spans kept
+int TrimSpanBin(SpanBinReader* r, TrimArgs* t, FILE* out);
+
+}	// namespace spantotrim
+
+#endif	// __SPANTOTRIM_H__
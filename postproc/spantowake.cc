@@ -0,0 +1,293 @@
+// Little program to measure scheduler wakeup-to-run latency from spans
+//
+// Filter from stdin to stdout, producing a text report of the delay from each
+// RUNNABLE wakeup of a PID to when that PID next runs on some CPU, overall,
+// per PID, and per CPU it ran on, split by whether the wakeup came from
+// another CPU. A wakeup is flagged when some other CPU sat idle for the whole
+// delay -- the PID could have run there at once.
+//
+// Copyright 2023 Richard L. Sites
+//
+// dsites 2023.08.26
+//  First version. Like the other span tools, it also takes eventtospan3
+//  -spanbin output
+//
+// These are the same wakeups eventtospan3 draws arcs for from pendingWakeup.
+// A PID woken again before it runs waits from its first wakeup. A wakeup of
+// a PID that is still on a CPU is not a delay and is skipped. A CPU counts
+// as idle while it runs PID 0, including interrupts taken while idle.
+//
+// Compile with g++ -O2 spantowake.cc latency_hist.cc span_bin.cc -o spantowake
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "latency_hist.h"
+#include "span_bin.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define largest_non_pid    0xffff
+
+
+// A wakeup not yet followed by the PID running
+typedef struct {
+  int64 wake_ts;
+  int wake_cpu;
+} PendingWake;
+
+// One measured delay, for the worst list
+typedef struct {
+  int64 wake_ts;
+  int64 delay;
+  int pid;
+  int wake_cpu;
+  int run_cpu;
+  bool idle_missed;
+} WakeDelay;
+
+// Delays split the ways the report shows them
+typedef struct {
+  LatHist all;
+  LatHist same_cpu;
+  LatHist cross_cpu;
+  LatHist idle_missed;
+} WakeHists;
+
+static bool do_hist = false;
+static int top_n = 10;
+
+static map<int, PendingWake> pending;	// By target PID
+static map<int, int64> last_end;	// By PID, end of its latest span on a CPU
+static vector<int64> idle_since;	// By CPU, start of its run of PID 0, or -1
+static map<int, string> pidnames;	// From user-mode spans
+static map<int, WakeHists> by_pid;
+static map<int, WakeHists> by_cpu;	// CPU the PID ran on
+static WakeHists total;
+static vector<WakeDelay> worst;		// Kept to the top_n longest
+
+
+void InitWakeHists(WakeHists* w) {
+  InitLatHist(&w->all);
+  InitLatHist(&w->same_cpu);
+  InitLatHist(&w->cross_cpu);
+  InitLatHist(&w->idle_missed);
+}
+
+void AddWakeHists(WakeHists* w, const WakeDelay& d) {
+  AddLatHist(&w->all, d.delay);
+  AddLatHist((d.wake_cpu == d.run_cpu) ? &w->same_cpu : &w->cross_cpu, d.delay);
+  if (d.idle_missed) {AddLatHist(&w->idle_missed, d.delay);}
+}
+
+WakeHists* FindWakeHists(map<int, WakeHists>* m, int key) {
+  map<int, WakeHists>::iterator it = m->find(key);
+  if (it == m->end()) {
+    WakeHists temp;
+    InitWakeHists(&temp);
+    it = m->insert(std::make_pair(key, temp)).first;
+  }
+  return &it->second;
+}
+
+bool LongerDelay(const WakeDelay& a, const WakeDelay& b) {
+  if (a.delay != b.delay) {return a.delay > b.delay;}
+  return a.wake_ts < b.wake_ts;
+}
+
+// True if some CPU other than run_cpu has run only PID 0 since wake_ts
+bool IdleCpuDuring(int64 wake_ts, int run_cpu) {
+  for (int cpu = 0; cpu < (int)idle_since.size(); ++cpu) {
+    if (cpu == run_cpu) {continue;}
+    if ((0 <= idle_since[cpu]) && (idle_since[cpu] <= wake_ts)) {return true;}
+  }
+  return false;
+}
+
+void Record(const WakeDelay& d) {
+  AddWakeHists(&total, d);
+  AddWakeHists(FindWakeHists(&by_pid, d.pid), d);
+  AddWakeHists(FindWakeHists(&by_cpu, d.run_cpu), d);
+  // Keep just the worst top_n, as a heap with the least bad on top
+  if ((int)worst.size() < top_n) {
+    worst.push_back(d);
+    std::push_heap(worst.begin(), worst.end(), LongerDelay);
+  } else if ((0 < top_n) && LongerDelay(d, worst.front())) {
+    std::pop_heap(worst.begin(), worst.end(), LongerDelay);
+    worst.back() = d;
+    std::push_heap(worst.begin(), worst.end(), LongerDelay);
+  }
+}
+
+// An execution span on a CPU: track idle CPUs, and end any wait of its PID
+void DoExecSpan(int64 start_ts, int64 duration, int cpu, int pid) {
+  if ((int)idle_since.size() <= cpu) {idle_since.resize(cpu + 1, -1);}
+  if (pid == 0) {
+    if (idle_since[cpu] < 0) {idle_since[cpu] = start_ts;}
+    return;
+  }
+  idle_since[cpu] = -1;
+
+  map<int, PendingWake>::iterator it = pending.find(pid);
+  if (it != pending.end()) {
+    WakeDelay d;
+    d.wake_ts = it->second.wake_ts;
+    d.delay = (start_ts < d.wake_ts) ? 0 : start_ts - d.wake_ts;
+    d.pid = pid;
+    d.wake_cpu = it->second.wake_cpu;
+    d.run_cpu = cpu;
+    d.idle_missed = IdleCpuDuring(d.wake_ts, cpu);
+    Record(d);
+    pending.erase(it);
+  }
+  int64& end = last_end[pid];
+  if (end < start_ts + duration) {end = start_ts + duration;}
+}
+
+void DoWakeup(int64 ts, int cpu, int target_pid) {
+  if (target_pid <= 0) {return;}
+  if (pending.find(target_pid) != pending.end()) {return;}	// Already woken
+  // Skip a PID still on a CPU
+  map<int, int64>::const_iterator it = last_end.find(target_pid);
+  if ((it != last_end.end()) && (ts < it->second)) {return;}
+  PendingWake w;
+  w.wake_ts = ts;
+  w.wake_cpu = cpu;
+  pending[target_pid] = w;
+}
+
+string PidName(int pid) {
+  map<int, string>::const_iterator it = pidnames.find(pid);
+  if (it != pidnames.end()) {return it->second;}
+  char temp[16];
+  snprintf(temp, sizeof(temp), "%d", pid);
+  return string(temp);
+}
+
+void PrintWakeHists(FILE* f, const char* label, const WakeHists& w) {
+  fprintf(f, "%-24s %-8s ", label, "all");
+  PrintLatHistRow(f, w.all);
+  fprintf(f, "\n");
+  if (do_hist) {PrintLatHistBars(f, w.all, "    ");}
+  fprintf(f, "%-24s %-8s ", "", "same");
+  PrintLatHistRow(f, w.same_cpu);
+  fprintf(f, "\n");
+  fprintf(f, "%-24s %-8s ", "", "cross");
+  PrintLatHistRow(f, w.cross_cpu);
+  fprintf(f, "\n");
+  fprintf(f, "%-24s %-8s ", "", "idle");
+  PrintLatHistRow(f, w.idle_missed);
+  fprintf(f, "\n");
+}
+
+bool MoreWakeups(const std::pair<int, const WakeHists*>& a,
+                 const std::pair<int, const WakeHists*>& b) {
+  if (a.second->all.sum != b.second->all.sum) {return a.second->all.sum > b.second->all.sum;}
+  return a.first < b.first;
+}
+
+void PrintReport(FILE* f) {
+  fprintf(f, "# spantowake: wakeup-to-run delay, usec\n");
+  fprintf(f, "# same/cross: woken from the CPU it ran on or another one\n");
+  fprintf(f, "# idle: some other CPU was idle for the whole delay\n\n");
+  fprintf(f, "%-24s %-8s ", "", "");
+  PrintLatHistHeader(f);
+  fprintf(f, "\n");
+  PrintWakeHists(f, "(all)", total);
+
+  // PIDs by total delay
+  vector<std::pair<int, const WakeHists*> > sorted;
+  for (map<int, WakeHists>::const_iterator it = by_pid.begin(); it != by_pid.end(); ++it) {
+    sorted.push_back(std::make_pair(it->first, &it->second));
+  }
+  std::sort(sorted.begin(), sorted.end(), MoreWakeups);
+  fprintf(f, "\n%-24s %-8s ", "pid", "");
+  PrintLatHistHeader(f);
+  fprintf(f, "\n");
+  for (int i = 0; i < (int)sorted.size(); ++i) {
+    PrintWakeHists(f, PidName(sorted[i].first).c_str(), *sorted[i].second);
+  }
+
+  // CPUs in order
+  fprintf(f, "\n%-24s %-8s ", "run on cpu", "");
+  PrintLatHistHeader(f);
+  fprintf(f, "\n");
+  for (map<int, WakeHists>::const_iterator it = by_cpu.begin(); it != by_cpu.end(); ++it) {
+    char label[16];
+    snprintf(label, sizeof(label), "%d", it->first);
+    PrintWakeHists(f, label, it->second);
+  }
+
+  std::sort(worst.begin(), worst.end(), LongerDelay);
+  fprintf(f, "\n%-24s %12s %10s %8s %8s %s\n", "longest", "wake_sec", "delay",
+          "from", "ran_on", "idle");
+  for (int i = 0; i < (int)worst.size(); ++i) {
+    const WakeDelay& d = worst[i];
+    fprintf(f, "%-24s %12.8f %10.2f %8d %8d %s\n", PidName(d.pid).c_str(),
+            d.wake_ts / 100000000.0, d.delay / 100.0, d.wake_cpu, d.run_cpu,
+            d.idle_missed ? "idle" : "");
+  }
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantowake [-hist] [-top n]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-hist") == 0) {do_hist = true;}
+    else if ((strcmp(argv[i], "-top") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+    }
+    else Usage();
+  }
+  InitWakeHists(&total);
+
+  // expecting:
+  //    ts           dur       cpu  pid  rpc event arg ret  ipc name-------->
+  //  [ 40.00004530, 0.00000001, 14, 5678, 0, 518, 6789, 0, 0, "runnable.6789"],
+
+  SpanLineReader reader;
+  OpenSpanLines(stdin, &reader);
+
+  int wakeup_count = 0;
+  SpanLine line;
+  while (ReadSpanLine(&reader, &line)) {
+    if (!line.is_span) {continue;}
+    if (line.start_ts >= 999.0) {break;}	// End marker
+    if (line.cpu < 0) {continue;}		// Not executing on a CPU
+    int64 ts = (int64)(line.start_ts * 100000000.0 + 0.5);
+
+    if (line.eventnum == KUTRACE_RUNNABLE) {
+      ++wakeup_count;
+      DoWakeup(ts, line.cpu, line.arg);
+      continue;
+    }
+    if (largest_non_pid < line.eventnum) {
+      if (pidnames.find(line.pid) == pidnames.end()) {pidnames[line.pid] = Unquote(line.name);}
+    } else if ((line.eventnum < KUTRACE_TRAP) || (0x1000 <= line.eventnum)) {
+      continue;		// PC samples, marks, and other non-execution
+    }
+    DoExecSpan(ts, (int64)(line.duration * 100000000.0 + 0.5), line.cpu, line.pid);
+  }
+  CloseSpanLines(&reader);
+
+  PrintReport(stdout);
+  fprintf(stderr, "spantowake: %d wakeups, %llu measured\n", wakeup_count, total.all.count);
+  return 0;
+}
@@ -7,7 +7,7 @@
 
 // Copyright 2021 Richard L. Sites
 
-// Compile with g++ -O2 time_getpid.cc kutrace_lib.cc -o time_getpid
+// Compile with g++ -O2 time_getpid.cc kutrace_lib.cc block_index.cc -o time_getpid
 
 // Do 100k getpid() calls
 // so we can time these with and without tracing to see the tracing overhead
@@ -0,0 +1,120 @@
+// trace_reader.cc
+// Copyright 2023 Richard L. Sites
+//
+// Read-only mmap access to a raw trace file, with a streaming fallback.
+// See trace_reader.h
+//
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "basetypes.h"
+#include "trace_reader.h"
+
+
+// Map a regular file. Returns false if that is not possible
+static bool MapTrace(int fd, TraceReader* r) {
+  struct stat buff;
+  if (fstat(fd, &buff) < 0) {return false;}
+  if (!S_ISREG(buff.st_mode) || (buff.st_size == 0)) {return false;}
+  void* base = mmap(NULL, buff.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {return false;}
+  // We walk the file once, front to back
+  madvise(base, buff.st_size, MADV_SEQUENTIAL);
+  r->base = reinterpret_cast<const uint8*>(base);
+  r->size = buff.st_size;
+  return true;
+}
+
+bool OpenTraceReader(const char* fname, TraceReader* r) {
+  r->f = NULL;
+  r->base = NULL;
+  r->size = 0;
+  r->offset = 0;
+  r->buffer = NULL;
+  r->ipcbuffer = NULL;
+
+  if (fname == NULL) {
+    r->f = stdin;
+  } else {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {return false;}
+    bool mapped = MapTrace(fd, r);
+    if (mapped) {
+      close(fd);		// The mapping stays
+    } else {
+      r->f = fdopen(fd, "rb");
+      if (r->f == NULL) {close(fd); return false;}
+    }
+  }
+
+  // Short last pieces are copied even when mapped, so always have buffers
+  r->buffer = new uint8[kTraceBlockBytes];
+  r->ipcbuffer = new uint8[kIpcBlockBytes];
+  return true;
+}
+
+void CloseTraceReader(TraceReader* r) {
+  if (r->base != NULL) {munmap(const_cast<uint8*>(r->base), r->size);}
+  if ((r->f != NULL) && (r->f != stdin)) {fclose(r->f);}
+  delete[] r->buffer;
+  delete[] r->ipcbuffer;
+  r->f = NULL;
+  r->base = NULL;
+  r->buffer = NULL;
+  r->ipcbuffer = NULL;
+}
+
+bool IsMappedTrace(const TraceReader* r) {
+  return r->base != NULL;
+}
+
+// Return the next nbytes in place if possible, else copied into buffer
+static const uint8* NextBytes(TraceReader* r, int nbytes, uint8* buffer, size_t* len) {
+  if (r->base != NULL) {
+    if (r->size <= r->offset) {*len = 0; return NULL;}
+    const uint8* p = r->base + r->offset;
+    uint64 remaining = r->size - r->offset;
+    if (remaining >= nbytes) {
+      r->offset += nbytes;
+      *len = nbytes;
+      return p;
+    }
+    // Short piece at the very end
+    memcpy(buffer, p, remaining);
+    memset(buffer + remaining, 0, nbytes - remaining);
+    r->offset = r->size;
+    *len = remaining;
+    return buffer;
+  }
+
+  size_t n = fread(buffer, 1, nbytes, r->f);
+  if (n == 0) {*len = 0; return NULL;}
+  if (n < nbytes) {memset(buffer + n, 0, nbytes - n);}
+  r->offset += n;
+  *len = n;
+  return buffer;
+}
+
+const uint8* NextTraceBytes(TraceReader* r, int nbytes, size_t* len) {
+  if (kTraceBlockBytes < nbytes) {
+    fprintf(stderr, "NextTraceBytes: %d bytes is more than one trace block\n", nbytes);
+    exit(0);
+  }
+  return NextBytes(r, nbytes, r->buffer, len);
+}
+
+const uint64* NextTraceBlock(TraceReader* r, size_t* len) {
+  return reinterpret_cast<const uint64*>(NextBytes(r, kTraceBlockBytes, r->buffer, len));
+}
+
+const uint8* NextIpcBlock(TraceReader* r, size_t* len) {
+  return NextBytes(r, kIpcBlockBytes, r->ipcbuffer, len);
+}
+
@@ -0,0 +1,50 @@
+// trace_reader.h
+// Copyright 2023 Richard L. Sites
+//
+// Read-only access to a raw KUtrace file, shared by rawtoevent, checktrace,
+// and kuod. A regular file is mapped with mmap and walked in place, so even a
+// multi-GB trace is decoded with no copying and stays within the page cache.
+// stdin and other unmappable inputs fall back to streaming through a buffer.
+//
+// Raw trace layout: 64KB trace blocks, each followed by an 8KB block of IPC
+// bytes if its flags have IPC_Flag set.
+//
+
+#ifndef __TRACE_READER_H__
+#define __TRACE_READER_H__
+
+#include <stdio.h>
+
+#include "basetypes.h"
+
+static const int kTraceBlockBytes = 64 * 1024;	// 8192 uint64 entries
+static const int kIpcBlockBytes = 8 * 1024;	// One byte per trace entry
+
+typedef struct {
+  FILE* f;			// Streaming input, else NULL
+  const uint8* base;		// Mapped file, else NULL
+  uint64 size;			// Mapped byte count
+  uint64 offset;		// Next byte to read
+  uint8* buffer;		// Streaming copy of the current trace block
+  uint8* ipcbuffer;		// Streaming copy of the current IPC block
+} TraceReader;
+
+// Open fname, or stdin if fname is NULL. Returns false if it does not open
+bool OpenTraceReader(const char* fname, TraceReader* r);
+void CloseTraceReader(TraceReader* r);
+
+// True if blocks are returned in place, valid until CloseTraceReader.
+// Otherwise each block is valid only until the next call
+bool IsMappedTrace(const TraceReader* r);
+
+// Return the next nbytes of the file, or NULL at the end. *len gets the byte
+// count actually there; any short last piece is zero-filled out to nbytes.
+// nbytes is at most kTraceBlockBytes
+const uint8* NextTraceBytes(TraceReader* r, int nbytes, size_t* len);
+
+// Block iterators: the next 64KB trace block and the 8KB IPC block after it
+const uint64* NextTraceBlock(TraceReader* r, size_t* len);
+const uint8* NextIpcBlock(TraceReader* r, size_t* len);
+
+#endif	// __TRACE_READER_H__
+
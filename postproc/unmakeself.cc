@@ -8,22 +8,111 @@
 //     The contained JSON file written to stdout
 //     If you want, then pipe through sed 's/], /],\n/g'
 //
+// dsites 2023.08.31 Also the gzipped, base64 myZString from makeself, which
+//   comes back out with its original lines
+// dsites 2023.09.08 Read inputs of any size, and gunzip more than 4GB
+//
+// Compile with g++ -O2 unmakeself.cc -lz -o unmakeself
+//
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>		// exit
 #include <string.h>
+#include <zlib.h>
 
 static const char* const_text_1 = "<script>";
 static const char* const_text_2 = "</script>";
 
 static const char* const_text_3 = "var myString = '";
+static const char* const_text_3z = "var myZString = '";
 static const char* const_text_4 = "';";
 
 static const char* const_text_5 = "data = JSON.parse(myString); newdata2_resize(data);";
 static const char* const_text_6 = "";
 
 
+// 0..63, or -1 for anything not in the base64 alphabet
+int Base64Value(char c) {
+  if (('A' <= c) && (c <= 'Z')) {return c - 'A';}
+  if (('a' <= c) && (c <= 'z')) {return c - 'a' + 26;}
+  if (('0' <= c) && (c <= '9')) {return c - '0' + 52;}
+  if (c == '+') {return 62;}
+  if (c == '/') {return 63;}
+  return -1;
+}
+
+// Decode base64 in place, stopping at the first non-base64 byte; return length
+int64_t DecodeBase64(char* buf, int64_t len) {
+  uint8_t* out = (uint8_t*)buf;
+  int64_t k = 0;
+  uint32_t w = 0;
+  int bits = 0;
+  for (int64_t i = 0; i < len; ++i) {
+    int v = Base64Value(buf[i]);
+    if (v < 0) {break;}
+    w = (w << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out[k++] = (w >> bits) & 0xff;
+    }
+  }
+  return k;
+}
+
+// zlib counts bytes in 32 bits, so feed it at most this much at a time
+static const int64_t kZChunk = 1 << 30;
+
+// Gunzip in[0..len) to f. Return false on bad data
+bool GunzipTo(const uint8_t* in, int64_t len, FILE* f) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {return false;}
+  int64_t in_left = len;
+  uint8_t out[65536];
+  int err = Z_OK;
+  while (err == Z_OK) {
+    if (zs.avail_in == 0) {
+      int64_t in_chunk = (in_left < kZChunk) ? in_left : kZChunk;
+      zs.next_in = (Bytef*)(in + (len - in_left));
+      zs.avail_in = in_chunk;
+      in_left -= in_chunk;
+    }
+    zs.next_out = out;
+    zs.avail_out = sizeof(out);
+    err = inflate(&zs, Z_NO_FLUSH);
+    fwrite(out, 1, sizeof(out) - zs.avail_out, f);
+    if ((err == Z_BUF_ERROR) && (zs.avail_in == 0)) {break;}	// Truncated
+  }
+  inflateEnd(&zs);
+  return (err == Z_STREAM_END);
+}
+
+// Read all of f into a new[] buffer with a NUL after it; return the length.
+// A file is sized up front; a pipe grows the buffer as it goes
+int64_t ReadAll(FILE* f, char** buf) {
+  int64_t capacity = 1 << 20;
+  if (fseeko(f, 0, SEEK_END) == 0) {
+    capacity = ftello(f) + 1;
+    fseeko(f, 0, SEEK_SET);
+  }
+  int64_t len = 0;
+  *buf = new char[capacity + 1];
+  for (;;) {
+    len += fread(*buf + len, 1, capacity - len, f);
+    if (len < capacity) {break;}
+    // Full; double it
+    char* bigger = new char[2 * capacity + 1];
+    memcpy(bigger, *buf, len);
+    delete[] *buf;
+    *buf = bigger;
+    capacity *= 2;
+  }
+  (*buf)[len] = '\0';
+  return len;
+}
+
 void usage() {
   fprintf(stderr, "Usage: unmakeself <input html>\n");
   exit(0);
@@ -41,9 +130,8 @@ int main (int argc, const char** argv) {
     }
   }
 
-  char* inhtml_buf = new char[250000000];	// 250MB
-
-  int html_len = fread(inhtml_buf, 1, 250000000, finhtml);
+  char* inhtml_buf = NULL;
+  ReadAll(finhtml, &inhtml_buf);
   fclose(finhtml);
 
 
@@ -74,6 +162,19 @@ int main (int argc, const char** argv) {
   // JSON is in self1_end .. self_2
   // Within this, there is a single-quote string that we want.
   *self2 = '\0';
+
+  // Gzipped and base64-encoded
+  char* zstring = strstr(self1_end, const_text_3z);
+  if (zstring != NULL) {
+    char* b64 = zstring + strlen(const_text_3z);
+    int64_t gz_len = DecodeBase64(b64, self2 - b64);
+    if (!GunzipTo((const uint8_t*)b64, gz_len, stdout)) {
+      fprintf(stderr, "Bad gzipped JSON\n");
+    }
+    delete[] inhtml_buf;
+    return 0;
+  }
+
   char* quote1 = strchr(self1_end, '\'');
   if (quote1 == NULL) {
     fprintf(stderr, "Missing '..' string\n");
@@ -93,7 +194,7 @@ int main (int argc, const char** argv) {
   int len3 = quote2 - quote1;
   fwrite(quote1, 1, len3, stdout);
 
-  free(inhtml_buf);
+  delete[] inhtml_buf;
   return 0;
 }
 